@@ -0,0 +1,93 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Storage engine interface behind the wrapperfs handlers.
+ *
+ * A backend implements the path-based FUSE operations and owns whatever
+ * state its open file handles point to. Every operation returns 0 (or a
+ * byte count for read/write) on success and -errno on failure.
+ *
+ * wrapperfs ships with:
+ *  - PassthroughFs: mirrors a directory of the host file system;
+ *  - KvFs: namespace kept in an embedded key-value store;
+ *  - RamFs: everything in memory, the upper bound for any design;
+ *  - NullFs: discards writes and reads zeros, the floor of FUSE overhead.
+ */
+
+#ifndef BACKEND_H_
+#define BACKEND_H_
+
+#include <errno.h>
+#include <fuse.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+class Backend {
+ public:
+  virtual ~Backend() {}
+
+  /// Called from the FUSE init callback, after the process daemonized, to
+  /// start background threads.
+  virtual void start() {}
+
+  /// Called from the FUSE destroy callback.
+  virtual void stop() {}
+
+  /// Makes the state kept by the backend itself durable; 0 or -errno.
+  virtual int sync() { return 0; }
+
+  /// Reclaims space held by the backend's own logs; 0 or -errno.
+  virtual int compact() { return 0; }
+
+  /// Opens the host file holding the data of 'path' with 'flags', for
+  /// clients reading it directly (bypass.h). Returns a descriptor, or
+  /// -ENOTSUP where the data is not kept as a plain host file.
+  virtual int open_backing(const char *path, int flags) {
+    (void) path;
+    (void) flags;
+    return -ENOTSUP;
+  }
+
+  virtual int getattr(const char *path, struct stat *stbuf) = 0;
+  virtual int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset) = 0;
+  virtual int access(const char *path, int mask) = 0;
+  virtual int readlink(const char *path, char *buf, size_t size) = 0;
+
+  virtual int mkdir(const char *path, mode_t mode) = 0;
+  virtual int rmdir(const char *path) = 0;
+  virtual int unlink(const char *path) = 0;
+  virtual int rename(const char *oldpath, const char *newpath) = 0;
+  virtual int link(const char *oldpath, const char *newpath) = 0;
+  virtual int symlink(const char *target, const char *path) = 0;
+  virtual int chmod(const char *path, mode_t mode) = 0;
+  virtual int chown(const char *path, uid_t owner, gid_t group) = 0;
+  virtual int utimens(const char *path, const struct timespec tv[2]) = 0;
+  virtual int truncate(const char *path, off_t length) = 0;
+
+  virtual int create(const char *path, mode_t mode,
+                     struct fuse_file_info *fi) = 0;
+  virtual int open(const char *path, struct fuse_file_info *fi) = 0;
+  virtual int release(struct fuse_file_info *fi) = 0;
+  virtual int read(char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi) = 0;
+  virtual int write(const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi) = 0;
+  virtual int fsync(int datasync, struct fuse_file_info *fi) = 0;
+};
+
+#endif  // BACKEND_H_
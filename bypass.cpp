@@ -0,0 +1,311 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./bypass.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "./hotpaths.h"
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+/// f_type of FUSE file systems.
+const long kFuseSuperMagic = 0x65735546;  // NOLINT
+
+/// What the kernel appends to the path of an unlinked file.
+const char kDeleted[] = " (deleted)";
+
+/// Libraries connected at once; further ones wait in the backlog.
+const size_t kMaxClients = 1024;
+
+Counter bypass_opens("bypass.opens");
+Counter bypass_refused("bypass.refused");
+Counter bypass_reads("bypass.reads");
+Counter bypass_read_bytes("bypass.read_bytes");
+
+/// Sends 'reply', with 'fd' unless it is -1.
+void send_reply(int sock, const BypassReply &reply, int fd) {
+  struct iovec iov = { const_cast<BypassReply*>(&reply), sizeof(reply) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  if (fd != -1) {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  while (sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) == -1 &&
+         errno == EINTR) {
+  }
+}
+
+}  // namespace
+
+BypassServer bypass;
+
+int bypass_check_client(int fd, struct stat *stbuf, string *path) {
+  if (fstat(fd, stbuf) == -1) {
+    return -errno;
+  }
+  if (!S_ISREG(stbuf->st_mode)) {
+    return -EXDEV;
+  }
+  // Writes keep going through the mount.
+  if ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY) {
+    return -EINVAL;
+  }
+  if (stbuf->st_nlink == 0) {
+    // Its name is gone from the backend too.
+    return -ESTALE;
+  }
+  // The kernel knows the path from its dentry cache, without asking us.
+  char link[64];
+  char buf[PATH_MAX];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t n = readlink(link, buf, sizeof(buf) - 1);
+  if (n == -1) {
+    return -errno;
+  }
+  buf[n] = '\0';
+  // Unlinked since the check above; the name may belong to another file.
+  size_t suffix = sizeof(kDeleted) - 1;
+  if (static_cast<size_t>(n) >= suffix &&
+      strcmp(buf + n - suffix, kDeleted) == 0) {
+    return -ESTALE;
+  }
+  *path = buf;
+  return 0;
+}
+
+int bypass_check_backing(const struct stat &backing,
+                         const struct stat &served,
+                         const struct stat &client) {
+  if (backing.st_ino != served.st_ino || backing.st_dev != served.st_dev ||
+      backing.st_mode != client.st_mode ||
+      backing.st_uid != client.st_uid || backing.st_gid != client.st_gid) {
+    return -ESTALE;
+  }
+  return 0;
+}
+
+BypassServer::BypassServer() : listen_fd_(-1) {
+  wakeup_[0] = wakeup_[1] = -1;
+}
+
+BypassServer::~BypassServer() {
+  stop();
+  if (listen_fd_ != -1) {
+    close(listen_fd_);
+    unlink(path_.c_str());
+  }
+}
+
+int BypassServer::listen(const string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if (path.empty() || path[0] != '/') {
+    return -EINVAL;
+  }
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  struct stat stbuf;
+  if (lstat(path.c_str(), &stbuf) == 0 && S_ISSOCK(stbuf.st_mode)) {
+    unlink(path.c_str());
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -errno;
+  }
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) == -1 ||
+      ::listen(fd, 64) == -1 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  listen_fd_ = fd;
+  path_ = path;
+  return 0;
+}
+
+void BypassServer::adopt(int fd, const string &path) {
+  listen_fd_ = fd;
+  path_ = path;
+}
+
+void BypassServer::start() {
+  if (listen_fd_ == -1 || pipe2(wakeup_, O_CLOEXEC) == -1) {
+    return;
+  }
+  server_ = std::thread(&BypassServer::serve, this);
+}
+
+void BypassServer::stop() {
+  if (!server_.joinable()) {
+    return;
+  }
+  char byte = 0;
+  while (write(wakeup_[1], &byte, 1) == -1 && errno == EINTR) {
+  }
+  server_.join();
+  close(wakeup_[0]);
+  close(wakeup_[1]);
+  wakeup_[0] = wakeup_[1] = -1;
+}
+
+int BypassServer::open(int fd, string *name) {
+  struct statfs fsbuf;
+  if (fstatfs(fd, &fsbuf) == -1) {
+    return -errno;
+  }
+  if (fsbuf.f_type != kFuseSuperMagic) {
+    return -EXDEV;
+  }
+  struct stat stbuf;
+  string path;
+  int ret = bypass_check_client(fd, &stbuf, &path);
+  if (ret) {
+    return ret;
+  }
+  return open_backing ? open_backing(path, stbuf, name) : -ENOTSUP;
+}
+
+bool BypassServer::handle(Client *client) {
+  BypassRequest req;
+  struct iovec iov = { &req, sizeof(req) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(client->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return true;
+  }
+  int fd = -1;
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (n != sizeof(req) || (msg.msg_flags & MSG_CTRUNC) ||
+      (fd != -1) != (req.op == kBypassOpen)) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+
+  if (req.op == kBypassOpen) {
+    string name;
+    int backing = open(fd, &name);
+    close(fd);
+    BypassReply reply = { backing < 0 ? backing : 0, 0 };
+    if (backing >= 0) {
+      reply.handle = client->next_handle++;
+      client->names[reply.handle] = name;
+      bypass_opens.add();
+    } else {
+      bypass_refused.add();
+    }
+    send_reply(client->fd, reply, backing < 0 ? -1 : backing);
+    if (backing >= 0) {
+      close(backing);
+    }
+    return true;
+  }
+  auto it = client->names.find(req.handle);
+  if (it == client->names.end() ||
+      (req.op != kBypassReport && req.op != kBypassClose)) {
+    return false;
+  }
+  bypass_reads.add(req.reads);
+  bypass_read_bytes.add(req.bytes);
+  if (req.reads && hot_paths.enabled()) {
+    hot_paths.record(it->second.c_str(), req.bytes);
+  }
+  if (req.op == kBypassClose) {
+    client->names.erase(it);
+  }
+  return true;
+}
+
+void BypassServer::serve() {
+  std::vector<Client> clients;
+  while (true) {
+    std::vector<struct pollfd> fds;
+    fds.push_back({ wakeup_[0], POLLIN, 0 });
+    fds.push_back({ listen_fd_,
+                    static_cast<short>(clients.size() < kMaxClients ?  // NOLINT
+                                       POLLIN : 0), 0 });
+    for (const auto &client : clients) {
+      fds.push_back({ client.fd, POLLIN, 0 });
+    }
+    if (poll(&fds[0], fds.size(), -1) == -1 && errno != EINTR) {
+      break;
+    }
+    if (fds[0].revents) {
+      break;
+    }
+    // Back to front, so that erasing keeps the indexes into 'fds' valid.
+    for (size_t i = clients.size(); i-- > 0;) {
+      short revents = fds[i + 2].revents;  // NOLINT
+      bool done = revents & (POLLERR | POLLNVAL);
+      if (!done && (revents & (POLLIN | POLLHUP))) {
+        done = !handle(&clients[i]);
+      }
+      if (done) {
+        close(clients[i].fd);
+        clients.erase(clients.begin() + i);
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd != -1) {
+        clients.push_back({ fd, 1, std::map<uint32_t, string>() });
+      }
+    }
+  }
+  for (const auto &client : clients) {
+    close(client.fd);
+  }
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Direct reads for processes using the mount.
+ *
+ * Every read through FUSE crosses the kernel twice and wakes a daemon
+ * thread. libwrapperfs_bypass.so, preloaded into an application with
+ * WRAPPERFS_BYPASS=PATH set, sends each regular file it opens read-only on
+ * a wrapperfs mount to the daemon listening on PATH (--bypass=PATH). The
+ * descriptor itself travels over the Unix socket (SCM_RIGHTS). The daemon
+ * checks that it refers to one of its mounts, opens the backing file and
+ * passes that back, and the library serves read() and pread() on the
+ * descriptor from it without involving FUSE.
+ *
+ * The open itself still goes through the mount, so the daemon's and the
+ * kernel's permission checks apply, and every other call on the
+ * descriptor (fstat, mmap, readv, ...) falls back to the mount as before.
+ * The library reports the reads it served every kReportReads reads and
+ * on close, and the daemon adds them to the bypass.* counters and to the
+ * hot paths.
+ *
+ * Only backends keeping file data as host files can hand them out
+ * (Backend::open_backing()); others answer ENOTSUP and the library keeps
+ * reading through the mount. --qos and --device need to see every read
+ * and cannot be combined with --bypass: bypassed reads would escape their
+ * throttling and latency.
+ *
+ * The path the kernel reports for the client's descriptor may name
+ * another file by the time the daemon opens it (a rename, or a deleted
+ * file's name taken over by a symlink). The backing file is opened
+ * without following symlinks, and it is only handed out if it is still
+ * the file the backend serves under that name, with the owner and mode
+ * the client's descriptor shows.
+ */
+
+#ifndef BYPASS_H_
+#define BYPASS_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+
+/// Messages from the library, one per SOCK_SEQPACKET packet.
+enum {
+  kBypassOpen = 1,    ///< Carries the descriptor opened on the mount.
+  kBypassReport = 2,  ///< Reads served on 'handle' since the last report.
+  kBypassClose = 3,   ///< Last report on 'handle'.
+};
+
+/// Reads the library serves on a descriptor between two reports.
+const uint64_t kReportReads = 4096;
+
+struct BypassRequest {
+  uint32_t op;
+  uint32_t handle;
+  uint64_t reads;
+  uint64_t bytes;
+};
+
+/// Answer to kBypassOpen, with the backing descriptor if 'error' is 0.
+struct BypassReply {
+  int32_t error;
+  uint32_t handle;
+};
+
+/**
+ * Checks 'fd', a descriptor a client opened on a mount: a regular file,
+ * open read-only and still linked under the name the kernel reports for
+ * it, which is returned as 'path' along with the file's 'stbuf'. Returns
+ * 0 or -errno.
+ */
+int bypass_check_client(int fd, struct stat *stbuf, std::string *path);
+
+/**
+ * Checks that 'backing', the file opened for a client, is still 'served'
+ * by the backend under the client's name and has the owner and mode of
+ * the client's descriptor 'client'. Returns 0 or -ESTALE.
+ */
+int bypass_check_backing(const struct stat &backing,
+                         const struct stat &served,
+                         const struct stat &client);
+
+class BypassServer {
+ public:
+  /**
+   * Opens the backing file of 'path', an absolute path in the mount, for
+   * reading. 'stbuf' describes the client's descriptor on the mount.
+   * Returns a descriptor and the path in the mount as 'name', or -errno.
+   */
+  typedef std::function<int(const std::string &path,
+                            const struct stat &stbuf,
+                            std::string *name)> OpenBacking;
+
+  BypassServer();
+  ~BypassServer();
+
+  /// Binds the Unix socket 'path'. Returns 0 or -errno.
+  int listen(const std::string &path);
+
+  /// Serves on 'fd', a socket bound to 'path' by another process.
+  void adopt(int fd, const std::string &path);
+
+  /// The listening socket, or -1.
+  int fd() const {
+    return listen_fd_;
+  }
+
+  OpenBacking open_backing;
+
+  /// Starts and stops the serving thread.
+  void start();
+  void stop();
+
+ private:
+  /// A connected library and the files it reads directly.
+  struct Client {
+    int fd;
+    uint32_t next_handle;
+    std::map<uint32_t, std::string> names;
+  };
+
+  void serve();
+  bool handle(Client *client);
+  int open(int fd, std::string *name);
+
+  int listen_fd_;
+  int wakeup_[2];  ///< Pipe that interrupts serve() on stop().
+  std::string path_;
+  std::thread server_;
+};
+
+extern BypassServer bypass;
+
+#endif  // BYPASS_H_
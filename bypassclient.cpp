@@ -0,0 +1,448 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief libwrapperfs_bypass.so, the client side of bypass.h.
+ *
+ *   WRAPPERFS_BYPASS=/run/wrapperfs.bypass \
+ *   LD_PRELOAD=/usr/local/lib/libwrapperfs_bypass.so app
+ *
+ * Wraps the libc entry points that open, read and close descriptors.
+ * Calls libc makes internally (e.g. from stdio) are not seen and keep
+ * going through the mount, as does everything when WRAPPERFS_BYPASS is
+ * not set or the daemon cannot be reached.
+ */
+
+// Both the 32 and the 64-bit offset variants are wrapped, under their own
+// names.
+#undef _FILE_OFFSET_BITS
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include "./bypass.h"
+
+namespace {
+
+/// f_type of FUSE file systems.
+const long kFuseSuperMagic = 0x65735546;  // NOLINT
+
+/// Descriptors from this one up are always read through the mount.
+const int kMaxFds = 1 << 16;
+
+/// Time given to the daemon to answer before falling back.
+const int kTimeoutMs = 1000;
+
+/// A descriptor whose reads are served from the backing file.
+struct Slot {
+  std::atomic<int> backing;  ///< Backing descriptor plus one, or 0.
+  uint32_t handle;
+  std::atomic<uint64_t> reads;  ///< Since the last report.
+  std::atomic<uint64_t> bytes;
+};
+
+/// Indexed by descriptor; zero-filled pages cost nothing until touched.
+Slot slots[kMaxFds];
+
+/// The next definitions of the wrapped functions, normally libc's.
+struct {
+  int (*open)(const char *path, int flags, ...);
+  int (*open64)(const char *path, int flags, ...);
+  int (*openat)(int dirfd, const char *path, int flags, ...);
+  int (*openat64)(int dirfd, const char *path, int flags, ...);
+  int (*open_2)(const char *path, int flags);
+  int (*open64_2)(const char *path, int flags);
+  ssize_t (*read)(int fd, void *buf, size_t count);
+  ssize_t (*pread)(int fd, void *buf, size_t count, off_t offset);
+  ssize_t (*pread64)(int fd, void *buf, size_t count, off64_t offset);
+  int (*close)(int fd);
+  int (*dup2)(int oldfd, int newfd);
+  int (*dup3)(int oldfd, int newfd, int flags);
+  int (*fclose)(FILE *stream);
+} real;
+
+const char *socket_path;  ///< WRAPPERFS_BYPASS, or NULL.
+
+std::mutex conn_mutex;
+std::atomic<int> conn(-1);  ///< Socket to the daemon.
+pid_t conn_pid;             ///< Process that connected 'conn'.
+pid_t failed_pid;           ///< Process that could not connect.
+
+template <typename T>
+void resolve(T **fn, const char *name) {
+  if (*fn == NULL) {
+    *fn = reinterpret_cast<T*>(dlsym(RTLD_NEXT, name));
+  }
+}
+
+void resolve_all() {
+  resolve(&real.open, "open");
+  resolve(&real.open64, "open64");
+  resolve(&real.openat, "openat");
+  resolve(&real.openat64, "openat64");
+  resolve(&real.open_2, "__open_2");
+  resolve(&real.open64_2, "__open64_2");
+  resolve(&real.read, "read");
+  resolve(&real.pread, "pread");
+  resolve(&real.pread64, "pread64");
+  resolve(&real.close, "close");
+  resolve(&real.dup2, "dup2");
+  resolve(&real.dup3, "dup3");
+  resolve(&real.fclose, "fclose");
+}
+
+/// A wrapper may run before the constructor, from another library's.
+#define REAL(fn) (real.fn ? real.fn : (resolve_all(), real.fn))
+
+void lock_conn() {
+  conn_mutex.lock();
+}
+
+void unlock_conn() {
+  conn_mutex.unlock();
+}
+
+__attribute__((constructor)) void bypass_init() {
+  resolve_all();
+  socket_path = getenv("WRAPPERFS_BYPASS");
+  // A child forked while another thread talked to the daemon must not
+  // inherit a locked mutex.
+  pthread_atfork(lock_conn, unlock_conn, unlock_conn);
+}
+
+bool needs_mode(int flags) {
+#ifdef O_TMPFILE
+  if ((flags & O_TMPFILE) == O_TMPFILE) {
+    return true;
+  }
+#endif
+  return flags & O_CREAT;
+}
+
+void disconnect_locked() {
+  int fd = conn.exchange(-1);
+  if (fd != -1) {
+    REAL(close)(fd);
+  }
+}
+
+/// Returns the socket to the daemon, connecting if needed, or -1.
+int connect_locked() {
+  pid_t pid = getpid();
+  if (conn != -1 && conn_pid == pid) {
+    return conn;
+  }
+  // After fork() the socket is shared with the parent; get our own.
+  disconnect_locked();
+  if (failed_pid == pid) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  struct timeval timeout = { kTimeoutMs / 1000, kTimeoutMs % 1000 * 1000 };
+  if (fd == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout)) == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                 sizeof(timeout)) == -1 ||
+      connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) == -1) {
+    if (fd != -1) {
+      REAL(close)(fd);
+    }
+    // Do not retry on every open.
+    failed_pid = pid;
+    return -1;
+  }
+  conn = fd;
+  conn_pid = pid;
+  return fd;
+}
+
+/// Sends the reads served on 'slot' since the last report.
+void report(Slot *slot, uint32_t op) {
+  BypassRequest req = { op, slot->handle, slot->reads.exchange(0),
+                        slot->bytes.exchange(0) };
+  std::lock_guard<std::mutex> guard(conn_mutex);
+  if (conn == -1 || conn_pid != getpid()) {
+    return;
+  }
+  while (send(conn, &req, sizeof(req), MSG_NOSIGNAL | MSG_DONTWAIT) == -1 &&
+         errno == EINTR) {
+  }
+}
+
+/// Stops serving 'fd' from its backing file.
+void release(int fd) {
+  if (fd < 0 || fd >= kMaxFds) {
+    return;
+  }
+  Slot *slot = &slots[fd];
+  int backing = slot->backing.exchange(0);
+  if (backing) {
+    report(slot, kBypassClose);
+    REAL(close)(backing - 1);
+  }
+}
+
+/// Asks the daemon for the backing file of 'fd'.
+void attach(int fd) {
+  struct statfs fsbuf;
+  if (fstatfs(fd, &fsbuf) == -1 || fsbuf.f_type != kFuseSuperMagic) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(conn_mutex);
+  int sock = connect_locked();
+  if (sock == -1) {
+    return;
+  }
+  BypassRequest req = { kBypassOpen, 0, 0, 0 };
+  struct iovec iov = { &req, sizeof(req) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  ssize_t n;
+  while ((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+  }
+  if (n != sizeof(req)) {
+    disconnect_locked();
+    return;
+  }
+
+  BypassReply reply;
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 &&
+         errno == EINTR) {
+  }
+  int backing = -1;
+  cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+    memcpy(&backing, CMSG_DATA(cmsg), sizeof(int));
+  }
+  if (n != sizeof(reply)) {
+    // A late answer would be taken for the next one.
+    disconnect_locked();
+  }
+  if (n != sizeof(reply) || reply.error || backing == -1) {
+    if (backing != -1) {
+      REAL(close)(backing);
+    }
+    return;
+  }
+  Slot *slot = &slots[fd];
+  slot->handle = reply.handle;
+  slot->reads = 0;
+  slot->bytes = 0;
+  slot->backing.store(backing + 1, std::memory_order_release);
+}
+
+/// Called with the result of every open.
+int opened(int fd, int flags) {
+  if (fd < 0 || fd >= kMaxFds) {
+    return fd;
+  }
+  // The number may have been closed behind our back, e.g. by fclose().
+  int saved_errno = errno;
+  release(fd);
+  int unsupported = O_DIRECTORY | O_DIRECT;
+#ifdef O_PATH
+  unsupported |= O_PATH;
+#endif
+  if (socket_path && (flags & O_ACCMODE) == O_RDONLY &&
+      !(flags & unsupported)) {
+    attach(fd);
+  }
+  errno = saved_errno;
+  return fd;
+}
+
+/// Returns the backing descriptor serving 'fd', or -1.
+int backing_fd(int fd) {
+  if (fd < 0 || fd >= kMaxFds) {
+    return -1;
+  }
+  return slots[fd].backing.load(std::memory_order_acquire) - 1;
+}
+
+ssize_t account(int fd, ssize_t n) {
+  if (n > 0) {
+    Slot *slot = &slots[fd];
+    slot->bytes += n;
+    if (++slot->reads >= kReportReads) {
+      report(slot, kBypassReport);
+    }
+  }
+  return n;
+}
+
+/// Forgets the daemon's socket when the application closes its number.
+void closing(int fd) {
+  if (fd == conn) {
+    std::lock_guard<std::mutex> guard(conn_mutex);
+    if (fd == conn) {
+      conn = -1;
+    }
+  }
+  release(fd);
+}
+
+}  // namespace
+
+extern "C" {
+
+int open(const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (needs_mode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+  return opened(REAL(open)(path, flags, mode), flags);
+}
+
+int open64(const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (needs_mode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+  return opened(REAL(open64)(path, flags, mode), flags);
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (needs_mode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+  return opened(REAL(openat)(dirfd, path, flags, mode), flags);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) {
+  mode_t mode = 0;
+  if (needs_mode(flags)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, int);
+    va_end(ap);
+  }
+  return opened(REAL(openat64)(dirfd, path, flags, mode), flags);
+}
+
+/// Called instead of open() by programs built with _FORTIFY_SOURCE.
+int __open_2(const char *path, int flags) {
+  return opened(REAL(open_2)(path, flags), flags);
+}
+
+int __open64_2(const char *path, int flags) {
+  return opened(REAL(open64_2)(path, flags), flags);
+}
+
+ssize_t read(int fd, void *buf, size_t count) {
+  int backing = backing_fd(fd);
+  if (backing == -1) {
+    return REAL(read)(fd, buf, count);
+  }
+  // The file position stays with the mount's descriptor; seeking it
+  // does not leave the kernel.
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset == -1) {
+    return REAL(read)(fd, buf, count);
+  }
+  ssize_t n = REAL(pread)(backing, buf, count, offset);
+  if (n > 0) {
+    lseek(fd, offset + n, SEEK_SET);
+  }
+  return account(fd, n);
+}
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset) {
+  int backing = backing_fd(fd);
+  if (backing == -1) {
+    return REAL(pread)(fd, buf, count, offset);
+  }
+  return account(fd, REAL(pread)(backing, buf, count, offset));
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+  int backing = backing_fd(fd);
+  if (backing == -1) {
+    return REAL(pread64)(fd, buf, count, offset);
+  }
+  return account(fd, REAL(pread64)(backing, buf, count, offset));
+}
+
+int close(int fd) {
+  closing(fd);
+  return REAL(close)(fd);
+}
+
+int dup2(int oldfd, int newfd) {
+  if (oldfd != newfd) {
+    closing(newfd);
+  }
+  return REAL(dup2)(oldfd, newfd);
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+  if (oldfd != newfd) {
+    closing(newfd);
+  }
+  return REAL(dup3)(oldfd, newfd, flags);
+}
+
+int fclose(FILE *stream) {
+  closing(fileno(stream));
+  return REAL(fclose)(stream);
+}
+
+}  // extern "C"
@@ -0,0 +1,348 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./changedblocks.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+
+using std::shared_ptr;
+using std::string;
+
+namespace {
+
+const char kXattrPrefix[] = "user.wrapperfs.cbt.";
+
+/// Largest attribute value the kernel passes on (XATTR_SIZE_MAX).
+const size_t kMaxValue = 65536;
+
+/// First block after 'length' bytes.
+uint64_t block_end(uint64_t length) {
+  return (length + (1 << ChangedBlocksFs::kBlockShift) - 1) >>
+      ChangedBlocksFs::kBlockShift;
+}
+
+}  // namespace
+
+ChangedBlocksFs::ChangedBlocksFs(Backend *inner) : inner_(inner) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  uint64_t ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%llx",
+           static_cast<unsigned long long>(ns));  // NOLINT
+  tracker_ = buf;
+}
+
+ChangedBlocksFs::~ChangedBlocksFs() {
+}
+
+shared_ptr<ChangedBlocksFs::File> ChangedBlocksFs::get_file(ino_t ino,
+                                                           bool fresh) {
+  std::lock_guard<std::mutex> guard(files_mutex_);
+  shared_ptr<File> &file = files_[ino];
+  if (file == NULL || fresh) {
+    file = std::make_shared<File>();
+    file->epoch = 0;
+  }
+  return file;
+}
+
+void ChangedBlocksFs::forget(const struct stat &stbuf) {
+  if (S_ISREG(stbuf.st_mode) && stbuf.st_nlink <= 1) {
+    std::lock_guard<std::mutex> guard(files_mutex_);
+    files_.erase(stbuf.st_ino);
+  }
+}
+
+void ChangedBlocksFs::wrap(shared_ptr<File> file,
+                           struct fuse_file_info *fi) {
+  Handle *handle = new Handle;
+  handle->fh = fi->fh;
+  handle->file = file;
+  fi->fh = reinterpret_cast<uint64_t>(handle);
+}
+
+struct fuse_file_info ChangedBlocksFs::unwrap(
+    const struct fuse_file_info *fi) {
+  struct fuse_file_info inner = *fi;
+  inner.fh = reinterpret_cast<Handle*>(fi->fh)->fh;
+  return inner;
+}
+
+int ChangedBlocksFs::getxattr(const char *path, const char *name,
+                              char *value, size_t size) {
+  size_t prefix = strlen(kXattrPrefix);
+  if (strncmp(name, kXattrPrefix, prefix) != 0) {
+    return -ENODATA;
+  }
+  name += prefix;
+  // "changed" and "frozen" may be followed by ".PAGE".
+  string kind = name;
+  uint64_t start = 0;
+  uint64_t end = 1ULL << 32;
+  size_t dot = kind.find('.');
+  if (dot != string::npos) {
+    const char *digits = name + dot + 1;
+    char *stop;
+    uint64_t page = strtoull(digits, &stop, 10);
+    kind.resize(dot);
+    if (*stop || stop == digits || !isdigit(*digits) || kind == "epoch" ||
+        page >= end / kPageBlocks) {
+      return -ENODATA;
+    }
+    start = page * kPageBlocks;
+    end = start + kPageBlocks;
+  }
+  if (kind != "epoch" && kind != "changed" && kind != "frozen") {
+    return -ENODATA;
+  }
+  struct stat stbuf;
+  int ret = inner_->getattr(path, &stbuf);
+  if (ret) {
+    return ret;
+  }
+  if (!S_ISREG(stbuf.st_mode)) {
+    return -ENODATA;
+  }
+  shared_ptr<File> file = get_file(stbuf.st_ino, false);
+  string buf;
+  {
+    std::lock_guard<std::mutex> guard(file->mutex);
+    if (kind == "epoch") {
+      buf = tracker_ + "." + std::to_string(file->epoch);
+    } else {
+      (kind == "changed" ? file->changed : file->frozen).serialize(
+          &buf, start, end);
+    }
+  }
+  if (buf.size() > kMaxValue) {
+    return -E2BIG;
+  }
+  if (size == 0) {
+    return buf.size();
+  }
+  if (size < buf.size()) {
+    return -ERANGE;
+  }
+  memcpy(value, buf.data(), buf.size());
+  return buf.size();
+}
+
+int ChangedBlocksFs::setxattr(const char *path, const char *name,
+                              const char *value, size_t size) {
+  if (strcmp(name, (string(kXattrPrefix) + "epoch").c_str()) != 0) {
+    return -ENOTSUP;
+  }
+  struct stat stbuf;
+  int ret = inner_->getattr(path, &stbuf);
+  if (ret) {
+    return ret;
+  }
+  if (!S_ISREG(stbuf.st_mode)) {
+    return -ENOTSUP;
+  }
+  shared_ptr<File> file = get_file(stbuf.st_ino, false);
+  std::lock_guard<std::mutex> guard(file->mutex);
+  if (string(value, size) != tracker_ + "." + std::to_string(file->epoch)) {
+    return -ESTALE;
+  }
+  file->frozen.swap(&file->changed);
+  file->changed.clear();
+  file->epoch++;
+  return 0;
+}
+
+void ChangedBlocksFs::start() {
+  inner_->start();
+}
+
+void ChangedBlocksFs::stop() {
+  inner_->stop();
+}
+
+int ChangedBlocksFs::sync() {
+  return inner_->sync();
+}
+
+int ChangedBlocksFs::compact() {
+  return inner_->compact();
+}
+
+int ChangedBlocksFs::open_backing(const char *path, int flags) {
+  return inner_->open_backing(path, flags);
+}
+
+int ChangedBlocksFs::getattr(const char *path, struct stat *stbuf) {
+  return inner_->getattr(path, stbuf);
+}
+
+int ChangedBlocksFs::readdir(const char *path, void *buf,
+                             fuse_fill_dir_t filler, off_t offset) {
+  return inner_->readdir(path, buf, filler, offset);
+}
+
+int ChangedBlocksFs::access(const char *path, int mask) {
+  return inner_->access(path, mask);
+}
+
+int ChangedBlocksFs::readlink(const char *path, char *buf, size_t size) {
+  return inner_->readlink(path, buf, size);
+}
+
+int ChangedBlocksFs::mkdir(const char *path, mode_t mode) {
+  return inner_->mkdir(path, mode);
+}
+
+int ChangedBlocksFs::rmdir(const char *path) {
+  return inner_->rmdir(path);
+}
+
+int ChangedBlocksFs::unlink(const char *path) {
+  struct stat stbuf;
+  bool known = inner_->getattr(path, &stbuf) == 0;
+  int ret = inner_->unlink(path);
+  if (ret == 0 && known) {
+    forget(stbuf);
+  }
+  return ret;
+}
+
+int ChangedBlocksFs::rename(const char *oldpath, const char *newpath) {
+  struct stat from, to;
+  bool replaces = inner_->getattr(newpath, &to) == 0 &&
+      inner_->getattr(oldpath, &from) == 0 && from.st_ino != to.st_ino;
+  int ret = inner_->rename(oldpath, newpath);
+  if (ret == 0 && replaces) {
+    forget(to);
+  }
+  return ret;
+}
+
+int ChangedBlocksFs::link(const char *oldpath, const char *newpath) {
+  return inner_->link(oldpath, newpath);
+}
+
+int ChangedBlocksFs::symlink(const char *target, const char *path) {
+  return inner_->symlink(target, path);
+}
+
+int ChangedBlocksFs::chmod(const char *path, mode_t mode) {
+  return inner_->chmod(path, mode);
+}
+
+int ChangedBlocksFs::chown(const char *path, uid_t owner, gid_t group) {
+  return inner_->chown(path, owner, group);
+}
+
+int ChangedBlocksFs::utimens(const char *path,
+                             const struct timespec tv[2]) {
+  return inner_->utimens(path, tv);
+}
+
+int ChangedBlocksFs::truncate(const char *path, off_t length) {
+  struct stat stbuf;
+  int ret = inner_->getattr(path, &stbuf);
+  if (ret) {
+    return ret;
+  }
+  ret = inner_->truncate(path, length);
+  if (ret || length == stbuf.st_size) {
+    return ret;
+  }
+  shared_ptr<File> file = get_file(stbuf.st_ino, false);
+  std::lock_guard<std::mutex> guard(file->mutex);
+  // Growing zeroes the rest of the block holding the old end; shrinking
+  // drops blocks a backup still holds, which read as zeros if the file
+  // grows again.
+  uint64_t from = std::min<uint64_t>(length, stbuf.st_size);
+  uint64_t to = std::max<uint64_t>(length, stbuf.st_size);
+  file->changed.add_range(from >> kBlockShift, block_end(to));
+  return 0;
+}
+
+int ChangedBlocksFs::create(const char *path, mode_t mode,
+                            struct fuse_file_info *fi) {
+  int ret = inner_->create(path, mode, fi);
+  if (ret == 0) {
+    struct stat stbuf;
+    shared_ptr<File> file;
+    if (inner_->getattr(path, &stbuf) == 0) {
+      file = get_file(stbuf.st_ino, true);
+    }
+    wrap(file, fi);
+  }
+  return ret;
+}
+
+int ChangedBlocksFs::open(const char *path, struct fuse_file_info *fi) {
+  // The size before O_TRUNC cuts it.
+  struct stat stbuf;
+  bool writing = (fi->flags & O_ACCMODE) != O_RDONLY &&
+      inner_->getattr(path, &stbuf) == 0;
+  int ret = inner_->open(path, fi);
+  if (ret) {
+    return ret;
+  }
+  shared_ptr<File> file;
+  if (writing) {
+    file = get_file(stbuf.st_ino, false);
+    if ((fi->flags & O_TRUNC) && stbuf.st_size > 0) {
+      std::lock_guard<std::mutex> guard(file->mutex);
+      file->changed.add_range(0, block_end(stbuf.st_size));
+    }
+  }
+  wrap(file, fi);
+  return 0;
+}
+
+int ChangedBlocksFs::release(struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  delete reinterpret_cast<Handle*>(fi->fh);
+  return inner_->release(&inner);
+}
+
+int ChangedBlocksFs::read(char *buf, size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->read(buf, size, offset, &inner);
+}
+
+int ChangedBlocksFs::write(const char *buf, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  int ret = inner_->write(buf, size, offset, &inner);
+  File *file = reinterpret_cast<Handle*>(fi->fh)->file.get();
+  if (ret > 0 && file) {
+    std::lock_guard<std::mutex> guard(file->mutex);
+    file->changed.add_range(offset >> kBlockShift,
+                            block_end(offset + ret));
+  }
+  return ret;
+}
+
+int ChangedBlocksFs::fsync(int datasync, struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->fsync(datasync, &inner);
+}
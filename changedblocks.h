@@ -0,0 +1,150 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Changed-block tracking for incremental backups.
+ *
+ * Backup tools re-read a whole VM image or database file to find what
+ * changed since the last backup. ChangedBlocksFs sits between the
+ * handlers and another backend and records, per file, the 64 KiB blocks
+ * that writes and truncates touched, in roaring bitmaps of block numbers.
+ * The blocks are read through extended attributes of the file:
+ *
+ *  - user.wrapperfs.cbt.epoch: the current epoch of the file, as
+ *    "TRACKER.N". TRACKER changes whenever tracking starts over (a new
+ *    daemon), and the blocks before it are unknown.
+ *  - user.wrapperfs.cbt.changed: blocks changed in the current epoch.
+ *  - user.wrapperfs.cbt.frozen: blocks changed in the epoch before.
+ *
+ * Setting user.wrapperfs.cbt.epoch to the current epoch ends it: its
+ * blocks become the frozen ones and a new epoch starts empty. A backup
+ * thus ends the epoch, copies the frozen blocks and records the epoch it
+ * ended; blocks written meanwhile are copied again by the next backup.
+ * Ending an epoch other than the current one fails with ESTALE.
+ *
+ * The bitmaps use the portable Roaring format. Shrinking a file marks
+ * the blocks it cut off as changed, so that they are copied as zeros if
+ * the file grows again; blocks past the end of the file read as nothing.
+ *
+ * A bitmap too large for an attribute (64 KiB) fails with E2BIG. Large or
+ * fragmented files are read in pages instead: user.wrapperfs.cbt.changed.N
+ * and user.wrapperfs.cbt.frozen.N hold the blocks from N * kPageBlocks to
+ * (N + 1) * kPageBlocks (16 GiB of file each), which always fit.
+ */
+
+#ifndef CHANGEDBLOCKS_H_
+#define CHANGEDBLOCKS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "./backend.h"
+#include "./roaring.h"
+
+class ChangedBlocksFs : public Backend {
+ public:
+  /// Bytes per tracked block.
+  static const int kBlockShift = 16;
+
+  /// Blocks per page of a bitmap attribute.
+  static const uint64_t kPageBlocks = 1 << 18;
+
+  /// Takes ownership of 'inner'.
+  explicit ChangedBlocksFs(Backend *inner);
+  ~ChangedBlocksFs();
+
+  /**
+   * Reads the attribute 'name' of the file 'path' into 'value', as
+   * getxattr(2) would. Returns its length, or -errno.
+   */
+  int getxattr(const char *path, const char *name, char *value,
+               size_t size);
+
+  /// Ends the epoch of 'path' named by 'value'; returns 0 or -errno.
+  int setxattr(const char *path, const char *name, const char *value,
+               size_t size);
+
+  void start() override;
+  void stop() override;
+  int sync() override;
+  int compact() override;
+  int open_backing(const char *path, int flags) override;
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  /// The blocks of one inode, shared by its names and open handles.
+  struct File {
+    std::mutex mutex;
+    uint64_t epoch;
+    RoaringBitmap changed;
+    RoaringBitmap frozen;
+  };
+
+  /// Wraps the inner backend's handle.
+  struct Handle {
+    uint64_t fh;
+    std::shared_ptr<File> file;  ///< NULL if opened read-only.
+  };
+
+  /// Returns the File of the inode 'ino', adding it if needed. With
+  /// 'fresh', the inode was just created and any File left from an
+  /// earlier inode with its number is replaced.
+  std::shared_ptr<File> get_file(ino_t ino, bool fresh);
+
+  /// Forgets the inode of 'stbuf' if it had no other name; called once
+  /// the name it was read from is gone.
+  void forget(const struct stat &stbuf);
+
+  void wrap(std::shared_ptr<File> file, struct fuse_file_info *fi);
+  struct fuse_file_info unwrap(const struct fuse_file_info *fi);
+
+  std::unique_ptr<Backend> inner_;
+  std::string tracker_;  ///< Tells apart the runs of the daemon.
+
+  std::mutex files_mutex_;
+  std::unordered_map<ino_t, std::shared_ptr<File>> files_;
+};
+
+#endif  // CHANGEDBLOCKS_H_
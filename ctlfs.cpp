@@ -0,0 +1,165 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./ctlfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+using std::string;
+
+namespace {
+
+const char kCtlDir[] = "/.wrapperfs";
+const size_t kCtlDirLen = sizeof(kCtlDir) - 1;
+
+}  // namespace
+
+CtlFs::CtlFs() {
+  clock_gettime(CLOCK_REALTIME, &mount_time_);
+}
+
+void CtlFs::add_file(const string &name, const Render &render,
+                     const Store &store) {
+  files_[name] = File{render, store};
+}
+
+bool CtlFs::owns(const char *path) const {
+  return strncmp(path, kCtlDir, kCtlDirLen) == 0 &&
+      (path[kCtlDirLen] == '\0' || path[kCtlDirLen] == '/');
+}
+
+const CtlFs::File *CtlFs::find(const char *path) const {
+  if (path[kCtlDirLen] != '/') {
+    return NULL;
+  }
+  auto it = files_.find(path + kCtlDirLen + 1);
+  return it == files_.end() ? NULL : &it->second;
+}
+
+int CtlFs::getattr(const char *path, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(*stbuf));
+  if (path[kCtlDirLen] == '\0') {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+  } else if (const File *file = find(path)) {
+    // The size is unknown until the file is rendered; reads bypass the
+    // page cache (see open()), so a zero size does not truncate them.
+    stbuf->st_mode = S_IFREG | (file->store ? 0644 : 0444);
+    stbuf->st_nlink = 1;
+  } else {
+    return -ENOENT;
+  }
+  stbuf->st_uid = getuid();
+  stbuf->st_gid = getgid();
+  stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = mount_time_.tv_sec;
+  return 0;
+}
+
+int CtlFs::readdir(const char *path, void *buf, fuse_fill_dir_t filler) {
+  if (path[kCtlDirLen] != '\0') {
+    return -ENOTDIR;
+  }
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (const auto &file : files_) {
+    filler(buf, file.first.c_str(), NULL, 0);
+  }
+  return 0;
+}
+
+int CtlFs::access(const char *path, int mask) {
+  if (!(mask & W_OK)) {
+    return 0;
+  }
+  const File *file = find(path);
+  if (!file || !file->store) {
+    return -EACCES;
+  }
+  uid_t uid = fuse_get_context()->uid;
+  return uid == 0 || uid == getuid() ? 0 : -EACCES;
+}
+
+int CtlFs::truncate(const char *path, off_t length) {
+  // Writable files start out empty on every open, so "echo x > file"
+  // works; there is nothing else to truncate.
+  const File *file = find(path);
+  if (!file || !file->store) {
+    return -EPERM;
+  }
+  return length == 0 ? 0 : -EINVAL;
+}
+
+int CtlFs::open(const char *path, struct fuse_file_info *fi) {
+  const File *file = find(path);
+  if (!file) {
+    return path[kCtlDirLen] == '\0' ? -EISDIR : -ENOENT;
+  }
+  Handle *handle = new Handle{file, string(), false};
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    int ret = access(path, W_OK);
+    if (ret) {
+      delete handle;
+      return ret;
+    }
+  } else {
+    // Render once per open so that a reader sees a consistent snapshot.
+    file->render(&handle->content);
+  }
+  fi->fh = reinterpret_cast<uint64_t>(handle);
+  fi->direct_io = 1;
+  return 0;
+}
+
+int CtlFs::read(char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi) {
+  const string *content = &reinterpret_cast<Handle*>(fi->fh)->content;
+  if (offset >= static_cast<off_t>(content->size())) {
+    return 0;
+  }
+  size_t len = std::min(size, content->size() - offset);
+  memcpy(buf, content->data() + offset, len);
+  return len;
+}
+
+int CtlFs::write(const char *buf, size_t size, off_t offset,
+                 struct fuse_file_info *fi) {
+  Handle *handle = reinterpret_cast<Handle*>(fi->fh);
+  if (offset + size > handle->content.size()) {
+    handle->content.resize(offset + size);
+  }
+  handle->content.replace(offset, size, buf, size);
+  handle->written = true;
+  return size;
+}
+
+int CtlFs::flush(struct fuse_file_info *fi) {
+  // close(2) reports what flush returns, unlike release.
+  Handle *handle = reinterpret_cast<Handle*>(fi->fh);
+  if (!handle->written) {
+    return 0;
+  }
+  handle->written = false;
+  return handle->file->store(handle->content);
+}
+
+int CtlFs::release(struct fuse_file_info *fi) {
+  delete reinterpret_cast<Handle*>(fi->fh);
+  return 0;
+}
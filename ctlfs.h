@@ -0,0 +1,84 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Virtual control directory.
+ *
+ * "/.wrapperfs" in the mounted namespace is not passed to the backing
+ * store. It holds virtual files whose contents are rendered when they are
+ * opened, e.g., "/.wrapperfs/stats" for the event counters. Files added
+ * with a Store function are also writable by the mounting user: what is
+ * written between open and close is handed to it on close.
+ */
+
+#ifndef CTLFS_H_
+#define CTLFS_H_
+
+#include <fuse.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <functional>
+#include <map>
+#include <string>
+
+class CtlFs {
+ public:
+  typedef std::function<void(std::string *out)> Render;
+
+  /// Applies the text written to a file; returns 0 or -errno.
+  typedef std::function<int(const std::string &in)> Store;
+
+  CtlFs();
+
+  /// Adds "/.wrapperfs/<name>", rendered by 'render' on every open.
+  void add_file(const std::string &name, const Render &render,
+                const Store &store = Store());
+
+  /// Returns true if 'path' is the control directory or a file in it.
+  bool owns(const char *path) const;
+
+  int getattr(const char *path, struct stat *stbuf);
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+  int access(const char *path, int mask);
+  int truncate(const char *path, off_t length);
+  int open(const char *path, struct fuse_file_info *fi);
+  int read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi);
+  int flush(struct fuse_file_info *fi);
+  int release(struct fuse_file_info *fi);
+
+ private:
+  struct File {
+    Render render;
+    Store store;
+  };
+
+  /// State of one open control file.
+  struct Handle {
+    const File *file;
+    std::string content;
+    bool written;  ///< 'content' holds input not yet stored.
+  };
+
+  const File *find(const char *path) const;
+
+  std::map<std::string, File> files_;
+  struct timespec mount_time_;
+};
+
+#endif  // CTLFS_H_
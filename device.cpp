@@ -0,0 +1,420 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./device.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include "./probes.h"
+#include "./stats.h"
+#include "./timing.h"
+
+using std::string;
+
+namespace {
+
+const uint64_t kBlockSize = 4096;
+
+Counter device_reads("device.reads");
+Counter device_writes("device.writes");
+Counter device_flushes("device.flushes");
+Counter device_wait_ns("device.wait_ns");
+
+/// FNV-1a, to spread files over the device.
+uint64_t hash_path(const char *path) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *path; path++) {
+    h = (h ^ static_cast<uint8_t>(*path)) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/// Parses "k1=v1,k2=v2" over the defaults in 'params'.
+bool parse_params(const string &text, std::map<string, double> *params,
+                  string *error) {
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find(',', pos);
+    if (end == string::npos) {
+      end = text.size();
+    }
+    string item = text.substr(pos, end - pos);
+    size_t eq = item.find('=');
+    string key = item.substr(0, eq);
+    if (eq == string::npos || !params->count(key)) {
+      *error = "unknown parameter '" + key + "'";
+      return false;
+    }
+    char *tail;
+    double value = strtod(item.c_str() + eq + 1, &tail);
+    if (*tail || value < 0) {
+      *error = "bad value for '" + key + "'";
+      return false;
+    }
+    (*params)[key] = value;
+    pos = end + 1;
+  }
+  return true;
+}
+
+void append_param(string *out, const char *key, double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %s=%g", key, value);
+  out->append(buf);
+}
+
+}  // namespace
+
+DeviceModel *DeviceModel::create(const string &spec, string *error) {
+  size_t colon = spec.find(':');
+  string name = spec.substr(0, colon);
+  string args = colon == string::npos ? "" : spec.substr(colon + 1);
+  std::map<string, double> p;
+  if (name == "ssd") {
+    p = { {"read_us", 80}, {"write_us", 20}, {"flush_us", 500}, {"qd", 32},
+          {"mbps", 2000} };
+    if (!parse_params(args, &p, error)) {
+      return NULL;
+    }
+    if (p["qd"] < 1 || p["mbps"] <= 0) {
+      *error = "qd and mbps must be positive";
+      return NULL;
+    }
+    return new SsdModel(p["read_us"], p["write_us"], p["flush_us"],
+                        static_cast<int>(p["qd"]), p["mbps"]);
+  }
+  if (name == "hdd") {
+    p = { {"rpm", 7200}, {"seek_ms", 8.5}, {"mbps", 150}, {"gb", 1000} };
+    if (!parse_params(args, &p, error)) {
+      return NULL;
+    }
+    if (p["rpm"] <= 0 || p["mbps"] <= 0 || p["gb"] <= 0) {
+      *error = "rpm, mbps and gb must be positive";
+      return NULL;
+    }
+    return new HddModel(p["rpm"], p["seek_ms"], p["mbps"], p["gb"]);
+  }
+  if (name == "cloud") {
+    p = { {"iops", 3000}, {"mbps", 125}, {"burst_s", 1},
+          {"latency_us", 1000} };
+    if (!parse_params(args, &p, error)) {
+      return NULL;
+    }
+    return new CloudModel(p["iops"], p["mbps"], p["burst_s"],
+                          p["latency_us"]);
+  }
+  *error = "unknown device model '" + name + "'";
+  return NULL;
+}
+
+SsdModel::SsdModel(double read_us, double write_us, double flush_us, int qd,
+                   double mbps)
+    : read_ns_(read_us * 1000), write_ns_(write_us * 1000),
+      flush_ns_(flush_us * 1000), ns_per_byte_(1e3 / mbps),
+      channel_free_(qd, 0), bus_free_(0) {
+}
+
+uint64_t SsdModel::submit(IoType type, uint64_t addr, uint64_t size,
+                          uint64_t now) {
+  (void) addr;
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (type == FLUSH) {
+    // A flush completes after everything queued before it.
+    uint64_t busy = *std::max_element(channel_free_.begin(),
+                                      channel_free_.end());
+    return std::max(now, busy) + static_cast<uint64_t>(flush_ns_);
+  }
+  auto channel = std::min_element(channel_free_.begin(), channel_free_.end());
+  uint64_t start = std::max(now, *channel);
+  uint64_t ready = start + static_cast<uint64_t>(
+      type == READ ? read_ns_ : write_ns_);
+  bus_free_ = std::max(ready, bus_free_) +
+      static_cast<uint64_t>(size * ns_per_byte_);
+  *channel = bus_free_;
+  return bus_free_;
+}
+
+void SsdModel::describe(string *out) const {
+  out->append("model ssd");
+  append_param(out, "read_us", read_ns_ / 1000);
+  append_param(out, "write_us", write_ns_ / 1000);
+  append_param(out, "flush_us", flush_ns_ / 1000);
+  append_param(out, "qd", channel_free_.size());
+  append_param(out, "mbps", 1e3 / ns_per_byte_);
+  out->append("\n");
+}
+
+HddModel::HddModel(double rpm, double seek_ms, double mbps, double gb)
+    : rpm_(rpm), seek_ns_(seek_ms * 1e6), rotation_ns_(30e9 / rpm),
+      ns_per_byte_(1e3 / mbps), capacity_(gb * 1e9), head_(0),
+      head_free_(0) {
+}
+
+uint64_t HddModel::submit(IoType type, uint64_t addr, uint64_t size,
+                          uint64_t now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  uint64_t start = std::max(now, head_free_);
+  double cost = 0;
+  if (type == FLUSH) {
+    cost = rotation_ns_;
+  } else {
+    addr %= capacity_;
+    if (addr != head_) {
+      // An average seek covers a third of the disk.
+      uint64_t distance = addr > head_ ? addr - head_ : head_ - addr;
+      cost = seek_ns_ * sqrt(3.0 * distance / capacity_) + rotation_ns_;
+    }
+    cost += size * ns_per_byte_;
+    head_ = addr + size;
+  }
+  head_free_ = start + static_cast<uint64_t>(cost);
+  return head_free_;
+}
+
+void HddModel::describe(string *out) const {
+  out->append("model hdd");
+  append_param(out, "rpm", rpm_);
+  append_param(out, "seek_ms", seek_ns_ / 1e6);
+  append_param(out, "mbps", 1e3 / ns_per_byte_);
+  append_param(out, "gb", capacity_ / 1e9);
+  out->append("\n");
+}
+
+CloudModel::CloudModel(double iops, double mbps, double burst_s,
+                       double latency_us)
+    : iops_(iops), mbps_(mbps), burst_s_(burst_s),
+      latency_ns_(latency_us * 1000),
+      iops_bucket_(iops, std::max(1.0, iops * burst_s)),
+      bytes_bucket_(mbps * 1e6, std::max(1e6, mbps * 1e6 * burst_s)) {
+}
+
+uint64_t CloudModel::submit(IoType type, uint64_t addr, uint64_t size,
+                            uint64_t now) {
+  (void) addr;
+  uint64_t start = iops_bucket_.reserve(1, now);
+  if (type != FLUSH) {
+    start = std::max(start, bytes_bucket_.reserve(size, now));
+  }
+  return start + static_cast<uint64_t>(latency_ns_);
+}
+
+void CloudModel::describe(string *out) const {
+  out->append("model cloud");
+  append_param(out, "iops", iops_);
+  append_param(out, "mbps", mbps_);
+  append_param(out, "burst_s", burst_s_);
+  append_param(out, "latency_us", latency_ns_ / 1000);
+  out->append("\n");
+}
+
+DeviceFs::DeviceFs(Backend *inner, DeviceModel *model)
+    : inner_(inner), model_(model) {
+}
+
+DeviceFs::~DeviceFs() {
+}
+
+void DeviceFs::report(string *out) const {
+  model_->describe(out);
+  char buf[128];
+  snprintf(buf, sizeof(buf), "reads %llu\nwrites %llu\nflushes %llu\n"
+           "wait_seconds %.3f\n",
+           static_cast<unsigned long long>(device_reads.value()),  // NOLINT
+           static_cast<unsigned long long>(device_writes.value()),  // NOLINT
+           static_cast<unsigned long long>(device_flushes.value()),  // NOLINT
+           device_wait_ns.value() / 1e9);
+  out->append(buf);
+}
+
+void DeviceFs::charge(DeviceModel::IoType type, uint64_t addr,
+                      uint64_t size) {
+  uint64_t now = now_ns();
+  uint64_t done = model_->submit(type, addr, size, now);
+  switch (type) {
+  case DeviceModel::READ:
+    device_reads.add();
+    break;
+  case DeviceModel::WRITE:
+    device_writes.add();
+    break;
+  case DeviceModel::FLUSH:
+    device_flushes.add();
+    break;
+  }
+  if (done > now) {
+    device_wait_ns.add(done - now);
+    WRAPPERFS_PROBE4(device_wait, type, addr, size, done - now);
+    sleep_until_ns(done);
+  }
+}
+
+void DeviceFs::charge_meta(DeviceModel::IoType type) {
+  charge(type, 0, kBlockSize);
+}
+
+void DeviceFs::wrap(const char *path, struct fuse_file_info *fi) {
+  Handle *handle = new Handle;
+  handle->fh = fi->fh;
+  handle->base = hash_path(path) & ~(kBlockSize - 1);
+  fi->fh = reinterpret_cast<uint64_t>(handle);
+}
+
+struct fuse_file_info DeviceFs::unwrap(const struct fuse_file_info *fi) {
+  struct fuse_file_info inner = *fi;
+  inner.fh = reinterpret_cast<Handle*>(fi->fh)->fh;
+  return inner;
+}
+
+void DeviceFs::start() {
+  inner_->start();
+}
+
+void DeviceFs::stop() {
+  inner_->stop();
+}
+
+int DeviceFs::sync() {
+  charge(DeviceModel::FLUSH, 0, 0);
+  return inner_->sync();
+}
+
+int DeviceFs::compact() {
+  return inner_->compact();
+}
+
+int DeviceFs::getattr(const char *path, struct stat *stbuf) {
+  charge_meta(DeviceModel::READ);
+  return inner_->getattr(path, stbuf);
+}
+
+int DeviceFs::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset) {
+  charge_meta(DeviceModel::READ);
+  return inner_->readdir(path, buf, filler, offset);
+}
+
+int DeviceFs::access(const char *path, int mask) {
+  charge_meta(DeviceModel::READ);
+  return inner_->access(path, mask);
+}
+
+int DeviceFs::readlink(const char *path, char *buf, size_t size) {
+  charge_meta(DeviceModel::READ);
+  return inner_->readlink(path, buf, size);
+}
+
+int DeviceFs::mkdir(const char *path, mode_t mode) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->mkdir(path, mode);
+}
+
+int DeviceFs::rmdir(const char *path) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->rmdir(path);
+}
+
+int DeviceFs::unlink(const char *path) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->unlink(path);
+}
+
+int DeviceFs::rename(const char *oldpath, const char *newpath) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->rename(oldpath, newpath);
+}
+
+int DeviceFs::link(const char *oldpath, const char *newpath) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->link(oldpath, newpath);
+}
+
+int DeviceFs::symlink(const char *target, const char *path) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->symlink(target, path);
+}
+
+int DeviceFs::chmod(const char *path, mode_t mode) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->chmod(path, mode);
+}
+
+int DeviceFs::chown(const char *path, uid_t owner, gid_t group) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->chown(path, owner, group);
+}
+
+int DeviceFs::utimens(const char *path, const struct timespec tv[2]) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->utimens(path, tv);
+}
+
+int DeviceFs::truncate(const char *path, off_t length) {
+  charge_meta(DeviceModel::WRITE);
+  return inner_->truncate(path, length);
+}
+
+int DeviceFs::create(const char *path, mode_t mode,
+                     struct fuse_file_info *fi) {
+  charge_meta(DeviceModel::WRITE);
+  int ret = inner_->create(path, mode, fi);
+  if (ret == 0) {
+    wrap(path, fi);
+  }
+  return ret;
+}
+
+int DeviceFs::open(const char *path, struct fuse_file_info *fi) {
+  charge_meta(DeviceModel::READ);
+  int ret = inner_->open(path, fi);
+  if (ret == 0) {
+    wrap(path, fi);
+  }
+  return ret;
+}
+
+int DeviceFs::release(struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  delete reinterpret_cast<Handle*>(fi->fh);
+  return inner_->release(&inner);
+}
+
+int DeviceFs::read(char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  int ret = inner_->read(buf, size, offset, &inner);
+  if (ret > 0) {
+    charge(DeviceModel::READ,
+           reinterpret_cast<Handle*>(fi->fh)->base + offset, ret);
+  }
+  return ret;
+}
+
+int DeviceFs::write(const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi) {
+  charge(DeviceModel::WRITE,
+         reinterpret_cast<Handle*>(fi->fh)->base + offset, size);
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->write(buf, size, offset, &inner);
+}
+
+int DeviceFs::fsync(int datasync, struct fuse_file_info *fi) {
+  charge(DeviceModel::FLUSH, 0, 0);
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->fsync(datasync, &inner);
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Emulated storage devices.
+ *
+ * DeviceFs sits between the handlers and another backend and delays each
+ * operation by what a modelled device would take to serve it, so that
+ * experiments behave the same on any machine. Data operations are placed
+ * on the device at a fixed address per file (a hash of its path) plus the
+ * file offset; metadata lookups read, and metadata updates write, one
+ * block at address 0.
+ *
+ * Models are given as NAME[:key=value,...]:
+ *   ssd   read_us=80 write_us=20 flush_us=500 qd=32 mbps=2000
+ *   hdd   rpm=7200 seek_ms=8.5 mbps=150 gb=1000
+ *   cloud iops=3000 mbps=125 burst_s=1 latency_us=1000
+ */
+
+#ifndef DEVICE_H_
+#define DEVICE_H_
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "./backend.h"
+#include "./tokenbucket.h"
+
+class DeviceModel {
+ public:
+  enum IoType { READ, WRITE, FLUSH };
+
+  virtual ~DeviceModel() {}
+
+  /**
+   * \brief Parses a model specification.
+   * \return the model, or NULL with the reason in 'error'.
+   */
+  static DeviceModel *create(const std::string &spec, std::string *error);
+
+  /// Queues an I/O submitted at 'now' (ns) and returns when it completes.
+  virtual uint64_t submit(IoType type, uint64_t addr, uint64_t size,
+                          uint64_t now) = 0;
+
+  /// Appends a description of the model and its parameters.
+  virtual void describe(std::string *out) const = 0;
+};
+
+/**
+ * \brief SSD with 'qd' independent channels sharing one bus.
+ */
+class SsdModel : public DeviceModel {
+ public:
+  SsdModel(double read_us, double write_us, double flush_us, int qd,
+           double mbps);
+
+  uint64_t submit(IoType type, uint64_t addr, uint64_t size,
+                  uint64_t now) override;
+  void describe(std::string *out) const override;
+
+ private:
+  double read_ns_;
+  double write_ns_;
+  double flush_ns_;
+  double ns_per_byte_;
+  std::mutex mutex_;
+  std::vector<uint64_t> channel_free_;  ///< When each channel goes idle.
+  uint64_t bus_free_;
+};
+
+/**
+ * \brief Single-head disk; seek time grows with the square root of the
+ * seek distance, and non-sequential I/O waits half a rotation.
+ */
+class HddModel : public DeviceModel {
+ public:
+  HddModel(double rpm, double seek_ms, double mbps, double gb);
+
+  uint64_t submit(IoType type, uint64_t addr, uint64_t size,
+                  uint64_t now) override;
+  void describe(std::string *out) const override;
+
+ private:
+  double rpm_;
+  double seek_ns_;       ///< Average seek, over a third of the disk.
+  double rotation_ns_;   ///< Half a rotation.
+  double ns_per_byte_;
+  uint64_t capacity_;
+  std::mutex mutex_;
+  uint64_t head_;       ///< Address after the last transfer.
+  uint64_t head_free_;
+};
+
+/**
+ * \brief Provisioned cloud volume: fixed network latency, with IOPS and
+ * throughput capped by token buckets that allow 'burst_s' of credit.
+ */
+class CloudModel : public DeviceModel {
+ public:
+  CloudModel(double iops, double mbps, double burst_s, double latency_us);
+
+  uint64_t submit(IoType type, uint64_t addr, uint64_t size,
+                  uint64_t now) override;
+  void describe(std::string *out) const override;
+
+ private:
+  double iops_;
+  double mbps_;
+  double burst_s_;
+  double latency_ns_;
+  TokenBucket iops_bucket_;
+  TokenBucket bytes_bucket_;
+};
+
+/**
+ * \brief Backend decorator that serves 'inner' at the speed of 'model'.
+ */
+class DeviceFs : public Backend {
+ public:
+  /// Takes ownership of both.
+  DeviceFs(Backend *inner, DeviceModel *model);
+  ~DeviceFs();
+
+  /// Renders the model and the time spent waiting on it.
+  void report(std::string *out) const;
+
+  void start() override;
+  void stop() override;
+  int sync() override;
+  int compact() override;
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  /// Wraps the inner backend's handle with the file's device address.
+  struct Handle {
+    uint64_t fh;
+    uint64_t base;
+  };
+
+  /// Waits for one I/O on the modelled device.
+  void charge(DeviceModel::IoType type, uint64_t addr, uint64_t size);
+  void charge_meta(DeviceModel::IoType type);
+
+  /// Replaces the inner handle in 'fi' with a Handle for 'path'.
+  void wrap(const char *path, struct fuse_file_info *fi);
+  static struct fuse_file_info unwrap(const struct fuse_file_info *fi);
+
+  std::unique_ptr<Backend> inner_;
+  std::unique_ptr<DeviceModel> model_;
+};
+
+#endif  // DEVICE_H_
@@ -0,0 +1,684 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./dirstats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+const char *kXattrPrefix = "user.wrapperfs.";
+
+/// Recorded deltas that make a writer settle them.
+const size_t kSettleDirs = 4096;
+
+Counter dirstats_scans("dirstats.scans");
+Counter dirstats_settled("dirstats.settled");
+
+string parent_of(const string &path) {
+  size_t slash = path.rfind('/');
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+/// Whether 'path' is 'dir' or below it.
+bool is_within(const string &path, const string &dir) {
+  return dir == "/" || (path.compare(0, dir.size(), dir) == 0 &&
+                        (path.size() == dir.size() || path[dir.size()] == '/'));
+}
+
+/// Holds a lock for reading or writing for the current scope.
+class ScopedLock {
+ public:
+  ScopedLock(pthread_rwlock_t *lock, bool write) : lock_(lock) {
+    if (write) {
+      pthread_rwlock_wrlock(lock_);
+    } else {
+      pthread_rwlock_rdlock(lock_);
+    }
+  }
+  ~ScopedLock() { pthread_rwlock_unlock(lock_); }
+
+ private:
+  pthread_rwlock_t *lock_;
+};
+
+int collect(void *buf, const char *name, const struct stat *stbuf,
+            off_t offset) {
+  (void) stbuf;
+  (void) offset;
+  static_cast<std::vector<string>*>(buf)->push_back(name);
+  return 0;
+}
+
+}  // namespace
+
+DirStatsFs::DirStatsFs(Backend *inner)
+    : inner_(inner), tracking_(false), walk_missed_{ 0, 0, 0 } {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  // A walk must not wait for a stream of writes to pause.
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&change_lock_, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+DirStatsFs::~DirStatsFs() {
+  for (const auto &entry : files_) {
+    delete entry.second;
+  }
+  pthread_rwlock_destroy(&change_lock_);
+}
+
+void DirStatsFs::record(const string &dir, const Totals &delta) {
+  if (!tracking_) {
+    return;
+  }
+  bool full;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Totals &pending = pending_[dir];
+    pending.bytes += delta.bytes;
+    pending.files += delta.files;
+    pending.dirs += delta.dirs;
+    full = pending_.size() >= kSettleDirs;
+    note_walk_locked(dir, delta);
+  }
+  // Left for the next reader if a walk holds the totals.
+  if (full && totals_mutex_.try_lock()) {
+    settle_locked();
+    totals_mutex_.unlock();
+  }
+}
+
+void DirStatsFs::settle_locked() {
+  std::unordered_map<string, Totals> batch;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    batch.swap(pending_);
+  }
+  for (const auto &entry : batch) {
+    add_locked(entry.first, entry.second);
+  }
+  dirstats_settled.add(batch.size());
+}
+
+void DirStatsFs::add_locked(const string &dir, const Totals &delta) {
+  string ancestor = dir;
+  for (;;) {
+    auto it = totals_.find(ancestor);
+    if (it != totals_.end()) {
+      it->second.bytes += delta.bytes;
+      it->second.files += delta.files;
+      it->second.dirs += delta.dirs;
+    }
+    if (ancestor == "/") {
+      break;
+    }
+    ancestor = parent_of(ancestor);
+  }
+}
+
+void DirStatsFs::note_walk_locked(const string &dir, const Totals &delta) {
+  if (walk_root_.empty() || !is_within(dir, walk_root_)) {
+    return;
+  }
+  for (string ancestor = dir;; ancestor = parent_of(ancestor)) {
+    if (walk_queue_.count(ancestor)) {
+      return;  // The walk lists it later.
+    }
+    if (ancestor == walk_root_) {
+      break;
+    }
+  }
+  walk_missed_.bytes += delta.bytes;
+  walk_missed_.files += delta.files;
+  walk_missed_.dirs += delta.dirs;
+}
+
+void DirStatsFs::start_walk_locked(const string &dir) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  walk_root_ = dir;
+  walk_queue_.insert(dir);
+  walk_missed_ = Totals{ 0, 0, 0 };
+}
+
+void DirStatsFs::end_walk_locked(Totals *totals) {
+  std::unordered_map<string, Totals> batch;
+  {
+    // Changes recorded from here on are settled into the new totals.
+    std::lock_guard<std::mutex> guard(mutex_);
+    batch.swap(pending_);
+    totals->bytes += walk_missed_.bytes;
+    totals->files += walk_missed_.files;
+    totals->dirs += walk_missed_.dirs;
+    walk_root_.clear();
+    walk_queue_.clear();
+  }
+  for (const auto &entry : batch) {
+    add_locked(entry.first, entry.second);
+  }
+  dirstats_settled.add(batch.size());
+}
+
+int DirStatsFs::scan(const string &dir, Totals *totals) {
+  std::vector<string> subdirs;
+  int ret;
+  {
+    // Changes wait, so each is recorded either before the listing, which
+    // sees it, or after, with its directory listed.
+    ScopedLock listing(&change_lock_, true);
+    ret = list(dir, totals, &subdirs);
+    std::lock_guard<std::mutex> guard(mutex_);
+    walk_queue_.erase(dir);
+    walk_queue_.insert(subdirs.begin(), subdirs.end());
+  }
+  if (ret) {
+    return ret;
+  }
+  for (const auto &child : subdirs) {
+    Totals sub = { 0, 0, 0 };
+    if (scan(child, &sub) == 0) {
+      totals->bytes += sub.bytes;
+      totals->files += sub.files;
+      totals->dirs += sub.dirs;
+    }
+  }
+  return 0;
+}
+
+int DirStatsFs::list(const string &dir, Totals *totals,
+                     std::vector<string> *subdirs) {
+  std::vector<string> names;
+  int ret = inner_->readdir(dir.c_str(), &names, collect, 0);
+  if (ret) {
+    return ret;
+  }
+  std::vector<string> dirs;
+  for (const auto &name : names) {
+    if (name == "." || name == "..") {
+      continue;
+    }
+    string child = dir == "/" ? "/" + name : dir + "/" + name;
+    struct stat stbuf;
+    if (inner_->getattr(child.c_str(), &stbuf)) {
+      continue;  // Removed since.
+    }
+    if (S_ISDIR(stbuf.st_mode)) {
+      totals->dirs++;
+      dirs.push_back(child);
+    } else {
+      totals->files++;
+      totals->bytes += stbuf.st_size;
+    }
+  }
+  std::lock_guard<std::mutex> guard(totals_mutex_);
+  settle_locked();
+  for (const auto &child : dirs) {
+    auto it = totals_.find(child);
+    if (it == totals_.end()) {
+      subdirs->push_back(child);
+      continue;
+    }
+    totals->bytes += it->second.bytes;
+    totals->files += it->second.files;
+    totals->dirs += it->second.dirs;
+  }
+  return 0;
+}
+
+int DirStatsFs::get_totals(const string &dir, Totals *out) {
+  {
+    std::lock_guard<std::mutex> guard(totals_mutex_);
+    settle_locked();
+    auto it = totals_.find(dir);
+    if (it != totals_.end()) {
+      *out = it->second;
+      return 0;
+    }
+  }
+  std::lock_guard<std::mutex> walk_guard(walk_mutex_);
+  {
+    std::lock_guard<std::mutex> guard(totals_mutex_);
+    auto it = totals_.find(dir);
+    if (it != totals_.end()) {
+      *out = it->second;  // Walked while this one waited.
+      return 0;
+    }
+    start_walk_locked(dir);
+    // Record changes from now on, for this walk and the totals known
+    // already.
+    tracking_ = true;
+  }
+  dirstats_scans.add();
+  Totals totals = { 0, 0, 0 };
+  int ret = scan(dir, &totals);
+
+  std::lock_guard<std::mutex> guard(totals_mutex_);
+  end_walk_locked(&totals);
+  if (ret) {
+    return ret;
+  }
+  *out = totals_.insert(std::make_pair(dir, totals)).first->second;
+  return 0;
+}
+
+bool DirStatsFs::walk_renamed(const string &from, const string &to,
+                              Totals *totals) {
+  {
+    std::lock_guard<std::mutex> guard(totals_mutex_);
+    if (!tracking_ || totals_.count(from) ||
+        !moves_totals(parent_of(from), parent_of(to))) {
+      return false;
+    }
+    start_walk_locked(from);
+  }
+  dirstats_scans.add();
+  scan(from, totals);
+  return true;
+}
+
+bool DirStatsFs::moves_totals(const string &from, const string &to) {
+  for (const auto &entry : totals_) {
+    if (is_within(from, entry.first) != is_within(to, entry.first)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int DirStatsFs::getxattr(const char *path, const char *name, char *value,
+                         size_t size) {
+  size_t prefix = strlen(kXattrPrefix);
+  if (strncmp(name, kXattrPrefix, prefix) != 0) {
+    return -ENODATA;
+  }
+  name += prefix;
+  if (strcmp(name, "rbytes") && strcmp(name, "rfiles") &&
+      strcmp(name, "rsubdirs")) {
+    return -ENODATA;
+  }
+  struct stat stbuf;
+  int ret = inner_->getattr(path, &stbuf);
+  if (ret) {
+    return ret;
+  }
+  if (!S_ISDIR(stbuf.st_mode)) {
+    return -ENODATA;
+  }
+  Totals totals;
+  ret = get_totals(path, &totals);
+  if (ret) {
+    return ret;
+  }
+  int64_t number = name[1] == 'b' ? totals.bytes :
+      name[1] == 'f' ? totals.files : totals.dirs;
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%lld",
+                     static_cast<long long>(number));  // NOLINT
+  if (size == 0) {
+    return len;
+  }
+  if (size < static_cast<size_t>(len)) {
+    return -ERANGE;
+  }
+  memcpy(value, buf, len);
+  return len;
+}
+
+void DirStatsFs::wrap(const char *path, bool writable,
+                      struct fuse_file_info *fi) {
+  Handle *handle = new Handle;
+  handle->fh = fi->fh;
+  handle->file = NULL;
+  if (writable) {
+    struct stat stbuf;
+    off_t size = inner_->getattr(path, &stbuf) == 0 ? stbuf.st_size : 0;
+    std::lock_guard<std::mutex> guard(mutex_);
+    OpenFile *&file = files_[path];
+    if (file == NULL) {
+      file = new OpenFile;
+      file->path = path;
+      file->size = size;
+      file->refs = 0;
+    }
+    file->refs++;
+    handle->file = file;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(handle);
+}
+
+struct fuse_file_info DirStatsFs::unwrap(const struct fuse_file_info *fi) {
+  struct fuse_file_info inner = *fi;
+  inner.fh = reinterpret_cast<Handle*>(fi->fh)->fh;
+  return inner;
+}
+
+void DirStatsFs::start() {
+  inner_->start();
+}
+
+void DirStatsFs::stop() {
+  inner_->stop();
+}
+
+int DirStatsFs::sync() {
+  return inner_->sync();
+}
+
+int DirStatsFs::compact() {
+  return inner_->compact();
+}
+
+int DirStatsFs::open_backing(const char *path, int flags) {
+  return inner_->open_backing(path, flags);
+}
+
+int DirStatsFs::getattr(const char *path, struct stat *stbuf) {
+  return inner_->getattr(path, stbuf);
+}
+
+int DirStatsFs::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                        off_t offset) {
+  return inner_->readdir(path, buf, filler, offset);
+}
+
+int DirStatsFs::access(const char *path, int mask) {
+  return inner_->access(path, mask);
+}
+
+int DirStatsFs::readlink(const char *path, char *buf, size_t size) {
+  return inner_->readlink(path, buf, size);
+}
+
+int DirStatsFs::mkdir(const char *path, mode_t mode) {
+  ScopedLock change(&change_lock_, false);
+  int ret = inner_->mkdir(path, mode);
+  if (ret == 0) {
+    record(parent_of(path), Totals{ 0, 0, 1 });
+  }
+  return ret;
+}
+
+int DirStatsFs::rmdir(const char *path) {
+  ScopedLock change(&change_lock_, false);
+  int ret = inner_->rmdir(path);
+  if (ret == 0) {
+    record(parent_of(path), Totals{ 0, 0, -1 });
+    std::lock_guard<std::mutex> guard(totals_mutex_);
+    totals_.erase(path);
+  }
+  return ret;
+}
+
+int DirStatsFs::unlink(const char *path) {
+  ScopedLock change(&change_lock_, false);
+  struct stat stbuf;
+  bool counted = tracking_ && inner_->getattr(path, &stbuf) == 0;
+  int ret = inner_->unlink(path);
+  if (ret) {
+    return ret;
+  }
+  if (counted) {
+    record(parent_of(path), Totals{ -stbuf.st_size, -1, 0 });
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  forget_file_locked(path);
+  return 0;
+}
+
+void DirStatsFs::forget_file_locked(const string &path) {
+  auto it = files_.find(path);
+  if (it != files_.end()) {
+    // Writes through its open handles no longer count anywhere.
+    it->second->path.clear();
+    files_.erase(it);
+  }
+}
+
+void DirStatsFs::rename_files_locked(const string &from, const string &to) {
+  forget_file_locked(to);
+  std::vector<OpenFile*> moved;
+  for (auto it = files_.lower_bound(from);
+       it != files_.end() && is_within(it->first, from);) {
+    it->second->path = to + it->first.substr(from.size());
+    moved.push_back(it->second);
+    it = files_.erase(it);
+  }
+  for (OpenFile *file : moved) {
+    files_[file->path] = file;
+  }
+}
+
+int DirStatsFs::rename(const char *oldpath, const char *newpath) {
+  string from = oldpath;
+  string to = newpath;
+  struct stat stbuf, replaced;
+  std::unique_lock<std::mutex> walk_guard(walk_mutex_, std::defer_lock);
+  // The totals of a directory leaving known totals, if unknown, are walked
+  // first: changes go on meanwhile, and totals are read and updated.
+  Totals walked = { 0, 0, 0 };
+  bool walking = false;
+  if (inner_->getattr(oldpath, &stbuf) == 0 && S_ISDIR(stbuf.st_mode)) {
+    walk_guard.lock();  // A walk cannot tell where it went.
+    walking = walk_renamed(from, to, &walked);
+  }
+  ScopedLock change(&change_lock_, false);
+  if (!tracking_ || inner_->getattr(oldpath, &stbuf)) {
+    if (walking) {
+      std::lock_guard<std::mutex> totals_guard(totals_mutex_);
+      end_walk_locked(&walked);
+    }
+    // Nothing known to keep up to date, or the rename fails anyway.
+    int ret = inner_->rename(oldpath, newpath);
+    if (ret == 0) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      rename_files_locked(from, to);
+    }
+    return ret;
+  }
+  bool replacing = inner_->getattr(newpath, &replaced) == 0 &&
+                   replaced.st_ino != stbuf.st_ino;
+
+  std::lock_guard<std::mutex> totals_guard(totals_mutex_);
+  if (walking) {
+    end_walk_locked(&walked);
+  } else {
+    settle_locked();
+  }
+  Totals moved = { stbuf.st_size, 1, 0 };
+  if (S_ISDIR(stbuf.st_mode)) {
+    moved = Totals{ 0, 0, 1 };
+    if (moves_totals(parent_of(from), parent_of(to))) {
+      // Totals only become known through walks, which walk_mutex_ holds
+      // off, so 'walked' has them unless they were known already.
+      auto it = totals_.find(from);
+      const Totals &sub = it != totals_.end() ? it->second : walked;
+      moved.bytes += sub.bytes;
+      moved.files += sub.files;
+      moved.dirs += sub.dirs;
+    }
+  }
+  int ret = inner_->rename(oldpath, newpath);
+  if (ret) {
+    return ret;
+  }
+  Totals gone = { 0, 0, 0 };
+  if (replacing) {
+    gone = S_ISDIR(replaced.st_mode) ?
+        Totals{ 0, 0, -1 } : Totals{ -replaced.st_size, -1, 0 };
+    add_locked(parent_of(to), gone);
+    totals_.erase(to);
+  }
+  Totals left = { -moved.bytes, -moved.files, -moved.dirs };
+  add_locked(parent_of(from), left);
+  add_locked(parent_of(to), moved);
+
+  // Totals and open files below 'from' now live below 'to'.
+  std::vector<std::pair<string, Totals>> renamed;
+  for (auto it = totals_.lower_bound(from);
+       it != totals_.end() && is_within(it->first, from);) {
+    renamed.push_back(std::make_pair(to + it->first.substr(from.size()),
+                                     it->second));
+    it = totals_.erase(it);
+  }
+  totals_.insert(renamed.begin(), renamed.end());
+  std::lock_guard<std::mutex> guard(mutex_);
+  note_walk_locked(parent_of(to), gone);
+  note_walk_locked(parent_of(from), left);
+  note_walk_locked(parent_of(to), moved);
+  rename_files_locked(from, to);
+  return 0;
+}
+
+int DirStatsFs::link(const char *oldpath, const char *newpath) {
+  ScopedLock change(&change_lock_, false);
+  int ret = inner_->link(oldpath, newpath);
+  struct stat stbuf;
+  if (ret == 0 && tracking_ && inner_->getattr(newpath, &stbuf) == 0) {
+    record(parent_of(newpath), Totals{ stbuf.st_size, 1, 0 });
+  }
+  return ret;
+}
+
+int DirStatsFs::symlink(const char *target, const char *path) {
+  ScopedLock change(&change_lock_, false);
+  int ret = inner_->symlink(target, path);
+  if (ret == 0) {
+    struct stat stbuf;
+    off_t size = tracking_ && inner_->getattr(path, &stbuf) == 0 ?
+        stbuf.st_size : 0;
+    record(parent_of(path), Totals{ size, 1, 0 });
+  }
+  return ret;
+}
+
+int DirStatsFs::chmod(const char *path, mode_t mode) {
+  return inner_->chmod(path, mode);
+}
+
+int DirStatsFs::chown(const char *path, uid_t owner, gid_t group) {
+  return inner_->chown(path, owner, group);
+}
+
+int DirStatsFs::utimens(const char *path, const struct timespec tv[2]) {
+  return inner_->utimens(path, tv);
+}
+
+int DirStatsFs::truncate(const char *path, off_t length) {
+  ScopedLock change(&change_lock_, false);
+  struct stat stbuf;
+  bool counted = tracking_ && inner_->getattr(path, &stbuf) == 0;
+  int ret = inner_->truncate(path, length);
+  if (ret) {
+    return ret;
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = files_.find(path);
+    if (it != files_.end()) {
+      it->second->size = length;
+    }
+  }
+  if (counted) {
+    record(parent_of(path), Totals{ length - stbuf.st_size, 0, 0 });
+  }
+  return 0;
+}
+
+int DirStatsFs::create(const char *path, mode_t mode,
+                       struct fuse_file_info *fi) {
+  ScopedLock change(&change_lock_, false);
+  int ret = inner_->create(path, mode, fi);
+  if (ret == 0) {
+    record(parent_of(path), Totals{ 0, 1, 0 });
+    wrap(path, true, fi);
+  }
+  return ret;
+}
+
+int DirStatsFs::open(const char *path, struct fuse_file_info *fi) {
+  int ret = inner_->open(path, fi);
+  if (ret == 0) {
+    wrap(path, (fi->flags & O_ACCMODE) != O_RDONLY, fi);
+  }
+  return ret;
+}
+
+int DirStatsFs::release(struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  Handle *handle = reinterpret_cast<Handle*>(fi->fh);
+  OpenFile *file = handle->file;
+  delete handle;
+  if (file) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (--file->refs == 0) {
+      auto it = files_.find(file->path);
+      if (it != files_.end() && it->second == file) {
+        files_.erase(it);
+      }
+      delete file;
+    }
+  }
+  return inner_->release(&inner);
+}
+
+int DirStatsFs::read(char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->read(buf, size, offset, &inner);
+}
+
+int DirStatsFs::write(const char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  ScopedLock change(&change_lock_, false);
+  int ret = inner_->write(buf, size, offset, &inner);
+  OpenFile *file = reinterpret_cast<Handle*>(fi->fh)->file;
+  if (ret <= 0 || file == NULL) {
+    return ret;
+  }
+  string dir;
+  int64_t grown = 0;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    off_t end = offset + ret;
+    if (end > file->size && !file->path.empty()) {
+      grown = end - file->size;
+      file->size = end;
+      dir = parent_of(file->path);
+    }
+  }
+  if (grown) {
+    record(dir, Totals{ grown, 0, 0 });
+  }
+  return ret;
+}
+
+int DirStatsFs::fsync(int datasync, struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->fsync(datasync, &inner);
+}
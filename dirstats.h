@@ -0,0 +1,206 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Recursive directory statistics.
+ *
+ * du(1) and quota checks walk every file below a directory. DirStatsFs
+ * sits between the handlers and another backend and answers them from
+ * recursive totals instead: the getxattr of user.wrapperfs.rbytes,
+ * user.wrapperfs.rfiles or user.wrapperfs.rsubdirs on a directory returns
+ * the apparent size of, and the number of files and of directories in,
+ * its whole subtree.
+ *
+ * A directory's totals are computed by one walk of its subtree the first
+ * time they are asked for, and maintained from then on. Operations that
+ * change a size or add or remove a name record a delta against the
+ * directory holding it only; deltas are added to the known totals of that
+ * directory and its ancestors in batches, when totals are read or enough
+ * deltas have piled up. A write deep in the tree thus never locks its
+ * ancestors. Until some totals are asked for, nothing is recorded.
+ *
+ * A walk lists one directory at a time while changes to the tree wait,
+ * so that each change happens either before the listing of its directory
+ * and is seen by it, or after. Changes the walk cannot see, in the
+ * directories it has listed or has no need to, are added to its totals
+ * once it is done. Renaming a directory waits for the walk.
+ *
+ * Sizes count once per name, so a file with two hard links counts twice.
+ */
+
+#ifndef DIRSTATS_H_
+#define DIRSTATS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "./backend.h"
+
+class DirStatsFs : public Backend {
+ public:
+  /// Takes ownership of 'inner'.
+  explicit DirStatsFs(Backend *inner);
+  ~DirStatsFs();
+
+  /**
+   * Reads the virtual attribute 'name' of the directory 'path' into
+   * 'value', as getxattr(2) would. Returns its length, or -errno.
+   */
+  int getxattr(const char *path, const char *name, char *value,
+               size_t size);
+
+  void start() override;
+  void stop() override;
+  int sync() override;
+  int compact() override;
+  int open_backing(const char *path, int flags) override;
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  /// Totals of a subtree, or a change to them.
+  struct Totals {
+    int64_t bytes;
+    int64_t files;
+    int64_t dirs;
+  };
+
+  /// A file open for writing, shared by its handles.
+  struct OpenFile {
+    std::string path;  ///< Empty once unlinked.
+    off_t size;        ///< Size as last counted.
+    int refs;
+  };
+
+  /// Wraps the inner backend's handle.
+  struct Handle {
+    uint64_t fh;
+    OpenFile *file;  ///< NULL if opened read-only.
+  };
+
+  /// Records a change to the totals of 'dir' and its ancestors.
+  void record(const std::string &dir, const Totals &delta);
+
+  /// Adds the recorded changes to the known totals; called with
+  /// totals_mutex_ held.
+  void settle_locked();
+
+  /// Adds 'delta' to the known totals of 'dir' and its ancestors.
+  void add_locked(const std::string &dir, const Totals &delta);
+
+  /// Sets 'out' to the totals of 'dir', walking it if they are not known.
+  int get_totals(const std::string &dir, Totals *out);
+
+  /// Starts the walk of 'dir', which records the changes it will not see;
+  /// called with walk_mutex_ and totals_mutex_ held.
+  void start_walk_locked(const std::string &dir);
+
+  /// Adds the changes the walk did not see to 'totals' and ends it, along
+  /// with settle_locked(); called with walk_mutex_ and totals_mutex_ held.
+  void end_walk_locked(Totals *totals);
+
+  /// Walks 'dir' through the inner backend, using the known totals of
+  /// subdirectories; called with walk_mutex_ held, between
+  /// start_walk_locked() and end_walk_locked().
+  int scan(const std::string &dir, Totals *totals);
+
+  /// Adds the entries of 'dir' to 'totals', and appends its subdirectories
+  /// without known totals to 'subdirs'.
+  int list(const std::string &dir, Totals *totals,
+           std::vector<std::string> *subdirs);
+
+  /// Starts a walk of the directory 'from' that rename() is to move out
+  /// of some known totals, unless they are known too; returns whether it
+  /// did, with the walk left to end. Called with walk_mutex_ held.
+  bool walk_renamed(const std::string &from, const std::string &to,
+                    Totals *totals);
+
+  /// Adds 'delta' to the changes the walk will not see, unless it is yet
+  /// to list 'dir'; called with mutex_ held.
+  void note_walk_locked(const std::string &dir, const Totals &delta);
+
+  /// Whether a directory with known totals holds exactly one of 'from'
+  /// and 'to'; called with totals_mutex_ held.
+  bool moves_totals(const std::string &from, const std::string &to);
+
+  /// Stop counting writes to the open file 'path', which was removed, or
+  /// count them under the name it was renamed to; called with mutex_ held.
+  void forget_file_locked(const std::string &path);
+  void rename_files_locked(const std::string &from, const std::string &to);
+
+  void wrap(const char *path, bool writable, struct fuse_file_info *fi);
+  static struct fuse_file_info unwrap(const struct fuse_file_info *fi);
+
+  std::unique_ptr<Backend> inner_;
+
+  std::mutex mutex_;  ///< Guards pending_ and files_.
+  std::unordered_map<std::string, Totals> pending_;  ///< By directory.
+  std::map<std::string, OpenFile*> files_;  ///< Open for writing, by path.
+  std::atomic<bool> tracking_;  ///< Whether any totals are known.
+
+  /// The walk in progress, under mutex_: its root (empty if none), the
+  /// directories it is yet to list and the changes it will not see.
+  std::string walk_root_;
+  std::set<std::string> walk_queue_;
+  Totals walk_missed_;
+
+  /// Held by a walk throughout, and by renames of directories, which
+  /// would move them under it.
+  std::mutex walk_mutex_;
+
+  /// Held shared by operations from their change until it is recorded,
+  /// and exclusively by a walk while it lists a directory.
+  pthread_rwlock_t change_lock_;
+
+  /// Taken before mutex_ when both are needed.
+  std::mutex totals_mutex_;
+  std::map<std::string, Totals> totals_;  ///< By directory.
+};
+
+#endif  // DIRSTATS_H_
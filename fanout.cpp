@@ -0,0 +1,240 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./fanout.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+uint32_t fnv1a(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= static_cast<uint8_t>(data[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/// Returns the shard directories ("00".."ff") under 'dir', sorted.
+vector<uint32_t> list_shards(const string &dir) {
+  vector<uint32_t> shards;
+  DIR *dirp = opendir(dir.c_str());
+  if (dirp == NULL) {
+    return shards;
+  }
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != NULL) {
+    if (strlen(dp->d_name) != 2) {
+      continue;
+    }
+    int hi = hex_value(dp->d_name[0]);
+    int lo = hex_value(dp->d_name[1]);
+    if (hi >= 0 && lo >= 0) {
+      shards.push_back(hi << 4 | lo);
+    }
+  }
+  closedir(dirp);
+  std::sort(shards.begin(), shards.end());
+  return shards;
+}
+
+string hex_name(uint32_t byte) {
+  char name[4];
+  snprintf(name, sizeof(name), "/%02x", byte);
+  return name;
+}
+
+/// Directory offsets: 1 and 2 follow "." and "..", and the entry at
+/// position 'pos' of shard 'shard' is followed by encode(shard, pos + 1).
+off_t encode_offset(uint32_t shard, uint32_t pos) {
+  return static_cast<off_t>(shard + 1) << 32 | pos;
+}
+
+/**
+ * Passes the entries of one shard directory to 'filler', skipping the
+ * first 'skip'. Returns 1 if the kernel buffer filled up, 0 otherwise.
+ */
+int fill_shard(const string &dir, uint32_t shard, uint32_t skip, void *buf,
+               fuse_fill_dir_t filler) {
+  DIR *dirp = opendir(dir.c_str());
+  if (dirp == NULL) {
+    // Removed by a concurrent rmdir of an empty shard.
+    return 0;
+  }
+  uint32_t pos = 0;
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != NULL) {
+    if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+      continue;
+    }
+    if (pos++ < skip) {
+      continue;
+    }
+    if (filler(buf, dp->d_name, NULL, encode_offset(shard, pos))) {
+      closedir(dirp);
+      return 1;
+    }
+  }
+  closedir(dirp);
+  return 0;
+}
+
+}  // namespace
+
+const int FanoutLayout::kMaxLevels;
+
+FanoutLayout::FanoutLayout(int levels)
+    : levels_(std::min(std::max(levels, 0), kMaxLevels)) {
+}
+
+string FanoutLayout::shard_of(const char *name, size_t len) const {
+  uint32_t hash = fnv1a(name, len);
+  string shard;
+  for (int level = 0; level < levels_; level++) {
+    shard += hex_name((hash >> (8 * level)) & 0xff);
+  }
+  return shard;
+}
+
+string FanoutLayout::map(const string &basedir, const string &path) const {
+  if (!enabled() || path.empty() || path[0] != '/') {
+    return basedir + path;
+  }
+  string result = basedir;
+  size_t pos = 1;
+  while (pos < path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos) {
+      next = path.size();
+    }
+    if (next > pos) {
+      result += shard_of(path.data() + pos, next - pos);
+      result.append(path, pos - 1, next - pos + 1);
+    }
+    pos = next + 1;
+  }
+  return result.size() == basedir.size() ? basedir + path : result;
+}
+
+int FanoutLayout::make_shards(const string &abspath) const {
+  // 'abspath' is B(D)/XX[/YY]/NAME; create B(D)/XX before B(D)/XX/YY.
+  vector<string> shard_dirs;
+  string dir = abspath.substr(0, abspath.find_last_of('/'));
+  for (int level = 0; level < levels_; level++) {
+    shard_dirs.push_back(dir);
+    dir.resize(dir.find_last_of('/'));
+  }
+  for (auto it = shard_dirs.rbegin(); it != shard_dirs.rend(); ++it) {
+    if (mkdir(it->c_str(), 0755) == -1 && errno != EEXIST) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+int FanoutLayout::readdir(const string &abspath, void *buf,
+                          fuse_fill_dir_t filler, off_t offset) const {
+  struct stat stbuf;
+  if (stat(abspath.c_str(), &stbuf) == -1) {
+    return -errno;
+  }
+  if (!S_ISDIR(stbuf.st_mode)) {
+    return -ENOTDIR;
+  }
+  if (offset < 1 && filler(buf, ".", NULL, 1)) {
+    return 0;
+  }
+  if (offset < 2 && filler(buf, "..", NULL, 2)) {
+    return 0;
+  }
+  uint32_t start_shard = 0;
+  uint32_t start_pos = 0;
+  if (offset > 2) {
+    start_shard = (offset >> 32) - 1;
+    start_pos = offset & 0xffffffff;
+  }
+
+  // Shard numbers follow the path order (first level in the high byte), so
+  // visiting sorted shard directories yields increasing numbers. Second
+  // level directories are only listed when their parent is reached.
+  int shift = 8 * (levels_ - 1);
+  for (uint32_t first : list_shards(abspath)) {
+    if (first < start_shard >> shift) {
+      continue;
+    }
+    string first_dir = abspath + hex_name(first);
+    vector<uint32_t> seconds;
+    if (levels_ == 1) {
+      seconds.push_back(0);
+    } else {
+      seconds = list_shards(first_dir);
+    }
+    for (uint32_t second : seconds) {
+      uint32_t shard = first << shift | second;
+      if (shard < start_shard) {
+        continue;
+      }
+      string dir = levels_ == 1 ? first_dir : first_dir + hex_name(second);
+      uint32_t skip = shard == start_shard ? start_pos : 0;
+      if (fill_shard(dir, shard, skip, buf, filler)) {
+        return 0;
+      }
+    }
+  }
+  return 0;
+}
+
+int FanoutLayout::rmdir(const string &abspath) const {
+  // Any non-empty shard makes the logical directory non-empty. Empty
+  // shards removed before finding one are recreated on demand.
+  for (uint32_t first : list_shards(abspath)) {
+    string first_dir = abspath + hex_name(first);
+    if (levels_ > 1) {
+      for (uint32_t second : list_shards(first_dir)) {
+        string dir = first_dir + hex_name(second);
+        if (::rmdir(dir.c_str()) == -1 && errno != ENOENT) {
+          return -errno;
+        }
+      }
+    }
+    if (::rmdir(first_dir.c_str()) == -1 && errno != ENOENT) {
+      return -errno;
+    }
+  }
+  return ::rmdir(abspath.c_str()) == -1 ? -errno : 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Hash-sharded backing layout for very large directories.
+ *
+ * With 'levels' > 0, every entry NAME of a logical directory D is stored at
+ * B(D)/XX[/YY]/NAME, where B(D) is the backing directory of D and XX, YY are
+ * bytes of a hash of NAME. Each backing directory therefore only holds up to
+ * 256 shard directories or 1/256^levels of the entries of D, which keeps
+ * lookups and creates in directories with millions of entries cheap on the
+ * backing file system. Shard directories are created on demand.
+ */
+
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include <fuse.h>
+#include <stdint.h>
+#include <string>
+
+class FanoutLayout {
+ public:
+  static const int kMaxLevels = 2;
+
+  /// 'levels' of 0 disables sharding.
+  explicit FanoutLayout(int levels = 0);
+
+  bool enabled() const { return levels_ > 0; }
+
+  /// Maps the logical 'path' to its location under 'basedir'.
+  std::string map(const std::string &basedir, const std::string &path) const;
+
+  /**
+   * \brief Creates the shard directories that hold 'abspath'.
+   * \return 0, or -errno if the logical parent does not exist.
+   */
+  int make_shards(const std::string &abspath) const;
+
+  /**
+   * \brief Lists the logical directory stored at 'abspath'.
+   *
+   * Shards are visited in hash order and entries are passed to 'filler'
+   * with offsets encoding (shard, position), so a listing that does not fit
+   * the kernel buffer resumes where it stopped without reading the whole
+   * directory into memory.
+   */
+  int readdir(const std::string &abspath, void *buf, fuse_fill_dir_t filler,
+              off_t offset) const;
+
+  /// Removes the logical directory at 'abspath' and its empty shards.
+  int rmdir(const std::string &abspath) const;
+
+ private:
+  std::string shard_of(const char *name, size_t len) const;
+
+  int levels_;
+};
+
+#endif  // FANOUT_H_
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./heatmap.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <utility>
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+/// Files with a heatmap; samples of further files are only counted.
+const size_t kMaxFiles = 4096;
+
+/// Interval between two drains of the rings.
+const std::chrono::milliseconds kDrainInterval(50);
+
+Counter heatmap_samples("heatmap.samples");
+Counter heatmap_dropped("heatmap.dropped");
+
+int bucket(uint64_t offset) {
+  return offset ? 64 - __builtin_clzll(offset) : 0;
+}
+
+/// Renders the lower bound of 'bucket' as 0, 1, 2, 4, ..., 1K, ..., 1G.
+string bucket_name(int bucket) {
+  if (bucket == 0) {
+    return "0";
+  }
+  int shift = bucket - 1;
+  const char *units = "\0KMGTPE";
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%llu%.1s",
+           1ULL << (shift % 10), units + shift / 10);  // NOLINT
+  return buf;
+}
+
+}  // namespace
+
+__thread unsigned Heatmap::countdown_;
+__thread Heatmap::Ring *Heatmap::ring_;
+
+Heatmap heatmap;
+
+Heatmap::Heatmap() : other_(0), drainer_stop_(false) {
+  pthread_key_create(&ring_key_, &Heatmap::release_ring);
+}
+
+Heatmap::~Heatmap() {
+  stop();
+}
+
+void Heatmap::init() {
+  for (size_t i = 0; i < kRings; i++) {
+    Ring *ring = new Ring;
+    ring->owned = false;
+    ring->head = 0;
+    ring->tail = 0;
+    rings_.push_back(std::unique_ptr<Ring>(ring));
+  }
+}
+
+void Heatmap::start() {
+  if (rings_.empty()) {
+    return;
+  }
+  drainer_stop_ = false;
+  drainer_ = std::thread(&Heatmap::drain_loop, this);
+}
+
+void Heatmap::stop() {
+  if (!drainer_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(drainer_mutex_);
+    drainer_stop_ = true;
+  }
+  drainer_wakeup_.notify_all();
+  drainer_.join();
+}
+
+Heatmap::Ring *Heatmap::claim_ring() {
+  for (auto &ring : rings_) {
+    bool owned = false;
+    if (ring->owned.compare_exchange_strong(owned, true,
+                                            std::memory_order_acquire)) {
+      if (!ring->slots) {
+        ring->slots.reset(new Sample[kRingSize]);
+      }
+      // Hands the ring back when the thread exits.
+      pthread_setspecific(ring_key_, ring.get());
+      return ring.get();
+    }
+  }
+  return NULL;
+}
+
+void Heatmap::release_ring(void *ring) {
+  static_cast<Ring*>(ring)->owned.store(false, std::memory_order_release);
+}
+
+void Heatmap::sample(Op op, const char *path, uint64_t offset,
+                     uint64_t size) {
+  if (!ring_) {
+    ring_ = claim_ring();
+  }
+  Ring *ring = ring_;
+  if (!ring) {
+    heatmap_dropped.add();
+    return;
+  }
+  uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  if (tail - ring->head.load(std::memory_order_acquire) == kRingSize) {
+    heatmap_dropped.add();
+    return;
+  }
+  Sample *s = &ring->slots[tail % kRingSize];
+  s->offset = offset;
+  s->size = size;
+  s->op = op;
+  strncpy(s->path, path, kPathMax - 1);
+  s->path[kPathMax - 1] = '\0';
+  ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+void Heatmap::drain() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto &ring : rings_) {
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    uint32_t tail = ring->tail.load(std::memory_order_acquire);
+    for (; head != tail; head++) {
+      add(ring->slots[head % kRingSize]);
+    }
+    ring->head.store(head, std::memory_order_release);
+  }
+}
+
+void Heatmap::add(const Sample &sample) {
+  heatmap_samples.add();
+  auto it = files_.find(sample.path);
+  if (it == files_.end()) {
+    if (files_.size() >= kMaxFiles) {
+      other_++;
+      return;
+    }
+    it = files_.insert(std::make_pair(string(sample.path),
+                                      FileHeat())).first;
+  }
+  int b = bucket(sample.offset);
+  it->second.samples++;
+  it->second.count[sample.op][b]++;
+  it->second.bytes[sample.op][b] += sample.size;
+}
+
+void Heatmap::drain_loop() {
+  std::unique_lock<std::mutex> lock(drainer_mutex_);
+  while (!drainer_wakeup_.wait_for(lock, kDrainInterval,
+                                   [this] { return drainer_stop_; })) {
+    drain();
+  }
+}
+
+int Heatmap::configure(const string &text) {
+  std::istringstream words(text);
+  string word;
+  bool clear = false;
+  string settings;
+  while (words >> word) {
+    if (word == "clear") {
+      clear = true;
+      continue;
+    }
+    if (word.compare(0, 5, "rate=") != 0) {
+      return -EINVAL;
+    }
+    settings += "heatmap_rate=" + word.substr(5) + " ";
+  }
+  if (!settings.empty()) {
+    int ret = tunables_update(settings);
+    if (ret) {
+      return ret;
+    }
+  }
+  if (clear) {
+    drain();
+    std::lock_guard<std::mutex> guard(mutex_);
+    files_.clear();
+    other_ = 0;
+  }
+  return 0;
+}
+
+void Heatmap::report(string *out) {
+  drain();
+  std::lock_guard<std::mutex> guard(mutex_);
+  char buf[128];
+  snprintf(buf, sizeof(buf), "# rate 1/%u files %zu untracked_samples %llu\n",
+           rate(), files_.size(),
+           static_cast<unsigned long long>(other_));  // NOLINT
+  out->append(buf);
+
+  // Busiest files first.
+  typedef std::map<string, FileHeat>::const_iterator FileIter;
+  std::vector<FileIter> order;
+  for (FileIter it = files_.begin(); it != files_.end(); ++it) {
+    order.push_back(it);
+  }
+  std::sort(order.begin(), order.end(), [](FileIter a, FileIter b) {
+    return a->second.samples > b->second.samples;
+  });
+  static const char *kOpNames[OP_COUNT] = { "read", "write" };
+  for (FileIter it : order) {
+    const FileHeat &heat = it->second;
+    out->append("file ");
+    out->append(it->first);
+    out->push_back('\n');
+    for (int op = 0; op < OP_COUNT; op++) {
+      string line;
+      for (int b = 0; b < kBuckets; b++) {
+        unsigned long long count = heat.count[op][b];  // NOLINT
+        unsigned long long bytes = heat.bytes[op][b];  // NOLINT
+        if (count) {
+          snprintf(buf, sizeof(buf), " %s:%llu/%llu",
+                   bucket_name(b).c_str(), count, bytes);
+          line += buf;
+        }
+      }
+      if (!line.empty()) {
+        out->append("  ");
+        out->append(kOpNames[op]);
+        out->append(line);
+        out->push_back('\n');
+      }
+    }
+  }
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Sampled per-file offset heatmaps.
+ *
+ * One in every 'rate' reads and writes on a thread is recorded as (path,
+ * op, offset, size) into a lock-free single-producer ring owned by that
+ * thread. A background thread drains the rings every 50ms into per-file
+ * heatmaps: sample counts and bytes per log2 offset bucket, where bucket
+ * i > 0 covers offsets [2^(i-1), 2^i). A thread that is not sampling pays
+ * one load of the tunables and a thread-local decrement per operation.
+ *
+ * The heatmaps are read from /.wrapperfs/heatmap as one "file PATH" line
+ * per file, busiest first, followed by "read" and "write" lines listing
+ * BUCKET:SAMPLES/BYTES for each bucket hit, BUCKET being the lowest
+ * offset it covers. Writing "rate=N" to that file changes the
+ * heatmap_rate tunable (0 stops sampling) and "clear" drops the collected
+ * data.
+ */
+
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <fuse.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./tunables.h"
+
+class Heatmap {
+ public:
+  enum Op { READ, WRITE, OP_COUNT };
+
+  /// log2 offset buckets: 0 and one per bit of a 64-bit offset.
+  static const int kBuckets = 65;
+
+  Heatmap();
+  ~Heatmap();
+
+  /// Sets up the rings; sampling follows the heatmap_rate tunable, and
+  /// nothing is sampled without them.
+  void init();
+
+  /// Starts and stops the thread draining the rings.
+  void start();
+  void stop();
+
+  unsigned rate() const {
+    return tunables().heatmap_rate;
+  }
+
+  /// Counts an operation, recording it if it is the sampled one.
+  void count(Op op, const char *path, uint64_t offset, uint64_t size) {
+    unsigned n = rate();
+    if (n == 0 || rings_.empty()) {
+      return;
+    }
+    if (--countdown_ > 0 && countdown_ <= n) {
+      return;
+    }
+    countdown_ = n;
+    sample(op, path, offset, size);
+  }
+
+  /// Applies "rate=N" and "clear"; returns 0 or -EINVAL.
+  int configure(const std::string &text);
+
+  void report(std::string *out);
+
+ private:
+  static const size_t kRings = 64;
+  static const size_t kRingSize = 512;
+  static const size_t kPathMax = 256;
+
+  struct Sample {
+    uint64_t offset;
+    uint64_t size;
+    int op;
+    char path[kPathMax];
+  };
+
+  /// Ring written by its owning thread and read under mutex_. Slots are
+  /// allocated by the first thread to own it.
+  struct Ring {
+    std::atomic<bool> owned;
+    std::atomic<uint32_t> head;  ///< Next slot to read.
+    std::atomic<uint32_t> tail;  ///< Next slot to write.
+    std::unique_ptr<Sample[]> slots;
+  };
+
+  struct FileHeat {
+    FileHeat() : samples(0), count(), bytes() {}
+
+    uint64_t samples;
+    uint64_t count[OP_COUNT][kBuckets];
+    uint64_t bytes[OP_COUNT][kBuckets];
+  };
+
+  void sample(Op op, const char *path, uint64_t offset, uint64_t size);
+  Ring *claim_ring();
+  static void release_ring(void *ring);
+  void drain();
+  void drain_loop();
+  void add(const Sample &sample);
+
+  static __thread unsigned countdown_;
+  static __thread Ring *ring_;
+
+  std::vector<std::unique_ptr<Ring>> rings_;
+  pthread_key_t ring_key_;
+
+  std::mutex mutex_;
+  std::map<std::string, FileHeat> files_;
+  uint64_t other_;  ///< Samples of files beyond the table size.
+
+  std::mutex drainer_mutex_;
+  std::condition_variable drainer_wakeup_;
+  bool drainer_stop_;
+  std::thread drainer_;
+};
+
+extern Heatmap heatmap;
+
+/**
+ * \brief Handler layer that samples reads and writes into 'heatmap'.
+ */
+template <class Next>
+struct HeatmapLayer : Next {
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    heatmap.count(Heatmap::READ, path, offset, size);
+    return Next::read(path, buf, size, offset, fi);
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    heatmap.count(Heatmap::WRITE, path, offset, size);
+    return Next::write(path, buf, size, offset, fi);
+  }
+};
+
+#endif  // HEATMAP_H_
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./hotpaths.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <sstream>
+#include <string>
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+/// Sketch dimensions: estimates exceed the truth by at most 0.13% of all
+/// counts with 98% confidence.
+const size_t kSketchWidth = 2048;
+const size_t kSketchDepth = 4;
+
+/// Shards updated by the handler threads.
+const size_t kShards = 8;
+
+/// Updates a shard takes before it is merged.
+const int kMergeUpdates = 1024;
+
+/// Distinct keys a shard remembers between merges. Keys beyond it are
+/// still counted, and make it into the top K once seen after a merge.
+const size_t kMaxShardKeys = 256;
+
+Counter hot_merges("hot.merges");
+
+/// Shard of the calling thread, assigned on first use.
+__thread int shard_index = -1;
+
+string parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL || slash == path) {
+    return "/";
+  }
+  return string(path, slash - path);
+}
+
+void remember(std::unordered_map<string, uint64_t> *keys, const string &key,
+              uint64_t hash) {
+  if (keys->size() < kMaxShardKeys) {
+    keys->insert(std::make_pair(key, hash));
+  }
+}
+
+void offer(TopK *top, const string &key, uint64_t count) {
+  if (count) {
+    top->offer(key, count);
+  }
+}
+
+}  // namespace
+
+HotPaths hot_paths;
+
+HotPaths::Sketches::Sketches()
+    : ops(kSketchWidth, kSketchDepth), bytes(kSketchWidth, kSketchDepth) {
+}
+
+void HotPaths::Sketches::merge(const Sketches &other) {
+  ops.merge(other.ops);
+  bytes.merge(other.bytes);
+}
+
+void HotPaths::Sketches::clear() {
+  ops.clear();
+  bytes.clear();
+}
+
+HotPaths::HotPaths() : enabled_(false), next_shard_(0) {
+}
+
+void HotPaths::init(size_t k) {
+  if (k == 0) {
+    return;
+  }
+  for (size_t i = 0; i < kShards; i++) {
+    shards_.push_back(std::unique_ptr<Shard>(new Shard));
+    shards_.back()->updates = 0;
+  }
+  file_ops_.reset(new TopK(k));
+  file_bytes_.reset(new TopK(k));
+  dir_ops_.reset(new TopK(k));
+  dir_bytes_.reset(new TopK(k));
+  enabled_ = true;
+}
+
+void HotPaths::record(const char *path, uint64_t bytes) {
+  if (shard_index < 0) {
+    shard_index = next_shard_++ % kShards;
+  }
+  string file(path);
+  string dir = parent_dir(path);
+  std::hash<string> hasher;
+  uint64_t file_hash = hasher(file);
+  uint64_t dir_hash = hasher(dir);
+
+  Shard *shard = shards_[shard_index].get();
+  std::lock_guard<std::mutex> guard(shard->mutex);
+  shard->files.ops.add(file_hash, 1);
+  shard->dirs.ops.add(dir_hash, 1);
+  if (bytes) {
+    shard->files.bytes.add(file_hash, bytes);
+    shard->dirs.bytes.add(dir_hash, bytes);
+  }
+  remember(&shard->file_keys, file, file_hash);
+  remember(&shard->dir_keys, dir, dir_hash);
+  if (++shard->updates >= kMergeUpdates) {
+    merge(shard);
+  }
+}
+
+void HotPaths::merge(Shard *shard) {
+  hot_merges.add();
+  std::lock_guard<std::mutex> guard(mutex_);
+  files_.merge(shard->files);
+  dirs_.merge(shard->dirs);
+  for (const auto &key : shard->file_keys) {
+    offer(file_ops_.get(), key.first, files_.ops.estimate(key.second));
+    offer(file_bytes_.get(), key.first, files_.bytes.estimate(key.second));
+  }
+  for (const auto &key : shard->dir_keys) {
+    offer(dir_ops_.get(), key.first, dirs_.ops.estimate(key.second));
+    offer(dir_bytes_.get(), key.first, dirs_.bytes.estimate(key.second));
+  }
+  shard->files.clear();
+  shard->dirs.clear();
+  shard->file_keys.clear();
+  shard->dir_keys.clear();
+  shard->updates = 0;
+}
+
+int HotPaths::configure(const string &text) {
+  std::istringstream words(text);
+  string word;
+  bool clear = false;
+  while (words >> word) {
+    if (word != "clear") {
+      return -EINVAL;
+    }
+    clear = true;
+  }
+  if (!clear || !enabled()) {
+    return 0;
+  }
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> shard_guard(shard->mutex);
+    shard->files.clear();
+    shard->dirs.clear();
+    shard->file_keys.clear();
+    shard->dir_keys.clear();
+    shard->updates = 0;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  files_.clear();
+  dirs_.clear();
+  file_ops_->clear();
+  file_bytes_->clear();
+  dir_ops_->clear();
+  dir_bytes_->clear();
+  return 0;
+}
+
+void HotPaths::report(string *out) {
+  if (!enabled()) {
+    return;
+  }
+  for (auto &shard : shards_) {
+    std::lock_guard<std::mutex> shard_guard(shard->mutex);
+    if (shard->updates) {
+      merge(shard.get());
+    }
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  const struct {
+    const char *name;
+    const TopK *top;
+  } lists[] = {
+    { "files.ops", file_ops_.get() },
+    { "files.bytes", file_bytes_.get() },
+    { "dirs.ops", dir_ops_.get() },
+    { "dirs.bytes", dir_bytes_.get() },
+  };
+  for (const auto &list : lists) {
+    for (const auto &entry : list.top->sorted()) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "%s %llu ", list.name,
+               static_cast<unsigned long long>(entry.second));  // NOLINT
+      out->append(buf);
+      out->append(entry.first);
+      out->push_back('\n');
+    }
+  }
+}
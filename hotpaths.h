@@ -0,0 +1,198 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Hot files and directories.
+ *
+ * Counts operations and bytes per path and per parent directory with
+ * count-min sketches, and keeps the top K of each. Handlers update one of
+ * a few striped shards, each a set of sketches plus the paths seen since
+ * its last merge; a shard is merged into the global sketches every
+ * kMergeUpdates updates and whenever the summary is read, and its paths
+ * are then offered to the top-K lists with their global estimates. Memory
+ * stays fixed however many files the tree holds.
+ *
+ * The summary is read from /.wrapperfs/hot; counts are upper bounds.
+ * Writing "clear" to the file starts over.
+ */
+
+#ifndef HOTPATHS_H_
+#define HOTPATHS_H_
+
+#include <fuse.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "./sketch.h"
+
+class HotPaths {
+ public:
+  HotPaths();
+
+  /// Starts tracking the top 'k' paths and directories; 0 turns it off.
+  void init(size_t k);
+
+  bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  /// Counts one operation on 'path' moving 'bytes'.
+  void record(const char *path, uint64_t bytes);
+
+  /// Accepts "clear"; returns 0 or -EINVAL.
+  int configure(const std::string &text);
+
+  void report(std::string *out);
+
+ private:
+  /// Sketches of one kind of key (paths or directories).
+  struct Sketches {
+    Sketches();
+    void merge(const Sketches &other);
+    void clear();
+
+    CountMinSketch ops;
+    CountMinSketch bytes;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    Sketches files;
+    Sketches dirs;
+    /// Keys counted since the last merge, with their hashes.
+    std::unordered_map<std::string, uint64_t> file_keys;
+    std::unordered_map<std::string, uint64_t> dir_keys;
+    int updates;
+  };
+
+  /// Merges 'shard' into the global state; caller holds its mutex.
+  void merge(Shard *shard);
+
+  std::atomic<bool> enabled_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<unsigned> next_shard_;
+
+  std::mutex mutex_;
+  Sketches files_;
+  Sketches dirs_;
+  std::unique_ptr<TopK> file_ops_;
+  std::unique_ptr<TopK> file_bytes_;
+  std::unique_ptr<TopK> dir_ops_;
+  std::unique_ptr<TopK> dir_bytes_;
+};
+
+extern HotPaths hot_paths;
+
+/**
+ * \brief Handler layer that feeds 'hot_paths'.
+ */
+template <class Next>
+struct HotPathsLayer : Next {
+  static int record(const char *path, int ret, bool data) {
+    if (hot_paths.enabled()) {
+      hot_paths.record(path, data && ret > 0 ? ret : 0);
+    }
+    return ret;
+  }
+
+  static int access(const char *path, int mask) {
+    return record(path, Next::access(path, mask), false);
+  }
+
+  static int chmod(const char *path, mode_t mode) {
+    return record(path, Next::chmod(path, mode), false);
+  }
+
+  static int chown(const char *path, uid_t owner, gid_t group) {
+    return record(path, Next::chown(path, owner, group), false);
+  }
+
+  static int create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    return record(path, Next::create(path, mode, fi), false);
+  }
+
+  static int fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    return record(path, Next::fsync(path, datasync, fi), false);
+  }
+
+  static int getattr(const char *path, struct stat *stbuf) {
+    return record(path, Next::getattr(path, stbuf), false);
+  }
+
+  static int link(const char *oldpath, const char *newpath) {
+    return record(newpath, Next::link(oldpath, newpath), false);
+  }
+
+  static int mkdir(const char *path, mode_t mode) {
+    return record(path, Next::mkdir(path, mode), false);
+  }
+
+  static int open(const char *path, struct fuse_file_info *fi) {
+    return record(path, Next::open(path, fi), false);
+  }
+
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    return record(path, Next::read(path, buf, size, offset, fi), true);
+  }
+
+  static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi) {
+    return record(path, Next::readdir(path, buf, filler, offset, fi),
+                  false);
+  }
+
+  static int readlink(const char *path, char *buf, size_t size) {
+    return record(path, Next::readlink(path, buf, size), false);
+  }
+
+  static int rename(const char *oldpath, const char *newpath) {
+    return record(oldpath, Next::rename(oldpath, newpath), false);
+  }
+
+  static int rmdir(const char *path) {
+    return record(path, Next::rmdir(path), false);
+  }
+
+  static int symlink(const char *target, const char *path) {
+    return record(path, Next::symlink(target, path), false);
+  }
+
+  static int truncate(const char *path, off_t length) {
+    return record(path, Next::truncate(path, length), false);
+  }
+
+  static int unlink(const char *path) {
+    return record(path, Next::unlink(path), false);
+  }
+
+  static int utimens(const char *path, const struct timespec tv[2]) {
+    return record(path, Next::utimens(path, tv), false);
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    return record(path, Next::write(path, buf, size, offset, fi), true);
+  }
+};
+
+#endif  // HOTPATHS_H_
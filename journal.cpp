@@ -0,0 +1,515 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include "./stats.h"
+
+using std::string;
+
+ChangeJournal journal;
+
+namespace {
+
+const char kMagic[8] = { 'W', 'F', 'S', 'J', 'R', 'N', 'L', '1' };
+
+/// Changes to files here are not part of the tree.
+const char kCtlDir[] = "/.wrapperfs";
+
+/// Keeps the largest record (two paths) well below half the ring.
+const uint64_t kMinCapacity = 1 << 20;
+
+/// Changes shown by report().
+const size_t kReportChanges = 16;
+
+Counter journal_records("journal.records");
+Counter journal_bytes("journal.bytes");
+Counter journal_overwritten("journal.overwritten");
+
+bool is_ctl(const char *path) {
+  size_t len = sizeof(kCtlDir) - 1;
+  return strncmp(path, kCtlDir, len) == 0 &&
+      (path[len] == '\0' || path[len] == '/');
+}
+
+/// Copies the header of the record at 'pos', or as much of it as there is
+/// before the end of the ring (always its size and type).
+void load_record(const char *ring, uint64_t capacity, uint64_t pos,
+                 JournalRecord *rec) {
+  uint64_t off = pos % capacity;
+  memset(rec, 0, sizeof(*rec));
+  memcpy(rec, ring + off, std::min<uint64_t>(sizeof(*rec), capacity - off));
+}
+
+/// Whether 'rec', found at 'pos', fits the ring and its own size.
+bool valid_record(const JournalRecord &rec, uint64_t capacity,
+                  uint64_t pos) {
+  if (rec.size < 8 || rec.size % 8 || rec.size > capacity - pos % capacity) {
+    return false;
+  }
+  return rec.op == JOURNAL_PAD ||
+      (rec.op <= JOURNAL_UTIMENS && rec.size >= sizeof(rec) &&
+       sizeof(rec) + static_cast<uint64_t>(rec.path_len) + rec.path2_len <=
+       rec.size);
+}
+
+void format_change(const JournalChange &change, string *out) {
+  char buf[256];
+  time_t secs = change.time_ns / 1000000000ULL;
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(buf + n, sizeof(buf) - n, ".%09llu %llu uid=%u pid=%d %s ",
+           static_cast<unsigned long long>(  // NOLINT
+               change.time_ns % 1000000000ULL),
+           static_cast<unsigned long long>(change.seq),  // NOLINT
+           change.uid, change.pid, journal_op_name(change.op));
+  out->append(buf);
+  out->append(change.path);
+  buf[0] = '\0';
+  switch (change.op) {
+  case JOURNAL_CREATE:
+  case JOURNAL_MKDIR:
+  case JOURNAL_CHMOD:
+    snprintf(buf, sizeof(buf), " mode=%04llo",
+             static_cast<unsigned long long>(change.arg[0]));  // NOLINT
+    break;
+  case JOURNAL_WRITE:
+    snprintf(buf, sizeof(buf), " offset=%llu length=%llu",
+             static_cast<unsigned long long>(change.arg[0]),  // NOLINT
+             static_cast<unsigned long long>(change.arg[1]));  // NOLINT
+    break;
+  case JOURNAL_TRUNCATE:
+    snprintf(buf, sizeof(buf), " length=%llu",
+             static_cast<unsigned long long>(change.arg[0]));  // NOLINT
+    break;
+  case JOURNAL_CHOWN:
+    snprintf(buf, sizeof(buf), " uid=%d gid=%d",
+             static_cast<int32_t>(change.arg[0]),
+             static_cast<int32_t>(change.arg[1]));
+    break;
+  case JOURNAL_UTIMENS:
+    snprintf(buf, sizeof(buf), " atime_ns=%lld mtime_ns=%lld",
+             static_cast<long long>(change.arg[0]),  // NOLINT
+             static_cast<long long>(change.arg[1]));  // NOLINT
+    break;
+  case JOURNAL_SYMLINK:
+  case JOURNAL_LINK:
+  case JOURNAL_RENAME:
+    out->append(" -> ");
+    out->append(change.path2);
+    break;
+  }
+  out->append(buf);
+  out->push_back('\n');
+}
+
+}  // namespace
+
+const char *journal_op_name(int op) {
+  static const char *const kNames[] = {
+    "pad", "create", "mkdir", "symlink", "link", "rename", "unlink", "rmdir",
+    "write", "truncate", "chmod", "chown", "utimens",
+  };
+  if (op < 0 || op > JOURNAL_UTIMENS) {
+    return "unknown";
+  }
+  return kNames[op];
+}
+
+JournalReader::JournalReader()
+    : header_(NULL), ring_(NULL), map_(NULL), map_size_(0) {
+}
+
+JournalReader::~JournalReader() {
+  if (map_) {
+    munmap(map_, map_size_);
+  }
+}
+
+int JournalReader::open(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -errno;
+  }
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    int err = -errno;
+    ::close(fd);
+    return err;
+  }
+  if (stbuf.st_size < static_cast<off_t>(kJournalHeaderSize)) {
+    ::close(fd);
+    return -EINVAL;
+  }
+  void *map = mmap(NULL, stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  int err = map == MAP_FAILED ? -errno : 0;
+  ::close(fd);
+  if (err) {
+    return err;
+  }
+  const JournalHeader *header = static_cast<const JournalHeader*>(map);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) ||
+      header->capacity + kJournalHeaderSize !=
+      static_cast<uint64_t>(stbuf.st_size)) {
+    munmap(map, stbuf.st_size);
+    return -EINVAL;
+  }
+  if (map_) {
+    munmap(map_, map_size_);
+  }
+  map_ = map;
+  map_size_ = stbuf.st_size;
+  attach(header);
+  return 0;
+}
+
+void JournalReader::attach(const JournalHeader *header) {
+  header_ = header;
+  ring_ = reinterpret_cast<const char*>(header) + kJournalHeaderSize;
+}
+
+JournalReader::Positions JournalReader::positions() const {
+  Positions p;
+  for (;;) {
+    uint64_t gen = header_->gen.load(std::memory_order_acquire);
+    p.first_seq = header_->first_seq.load(std::memory_order_relaxed);
+    p.first_pos = header_->first_pos.load(std::memory_order_relaxed);
+    p.next_seq = header_->next_seq.load(std::memory_order_relaxed);
+    p.next_pos = header_->next_pos.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(gen & 1) && header_->gen.load(std::memory_order_relaxed) == gen) {
+      return p;
+    }
+  }
+}
+
+JournalReader::Cursor JournalReader::oldest() const {
+  Positions p = positions();
+  Cursor cursor = { p.first_seq, p.first_pos };
+  return cursor;
+}
+
+JournalReader::Cursor JournalReader::end() const {
+  Positions p = positions();
+  Cursor cursor = { p.next_seq, p.next_pos };
+  return cursor;
+}
+
+int JournalReader::seek(uint64_t seq, Cursor *cursor) const {
+  *cursor = oldest();
+  JournalChange change;
+  while (cursor->seq < seq) {
+    int ret = next(cursor, &change);
+    if (ret == 0) {
+      break;
+    } else if (ret < 0 && ret != -ESTALE) {
+      return ret;
+    }
+  }
+  return cursor->seq > seq ? -ESTALE : 0;
+}
+
+int JournalReader::next(Cursor *cursor, JournalChange *change) const {
+  uint64_t capacity = header_->capacity;
+  for (;;) {
+    Positions p = positions();
+    if (cursor->pos >= p.next_pos) {
+      return 0;
+    }
+    if (cursor->pos < p.first_pos) {
+      *cursor = oldest();
+      return -ESTALE;
+    }
+    JournalRecord rec;
+    load_record(ring_, capacity, cursor->pos, &rec);
+    bool valid = valid_record(rec, capacity, cursor->pos);
+    if (valid && rec.op != JOURNAL_PAD) {
+      const char *path = ring_ + cursor->pos % capacity + sizeof(rec);
+      change->path.assign(path, rec.path_len);
+      change->path2.assign(path + rec.path_len, rec.path2_len);
+    }
+    // The copy is only good if the writer did not start overwriting it.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->first_pos.load(std::memory_order_relaxed) > cursor->pos) {
+      *cursor = oldest();
+      return -ESTALE;
+    }
+    if (!valid) {
+      return -EIO;
+    }
+    if (rec.op == JOURNAL_PAD) {
+      cursor->pos += rec.size;
+      continue;
+    }
+    if (rec.seq != cursor->seq) {
+      return -EIO;
+    }
+    change->seq = rec.seq;
+    change->time_ns = rec.time_ns;
+    change->op = rec.op;
+    change->uid = rec.uid;
+    change->pid = rec.pid;
+    change->arg[0] = rec.arg[0];
+    change->arg[1] = rec.arg[1];
+    cursor->pos += rec.size;
+    cursor->seq++;
+    return 1;
+  }
+}
+
+ChangeJournal::ChangeJournal() : header_(NULL), ring_(NULL), map_size_(0) {
+}
+
+ChangeJournal::~ChangeJournal() {
+  close();
+}
+
+int ChangeJournal::open(const string &path, uint64_t capacity) {
+  if (capacity < kMinCapacity || capacity % 8) {
+    return -EINVAL;
+  }
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return -errno;
+  }
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    int err = -errno;
+    ::close(fd);
+    return err;
+  }
+  size_t map_size = kJournalHeaderSize + capacity;
+
+  // A journal of another size starts over, but its sequence numbers go
+  // on, so that consumers notice they missed its records.
+  bool keep = false;
+  uint64_t next_seq = 1;
+  if (stbuf.st_size >= static_cast<off_t>(kJournalHeaderSize)) {
+    void *old = mmap(NULL, kJournalHeaderSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (old != MAP_FAILED) {
+      const JournalHeader *header = static_cast<const JournalHeader*>(old);
+      if (memcmp(header->magic, kMagic, sizeof(kMagic)) == 0) {
+        keep = header->capacity == capacity &&
+            static_cast<uint64_t>(stbuf.st_size) == map_size;
+        next_seq = header->next_seq.load();
+      }
+      munmap(old, kJournalHeaderSize);
+    }
+  }
+  if (!keep && (ftruncate(fd, 0) == -1 || ftruncate(fd, map_size) == -1)) {
+    int err = -errno;
+    ::close(fd);
+    return err;
+  }
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+  int err = map == MAP_FAILED ? -errno : 0;
+  ::close(fd);
+  if (err) {
+    return err;
+  }
+
+  close();
+  header_ = static_cast<JournalHeader*>(map);
+  ring_ = static_cast<char*>(map) + kJournalHeaderSize;
+  map_size_ = map_size;
+  if (keep) {
+    recover();
+  } else {
+    memcpy(header_->magic, kMagic, sizeof(kMagic));
+    header_->capacity = capacity;
+    header_->gen = 0;
+    update_locked(next_seq, 0, next_seq, 0);
+  }
+  return 0;
+}
+
+void ChangeJournal::close() {
+  if (header_) {
+    munmap(header_, map_size_);
+    header_ = NULL;
+    ring_ = NULL;
+  }
+}
+
+void ChangeJournal::recover() {
+  uint64_t capacity = header_->capacity;
+  uint64_t first_seq = header_->first_seq.load();
+  uint64_t first_pos = header_->first_pos.load();
+  uint64_t next_pos = header_->next_pos.load();
+  if (next_pos < first_pos || next_pos - first_pos > capacity) {
+    next_pos = first_pos;
+  }
+  // Pages of the ring may not have reached the disk before a crash, while
+  // the header did.
+  uint64_t seq = first_seq;
+  uint64_t pos = first_pos;
+  while (pos < next_pos) {
+    JournalRecord rec;
+    load_record(ring_, capacity, pos, &rec);
+    if (!valid_record(rec, capacity, pos) || pos + rec.size > next_pos ||
+        (rec.op != JOURNAL_PAD && rec.seq != seq)) {
+      break;
+    }
+    if (rec.op != JOURNAL_PAD) {
+      seq++;
+    }
+    pos += rec.size;
+  }
+  header_->gen = 0;
+  update_locked(first_seq, first_pos, seq, pos);
+}
+
+void ChangeJournal::update_locked(uint64_t first_seq, uint64_t first_pos,
+                                  uint64_t next_seq, uint64_t next_pos) {
+  uint64_t gen = header_->gen.load(std::memory_order_relaxed);
+  header_->gen.store(gen + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->first_seq.store(first_seq, std::memory_order_relaxed);
+  header_->first_pos.store(first_pos, std::memory_order_relaxed);
+  header_->next_seq.store(next_seq, std::memory_order_relaxed);
+  header_->next_pos.store(next_pos, std::memory_order_relaxed);
+  header_->gen.store(gen + 2, std::memory_order_release);
+}
+
+void ChangeJournal::drop_until_locked(uint64_t end) {
+  uint64_t capacity = header_->capacity;
+  uint64_t first_seq = header_->first_seq.load(std::memory_order_relaxed);
+  uint64_t first_pos = header_->first_pos.load(std::memory_order_relaxed);
+  uint64_t next_seq = header_->next_seq.load(std::memory_order_relaxed);
+  uint64_t next_pos = header_->next_pos.load(std::memory_order_relaxed);
+  if (end - first_pos <= capacity) {
+    return;
+  }
+  uint64_t dropped = 0;
+  while (end - first_pos > capacity && first_pos < next_pos) {
+    JournalRecord rec;
+    load_record(ring_, capacity, first_pos, &rec);
+    if (rec.op != JOURNAL_PAD) {
+      first_seq = rec.seq + 1;
+      dropped++;
+    }
+    first_pos += rec.size;
+  }
+  update_locked(first_seq, first_pos, next_seq, next_pos);
+  // Readers copying the dropped records must see them go before they see
+  // them overwritten.
+  std::atomic_thread_fence(std::memory_order_release);
+  journal_overwritten.add(dropped);
+}
+
+void ChangeJournal::append(int op, const char *path, const char *path2,
+                           uint64_t arg0, uint64_t arg1) {
+  if (is_ctl(path)) {
+    return;
+  }
+  JournalRecord rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.op = op;
+  rec.path_len = strlen(path);
+  rec.path2_len = path2 ? strlen(path2) : 0;
+  rec.size = (sizeof(rec) + rec.path_len + rec.path2_len + 7) & ~7UL;
+  struct fuse_context *ctx = fuse_get_context();
+  rec.uid = ctx ? ctx->uid : 0;
+  rec.pid = ctx ? ctx->pid : 0;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  rec.time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  rec.arg[0] = arg0;
+  rec.arg[1] = arg1;
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  uint64_t capacity = header_->capacity;
+  uint64_t pos = header_->next_pos.load(std::memory_order_relaxed);
+  uint64_t off = pos % capacity;
+  uint64_t pad = off + rec.size > capacity ? capacity - off : 0;
+  drop_until_locked(pos + pad + rec.size);
+  if (pad) {
+    JournalRecord fill;
+    memset(&fill, 0, sizeof(fill));
+    fill.size = pad;
+    fill.op = JOURNAL_PAD;
+    memcpy(ring_ + off, &fill, std::min<uint64_t>(sizeof(fill), pad));
+    pos += pad;
+    off = 0;
+  }
+  rec.seq = header_->next_seq.load(std::memory_order_relaxed);
+  char *p = ring_ + off;
+  memcpy(p, &rec, sizeof(rec));
+  memcpy(p + sizeof(rec), path, rec.path_len);
+  if (rec.path2_len) {
+    memcpy(p + sizeof(rec) + rec.path_len, path2, rec.path2_len);
+  }
+  update_locked(header_->first_seq.load(std::memory_order_relaxed),
+                header_->first_pos.load(std::memory_order_relaxed),
+                rec.seq + 1, pos + rec.size);
+  journal_records.add();
+  journal_bytes.add(rec.size);
+}
+
+int ChangeJournal::sync() {
+  if (header_ == NULL) {
+    return 0;
+  }
+  return msync(header_, map_size_, MS_SYNC) == -1 ? -errno : 0;
+}
+
+void ChangeJournal::report(string *out) const {
+  JournalReader reader;
+  reader.attach(header_);
+  JournalReader::Cursor cursor = reader.oldest();
+  JournalReader::Cursor end = reader.end();
+  char buf[256];
+  snprintf(buf, sizeof(buf), "first_seq %llu\nnext_seq %llu\n"
+           "used_bytes %llu\ncapacity %llu\n",
+           static_cast<unsigned long long>(cursor.seq),  // NOLINT
+           static_cast<unsigned long long>(end.seq),  // NOLINT
+           static_cast<unsigned long long>(end.pos - cursor.pos),  // NOLINT
+           static_cast<unsigned long long>(header_->capacity));  // NOLINT
+  out->append(buf);
+
+  if (end.seq - cursor.seq > kReportChanges) {
+    reader.seek(end.seq - kReportChanges, &cursor);
+  }
+  std::deque<JournalChange> latest;
+  JournalChange change;
+  while (cursor.seq < end.seq) {
+    int ret = reader.next(&cursor, &change);
+    if (ret == -ESTALE) {
+      latest.clear();
+      continue;
+    } else if (ret <= 0) {
+      break;
+    }
+    latest.push_back(change);
+    if (latest.size() > kReportChanges) {
+      latest.pop_front();
+    }
+  }
+  for (const auto &c : latest) {
+    format_change(c, out);
+  }
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Change journal.
+ *
+ * Every successful mutation (create, mkdir, symlink, link, rename, unlink,
+ * rmdir, write, truncate, chmod, chown, utimens) is appended as a record
+ * to a memory-mapped file, so that indexers, backup and replication tools
+ * can follow the tree instead of rescanning it. Records carry consecutive
+ * sequence numbers. The file is a ring: it keeps the latest records that
+ * fit and the oldest ones are overwritten.
+ *
+ * The file starts with a JournalHeader page, followed by the ring. Byte
+ * positions count from the first record ever written; the record at
+ * position P lives at P % capacity in the ring, and one that would cross
+ * the end of the ring is preceded by a padding record instead. Before
+ * overwriting records, the writer moves first_pos past them; a record is
+ * published by moving next_pos past it. The four positions are updated
+ * under a sequence lock ('gen' is odd while they change).
+ *
+ * A consumer keeps a cursor (sequence number and position), copies the
+ * record at its position while that is below next_pos, and then checks
+ * that first_pos has not moved past it: otherwise the copy may be torn
+ * and the consumer has fallen behind. JournalReader does all this, on a
+ * file it maps read-only. Sequence numbers carry on across mounts of the
+ * same file.
+ */
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <fuse.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+/// Record types; arg[] holds the values listed.
+enum {
+  JOURNAL_PAD = 0,  ///< Fills the end of the ring.
+  JOURNAL_CREATE = 1,  ///< mode
+  JOURNAL_MKDIR,     ///< mode
+  JOURNAL_SYMLINK,   ///< path2 is the target
+  JOURNAL_LINK,      ///< path2 is the new name
+  JOURNAL_RENAME,    ///< path2 is the new name
+  JOURNAL_UNLINK,
+  JOURNAL_RMDIR,
+  JOURNAL_WRITE,     ///< offset, length
+  JOURNAL_TRUNCATE,  ///< length
+  JOURNAL_CHMOD,     ///< mode
+  JOURNAL_CHOWN,     ///< uid, gid ((uint32_t) -1: unchanged)
+  JOURNAL_UTIMENS,   ///< atime, mtime in ns (UINT64_MAX: unchanged)
+};
+
+/// Returns e.g. "write" for JOURNAL_WRITE.
+const char *journal_op_name(int op);
+
+/// Bytes before the ring.
+const uint64_t kJournalHeaderSize = 4096;
+
+struct JournalHeader {
+  char magic[8];      ///< "WFSJRNL1"
+  uint64_t capacity;  ///< bytes in the ring
+  std::atomic<uint64_t> gen;
+  std::atomic<uint64_t> first_seq;  ///< oldest record kept
+  std::atomic<uint64_t> first_pos;
+  std::atomic<uint64_t> next_seq;   ///< record written next
+  std::atomic<uint64_t> next_pos;
+};
+
+/// Followed by 'path' and 'path2', padded to a multiple of 8 bytes.
+struct JournalRecord {
+  uint32_t size;  ///< of the whole record
+  uint16_t op;
+  uint16_t reserved;
+  uint32_t path_len;
+  uint32_t path2_len;
+  uint32_t uid;
+  uint32_t pid;
+  uint64_t seq;
+  uint64_t time_ns;  ///< CLOCK_REALTIME
+  uint64_t arg[2];
+};
+
+/// A record as returned by JournalReader.
+struct JournalChange {
+  uint64_t seq;
+  uint64_t time_ns;
+  int op;
+  uid_t uid;
+  pid_t pid;
+  std::string path;
+  std::string path2;
+  uint64_t arg[2];
+};
+
+/**
+ * \brief Tails a change journal.
+ */
+class JournalReader {
+ public:
+  struct Cursor {
+    uint64_t seq;
+    uint64_t pos;
+  };
+
+  JournalReader();
+  ~JournalReader();
+
+  /// Maps the journal at 'path' read-only; returns 0 or -errno.
+  int open(const std::string &path);
+
+  /// Reads the mapping of a journal written by this process.
+  void attach(const JournalHeader *header);
+
+  /// The oldest record kept, and the one that will be written next.
+  Cursor oldest() const;
+  Cursor end() const;
+
+  /**
+   * Positions 'cursor' on record 'seq', or on end() if 'seq' has not been
+   * written yet. Returns 0, or -ESTALE and the oldest record if 'seq' is
+   * no longer kept.
+   */
+  int seek(uint64_t seq, Cursor *cursor) const;
+
+  /**
+   * Reads the record at 'cursor' and moves past it. Returns 1, 0 if there
+   * is none yet, -ESTALE if it was overwritten (the cursor then moves to
+   * the oldest record) or -EIO if the journal is corrupted.
+   */
+  int next(Cursor *cursor, JournalChange *change) const;
+
+ private:
+  struct Positions {
+    uint64_t first_seq;
+    uint64_t first_pos;
+    uint64_t next_seq;
+    uint64_t next_pos;
+  };
+
+  Positions positions() const;
+
+  const JournalHeader *header_;
+  const char *ring_;
+  void *map_;  ///< set by open()
+  size_t map_size_;
+};
+
+/**
+ * \brief Appends changes to a journal file.
+ */
+class ChangeJournal {
+ public:
+  ChangeJournal();
+  ~ChangeJournal();
+
+  /**
+   * Maps 'path', creating it or resizing it to keep 'capacity' bytes of
+   * records; records already in a file of that capacity are kept. Returns
+   * 0 or -errno.
+   */
+  int open(const std::string &path, uint64_t capacity);
+  void close();
+
+  bool enabled() const {
+    return header_ != NULL;
+  }
+
+  /// Appends a change by the calling FUSE request. Paths under the
+  /// control directory are left out.
+  void append(int op, const char *path, const char *path2 = NULL,
+              uint64_t arg0 = 0, uint64_t arg1 = 0);
+
+  /// Writes the mapping back to the file; returns 0 or -errno.
+  int sync();
+
+  /// Renders the positions and the latest changes.
+  void report(std::string *out) const;
+
+ private:
+  /// Drops records from the oldest up to or past position 'end'.
+  void drop_until_locked(uint64_t end);
+
+  /// Moves the positions forward from the records found in the ring,
+  /// dropping a torn tail left by a crash.
+  void recover();
+
+  void update_locked(uint64_t first_seq, uint64_t first_pos,
+                     uint64_t next_seq, uint64_t next_pos);
+
+  JournalHeader *header_;
+  char *ring_;
+  size_t map_size_;
+  std::mutex mutex_;
+};
+
+extern ChangeJournal journal;
+
+/**
+ * \brief Handler layer that appends successful mutations to 'journal'.
+ */
+template <class Next>
+struct JournalLayer : Next {
+  static int record(int ret, int op, const char *path,
+                    const char *path2 = NULL, uint64_t arg0 = 0,
+                    uint64_t arg1 = 0) {
+    if (ret >= 0 && journal.enabled()) {
+      journal.append(op, path, path2, arg0, arg1);
+    }
+    return ret;
+  }
+
+  static uint64_t time_arg(const struct timespec &ts) {
+    if (ts.tv_nsec == UTIME_OMIT) {
+      return UINT64_MAX;
+    } else if (ts.tv_nsec == UTIME_NOW) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      return now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  static int chmod(const char *path, mode_t mode) {
+    return record(Next::chmod(path, mode), JOURNAL_CHMOD, path, NULL, mode);
+  }
+
+  static int chown(const char *path, uid_t owner, gid_t group) {
+    return record(Next::chown(path, owner, group), JOURNAL_CHOWN, path, NULL,
+                  static_cast<uint32_t>(owner), static_cast<uint32_t>(group));
+  }
+
+  static int create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    return record(Next::create(path, mode, fi), JOURNAL_CREATE, path, NULL,
+                  mode);
+  }
+
+  static int link(const char *oldpath, const char *newpath) {
+    return record(Next::link(oldpath, newpath), JOURNAL_LINK, oldpath,
+                  newpath);
+  }
+
+  static int mkdir(const char *path, mode_t mode) {
+    return record(Next::mkdir(path, mode), JOURNAL_MKDIR, path, NULL, mode);
+  }
+
+  static int rename(const char *oldpath, const char *newpath) {
+    return record(Next::rename(oldpath, newpath), JOURNAL_RENAME, oldpath,
+                  newpath);
+  }
+
+  static int rmdir(const char *path) {
+    return record(Next::rmdir(path), JOURNAL_RMDIR, path);
+  }
+
+  static int symlink(const char *target, const char *path) {
+    return record(Next::symlink(target, path), JOURNAL_SYMLINK, path,
+                  target);
+  }
+
+  static int truncate(const char *path, off_t length) {
+    return record(Next::truncate(path, length), JOURNAL_TRUNCATE, path, NULL,
+                  length);
+  }
+
+  static int unlink(const char *path) {
+    return record(Next::unlink(path), JOURNAL_UNLINK, path);
+  }
+
+  static int utimens(const char *path, const struct timespec tv[2]) {
+    return record(Next::utimens(path, tv), JOURNAL_UTIMENS, path, NULL,
+                  time_arg(tv[0]), time_arg(tv[1]));
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    int ret = Next::write(path, buf, size, offset, fi);
+    return record(ret, JOURNAL_WRITE, path, NULL, offset, ret);
+  }
+};
+
+#endif  // JOURNAL_H_
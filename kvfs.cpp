@@ -0,0 +1,1098 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./kvfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "./stats.h"
+#include "./tunables.h"
+
+using std::string;
+
+namespace {
+
+const uint64_t kRootIno = 1;
+
+/// Inode numbers are reserved in the store this many at a time.
+const uint64_t kInoReserve = 1024;
+
+const char *kNextInoKey = "snext_ino";
+
+/// InodeRecord::flags: the file contents follow the record.
+const uint32_t kInlineData = 1;
+
+Counter inline_reads("kvfs.inline_reads");
+Counter inline_read_bytes("kvfs.inline_read_bytes");
+Counter backing_reads("kvfs.backing_reads");
+Counter inline_spills("kvfs.inline_spills");
+
+string be64(uint64_t v) {
+  string s(8, '\0');
+  for (int i = 7; i >= 0; i--) {
+    s[i] = static_cast<char>(v & 0xff);
+    v >>= 8;
+  }
+  return s;
+}
+
+uint64_t from_be64(const char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v = (v << 8) | static_cast<uint8_t>(p[i]);
+  }
+  return v;
+}
+
+string inode_key(uint64_t ino) {
+  return "i" + be64(ino);
+}
+
+string dirent_prefix(uint64_t parent) {
+  return "d" + be64(parent);
+}
+
+string dirent_key(uint64_t parent, const string &name) {
+  return dirent_prefix(parent) + name;
+}
+
+struct timespec now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts;
+}
+
+/// Splits "/a/b/c" into {"a", "b", "c"}.
+std::vector<string> split_path(const string &path) {
+  std::vector<string> parts;
+  size_t pos = 0;
+  while (pos < path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos) {
+      next = path.size();
+    }
+    if (next > pos) {
+      parts.push_back(path.substr(pos, next - pos));
+    }
+    pos = next + 1;
+  }
+  return parts;
+}
+
+}  // namespace
+
+KvFs::KvFs()
+    : next_ino_(kRootIno + 1),
+      reserved_ino_(kRootIno + 1) {
+}
+
+KvFs::~KvFs() {
+  for (auto &entry : open_inodes_) {
+    if (entry.second->fd != -1) {
+      close(entry.second->fd);
+    }
+  }
+  store_.close();
+}
+
+int KvFs::init(const string &basedir) {
+  basedir_ = basedir + "/.wrapperfs";
+  if (::mkdir(basedir_.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  if (::mkdir((basedir_ + "/data").c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  int ret = store_.open(basedir_ + "/meta");
+  if (ret) {
+    return ret;
+  }
+
+  string value;
+  if (store_.get(kNextInoKey, &value) && value.size() == 8) {
+    next_ino_ = reserved_ino_ = from_be64(value.data());
+  }
+  if (!store_.exists(inode_key(kRootIno))) {
+    // Not called from a FUSE request, so there is no caller context to
+    // take the owner from.
+    KvBatch batch;
+    InodeRecord root;
+    memset(&root, 0, sizeof(root));
+    root.ino = root.parent = kRootIno;
+    root.mode = S_IFDIR | 0755;
+    root.uid = getuid();
+    root.gid = getgid();
+    root.nlink = 2;
+    root.atime = root.mtime = root.ctime = now();
+    put_inode(&batch, root);
+    ret = store_.write(batch);
+    if (ret) {
+      return ret;
+    }
+  }
+  purge_orphans();
+  return 0;
+}
+
+void KvFs::init_record(InodeRecord *rec, uint64_t ino, mode_t mode) {
+  memset(rec, 0, sizeof(*rec));
+  struct fuse_context *ctx = fuse_get_context();
+  rec->ino = ino;
+  rec->mode = mode;
+  rec->uid = ctx->uid;
+  rec->gid = ctx->gid;
+  rec->nlink = 1;
+  rec->atime = rec->mtime = rec->ctime = now();
+}
+
+uint64_t KvFs::alloc_ino(KvBatch *batch) {
+  // Callers hold ns_mutex_.
+  if (next_ino_ >= reserved_ino_) {
+    reserved_ino_ = next_ino_ + kInoReserve;
+    batch->put(kNextInoKey, be64(reserved_ino_));
+  }
+  return next_ino_++;
+}
+
+bool KvFs::load_inode(uint64_t ino, InodeRecord *rec, string *tail) const {
+  string value;
+  if (!store_.get(inode_key(ino), &value) || value.size() < sizeof(*rec)) {
+    return false;
+  }
+  memcpy(rec, value.data(), sizeof(*rec));
+  if (tail) {
+    tail->assign(value, sizeof(*rec), string::npos);
+  }
+  return true;
+}
+
+void KvFs::put_inode(KvBatch *batch, const InodeRecord &rec,
+                     const string &tail) {
+  string value(reinterpret_cast<const char*>(&rec), sizeof(rec));
+  value += tail;
+  batch->put(inode_key(rec.ino), value);
+}
+
+void KvFs::put_dirent(KvBatch *batch, uint64_t parent, const string &name,
+                      const InodeRecord &rec) {
+  DirentRecord dent = { rec.ino, rec.mode };
+  batch->put(dirent_key(parent, name),
+             string(reinterpret_cast<const char*>(&dent), sizeof(dent)));
+}
+
+void KvFs::del_dirent(KvBatch *batch, uint64_t parent, const string &name) {
+  batch->del(dirent_key(parent, name));
+}
+
+int KvFs::lookup_child(uint64_t parent, const string &name,
+                       DirentRecord *dent) const {
+  string value;
+  if (!store_.get(dirent_key(parent, name), &value) ||
+      value.size() != sizeof(*dent)) {
+    return -ENOENT;
+  }
+  memcpy(dent, value.data(), sizeof(*dent));
+  return 0;
+}
+
+int KvFs::lookup(const string &path, InodeRecord *rec, string *tail) const {
+  uint64_t ino = kRootIno;
+  for (const auto &name : split_path(path)) {
+    DirentRecord dent;
+    int ret = lookup_child(ino, name, &dent);
+    if (ret) {
+      return ret;
+    }
+    ino = dent.ino;
+  }
+  return load_inode(ino, rec, tail) ? 0 : -ENOENT;
+}
+
+int KvFs::lookup_parent(const string &path, InodeRecord *parent,
+                        string *name) const {
+  size_t slash = path.find_last_of('/');
+  if (slash == string::npos || slash + 1 == path.size()) {
+    return -EINVAL;
+  }
+  *name = path.substr(slash + 1);
+  int ret = lookup(path.substr(0, slash), parent);
+  if (ret) {
+    return ret;
+  }
+  return S_ISDIR(parent->mode) ? 0 : -ENOTDIR;
+}
+
+bool KvFs::dir_empty(uint64_t ino) const {
+  bool empty = true;
+  store_.scan(dirent_prefix(ino), "",
+              [&empty](const string &, const string &) {
+                empty = false;
+                return false;
+              });
+  return empty;
+}
+
+string KvFs::data_path(uint64_t ino) const {
+  char name[64];
+  snprintf(name, sizeof(name), "/data/%02x/%016llx",
+           static_cast<unsigned>(ino & 0xff),
+           static_cast<unsigned long long>(ino));
+  return basedir_ + name;
+}
+
+int KvFs::open_data(uint64_t ino, bool create) {
+  string path = data_path(ino);
+  int flags = O_RDWR | (create ? O_CREAT : 0);
+  int fd = ::open(path.c_str(), flags, 0600);
+  if (fd == -1 && errno == ENOENT && create) {
+    // Files that were never written have no backing file; the shard
+    // directory is created on first use.
+    string shard = path.substr(0, path.find_last_of('/'));
+    if (::mkdir(shard.c_str(), 0700) == -1 && errno != EEXIST) {
+      return -errno;
+    }
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  }
+  return fd == -1 ? -errno : fd;
+}
+
+void KvFs::fill_stat(const InodeRecord &rec, struct stat *stbuf) const {
+  memset(stbuf, 0, sizeof(*stbuf));
+  stbuf->st_ino = rec.ino;
+  stbuf->st_mode = rec.mode;
+  stbuf->st_nlink = rec.nlink;
+  stbuf->st_uid = rec.uid;
+  stbuf->st_gid = rec.gid;
+  stbuf->st_size = rec.size;
+  stbuf->st_blksize = 4096;
+  stbuf->st_blocks = (rec.size + 511) / 512;
+#ifdef __APPLE__
+  stbuf->st_atimespec = rec.atime;
+  stbuf->st_mtimespec = rec.mtime;
+  stbuf->st_ctimespec = rec.ctime;
+#else
+  stbuf->st_atim = rec.atime;
+  stbuf->st_mtim = rec.mtime;
+  stbuf->st_ctim = rec.ctime;
+#endif
+}
+
+int KvFs::getattr(const char *path, struct stat *stbuf) {
+  InodeRecord rec;
+  int ret = lookup(path, &rec);
+  if (ret) {
+    return ret;
+  }
+  if (S_ISREG(rec.mode)) {
+    // Writes only update the open-file state; pick up the live values.
+    std::lock_guard<std::mutex> guard(open_mutex_);
+    auto it = open_inodes_.find(rec.ino);
+    if (it != open_inodes_.end()) {
+      std::lock_guard<std::mutex> inode_guard(it->second->mutex);
+      rec.size = it->second->size;
+      rec.mtime = it->second->mtime;
+    }
+  }
+  fill_stat(rec, stbuf);
+  return 0;
+}
+
+int KvFs::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                  off_t offset) {
+  (void) offset;
+  InodeRecord rec;
+  int ret = lookup(path, &rec);
+  if (ret) {
+    return ret;
+  }
+  if (!S_ISDIR(rec.mode)) {
+    return -ENOTDIR;
+  }
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+
+  string prefix = dirent_prefix(rec.ino);
+  store_.scan(prefix, "",
+              [&](const string &key, const string &value) {
+                if (value.size() != sizeof(DirentRecord)) {
+                  return true;
+                }
+                DirentRecord dent;
+                memcpy(&dent, value.data(), sizeof(dent));
+                struct stat stbuf;
+                memset(&stbuf, 0, sizeof(stbuf));
+                stbuf.st_ino = dent.ino;
+                stbuf.st_mode = dent.mode;
+                return filler(buf, key.c_str() + prefix.size(), &stbuf, 0)
+                    == 0;
+              });
+  return 0;
+}
+
+int KvFs::access(const char *path, int mask) {
+  InodeRecord rec;
+  int ret = lookup(path, &rec);
+  if (ret || mask == F_OK) {
+    return ret;
+  }
+  struct fuse_context *ctx = fuse_get_context();
+  uid_t uid = ctx->uid;
+  if (uid == 0) {
+    // root may do anything, except execute files with no x bit at all.
+    return (mask & X_OK) && !S_ISDIR(rec.mode) && !(rec.mode & 0111)
+        ? -EACCES : 0;
+  }
+  int shift = 0;
+  if (rec.uid == uid) {
+    shift = 6;
+  } else if (rec.gid == ctx->gid) {
+    shift = 3;
+  }
+  int granted = (rec.mode >> shift) & 7;
+  return (granted & mask) == mask ? 0 : -EACCES;
+}
+
+int KvFs::readlink(const char *path, char *buf, size_t size) {
+  InodeRecord rec;
+  string target;
+  int ret = lookup(path, &rec, &target);
+  if (ret) {
+    return ret;
+  }
+  if (!S_ISLNK(rec.mode)) {
+    return -EINVAL;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  size_t len = std::min(target.size(), size - 1);
+  memcpy(buf, target.data(), len);
+  buf[len] = '\0';
+  return 0;
+}
+
+int KvFs::mkdir(const char *path, mode_t mode) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  if (lookup_child(parent.ino, name, &dent) == 0) {
+    return -EEXIST;
+  }
+  KvBatch batch;
+  InodeRecord rec;
+  init_record(&rec, alloc_ino(&batch), S_IFDIR | (mode & 07777));
+  rec.parent = parent.ino;
+  rec.nlink = 2;
+  put_inode(&batch, rec);
+  put_dirent(&batch, parent.ino, name, rec);
+  parent.nlink++;
+  parent.mtime = parent.ctime = rec.ctime;
+  put_inode(&batch, parent);
+  return store_.write(batch);
+}
+
+int KvFs::rmdir(const char *path) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  InodeRecord rec;
+  if (lookup_child(parent.ino, name, &dent) || !load_inode(dent.ino, &rec)) {
+    return -ENOENT;
+  }
+  if (!S_ISDIR(rec.mode)) {
+    return -ENOTDIR;
+  }
+  if (!dir_empty(rec.ino)) {
+    return -ENOTEMPTY;
+  }
+  KvBatch batch;
+  del_dirent(&batch, parent.ino, name);
+  batch.del(inode_key(rec.ino));
+  parent.nlink--;
+  parent.mtime = parent.ctime = now();
+  put_inode(&batch, parent);
+  return store_.write(batch);
+}
+
+void KvFs::release_inode(KvBatch *batch, const InodeRecord &rec) {
+  // Callers hold ns_mutex_.
+  if (rec.nlink > 0) {
+    put_inode(batch, rec);
+    return;
+  }
+  std::lock_guard<std::mutex> guard(open_mutex_);
+  if (open_inodes_.count(rec.ino)) {
+    // Keep the orphan until the last release; purge_orphans() cleans up
+    // after a crash.
+    put_inode(batch, rec);
+    return;
+  }
+  batch->del(inode_key(rec.ino));
+  if (S_ISREG(rec.mode)) {
+    ::unlink(data_path(rec.ino).c_str());
+  }
+}
+
+void KvFs::purge_orphans() {
+  std::vector<InodeRecord> orphans;
+  store_.scan("i", "", [&orphans](const string &, const string &value) {
+    InodeRecord rec;
+    if (value.size() >= sizeof(rec)) {
+      memcpy(&rec, value.data(), sizeof(rec));
+      if (rec.nlink == 0) {
+        orphans.push_back(rec);
+      }
+    }
+    return true;
+  });
+  KvBatch batch;
+  for (const auto &rec : orphans) {
+    release_inode(&batch, rec);
+  }
+  store_.write(batch);
+}
+
+int KvFs::unlink(const char *path) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  InodeRecord rec;
+  string tail;
+  if (lookup_child(parent.ino, name, &dent) ||
+      !load_inode(dent.ino, &rec, &tail)) {
+    return -ENOENT;
+  }
+  if (S_ISDIR(rec.mode)) {
+    return -EISDIR;
+  }
+  KvBatch batch;
+  del_dirent(&batch, parent.ino, name);
+  rec.nlink--;
+  rec.ctime = parent.mtime = parent.ctime = now();
+  if (rec.nlink > 0) {
+    put_inode(&batch, rec, tail);
+  } else {
+    release_inode(&batch, rec);
+  }
+  put_inode(&batch, parent);
+  return store_.write(batch);
+}
+
+int KvFs::rename(const char *oldpath, const char *newpath) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord old_parent, new_parent;
+  string old_name, new_name;
+  int ret = lookup_parent(oldpath, &old_parent, &old_name);
+  if (ret) {
+    return ret;
+  }
+  ret = lookup_parent(newpath, &new_parent, &new_name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  InodeRecord src;
+  string src_tail;
+  if (lookup_child(old_parent.ino, old_name, &dent) ||
+      !load_inode(dent.ino, &src, &src_tail)) {
+    return -ENOENT;
+  }
+  bool is_dir = S_ISDIR(src.mode);
+  if (is_dir) {
+    // A directory must not be moved into its own subtree.
+    uint64_t ino = new_parent.ino;
+    while (true) {
+      if (ino == src.ino) {
+        return -EINVAL;
+      }
+      InodeRecord rec;
+      if (ino == kRootIno || !load_inode(ino, &rec)) {
+        break;
+      }
+      ino = rec.parent;
+    }
+  }
+
+  KvBatch batch;
+  struct timespec ts = now();
+  bool same_parent = old_parent.ino == new_parent.ino;
+  InodeRecord dst;
+  string dst_tail;
+  if (lookup_child(new_parent.ino, new_name, &dent) == 0 &&
+      load_inode(dent.ino, &dst, &dst_tail)) {
+    if (dst.ino == src.ino) {
+      return 0;
+    }
+    if (S_ISDIR(dst.mode)) {
+      if (!is_dir) {
+        return -EISDIR;
+      }
+      if (!dir_empty(dst.ino)) {
+        return -ENOTEMPTY;
+      }
+      batch.del(inode_key(dst.ino));
+      new_parent.nlink--;
+    } else {
+      if (is_dir) {
+        return -ENOTDIR;
+      }
+      dst.nlink--;
+      dst.ctime = ts;
+      if (dst.nlink > 0) {
+        put_inode(&batch, dst, dst_tail);
+      } else {
+        release_inode(&batch, dst);
+      }
+    }
+  }
+
+  del_dirent(&batch, old_parent.ino, old_name);
+  put_dirent(&batch, new_parent.ino, new_name, src);
+  if (is_dir && !same_parent) {
+    src.parent = new_parent.ino;
+    old_parent.nlink--;
+    new_parent.nlink++;
+  }
+  src.ctime = ts;
+  put_inode(&batch, src, src_tail);
+  old_parent.mtime = old_parent.ctime = ts;
+  if (same_parent) {
+    // Both records describe the same directory; keep the nlink change
+    // made through new_parent above.
+    new_parent.mtime = new_parent.ctime = ts;
+    put_inode(&batch, new_parent);
+  } else {
+    new_parent.mtime = new_parent.ctime = ts;
+    put_inode(&batch, old_parent);
+    put_inode(&batch, new_parent);
+  }
+  return store_.write(batch);
+}
+
+int KvFs::link(const char *oldpath, const char *newpath) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord rec;
+  string tail;
+  int ret = lookup(oldpath, &rec, &tail);
+  if (ret) {
+    return ret;
+  }
+  if (S_ISDIR(rec.mode)) {
+    return -EPERM;
+  }
+  InodeRecord parent;
+  string name;
+  ret = lookup_parent(newpath, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  if (lookup_child(parent.ino, name, &dent) == 0) {
+    return -EEXIST;
+  }
+  KvBatch batch;
+  rec.nlink++;
+  rec.ctime = parent.mtime = parent.ctime = now();
+  put_inode(&batch, rec, tail);
+  put_dirent(&batch, parent.ino, name, rec);
+  put_inode(&batch, parent);
+  return store_.write(batch);
+}
+
+int KvFs::symlink(const char *target, const char *path) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  if (lookup_child(parent.ino, name, &dent) == 0) {
+    return -EEXIST;
+  }
+  KvBatch batch;
+  InodeRecord rec;
+  init_record(&rec, alloc_ino(&batch), S_IFLNK | 0777);
+  rec.size = strlen(target);
+  put_inode(&batch, rec, target);
+  put_dirent(&batch, parent.ino, name, rec);
+  parent.mtime = parent.ctime = rec.ctime;
+  put_inode(&batch, parent);
+  return store_.write(batch);
+}
+
+int KvFs::chmod(const char *path, mode_t mode) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord rec;
+  string tail;
+  int ret = lookup(path, &rec, &tail);
+  if (ret) {
+    return ret;
+  }
+  rec.mode = (rec.mode & S_IFMT) | (mode & 07777);
+  rec.ctime = now();
+  KvBatch batch;
+  put_inode(&batch, rec, tail);
+  return store_.write(batch);
+}
+
+int KvFs::chown(const char *path, uid_t owner, gid_t group) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord rec;
+  string tail;
+  int ret = lookup(path, &rec, &tail);
+  if (ret) {
+    return ret;
+  }
+  if (owner != static_cast<uid_t>(-1)) {
+    rec.uid = owner;
+  }
+  if (group != static_cast<gid_t>(-1)) {
+    rec.gid = group;
+  }
+  rec.ctime = now();
+  KvBatch batch;
+  put_inode(&batch, rec, tail);
+  return store_.write(batch);
+}
+
+int KvFs::utimens(const char *path, const struct timespec tv[2]) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord rec;
+  string tail;
+  int ret = lookup(path, &rec, &tail);
+  if (ret) {
+    return ret;
+  }
+  struct timespec ts = now();
+  if (tv[0].tv_nsec != UTIME_OMIT) {
+    rec.atime = tv[0].tv_nsec == UTIME_NOW ? ts : tv[0];
+  }
+  if (tv[1].tv_nsec != UTIME_OMIT) {
+    rec.mtime = tv[1].tv_nsec == UTIME_NOW ? ts : tv[1];
+    std::lock_guard<std::mutex> open_guard(open_mutex_);
+    auto it = open_inodes_.find(rec.ino);
+    if (it != open_inodes_.end()) {
+      std::lock_guard<std::mutex> inode_guard(it->second->mutex);
+      it->second->mtime = rec.mtime;
+    }
+  }
+  rec.ctime = ts;
+  KvBatch batch;
+  put_inode(&batch, rec, tail);
+  return store_.write(batch);
+}
+
+int KvFs::truncate(const char *path, off_t length) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord rec;
+  string tail;
+  int ret = lookup(path, &rec, &tail);
+  if (ret) {
+    return ret;
+  }
+  if (S_ISDIR(rec.mode)) {
+    return -EISDIR;
+  }
+  std::shared_ptr<OpenInode> entry;
+  {
+    std::lock_guard<std::mutex> open_guard(open_mutex_);
+    auto it = open_inodes_.find(rec.ino);
+    if (it != open_inodes_.end()) {
+      entry = it->second;
+    }
+  }
+  if (entry) {
+    // The open state is authoritative; write it back right away.
+    {
+      std::lock_guard<std::mutex> inode_guard(entry->mutex);
+      if (entry->is_inline &&
+          static_cast<size_t>(length) > tunables().inline_size) {
+        ret = spill(entry.get());
+      }
+      if (entry->is_inline) {
+        entry->data.resize(length);
+      } else if (!ret && ftruncate(entry->fd, length) == -1) {
+        ret = -errno;
+      }
+      if (ret) {
+        return ret;
+      }
+      entry->size = length;
+      entry->mtime = now();
+      entry->dirty = true;
+    }
+    KvBatch batch;
+    persist_locked(&batch, entry.get(), rec);
+    return store_.write(batch);
+  }
+
+  if ((rec.flags & kInlineData) &&
+      static_cast<size_t>(length) <= tunables().inline_size) {
+    tail.resize(length);
+  } else {
+    int fd = open_data(rec.ino, true);
+    if (fd < 0) {
+      return fd;
+    }
+    if (rec.flags & kInlineData) {
+      ret = pwrite(fd, tail.data(), tail.size(), 0) == -1 ? -errno : 0;
+      rec.flags &= ~kInlineData;
+      tail.clear();
+      inline_spills.add();
+    }
+    if (!ret && ftruncate(fd, length) == -1) {
+      ret = -errno;
+    }
+    close(fd);
+    if (ret) {
+      return ret;
+    }
+  }
+  rec.size = length;
+  rec.mtime = rec.ctime = now();
+  KvBatch batch;
+  put_inode(&batch, rec, tail);
+  return store_.write(batch);
+}
+
+int KvFs::new_file(const char *path, mode_t mode, InodeRecord *rec) {
+  // Callers hold ns_mutex_.
+  InodeRecord parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  DirentRecord dent;
+  if (lookup_child(parent.ino, name, &dent) == 0) {
+    return load_inode(dent.ino, rec) ? -EEXIST : -EIO;
+  }
+  KvBatch batch;
+  init_record(rec, alloc_ino(&batch), S_IFREG | (mode & 07777));
+  if (tunables().inline_size > 0) {
+    rec->flags |= kInlineData;
+  }
+  put_inode(&batch, *rec);
+  put_dirent(&batch, parent.ino, name, *rec);
+  parent.mtime = parent.ctime = rec->ctime;
+  put_inode(&batch, parent);
+  return store_.write(batch);
+}
+
+int KvFs::open_inode(uint64_t ino, struct fuse_file_info *fi) {
+  std::lock_guard<std::mutex> guard(open_mutex_);
+  std::shared_ptr<OpenInode> &entry = open_inodes_[ino];
+  if (!entry) {
+    InodeRecord rec;
+    string tail;
+    if (!load_inode(ino, &rec, &tail)) {
+      open_inodes_.erase(ino);
+      return -ENOENT;
+    }
+    int fd = -1;
+    if (!(rec.flags & kInlineData)) {
+      fd = open_data(ino, true);
+      if (fd < 0) {
+        open_inodes_.erase(ino);
+        return fd;
+      }
+    }
+    entry.reset(new OpenInode);
+    entry->ino = ino;
+    entry->fd = fd;
+    entry->refs = 0;
+    entry->dirty = false;
+    entry->is_inline = rec.flags & kInlineData;
+    entry->data.swap(tail);
+    entry->size = rec.size;
+    entry->mtime = rec.mtime;
+  }
+  entry->refs++;
+  fi->fh = reinterpret_cast<uint64_t>(entry.get());
+  return 0;
+}
+
+int KvFs::spill(OpenInode *entry) {
+  // Callers hold entry->mutex.
+  int fd = open_data(entry->ino, true);
+  if (fd < 0) {
+    return fd;
+  }
+  if (pwrite(fd, entry->data.data(), entry->data.size(), 0) == -1) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  entry->fd = fd;
+  entry->is_inline = false;
+  entry->dirty = true;
+  string().swap(entry->data);
+  inline_spills.add();
+  return 0;
+}
+
+void KvFs::persist_locked(KvBatch *batch, OpenInode *entry,
+                          const InodeRecord &loaded) {
+  // Callers hold ns_mutex_.
+  InodeRecord rec = loaded;
+  std::lock_guard<std::mutex> guard(entry->mutex);
+  if (!entry->dirty) {
+    return;
+  }
+  rec.size = entry->size;
+  rec.mtime = rec.ctime = entry->mtime;
+  if (entry->is_inline) {
+    rec.flags |= kInlineData;
+  } else {
+    rec.flags &= ~kInlineData;
+  }
+  entry->dirty = false;
+  put_inode(batch, rec, entry->is_inline ? entry->data : string());
+}
+
+int KvFs::persist(OpenInode *entry) {
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  InodeRecord rec;
+  if (!load_inode(entry->ino, &rec)) {
+    return 0;
+  }
+  KvBatch batch;
+  persist_locked(&batch, entry, rec);
+  return store_.write(batch);
+}
+
+int KvFs::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  InodeRecord rec;
+  {
+    std::lock_guard<std::mutex> guard(ns_mutex_);
+    int ret = new_file(path, mode, &rec);
+    if (ret == -EEXIST && !(fi->flags & O_EXCL)) {
+      ret = 0;
+    }
+    if (ret) {
+      return ret;
+    }
+  }
+  int ret = open_inode(rec.ino, fi);
+  if (ret == 0 && (fi->flags & O_TRUNC) && rec.size > 0) {
+    ret = truncate(path, 0);
+  }
+  return ret;
+}
+
+int KvFs::open(const char *path, struct fuse_file_info *fi) {
+  InodeRecord rec;
+  int ret = lookup(path, &rec);
+  if (ret) {
+    return ret;
+  }
+  if (S_ISDIR(rec.mode)) {
+    return -EISDIR;
+  }
+  ret = open_inode(rec.ino, fi);
+  if (ret == 0 && (fi->flags & O_TRUNC) && rec.size > 0) {
+    ret = truncate(path, 0);
+  }
+  return ret;
+}
+
+int KvFs::release(struct fuse_file_info *fi) {
+  OpenInode *entry = reinterpret_cast<OpenInode*>(fi->fh);
+  std::lock_guard<std::mutex> guard(ns_mutex_);
+  {
+    std::lock_guard<std::mutex> open_guard(open_mutex_);
+    if (--entry->refs > 0) {
+      return 0;
+    }
+  }
+  // Drops the entry unless it was opened again in the meantime.
+  auto forget = [this, entry] {
+    std::shared_ptr<OpenInode> last;
+    {
+      std::lock_guard<std::mutex> open_guard(open_mutex_);
+      if (entry->refs > 0) {
+        return;
+      }
+      auto it = open_inodes_.find(entry->ino);
+      last = it->second;
+      open_inodes_.erase(it);
+    }
+    if (last->fd != -1) {
+      close(last->fd);
+    }
+  };
+
+  InodeRecord rec;
+  if (!load_inode(entry->ino, &rec)) {
+    forget();
+    return 0;
+  }
+  KvBatch batch;
+  if (rec.nlink == 0) {
+    // No name leads to it any more, so it cannot be opened again.
+    forget();
+    release_inode(&batch, rec);
+    return store_.write(batch);
+  }
+  // Written while the entry is still in open_inodes_, so that an open in
+  // the meantime shares it rather than loading the record from before.
+  persist_locked(&batch, entry, rec);
+  int ret = store_.write(batch);
+  forget();
+  return ret;
+}
+
+int KvFs::read(char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+  OpenInode *entry = reinterpret_cast<OpenInode*>(fi->fh);
+  {
+    std::lock_guard<std::mutex> guard(entry->mutex);
+    if (entry->is_inline) {
+      size_t len = 0;
+      if (static_cast<size_t>(offset) < entry->data.size()) {
+        len = std::min(size, entry->data.size() - offset);
+        memcpy(buf, entry->data.data() + offset, len);
+      }
+      inline_reads.add();
+      inline_read_bytes.add(len);
+      return len;
+    }
+  }
+  ssize_t nread = pread(entry->fd, buf, size, offset);
+  if (nread == -1) {
+    return -errno;
+  }
+  backing_reads.add();
+  return nread;
+}
+
+int KvFs::write(const char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi) {
+  OpenInode *entry = reinterpret_cast<OpenInode*>(fi->fh);
+  uint64_t end = offset + size;
+  bool spilled = false;
+  {
+    std::lock_guard<std::mutex> guard(entry->mutex);
+    if (entry->is_inline) {
+      if (end <= tunables().inline_size) {
+        if (end > entry->data.size()) {
+          entry->data.resize(end);
+        }
+        memcpy(&entry->data[offset], buf, size);
+        if (end > entry->size) {
+          entry->size = end;
+        }
+        entry->mtime = now();
+        entry->dirty = true;
+        return size;
+      }
+      int ret = spill(entry);
+      if (ret) {
+        return ret;
+      }
+      spilled = true;
+    }
+  }
+  if (spilled) {
+    // Drop the inline copy from the record before the backing file is
+    // the only place that holds the data.
+    int ret = persist(entry);
+    if (ret) {
+      return ret;
+    }
+  }
+  ssize_t nwrite = pwrite(entry->fd, buf, size, offset);
+  if (nwrite == -1) {
+    return -errno;
+  }
+  std::lock_guard<std::mutex> guard(entry->mutex);
+  end = offset + nwrite;
+  if (end > entry->size) {
+    entry->size = end;
+  }
+  entry->mtime = now();
+  entry->dirty = true;
+  return nwrite;
+}
+
+int KvFs::sync() {
+  std::vector<std::shared_ptr<OpenInode>> entries;
+  {
+    std::lock_guard<std::mutex> open_guard(open_mutex_);
+    for (const auto &it : open_inodes_) {
+      entries.push_back(it.second);
+    }
+  }
+  for (const auto &entry : entries) {
+    int fd;
+    {
+      std::lock_guard<std::mutex> guard(entry->mutex);
+      fd = entry->fd;
+    }
+    if (fd != -1 && ::fdatasync(fd) == -1) {
+      return -errno;
+    }
+    int ret = persist(entry.get());
+    if (ret) {
+      return ret;
+    }
+  }
+  return store_.sync();
+}
+
+int KvFs::compact() {
+  return store_.compact();
+}
+
+int KvFs::fsync(int datasync, struct fuse_file_info *fi) {
+  OpenInode *entry = reinterpret_cast<OpenInode*>(fi->fh);
+  int fd;
+  {
+    std::lock_guard<std::mutex> guard(entry->mutex);
+    fd = entry->fd;
+  }
+  if (fd != -1 && (datasync ? ::fdatasync(fd) : ::fsync(fd)) == -1) {
+    return -errno;
+  }
+  int ret = persist(entry);
+  if (ret) {
+    return ret;
+  }
+  return store_.sync();
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Namespace kept in an embedded key-value store.
+ *
+ * Inodes and directory entries live in a KvStore under
+ * BASEDIR/.wrapperfs/meta; only regular file contents are stored as backing
+ * files, named after their inode number under BASEDIR/.wrapperfs/data.
+ * Lookups, stat and readdir therefore never touch the backing file system.
+ *
+ * Regular files created while the inline_size tunable (tunables.h) is
+ * non-zero start out with their contents stored inline in the inode
+ * record, and are served without any backing file syscall. A write that
+ * grows such a file past inline_size spills it to a backing file for good.
+ * Inline contents are written back to the store on release and fsync.
+ *
+ * Key layout:
+ *   "i" + be64(ino)               -> InodeRecord [+ symlink target/data]
+ *   "d" + be64(parent) + name     -> DirentRecord
+ *   "s" + name                    -> store-wide counters
+ */
+
+#ifndef KVFS_H_
+#define KVFS_H_
+
+#include <fuse.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "./backend.h"
+#include "./kvstore.h"
+
+class KvFs : public Backend {
+ public:
+  KvFs();
+  ~KvFs();
+
+  /// Opens the store under 'basedir', creating the root inode if needed.
+  int init(const std::string &basedir);
+
+  /// Writes back every open inode and syncs the store.
+  int sync() override;
+
+  /// Rewrites the store as a snapshot and truncates its log.
+  int compact() override;
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  struct InodeRecord {
+    uint64_t ino;
+    uint64_t parent;  ///< Only maintained for directories.
+    uint64_t size;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint32_t flags;
+    uint32_t reserved;
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+  };
+
+  struct DirentRecord {
+    uint64_t ino;
+    uint32_t mode;
+  };
+
+  /// State shared by all handles open on one inode.
+  struct OpenInode {
+    uint64_t ino;
+    int fd;
+    int refs;
+    bool dirty;  ///< size/mtime/data changed since the record was written.
+    bool is_inline;
+    std::string data;  ///< Contents of an inline file.
+    uint64_t size;
+    struct timespec mtime;
+    std::mutex mutex;
+  };
+
+  int lookup(const std::string &path, InodeRecord *rec,
+             std::string *tail = NULL) const;
+  int lookup_parent(const std::string &path, InodeRecord *parent,
+                    std::string *name) const;
+  int lookup_child(uint64_t parent, const std::string &name,
+                   DirentRecord *dent) const;
+  bool load_inode(uint64_t ino, InodeRecord *rec,
+                  std::string *tail = NULL) const;
+  bool dir_empty(uint64_t ino) const;
+
+  void put_inode(KvBatch *batch, const InodeRecord &rec,
+                 const std::string &tail = std::string());
+  void put_dirent(KvBatch *batch, uint64_t parent, const std::string &name,
+                  const InodeRecord &rec);
+  void del_dirent(KvBatch *batch, uint64_t parent, const std::string &name);
+  uint64_t alloc_ino(KvBatch *batch);
+  void init_record(InodeRecord *rec, uint64_t ino, mode_t mode);
+
+  /// Drops a record whose link count reached zero, unless it is still open.
+  void release_inode(KvBatch *batch, const InodeRecord &rec);
+  void purge_orphans();
+
+  std::string data_path(uint64_t ino) const;
+  int open_data(uint64_t ino, bool create);
+  int new_file(const char *path, mode_t mode, InodeRecord *rec);
+  int open_inode(uint64_t ino, struct fuse_file_info *fi);
+
+  /// Moves inline contents to a backing file; caller holds entry->mutex.
+  int spill(OpenInode *entry);
+
+  /// Writes the open state of 'entry' back to its inode record.
+  int persist(OpenInode *entry);
+  void persist_locked(KvBatch *batch, OpenInode *entry,
+                      const InodeRecord &loaded);
+  void fill_stat(const InodeRecord &rec, struct stat *stbuf) const;
+
+  std::string basedir_;
+  KvStore store_;
+
+  /// Serializes namespace mutations so that read-modify-write sequences on
+  /// inode and dirent records are atomic with respect to each other.
+  std::mutex ns_mutex_;
+
+  std::mutex open_mutex_;
+  std::map<uint64_t, std::shared_ptr<OpenInode>> open_inodes_;
+
+  uint64_t next_ino_;
+  uint64_t reserved_ino_;
+};
+
+#endif  // KVFS_H_
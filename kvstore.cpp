@@ -0,0 +1,454 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./kvstore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include "./crc32.h"
+
+using std::string;
+
+namespace {
+
+const char *kLogName = "kv.log";
+const char *kSnapshotName = "kv.snap";
+
+/// The log is compacted once it is this large and twice the live data.
+const uint64_t kCompactThreshold = 64 << 20;
+
+/// Snapshot records are cut at roughly this size.
+const size_t kSnapshotRecordSize = 1 << 20;
+
+enum { OP_PUT = 1, OP_DEL = 2 };
+
+void append_u32(string *buf, uint32_t v) {
+  buf->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+uint32_t read_u32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+void append_op(string *payload, int type, const string &key,
+               const string &value) {
+  payload->push_back(static_cast<char>(type));
+  append_u32(payload, key.size());
+  append_u32(payload, value.size());
+  payload->append(key);
+  payload->append(value);
+}
+
+/// Frames a payload as [length][crc32][payload].
+string make_record(const string &payload) {
+  string record;
+  record.reserve(payload.size() + 8);
+  append_u32(&record, payload.size());
+  append_u32(&record, crc32(payload.data(), payload.size()));
+  record.append(payload);
+  return record;
+}
+
+/// Reads up to 'size' bytes at 'offset'; returns how many were read.
+size_t read_at(int fd, char *buf, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, buf + done, size - done, offset + done);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+int write_all(int fd, const string &buf) {
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/// Makes the entries of 'dir' durable.
+int sync_dir(const string &dir) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    return -errno;
+  }
+  int ret = fsync(fd) == -1 ? -errno : 0;
+  ::close(fd);
+  return ret;
+}
+
+}  // namespace
+
+void KvBatch::put(const string &key, const string &value) {
+  Op op = { true, key, value };
+  ops_.push_back(op);
+}
+
+void KvBatch::del(const string &key) {
+  Op op = { false, key, string() };
+  ops_.push_back(op);
+}
+
+KvStore::KvStore()
+    : log_fd_(-1), log_bytes_(0), live_bytes_(0), compactor_stop_(false),
+      compact_wanted_(false) {
+  pthread_rwlock_init(&lock_, NULL);
+}
+
+KvStore::~KvStore() {
+  close();
+  pthread_rwlock_destroy(&lock_);
+}
+
+int KvStore::open(const string &dir) {
+  dir_ = dir;
+  if (mkdir(dir_.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  int ret = replay_file(dir_ + "/" + kSnapshotName, false);
+  if (ret) {
+    return ret;
+  }
+  ret = replay_file(dir_ + "/" + kLogName, true);
+  if (ret) {
+    return ret;
+  }
+  string log_path = dir_ + "/" + kLogName;
+  // Read back by compaction, which keeps the records after its copy.
+  log_fd_ = ::open(log_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+  if (log_fd_ == -1) {
+    return -errno;
+  }
+  compactor_stop_ = false;
+  compactor_ = std::thread(&KvStore::compactor_loop, this);
+  return 0;
+}
+
+void KvStore::close() {
+  if (compactor_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(compactor_mutex_);
+      compactor_stop_ = true;
+    }
+    compactor_cond_.notify_all();
+    compactor_.join();
+  }
+  if (log_fd_ != -1) {
+    fsync(log_fd_);
+    ::close(log_fd_);
+    log_fd_ = -1;
+  }
+}
+
+int KvStore::replay_file(const string &path, bool is_log) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return errno == ENOENT ? 0 : -errno;
+  }
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    int err = -errno;
+    ::close(fd);
+    return err;
+  }
+  string content(stbuf.st_size, '\0');
+  content.resize(read_at(fd, &content[0], content.size(), 0));
+  ::close(fd);
+
+  // Apply complete records in order. A torn or corrupted tail is where the
+  // last write was interrupted; everything after it is discarded.
+  size_t pos = 0;
+  while (pos + 8 <= content.size()) {
+    uint32_t len = read_u32(&content[pos]);
+    uint32_t crc = read_u32(&content[pos + 4]);
+    if (pos + 8 + len > content.size() ||
+        crc32(&content[pos + 8], len) != crc) {
+      break;
+    }
+    KvBatch batch;
+    const char *p = &content[pos + 8];
+    const char *end = p + len;
+    while (p + 9 <= end) {
+      int type = *p;
+      uint32_t klen = read_u32(p + 1);
+      uint32_t vlen = read_u32(p + 5);
+      p += 9;
+      if (p + klen + vlen > end) {
+        break;
+      }
+      if (type == OP_PUT) {
+        batch.put(string(p, klen), string(p + klen, vlen));
+      } else {
+        batch.del(string(p, klen));
+      }
+      p += klen + vlen;
+    }
+    apply(batch);
+    pos += 8 + len;
+  }
+  if (is_log) {
+    log_bytes_ = pos;
+    if (pos < content.size() && truncate(path.c_str(), pos) == -1) {
+      return -errno;
+    }
+  }
+  return 0;
+}
+
+void KvStore::apply(const KvBatch &batch) {
+  for (const auto &op : batch.ops_) {
+    auto it = table_.find(op.key);
+    if (it != table_.end()) {
+      live_bytes_ -= it->first.size() + it->second.size();
+    }
+    if (op.is_put) {
+      if (it != table_.end()) {
+        it->second = op.value;
+      } else {
+        table_.insert(std::make_pair(op.key, op.value));
+      }
+      live_bytes_ += op.key.size() + op.value.size();
+    } else if (it != table_.end()) {
+      table_.erase(it);
+    }
+  }
+}
+
+bool KvStore::get(const string &key, string *value) const {
+  pthread_rwlock_rdlock(&lock_);
+  auto it = table_.find(key);
+  bool found = it != table_.end();
+  if (found && value) {
+    *value = it->second;
+  }
+  pthread_rwlock_unlock(&lock_);
+  return found;
+}
+
+bool KvStore::exists(const string &key) const {
+  return get(key, NULL);
+}
+
+void KvStore::scan(const string &prefix, const string &start,
+                   const ScanFunc &func) const {
+  pthread_rwlock_rdlock(&lock_);
+  auto it = table_.lower_bound(start.empty() ? prefix : start);
+  for (; it != table_.end(); ++it) {
+    if (it->first.compare(0, prefix.size(), prefix) != 0) {
+      break;
+    }
+    if (!func(it->first, it->second)) {
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&lock_);
+}
+
+int KvStore::write(const KvBatch &batch) {
+  if (batch.empty()) {
+    return 0;
+  }
+  string payload;
+  for (const auto &op : batch.ops_) {
+    append_op(&payload, op.is_put ? OP_PUT : OP_DEL, op.key, op.value);
+  }
+  string record = make_record(payload);
+
+  bool full;
+  {
+    std::lock_guard<std::mutex> guard(write_mutex_);
+    int ret = write_all(log_fd_, record);
+    if (ret) {
+      // A torn record would end replay there, dropping every batch after
+      // it.
+      if (ftruncate(log_fd_, log_bytes_) == -1) {
+        // Nothing more to do; the next write fails the same way.
+      }
+      return ret;
+    }
+    log_bytes_ += record.size();
+
+    pthread_rwlock_wrlock(&lock_);
+    apply(batch);
+    pthread_rwlock_unlock(&lock_);
+    full = log_bytes_ > kCompactThreshold && log_bytes_ > 2 * live_bytes_;
+  }
+  if (full) {
+    // Writing the snapshot here would stall every writer behind this one.
+    std::lock_guard<std::mutex> guard(compactor_mutex_);
+    compact_wanted_ = true;
+    compactor_cond_.notify_one();
+  }
+  return 0;
+}
+
+int KvStore::put(const string &key, const string &value) {
+  KvBatch batch;
+  batch.put(key, value);
+  return write(batch);
+}
+
+int KvStore::del(const string &key) {
+  KvBatch batch;
+  batch.del(key);
+  return write(batch);
+}
+
+int KvStore::sync() {
+  std::lock_guard<std::mutex> guard(write_mutex_);
+  return fdatasync(log_fd_) == -1 ? -errno : 0;
+}
+
+int KvStore::compact() {
+  std::lock_guard<std::mutex> compact_guard(compact_mutex_);
+  std::map<string, string> table;
+  uint64_t cut;
+  {
+    // Writers apply batches under write_mutex_, so the copy holds exactly
+    // the log records before 'cut'.
+    std::lock_guard<std::mutex> guard(write_mutex_);
+    cut = log_bytes_;
+    pthread_rwlock_rdlock(&lock_);
+    table = table_;
+    pthread_rwlock_unlock(&lock_);
+  }
+  int ret = write_snapshot(table);
+  if (ret) {
+    return ret;
+  }
+  std::lock_guard<std::mutex> guard(write_mutex_);
+  return drop_log_locked(cut);
+}
+
+int KvStore::write_snapshot(const std::map<string, string> &table) {
+  string tmp_path = dir_ + "/" + kSnapshotName + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    return -errno;
+  }
+  int ret = 0;
+  string payload;
+  for (const auto &kv : table) {
+    append_op(&payload, OP_PUT, kv.first, kv.second);
+    if (payload.size() >= kSnapshotRecordSize) {
+      ret = write_all(fd, make_record(payload));
+      payload.clear();
+      if (ret) {
+        break;
+      }
+    }
+  }
+  if (!ret && !payload.empty()) {
+    ret = write_all(fd, make_record(payload));
+  }
+  if (!ret && fsync(fd) == -1) {
+    ret = -errno;
+  }
+  ::close(fd);
+  if (ret) {
+    unlink(tmp_path.c_str());
+    return ret;
+  }
+  string snap_path = dir_ + "/" + kSnapshotName;
+  if (rename(tmp_path.c_str(), snap_path.c_str()) == -1) {
+    return -errno;
+  }
+  // The rename must be durable before the log it replaces is cut.
+  return sync_dir(dir_);
+}
+
+int KvStore::drop_log_locked(uint64_t cut) {
+  // A crash before the log is cut replays records the snapshot already
+  // holds, which does not lose or corrupt anything.
+  if (cut == log_bytes_) {
+    if (ftruncate(log_fd_, 0) == -1) {
+      return -errno;
+    }
+    log_bytes_ = 0;
+    return 0;
+  }
+  // Records appended since the copy move to a new log replacing this one.
+  string tail(log_bytes_ - cut, '\0');
+  if (read_at(log_fd_, &tail[0], tail.size(), cut) != tail.size()) {
+    return -EIO;
+  }
+  string log_path = dir_ + "/" + kLogName;
+  string tmp_path = log_path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND,
+                  0600);
+  if (fd == -1) {
+    return -errno;
+  }
+  int ret = write_all(fd, tail);
+  if (!ret && fsync(fd) == -1) {
+    ret = -errno;
+  }
+  if (!ret && rename(tmp_path.c_str(), log_path.c_str()) == -1) {
+    ret = -errno;
+  }
+  if (ret) {
+    ::close(fd);
+    unlink(tmp_path.c_str());
+    return ret;
+  }
+  ::close(log_fd_);
+  log_fd_ = fd;
+  log_bytes_ = tail.size();
+  return sync_dir(dir_);
+}
+
+void KvStore::compactor_loop() {
+  std::unique_lock<std::mutex> lock(compactor_mutex_);
+  while (!compactor_stop_) {
+    if (!compact_wanted_) {
+      compactor_cond_.wait(lock);
+      continue;
+    }
+    compact_wanted_ = false;
+    lock.unlock();
+    // On failure the log keeps growing, and the next write asks again.
+    compact();
+    lock.lock();
+  }
+}
+
+size_t KvStore::size() const {
+  pthread_rwlock_rdlock(&lock_);
+  size_t n = table_.size();
+  pthread_rwlock_unlock(&lock_);
+  return n;
+}
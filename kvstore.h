@@ -0,0 +1,142 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Embedded log-structured key-value store.
+ *
+ * All live keys are kept in an ordered in-memory table. Every mutation is
+ * appended to a log file as one checksummed batch record, so that a batch
+ * is either fully replayed or dropped after a crash. When the log grows
+ * well beyond the live data, a background thread writes the table out as
+ * a sorted snapshot and the log is restarted.
+ *
+ * Compaction copies the table in memory and writes the copy with writers
+ * running. The log then only keeps the records appended since the copy.
+ * Replaying records the snapshot already holds is harmless, since every
+ * mutation sets or removes a key outright.
+ */
+
+#ifndef KVSTORE_H_
+#define KVSTORE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * \brief A group of mutations applied atomically by KvStore::write().
+ */
+class KvBatch {
+ public:
+  void put(const std::string &key, const std::string &value);
+  void del(const std::string &key);
+  bool empty() const { return ops_.empty(); }
+
+ private:
+  friend class KvStore;
+
+  struct Op {
+    bool is_put;
+    std::string key;
+    std::string value;
+  };
+  std::vector<Op> ops_;
+};
+
+class KvStore {
+ public:
+  /// Called for each key under a prefix; return false to stop the scan.
+  typedef std::function<bool(const std::string &key,
+                             const std::string &value)> ScanFunc;
+
+  KvStore();
+  ~KvStore();
+
+  /**
+   * \brief Opens (or creates) the store in directory 'dir', replays its
+   * snapshot and log, and starts the compaction thread.
+   * \return 0 on success, -errno otherwise.
+   */
+  int open(const std::string &dir);
+
+  void close();
+
+  /// Returns true and fills 'value' if 'key' exists.
+  bool get(const std::string &key, std::string *value) const;
+
+  /// Returns true if 'key' exists.
+  bool exists(const std::string &key) const;
+
+  /// Visits keys starting with 'prefix' in order, beginning at 'start'
+  /// (or at the prefix itself if 'start' is empty).
+  void scan(const std::string &prefix, const std::string &start,
+            const ScanFunc &func) const;
+
+  /// Appends the batch to the log and applies it. Returns 0 or -errno.
+  int write(const KvBatch &batch);
+
+  int put(const std::string &key, const std::string &value);
+  int del(const std::string &key);
+
+  /// Flushes the log to stable storage.
+  int sync();
+
+  /// Writes a snapshot of the current table and drops the log records
+  /// it holds.
+  int compact();
+
+  size_t size() const;
+
+ private:
+  int replay_file(const std::string &path, bool is_log);
+  void apply(const KvBatch &batch);
+
+  /// Writes 'table' to the snapshot file in place of the last one.
+  int write_snapshot(const std::map<std::string, std::string> &table);
+
+  /// Drops the first 'cut' bytes of the log; called with write_mutex_
+  /// held.
+  int drop_log_locked(uint64_t cut);
+
+  /// Compacts whenever write() asks for it, until close().
+  void compactor_loop();
+
+  std::string dir_;
+  int log_fd_;
+  uint64_t log_bytes_;
+  uint64_t live_bytes_;
+
+  std::map<std::string, std::string> table_;
+  mutable pthread_rwlock_t lock_;
+  /// Serializes log appends; taken before lock_.
+  std::mutex write_mutex_;
+  /// Held by compact() throughout; taken before write_mutex_.
+  std::mutex compact_mutex_;
+
+  std::thread compactor_;
+  std::mutex compactor_mutex_;
+  std::condition_variable compactor_cond_;
+  bool compactor_stop_;
+  bool compact_wanted_;  ///< Set by write() once the log is too large.
+};
+
+#endif  // KVSTORE_H_
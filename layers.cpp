@@ -0,0 +1,52 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./layers.h"
+
+#define OP_STATS(name) { "op." name ".calls", "op." name ".ns" }
+
+const char *const op_names[OP_COUNT] = {
+  "access", "chmod", "chown", "create", "flush", "fsync", "getattr",
+  "getxattr", "link", "mkdir", "open", "read", "readdir", "readlink",
+  "release", "rename", "rmdir", "setxattr", "symlink", "truncate",
+  "unlink", "utimens", "write",
+};
+
+OpStats op_stats[OP_COUNT] = {
+  OP_STATS("access"),
+  OP_STATS("chmod"),
+  OP_STATS("chown"),
+  OP_STATS("create"),
+  OP_STATS("flush"),
+  OP_STATS("fsync"),
+  OP_STATS("getattr"),
+  OP_STATS("getxattr"),
+  OP_STATS("link"),
+  OP_STATS("mkdir"),
+  OP_STATS("open"),
+  OP_STATS("read"),
+  OP_STATS("readdir"),
+  OP_STATS("readlink"),
+  OP_STATS("release"),
+  OP_STATS("rename"),
+  OP_STATS("rmdir"),
+  OP_STATS("setxattr"),
+  OP_STATS("symlink"),
+  OP_STATS("truncate"),
+  OP_STATS("unlink"),
+  OP_STATS("utimens"),
+  OP_STATS("write"),
+};
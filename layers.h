@@ -0,0 +1,502 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Handler layers composed at compile time.
+ *
+ * A layer is a class template deriving from the layer below it. It
+ * redefines the static handlers it cares about and calls Next:: for the
+ * rest of the work; everything it does not redefine is inherited as is.
+ * A stack such as OpStatsLayer<ReadOnlyLayer<Handlers>> is flattened by the
+ * compiler into one set of functions, which make_operations() turns into a
+ * fuse_operations table. Layers left out of a stack cost nothing, and no
+ * call in a stack goes through a function pointer except the one made by
+ * FUSE itself. A stack is picked when mounting, from --stack and the
+ * features enabled; only the slow operation log, whose threshold can be
+ * set at runtime, is in every stack and loads the tunables on each call.
+ *
+ * The bottom of every stack provides all of the handlers listed in
+ * make_operations().
+ */
+
+#ifndef LAYERS_H_
+#define LAYERS_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include "./probes.h"
+#include "./stats.h"
+
+/// Operations that a layer may intercept.
+enum LayerOp {
+  OP_ACCESS,
+  OP_CHMOD,
+  OP_CHOWN,
+  OP_CREATE,
+  OP_FLUSH,
+  OP_FSYNC,
+  OP_GETATTR,
+  OP_GETXATTR,
+  OP_LINK,
+  OP_MKDIR,
+  OP_OPEN,
+  OP_READ,
+  OP_READDIR,
+  OP_READLINK,
+  OP_RELEASE,
+  OP_RENAME,
+  OP_RMDIR,
+  OP_SETXATTR,
+  OP_SYMLINK,
+  OP_TRUNCATE,
+  OP_UNLINK,
+  OP_UTIMENS,
+  OP_WRITE,
+  OP_COUNT
+};
+
+/// Call count and total latency of one operation, as "op.NAME.calls" and
+/// "op.NAME.ns" in the stats file, and a latency histogram.
+struct OpStats {
+  /// Bucket i counts calls under 2^i us; the last one all slower calls.
+  static const int kLatencyBuckets = 25;
+
+  OpStats(const char *calls_name, const char *ns_name)
+      : calls(calls_name), ns(ns_name), latency() {}
+
+  void record(uint64_t elapsed_ns) {
+    calls.add();
+    ns.add(elapsed_ns);
+    uint64_t us = elapsed_ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= kLatencyBuckets) {
+      bucket = kLatencyBuckets - 1;
+    }
+    latency[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  Counter calls;
+  Counter ns;
+  std::atomic<uint64_t> latency[kLatencyBuckets];
+};
+
+extern OpStats op_stats[OP_COUNT];
+
+/// Names of the LayerOps, e.g. "getattr".
+extern const char *const op_names[OP_COUNT];
+
+/**
+ * Fills 'ops' with the handlers of 'Stack'.
+ */
+template <class Stack>
+void make_operations(struct fuse_operations *ops) {
+  ops->access = Stack::access;
+  ops->chmod = Stack::chmod;
+  ops->chown = Stack::chown;
+  ops->create = Stack::create;
+  ops->destroy = Stack::destroy;
+  ops->flush = Stack::flush;
+  ops->fsync = Stack::fsync;
+  ops->getattr = Stack::getattr;
+  ops->getxattr = Stack::getxattr;
+  ops->init = Stack::init;
+  ops->link = Stack::link;
+  ops->mkdir = Stack::mkdir;
+  ops->open = Stack::open;
+  ops->read = Stack::read;
+  ops->readdir = Stack::readdir;
+  ops->readlink = Stack::readlink;
+  ops->release = Stack::release;
+  ops->rename = Stack::rename;
+  ops->rmdir = Stack::rmdir;
+  ops->setxattr = Stack::setxattr;
+  ops->symlink = Stack::symlink;
+  ops->truncate = Stack::truncate;
+  ops->unlink = Stack::unlink;
+  ops->utimens = Stack::utimens;
+  ops->write = Stack::write;
+}
+
+/**
+ * \brief Measures every operation into op_stats.
+ */
+template <class Next>
+struct OpStatsLayer : Next {
+  /// Adds the time from construction to destruction to one OpStats.
+  class Timer {
+   public:
+    explicit Timer(LayerOp op) : op_(op), start_(now_ns()) {}
+    ~Timer() {
+      op_stats[op_].record(now_ns() - start_);
+    }
+
+   private:
+    static uint64_t now_ns() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    LayerOp op_;
+    uint64_t start_;
+  };
+
+  static int access(const char *path, int mask) {
+    Timer timer(OP_ACCESS);
+    return Next::access(path, mask);
+  }
+
+  static int chmod(const char *path, mode_t mode) {
+    Timer timer(OP_CHMOD);
+    return Next::chmod(path, mode);
+  }
+
+  static int chown(const char *path, uid_t owner, gid_t group) {
+    Timer timer(OP_CHOWN);
+    return Next::chown(path, owner, group);
+  }
+
+  static int create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    Timer timer(OP_CREATE);
+    return Next::create(path, mode, fi);
+  }
+
+  static int flush(const char *path, struct fuse_file_info *fi) {
+    Timer timer(OP_FLUSH);
+    return Next::flush(path, fi);
+  }
+
+  static int fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    Timer timer(OP_FSYNC);
+    return Next::fsync(path, datasync, fi);
+  }
+
+  static int getattr(const char *path, struct stat *stbuf) {
+    Timer timer(OP_GETATTR);
+    return Next::getattr(path, stbuf);
+  }
+
+  static int getxattr(const char *path, const char *name, char *value,
+                      size_t size) {
+    Timer timer(OP_GETXATTR);
+    return Next::getxattr(path, name, value, size);
+  }
+
+  static int link(const char *oldpath, const char *newpath) {
+    Timer timer(OP_LINK);
+    return Next::link(oldpath, newpath);
+  }
+
+  static int mkdir(const char *path, mode_t mode) {
+    Timer timer(OP_MKDIR);
+    return Next::mkdir(path, mode);
+  }
+
+  static int open(const char *path, struct fuse_file_info *fi) {
+    Timer timer(OP_OPEN);
+    return Next::open(path, fi);
+  }
+
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    Timer timer(OP_READ);
+    return Next::read(path, buf, size, offset, fi);
+  }
+
+  static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi) {
+    Timer timer(OP_READDIR);
+    return Next::readdir(path, buf, filler, offset, fi);
+  }
+
+  static int readlink(const char *path, char *buf, size_t size) {
+    Timer timer(OP_READLINK);
+    return Next::readlink(path, buf, size);
+  }
+
+  static int release(const char *path, struct fuse_file_info *fi) {
+    Timer timer(OP_RELEASE);
+    return Next::release(path, fi);
+  }
+
+  static int rename(const char *oldpath, const char *newpath) {
+    Timer timer(OP_RENAME);
+    return Next::rename(oldpath, newpath);
+  }
+
+  static int rmdir(const char *path) {
+    Timer timer(OP_RMDIR);
+    return Next::rmdir(path);
+  }
+
+  static int setxattr(const char *path, const char *name, const char *value,
+                      size_t size, int flags) {
+    Timer timer(OP_SETXATTR);
+    return Next::setxattr(path, name, value, size, flags);
+  }
+
+  static int symlink(const char *target, const char *path) {
+    Timer timer(OP_SYMLINK);
+    return Next::symlink(target, path);
+  }
+
+  static int truncate(const char *path, off_t length) {
+    Timer timer(OP_TRUNCATE);
+    return Next::truncate(path, length);
+  }
+
+  static int unlink(const char *path) {
+    Timer timer(OP_UNLINK);
+    return Next::unlink(path);
+  }
+
+  static int utimens(const char *path, const struct timespec tv[2]) {
+    Timer timer(OP_UTIMENS);
+    return Next::utimens(path, tv);
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    Timer timer(OP_WRITE);
+    return Next::write(path, buf, size, offset, fi);
+  }
+};
+
+/**
+ * \brief Rejects every modification with EROFS.
+ */
+template <class Next>
+struct ReadOnlyLayer : Next {
+  static int access(const char *path, int mask) {
+    if (mask & W_OK) {
+      return -EROFS;
+    }
+    return Next::access(path, mask);
+  }
+
+  static int open(const char *path, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+      return -EROFS;
+    }
+    return Next::open(path, fi);
+  }
+
+  static int chmod(const char *, mode_t) { return -EROFS; }
+  static int chown(const char *, uid_t, gid_t) { return -EROFS; }
+  static int create(const char *, mode_t, struct fuse_file_info *) {
+    return -EROFS;
+  }
+  static int link(const char *, const char *) { return -EROFS; }
+  static int mkdir(const char *, mode_t) { return -EROFS; }
+  static int rename(const char *, const char *) { return -EROFS; }
+  static int rmdir(const char *) { return -EROFS; }
+  static int setxattr(const char *, const char *, const char *, size_t,
+                      int) {
+    return -EROFS;
+  }
+  static int symlink(const char *, const char *) { return -EROFS; }
+  static int truncate(const char *, off_t) { return -EROFS; }
+  static int unlink(const char *) { return -EROFS; }
+  static int utimens(const char *, const struct timespec[2]) {
+    return -EROFS;
+  }
+  static int write(const char *, const char *, size_t, off_t,
+                   struct fuse_file_info *) {
+    return -EROFS;
+  }
+};
+
+/**
+ * \brief Fires the op_entry and op_return probes (see probes.h).
+ */
+template <class Next>
+struct ProbeLayer : Next {
+  static int access(const char *path, int mask) {
+    WRAPPERFS_PROBE4(op_entry, "access", path, 0, 0);
+    int ret = Next::access(path, mask);
+    WRAPPERFS_PROBE3(op_return, "access", path, ret);
+    return ret;
+  }
+
+  static int chmod(const char *path, mode_t mode) {
+    WRAPPERFS_PROBE4(op_entry, "chmod", path, 0, 0);
+    int ret = Next::chmod(path, mode);
+    WRAPPERFS_PROBE3(op_return, "chmod", path, ret);
+    return ret;
+  }
+
+  static int chown(const char *path, uid_t owner, gid_t group) {
+    WRAPPERFS_PROBE4(op_entry, "chown", path, 0, 0);
+    int ret = Next::chown(path, owner, group);
+    WRAPPERFS_PROBE3(op_return, "chown", path, ret);
+    return ret;
+  }
+
+  static int create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "create", path, 0, 0);
+    int ret = Next::create(path, mode, fi);
+    WRAPPERFS_PROBE3(op_return, "create", path, ret);
+    return ret;
+  }
+
+  static int flush(const char *path, struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "flush", path, 0, 0);
+    int ret = Next::flush(path, fi);
+    WRAPPERFS_PROBE3(op_return, "flush", path, ret);
+    return ret;
+  }
+
+  static int fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "fsync", path, 0, 0);
+    int ret = Next::fsync(path, datasync, fi);
+    WRAPPERFS_PROBE3(op_return, "fsync", path, ret);
+    return ret;
+  }
+
+  static int getattr(const char *path, struct stat *stbuf) {
+    WRAPPERFS_PROBE4(op_entry, "getattr", path, 0, 0);
+    int ret = Next::getattr(path, stbuf);
+    WRAPPERFS_PROBE3(op_return, "getattr", path, ret);
+    return ret;
+  }
+
+  static int getxattr(const char *path, const char *name, char *value,
+                      size_t size) {
+    WRAPPERFS_PROBE4(op_entry, "getxattr", path, size, 0);
+    int ret = Next::getxattr(path, name, value, size);
+    WRAPPERFS_PROBE3(op_return, "getxattr", path, ret);
+    return ret;
+  }
+
+  static int link(const char *oldpath, const char *newpath) {
+    WRAPPERFS_PROBE4(op_entry, "link", newpath, 0, 0);
+    int ret = Next::link(oldpath, newpath);
+    WRAPPERFS_PROBE3(op_return, "link", newpath, ret);
+    return ret;
+  }
+
+  static int mkdir(const char *path, mode_t mode) {
+    WRAPPERFS_PROBE4(op_entry, "mkdir", path, 0, 0);
+    int ret = Next::mkdir(path, mode);
+    WRAPPERFS_PROBE3(op_return, "mkdir", path, ret);
+    return ret;
+  }
+
+  static int open(const char *path, struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "open", path, 0, 0);
+    int ret = Next::open(path, fi);
+    WRAPPERFS_PROBE3(op_return, "open", path, ret);
+    return ret;
+  }
+
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "read", path, size, offset);
+    int ret = Next::read(path, buf, size, offset, fi);
+    WRAPPERFS_PROBE3(op_return, "read", path, ret);
+    return ret;
+  }
+
+  static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "readdir", path, 0, offset);
+    int ret = Next::readdir(path, buf, filler, offset, fi);
+    WRAPPERFS_PROBE3(op_return, "readdir", path, ret);
+    return ret;
+  }
+
+  static int readlink(const char *path, char *buf, size_t size) {
+    WRAPPERFS_PROBE4(op_entry, "readlink", path, 0, 0);
+    int ret = Next::readlink(path, buf, size);
+    WRAPPERFS_PROBE3(op_return, "readlink", path, ret);
+    return ret;
+  }
+
+  static int release(const char *path, struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "release", path, 0, 0);
+    int ret = Next::release(path, fi);
+    WRAPPERFS_PROBE3(op_return, "release", path, ret);
+    return ret;
+  }
+
+  static int rename(const char *oldpath, const char *newpath) {
+    WRAPPERFS_PROBE4(op_entry, "rename", oldpath, 0, 0);
+    int ret = Next::rename(oldpath, newpath);
+    WRAPPERFS_PROBE3(op_return, "rename", oldpath, ret);
+    return ret;
+  }
+
+  static int rmdir(const char *path) {
+    WRAPPERFS_PROBE4(op_entry, "rmdir", path, 0, 0);
+    int ret = Next::rmdir(path);
+    WRAPPERFS_PROBE3(op_return, "rmdir", path, ret);
+    return ret;
+  }
+
+  static int setxattr(const char *path, const char *name, const char *value,
+                      size_t size, int flags) {
+    WRAPPERFS_PROBE4(op_entry, "setxattr", path, size, 0);
+    int ret = Next::setxattr(path, name, value, size, flags);
+    WRAPPERFS_PROBE3(op_return, "setxattr", path, ret);
+    return ret;
+  }
+
+  static int symlink(const char *target, const char *path) {
+    WRAPPERFS_PROBE4(op_entry, "symlink", path, 0, 0);
+    int ret = Next::symlink(target, path);
+    WRAPPERFS_PROBE3(op_return, "symlink", path, ret);
+    return ret;
+  }
+
+  static int truncate(const char *path, off_t length) {
+    WRAPPERFS_PROBE4(op_entry, "truncate", path, 0, length);
+    int ret = Next::truncate(path, length);
+    WRAPPERFS_PROBE3(op_return, "truncate", path, ret);
+    return ret;
+  }
+
+  static int unlink(const char *path) {
+    WRAPPERFS_PROBE4(op_entry, "unlink", path, 0, 0);
+    int ret = Next::unlink(path);
+    WRAPPERFS_PROBE3(op_return, "unlink", path, ret);
+    return ret;
+  }
+
+  static int utimens(const char *path, const struct timespec tv[2]) {
+    WRAPPERFS_PROBE4(op_entry, "utimens", path, 0, 0);
+    int ret = Next::utimens(path, tv);
+    WRAPPERFS_PROBE3(op_return, "utimens", path, ret);
+    return ret;
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    WRAPPERFS_PROBE4(op_entry, "write", path, size, offset);
+    int ret = Next::write(path, buf, size, offset, fi);
+    WRAPPERFS_PROBE3(op_return, "write", path, ret);
+    return ret;
+  }
+};
+
+#endif  // LAYERS_H_
@@ -0,0 +1,263 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./lazytimes.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <iterator>
+#include <string>
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+/// Entries written out per hold of the lock by flush_all().
+const int kBatchSize = 256;
+
+Counter times_deferred("times.deferred");
+Counter times_flushed("times.flushed");
+Counter times_errors("times.errors");
+
+}  // namespace
+
+LazyTimes::LazyTimes() : size_(0), stopping_(false) {
+}
+
+LazyTimes::~LazyTimes() {
+  stop();
+}
+
+void LazyTimes::start(unsigned interval_ms) {
+  if (flusher_.joinable()) {
+    return;
+  }
+  stopping_ = false;
+  flusher_ = std::thread(&LazyTimes::run, this, interval_ms);
+}
+
+void LazyTimes::stop() {
+  if (flusher_.joinable()) {
+    {
+      std::lock_guard<std::mutex> guard(run_mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_all();
+    flusher_.join();
+  }
+  flush_all();
+}
+
+void LazyTimes::run(unsigned interval_ms) {
+  std::unique_lock<std::mutex> lock(run_mutex_);
+  while (!stopping_) {
+    wakeup_.wait_for(lock, std::chrono::milliseconds(interval_ms));
+    if (stopping_) {
+      break;
+    }
+    lock.unlock();
+    flush_all();
+    lock.lock();
+  }
+}
+
+void LazyTimes::set(const string &path, const struct timespec tv[2]) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = pending_.find(path);
+  Times times;
+  if (it != pending_.end()) {
+    times = it->second;
+  } else {
+    times.tv[0].tv_sec = times.tv[1].tv_sec = 0;
+    times.tv[0].tv_nsec = times.tv[1].tv_nsec = UTIME_OMIT;
+  }
+  bool changed = false;
+  for (int i = 0; i < 2; i++) {
+    if (tv[i].tv_nsec == UTIME_OMIT) {
+      continue;
+    }
+    if (tv[i].tv_nsec == UTIME_NOW) {
+      // Resolved now: the update is written out later.
+      clock_gettime(CLOCK_REALTIME, &times.tv[i]);
+    } else {
+      times.tv[i] = tv[i];
+    }
+    changed = true;
+  }
+  if (changed) {
+    pending_[path] = times;
+    size_ = pending_.size();
+    times_deferred.add();
+  }
+}
+
+void LazyTimes::get(const string &path, struct stat *stbuf) {
+  if (size_ == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = pending_.find(path);
+  if (it == pending_.end()) {
+    return;
+  }
+  const struct timespec *tv = it->second.tv;
+  if (tv[0].tv_nsec != UTIME_OMIT) {
+    stbuf->st_atim = tv[0];
+  }
+  if (tv[1].tv_nsec != UTIME_OMIT) {
+    stbuf->st_mtim = tv[1];
+  }
+}
+
+int LazyTimes::apply_locked(Iterator first, Iterator last) {
+  int ret = 0;
+  for (Iterator it = first; it != last; ++it) {
+    times_flushed.add();
+    // A file removed since has nothing left to update.
+    if (utimensat(AT_FDCWD, it->first.c_str(), it->second.tv, 0) == -1 &&
+        errno != ENOENT) {
+      times_errors.add();
+      if (!ret) {
+        ret = -errno;
+      }
+    }
+  }
+  pending_.erase(first, last);
+  size_ = pending_.size();
+  return ret;
+}
+
+void LazyTimes::flush_locked(const string &path, bool subtree) {
+  auto it = pending_.find(path);
+  if (it != pending_.end()) {
+    apply_locked(it, std::next(it));
+  }
+  if (subtree) {
+    // Paths under 'path' sort between "path/" and "path0".
+    apply_locked(pending_.lower_bound(path + "/"),
+                 pending_.lower_bound(path + "0"));
+  }
+}
+
+void LazyTimes::forget_locked(const string &path, bool subtree) {
+  pending_.erase(path);
+  if (subtree) {
+    pending_.erase(pending_.lower_bound(path + "/"),
+                   pending_.lower_bound(path + "0"));
+  }
+  size_ = pending_.size();
+}
+
+void LazyTimes::forget(const string &path, bool subtree) {
+  if (size_ == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  forget_locked(path, subtree);
+}
+
+void LazyTimes::flush(const string &path, bool subtree) {
+  if (size_ == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  flush_locked(path, subtree);
+}
+
+void LazyTimes::flush_fd(int fd) {
+  if (size_ == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = fds_.find(fd);
+  if (it != fds_.end()) {
+    flush_locked(it->second, false);
+  }
+}
+
+int LazyTimes::flush_all() {
+  int ret = 0;
+  // Batch by batch, so that getattr and utimens are not held up for long,
+  // and from a cursor, so that new entries cannot keep this going.
+  string next;
+  while (size_) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Iterator first = pending_.lower_bound(next);
+    Iterator last = first;
+    for (int n = 0; n < kBatchSize && last != pending_.end(); n++) {
+      ++last;
+    }
+    if (first == last) {
+      break;
+    }
+    bool done = last == pending_.end();
+    if (!done) {
+      next = last->first;
+    }
+    int err = apply_locked(first, last);
+    if (!ret) {
+      ret = err;
+    }
+    if (done) {
+      break;
+    }
+  }
+  return ret;
+}
+
+void LazyTimes::opened(int fd, const string &path) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  fds_[fd] = path;
+}
+
+void LazyTimes::closed(int fd) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = fds_.find(fd);
+  if (it != fds_.end()) {
+    flush_locked(it->second, false);
+    fds_.erase(it);
+  }
+}
+
+void LazyTimes::renamed(const string &from, const string &to) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (size_) {
+    forget_locked(to, true);
+    std::map<string, Times> moved;
+    auto first = pending_.lower_bound(from + "/");
+    auto last = pending_.lower_bound(from + "0");
+    for (auto it = first; it != last; ++it) {
+      moved[to + it->first.substr(from.size())] = it->second;
+    }
+    pending_.erase(first, last);
+    auto it = pending_.find(from);
+    if (it != pending_.end()) {
+      moved[to] = it->second;
+      pending_.erase(it);
+    }
+    pending_.insert(moved.begin(), moved.end());
+    size_ = pending_.size();
+  }
+  for (auto &entry : fds_) {
+    string &path = entry.second;
+    if (path.compare(0, from.size(), from) == 0 &&
+        (path.size() == from.size() || path[from.size()] == '/')) {
+      path = to + path.substr(from.size());
+    }
+  }
+}
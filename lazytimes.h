@@ -0,0 +1,109 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Deferred timestamp updates for backing files.
+ *
+ * make, rsync and tar set times on many files in a row, and each utimens
+ * would otherwise walk the backing path right away. LazyTimes only records
+ * the times asked for, serves them to getattr in place of the backing
+ * file's, and writes them out with utimensat() at full nanosecond
+ * precision: every interval from a background thread, in batches, and
+ * for a single file before anything else may change its times on the host
+ * (a write through a descriptor, a truncate, a new entry in a directory,
+ * a rename) or when it is closed or synced.
+ *
+ * Paths are backing paths. Descriptors are tracked by the path they were
+ * opened as, so times set through another hard link of an open file may be
+ * written after a later write to it.
+ */
+
+#ifndef LAZYTIMES_H_
+#define LAZYTIMES_H_
+
+#include <sys/stat.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class LazyTimes {
+ public:
+  LazyTimes();
+  ~LazyTimes();
+
+  /// Starts and stops writing the pending times out every 'interval_ms'.
+  void start(unsigned interval_ms);
+  void stop();
+
+  /// Records 'tv' for 'path', as given to utimensat(2). UTIME_NOW is
+  /// taken as the current time.
+  void set(const std::string &path, const struct timespec tv[2]);
+
+  /// Replaces the times in 'stbuf' by those pending for 'path'.
+  void get(const std::string &path, struct stat *stbuf);
+
+  /// Writes out the times pending for 'path', and with 'subtree' those of
+  /// every path under it.
+  void flush(const std::string &path, bool subtree = false);
+
+  /// Writes out the times pending for the file open as 'fd'.
+  void flush_fd(int fd);
+
+  /// Writes out everything pending. Returns 0 or the first -errno.
+  int flush_all();
+
+  /// Drops the times pending for 'path', and with 'subtree' those of
+  /// every path under it, once it is removed: a new file by that name
+  /// must not get them.
+  void forget(const std::string &path, bool subtree = false);
+
+  /// Remembers that 'fd' was opened as 'path', until closed().
+  void opened(int fd, const std::string &path);
+  void closed(int fd);
+
+  /// Moves the times pending and the descriptors open under 'from' to
+  /// 'to' after a rename, dropping those of the 'to' it replaced.
+  void renamed(const std::string &from, const std::string &to);
+
+ private:
+  struct Times {
+    struct timespec tv[2];
+  };
+  typedef std::map<std::string, Times>::iterator Iterator;
+
+  /// Writes out and forgets the entries in [first, last).
+  int apply_locked(Iterator first, Iterator last);
+  void flush_locked(const std::string &path, bool subtree);
+  void forget_locked(const std::string &path, bool subtree);
+
+  void run(unsigned interval_ms);
+
+  std::mutex mutex_;
+  std::map<std::string, Times> pending_;
+  std::atomic<size_t> size_;  ///< Of pending_, read without the lock.
+  std::map<int, std::string> fds_;
+
+  std::mutex run_mutex_;
+  std::condition_variable wakeup_;
+  bool stopping_;
+  std::thread flusher_;
+};
+
+#endif  // LAZYTIMES_H_
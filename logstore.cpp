@@ -0,0 +1,749 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./logstore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "./crc32.h"
+#include "./stats.h"
+#include "./tunables.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+const uint64_t kSegmentSize = 64 << 20;
+
+const uint32_t kRecordMagic = 0x574c4f47;  // "WLOG"
+
+enum {
+  REC_WRITE = 1,
+  REC_TRUNCATE = 2,  ///< 'offset' is the new length.
+  REC_DROP = 3,
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t seq;
+  uint64_t id;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t crc;  ///< Over the header with crc = 0, then the data.
+};
+
+Counter user_bytes("logstore.user_bytes");
+Counter log_bytes("logstore.log_bytes");
+Counter cleaner_bytes("logstore.cleaner_bytes");
+Counter cleaner_ns("logstore.cleaner_ns");
+Counter segments_cleaned("logstore.segments_cleaned");
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int pread_full(int fd, char *buf, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, buf + done, size - done, offset + done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    if (n == 0) {
+      break;
+    }
+    done += n;
+  }
+  return done;
+}
+
+int pwrite_full(int fd, const char *buf, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+string segment_name(uint64_t number) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016" PRIx64 ".seg", number);
+  return name;
+}
+
+/// A record found while scanning the segments at startup.
+struct ReplayEntry {
+  uint64_t seq;
+  uint32_t type;
+  uint64_t id;
+  uint64_t offset;
+  uint32_t length;
+  uint64_t segment;
+  uint64_t data_offset;
+
+  bool operator<(const ReplayEntry &other) const {
+    return seq < other.seq;
+  }
+};
+
+}  // namespace
+
+LogStore::Segment::~Segment() {
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+LogStore::LogStore() : next_seq_(1), cleaner_stop_(false) {
+}
+
+LogStore::~LogStore() {
+  stop_cleaner();
+  sync();
+}
+
+int LogStore::init(const string &dir) {
+  dir_ = dir;
+  if (mkdir(dir_.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  // Nothing else runs yet; replay() takes no locks.
+  std::lock_guard<std::mutex> guard(log_mutex_);
+  int ret = replay();
+  if (ret) {
+    return ret;
+  }
+  return roll_locked();
+}
+
+int LogStore::replay() {
+  DIR *dirp = opendir(dir_.c_str());
+  if (dirp == NULL) {
+    return -errno;
+  }
+  vector<uint64_t> numbers;
+  struct dirent *dp;
+  while ((dp = readdir(dirp)) != NULL) {
+    char *end;
+    uint64_t number = strtoull(dp->d_name, &end, 16);
+    if (end != dp->d_name && strcmp(end, ".seg") == 0) {
+      numbers.push_back(number);
+    }
+  }
+  closedir(dirp);
+  std::sort(numbers.begin(), numbers.end());
+
+  vector<ReplayEntry> entries;
+  string data;
+  for (size_t i = 0; i < numbers.size(); i++) {
+    SegmentPtr seg(new Segment);
+    seg->number = numbers[i];
+    seg->path = dir_ + segment_name(seg->number);
+    seg->size = 0;
+    seg->live = 0;
+    seg->fd = ::open(seg->path.c_str(), O_RDWR);
+    if (seg->fd == -1) {
+      return -errno;
+    }
+    // Segments are synced when the log moves past them, so only the last
+    // one can end in a torn record; only its data checksums are verified.
+    bool verify = i + 1 == numbers.size();
+    RecordHeader header;
+    while (pread_full(seg->fd, reinterpret_cast<char*>(&header),
+                      sizeof(header), seg->size) == sizeof(header) &&
+           header.magic == kRecordMagic) {
+      uint64_t data_offset = seg->size + sizeof(header);
+      if (verify) {
+        data.resize(header.length);
+        if (pread_full(seg->fd, &data[0], header.length, data_offset) !=
+            static_cast<int>(header.length)) {
+          break;
+        }
+        uint32_t crc = header.crc;
+        header.crc = 0;
+        uint32_t actual = crc32(reinterpret_cast<char*>(&header),
+                                sizeof(header));
+        if (crc32(data.data(), data.size(), actual) != crc) {
+          break;
+        }
+      }
+      ReplayEntry entry = { header.seq, header.type, header.id,
+                            header.offset, header.length, seg->number,
+                            data_offset };
+      entries.push_back(entry);
+      seg->size = data_offset + header.length;
+    }
+    if (verify && ftruncate(seg->fd, seg->size) == -1) {
+      return -errno;
+    }
+    segments_[seg->number] = seg;
+  }
+
+  std::sort(entries.begin(), entries.end());
+  for (const auto &entry : entries) {
+    next_seq_ = std::max(next_seq_, entry.seq + 1);
+    FilePtr &slot = files_[entry.id];
+    if (!slot) {
+      slot.reset(new File);
+    }
+    File *file = slot.get();
+    switch (entry.type) {
+    case REC_WRITE: {
+      Extent extent = { entry.length, entry.segment, entry.data_offset };
+      map_locked(file, entry.offset, extent);
+      file->size = std::max(file->size, entry.offset + entry.length);
+      break;
+    }
+    case REC_TRUNCATE:
+    case REC_DROP: {
+      Tombstone tomb = { entry.type, entry.seq, entry.id, entry.offset };
+      tombstones_[entry.segment].push_back(tomb);
+      if (entry.type == REC_TRUNCATE) {
+        truncate_locked(file, entry.offset);
+      } else {
+        cut_locked(file, 0, UINT64_MAX);
+        files_.erase(entry.id);
+      }
+      break;
+    }
+    }
+  }
+  return 0;
+}
+
+int LogStore::roll_locked() {
+  uint64_t number = 1;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (!segments_.empty()) {
+      number = segments_.rbegin()->first + 1;
+    }
+  }
+  if (head_ && fdatasync(head_->fd) == -1) {
+    return -errno;
+  }
+  SegmentPtr seg(new Segment);
+  seg->number = number;
+  seg->path = dir_ + segment_name(number);
+  seg->size = 0;
+  seg->live = 0;
+  seg->fd = ::open(seg->path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (seg->fd == -1) {
+    return -errno;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  segments_[number] = seg;
+  head_ = seg;
+  return 0;
+}
+
+int LogStore::append_locked(uint32_t type, uint64_t seq, uint64_t id,
+                            uint64_t offset, const char *data,
+                            uint32_t length, Location *at) {
+  uint64_t total = sizeof(RecordHeader) + length;
+  if (head_->size > 0 && head_->size + total > kSegmentSize) {
+    int ret = roll_locked();
+    if (ret) {
+      return ret;
+    }
+  }
+  RecordHeader header = { kRecordMagic, type, seq, id, offset, length, 0 };
+  uint32_t crc = crc32(reinterpret_cast<char*>(&header), sizeof(header));
+  header.crc = crc32(data, length, crc);
+
+  string record(reinterpret_cast<char*>(&header), sizeof(header));
+  record.append(data, length);
+  int ret = pwrite_full(head_->fd, record.data(), record.size(),
+                        head_->size);
+  if (ret) {
+    return ret;
+  }
+  if (at) {
+    at->segment = head_->number;
+    at->data_offset = head_->size + sizeof(header);
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  head_->size += total;
+  if (type != REC_WRITE) {
+    Tombstone tomb = { type, seq, id, offset };
+    tombstones_[head_->number].push_back(tomb);
+  }
+  log_bytes.add(total);
+  return 0;
+}
+
+int LogStore::append(uint32_t type, uint64_t id, uint64_t offset,
+                     const char *data, uint32_t length, Location *at) {
+  std::lock_guard<std::mutex> guard(log_mutex_);
+  return append_locked(type, next_seq_++, id, offset, data, length, at);
+}
+
+void LogStore::cut_locked(File *file, uint64_t offset, uint64_t end) {
+  auto it = file->extents.upper_bound(offset);
+  if (it != file->extents.begin()) {
+    --it;
+  }
+  while (it != file->extents.end() && it->first < end) {
+    uint64_t start = it->first;
+    Extent extent = it->second;
+    uint64_t extent_end = start + extent.length;
+    if (extent_end <= offset) {
+      ++it;
+      continue;
+    }
+    uint64_t overlap = std::min(extent_end, end) - std::max(start, offset);
+    auto seg = segments_.find(extent.segment);
+    if (seg != segments_.end()) {
+      seg->second->live -= overlap;
+    }
+    it = file->extents.erase(it);
+    if (start < offset) {
+      Extent left = extent;
+      left.length = offset - start;
+      file->extents[start] = left;
+    }
+    if (extent_end > end) {
+      Extent right = extent;
+      right.length = extent_end - end;
+      right.segment_offset += end - start;
+      it = file->extents.insert(std::make_pair(end, right)).first;
+      ++it;
+    }
+  }
+}
+
+void LogStore::map_locked(File *file, uint64_t offset, const Extent &extent) {
+  cut_locked(file, offset, offset + extent.length);
+  file->extents[offset] = extent;
+  auto seg = segments_.find(extent.segment);
+  if (seg != segments_.end()) {
+    seg->second->live += extent.length;
+  }
+}
+
+void LogStore::truncate_locked(File *file, uint64_t length) {
+  cut_locked(file, length, UINT64_MAX);
+  file->size = length;
+}
+
+LogStore::FilePtr LogStore::find(uint64_t id) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = files_.find(id);
+  return it == files_.end() ? FilePtr() : it->second;
+}
+
+int LogStore::open(uint64_t id, uint64_t size) {
+  FilePtr file;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    FilePtr &slot = files_[id];
+    if (!slot) {
+      slot.reset(new File);
+    }
+    file = slot;
+    file->refs++;
+    file->dropped = false;
+  }
+  std::lock_guard<std::mutex> file_guard(file->mutex);
+  if (!file->extents.empty()) {
+    auto last = file->extents.rbegin();
+    if (last->first + last->second.length > size) {
+      // The backing file was truncated behind our back, e.g., by creat().
+      int ret = append(REC_TRUNCATE, id, size, NULL, 0, NULL);
+      if (ret) {
+        return ret;
+      }
+      std::lock_guard<std::mutex> guard(mutex_);
+      truncate_locked(file.get(), size);
+    }
+  }
+  file->size = size;
+  return 0;
+}
+
+void LogStore::release(uint64_t id) {
+  bool dropped = false;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = files_.find(id);
+    if (it == files_.end()) {
+      return;
+    }
+    File *file = it->second.get();
+    dropped = --file->refs == 0 && file->dropped;
+  }
+  if (dropped) {
+    drop(id);
+  }
+}
+
+ssize_t LogStore::read(uint64_t id, int base_fd, char *buf, size_t size,
+                       off_t offset) {
+  struct Piece {
+    uint64_t buf_offset;
+    uint64_t length;
+    SegmentPtr segment;
+    uint64_t segment_offset;
+  };
+  vector<Piece> pieces;
+  uint64_t covered = 0;
+  uint64_t file_size = 0;
+  FilePtr file = find(id);
+  if (file == NULL) {
+    return pread(base_fd, buf, size, offset);
+  }
+  {
+    std::unique_lock<std::mutex> file_lock(file->mutex);
+    if (file->extents.empty()) {
+      file_lock.unlock();
+      return pread(base_fd, buf, size, offset);
+    }
+    file_size = file->size;
+    if (static_cast<uint64_t>(offset) >= file_size) {
+      return 0;
+    }
+    size = std::min<uint64_t>(size, file_size - offset);
+    uint64_t end = offset + size;
+    auto it = file->extents.upper_bound(offset);
+    if (it != file->extents.begin()) {
+      --it;
+    }
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (; it != file->extents.end() && it->first < end; ++it) {
+      uint64_t start = std::max<uint64_t>(it->first, offset);
+      uint64_t stop = std::min(it->first + it->second.length, end);
+      if (stop <= start) {
+        continue;
+      }
+      Piece piece = { start - offset, stop - start,
+                      segments_[it->second.segment],
+                      it->second.segment_offset + (start - it->first) };
+      pieces.push_back(piece);
+      covered += stop - start;
+    }
+  }
+
+  // Segments are immutable once written, and a segment removed by the
+  // cleaner stays readable through the references taken above.
+  if (covered < size) {
+    int n = pread_full(base_fd, buf, size, offset);
+    if (n < 0) {
+      return n;
+    }
+    memset(buf + n, 0, size - n);
+  }
+  for (const auto &piece : pieces) {
+    int n = pread_full(piece.segment->fd, buf + piece.buf_offset,
+                       piece.length, piece.segment_offset);
+    if (n < 0) {
+      return n;
+    }
+  }
+  return size;
+}
+
+ssize_t LogStore::write(uint64_t id, int base_fd, const char *buf,
+                        size_t size, off_t offset) {
+  FilePtr file;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    FilePtr &slot = files_[id];
+    if (!slot) {
+      slot.reset(new File);
+    }
+    file = slot;
+  }
+  std::lock_guard<std::mutex> file_guard(file->mutex);
+  Location at;
+  int ret = append(REC_WRITE, id, offset, buf, size, &at);
+  if (ret) {
+    return ret;
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Extent extent = { size, at.segment, at.data_offset };
+    map_locked(file.get(), offset, extent);
+  }
+  if (offset + size > file->size) {
+    // Keep the placeholder's size current for getattr.
+    if (ftruncate(base_fd, offset + size) == -1) {
+      return -errno;
+    }
+    file->size = offset + size;
+  }
+  user_bytes.add(size);
+  return size;
+}
+
+int LogStore::truncate(uint64_t id, off_t length) {
+  FilePtr file = find(id);
+  if (file == NULL) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> file_guard(file->mutex);
+  int ret = append(REC_TRUNCATE, id, length, NULL, 0, NULL);
+  if (ret) {
+    return ret;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  truncate_locked(file.get(), length);
+  return 0;
+}
+
+int LogStore::drop(uint64_t id) {
+  FilePtr file = find(id);
+  if (file == NULL) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> file_guard(file->mutex);
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (file->refs > 0) {
+      // Still readable through open handles; dropped on the last release.
+      file->dropped = true;
+      return 0;
+    }
+  }
+  int ret = append(REC_DROP, id, 0, NULL, 0, NULL);
+  if (ret) {
+    return ret;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  cut_locked(file.get(), 0, UINT64_MAX);
+  auto it = files_.find(id);
+  if (it != files_.end() && it->second == file && file->refs == 0) {
+    files_.erase(it);
+  }
+  return 0;
+}
+
+int LogStore::sync() {
+  std::lock_guard<std::mutex> guard(log_mutex_);
+  if (head_ && fdatasync(head_->fd) == -1) {
+    return -errno;
+  }
+  return 0;
+}
+
+bool LogStore::clean_one(double max_live_ratio) {
+  struct Live {
+    FilePtr file;
+    uint64_t id;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t segment_offset;
+  };
+  SegmentPtr victim;
+  vector<std::pair<uint64_t, FilePtr>> files;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    double best = max_live_ratio;
+    for (const auto &entry : segments_) {
+      const SegmentPtr &seg = entry.second;
+      if (seg == head_ || seg->size == 0) {
+        continue;
+      }
+      double ratio = static_cast<double>(seg->live) / seg->size;
+      if (ratio < best) {
+        best = ratio;
+        victim = seg;
+      }
+    }
+    if (!victim) {
+      return false;
+    }
+    files.assign(files_.begin(), files_.end());
+  }
+  // One file at a time, so that only writes to that file wait.
+  vector<Live> live;
+  for (const auto &entry : files) {
+    std::lock_guard<std::mutex> file_guard(entry.second->mutex);
+    for (const auto &extent : entry.second->extents) {
+      if (extent.second.segment == victim->number) {
+        Live piece = { entry.second, entry.first, extent.first,
+                       extent.second.length, extent.second.segment_offset };
+        live.push_back(piece);
+      }
+    }
+  }
+  files.clear();
+
+  uint64_t start = now_ns();
+  string data;
+  for (const auto &piece : live) {
+    data.resize(piece.length);
+    if (pread_full(victim->fd, &data[0], piece.length,
+                   piece.segment_offset) != static_cast<int>(piece.length)) {
+      return false;
+    }
+    File *file = piece.file.get();
+    std::lock_guard<std::mutex> file_guard(file->mutex);
+    // Only copy the parts that still map to the victim; the rest was
+    // overwritten, truncated or dropped while the data was being read.
+    uint64_t end = piece.offset + piece.length;
+    vector<Live> valid;
+    auto it = file->extents.upper_bound(piece.offset);
+    if (it != file->extents.begin()) {
+      --it;
+    }
+    for (; it != file->extents.end() && it->first < end; ++it) {
+      const Extent &extent = it->second;
+      uint64_t lo = std::max(it->first, piece.offset);
+      uint64_t hi = std::min(it->first + extent.length, end);
+      if (hi <= lo || extent.segment != victim->number ||
+          extent.segment_offset + (lo - it->first) !=
+          piece.segment_offset + (lo - piece.offset)) {
+        continue;
+      }
+      Live part = { FilePtr(), piece.id, lo, hi - lo, 0 };
+      valid.push_back(part);
+    }
+    for (const auto &part : valid) {
+      Location at;
+      if (append(REC_WRITE, part.id, part.offset,
+                 data.data() + (part.offset - piece.offset), part.length,
+                 &at)) {
+        return false;
+      }
+      Extent extent = { part.length, at.segment, at.data_offset };
+      std::lock_guard<std::mutex> guard(mutex_);
+      map_locked(file, part.offset, extent);
+      cleaner_bytes.add(part.length);
+    }
+  }
+
+  std::lock_guard<std::mutex> log_guard(log_mutex_);
+  // Truncates and drops in the victim still matter while an older segment
+  // may hold data they invalidated; replay orders them by sequence number.
+  vector<Tombstone> tombs;
+  bool older;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = tombstones_.find(victim->number);
+    if (it != tombstones_.end()) {
+      tombs = it->second;
+    }
+    older = segments_.begin()->first < victim->number;
+  }
+  if (older) {
+    for (const auto &tomb : tombs) {
+      if (append_locked(tomb.type, tomb.seq, tomb.id, tomb.length, NULL, 0,
+                        NULL)) {
+        return false;
+      }
+    }
+  }
+  // The copies must be durable before the only other copy goes away.
+  if (fdatasync(head_->fd) == -1) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    tombstones_.erase(victim->number);
+    segments_.erase(victim->number);
+  }
+  unlink(victim->path.c_str());
+  segments_cleaned.add();
+  cleaner_ns.add(now_ns() - start);
+  return true;
+}
+
+void LogStore::cleaner_loop() {
+  std::unique_lock<std::mutex> lock(cleaner_mutex_);
+  while (!cleaner_stop_) {
+    lock.unlock();
+    // Segments with less live data than this are cleaned.
+    while (clean_one(tunables().clean_live_ratio)) {
+      lock.lock();
+      bool stop = cleaner_stop_;
+      lock.unlock();
+      if (stop) {
+        break;
+      }
+    }
+    lock.lock();
+    cleaner_cond_.wait_for(lock, std::chrono::seconds(1));
+  }
+}
+
+void LogStore::start_cleaner() {
+  cleaner_stop_ = false;
+  cleaner_ = std::thread(&LogStore::cleaner_loop, this);
+}
+
+void LogStore::stop_cleaner() {
+  if (!cleaner_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(cleaner_mutex_);
+    cleaner_stop_ = true;
+  }
+  cleaner_cond_.notify_all();
+  cleaner_.join();
+}
+
+void LogStore::report(string *out) {
+  char line[256];
+  uint64_t user = user_bytes.value();
+  uint64_t logged = log_bytes.value();
+  snprintf(line, sizeof(line),
+           "user_bytes %" PRIu64 "\n"
+           "log_bytes %" PRIu64 "\n"
+           "cleaner_bytes %" PRIu64 "\n"
+           "cleaner_seconds %.3f\n"
+           "segments_cleaned %" PRIu64 "\n"
+           "write_amplification %.3f\n",
+           user, logged, cleaner_bytes.value(), cleaner_ns.value() / 1e9,
+           segments_cleaned.value(),
+           user ? static_cast<double>(logged) / user : 0.0);
+  out->append(line);
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (const auto &entry : segments_) {
+    const SegmentPtr &seg = entry.second;
+    snprintf(line, sizeof(line),
+             "segment %016" PRIx64 " size %" PRIu64 " live %" PRIu64
+             " ratio %.3f%s\n", seg->number, seg->size, seg->live,
+             seg->size ? static_cast<double>(seg->live) / seg->size : 0.0,
+             seg == head_ ? " head" : "");
+    out->append(line);
+  }
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Log-structured data engine.
+ *
+ * File writes are appended to large segment files under
+ * BASEDIR/.wrapperfs/log instead of being written in place, turning random
+ * small writes into sequential I/O. Each file (identified by its backing
+ * inode number) has an extent map from file offsets to segment locations;
+ * reads start from the backing file and overlay the mapped extents. The
+ * backing file itself is only extended with ftruncate(), so it stays a
+ * sparse placeholder that carries the namespace, attributes and size.
+ *
+ * Records carry a global sequence number. On startup all segments are
+ * scanned and records are replayed in sequence order to rebuild the extent
+ * maps. A background cleaner rewrites the live extents of mostly-dead
+ * segments at the head of the log and deletes them; truncate and drop
+ * records from a cleaned segment are carried over with their original
+ * sequence number while older segments still exist.
+ *
+ * Appends are serialized by log_mutex_, which is all a log can do. Each
+ * file has a mutex of its own that orders its writes and guards its
+ * extent map, so reads of other files never wait for an append. mutex_
+ * guards the file and segment tables and is only held for in-memory
+ * updates. Locks are taken in that order: file, log_mutex_, mutex_.
+ */
+
+#ifndef LOGSTORE_H_
+#define LOGSTORE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class LogStore {
+ public:
+  LogStore();
+  ~LogStore();
+
+  /// Replays the segments in 'dir', creating it if needed.
+  int init(const std::string &dir);
+
+  /// Starts and stops the background cleaner thread.
+  void start_cleaner();
+  void stop_cleaner();
+
+  /**
+   * \brief Registers an open handle on file 'id', whose backing file
+   * currently has 'size' bytes.
+   */
+  int open(uint64_t id, uint64_t size);
+  void release(uint64_t id);
+
+  ssize_t read(uint64_t id, int base_fd, char *buf, size_t size,
+               off_t offset);
+  ssize_t write(uint64_t id, int base_fd, const char *buf, size_t size,
+                off_t offset);
+  int truncate(uint64_t id, off_t length);
+
+  /// Forgets all data of 'id' once its last link is removed.
+  int drop(uint64_t id);
+
+  /// Flushes the active segment to stable storage.
+  int sync();
+
+  /// Renders cleaner cost, write amplification and segment usage.
+  void report(std::string *out);
+
+  /**
+   * \brief Cleans the segment with the lowest live ratio if that ratio is
+   * below 'max_live_ratio'. Returns true if a segment was cleaned.
+   */
+  bool clean_one(double max_live_ratio);
+
+ private:
+  struct Segment {
+    uint64_t number;
+    int fd;
+    std::string path;
+    uint64_t size;
+    uint64_t live;
+    ~Segment();
+  };
+  typedef std::shared_ptr<Segment> SegmentPtr;
+
+  struct Extent {
+    uint64_t length;
+    uint64_t segment;
+    uint64_t segment_offset;
+  };
+
+  struct File {
+    File() : size(0), refs(0), dropped(false) {}
+
+    std::mutex mutex;  ///< Guards the members below but refs and dropped.
+    std::map<uint64_t, Extent> extents;  ///< Keyed by file offset.
+    uint64_t size;
+    int refs;      ///< Under mutex_.
+    bool dropped;  ///< Under mutex_.
+  };
+  typedef std::shared_ptr<File> FilePtr;
+
+  /// Where a record was appended.
+  struct Location {
+    uint64_t segment;
+    uint64_t data_offset;
+  };
+
+  /// A truncate or drop record kept for carrying over during cleaning.
+  struct Tombstone {
+    uint32_t type;
+    uint64_t seq;
+    uint64_t id;
+    uint64_t length;
+  };
+
+  int replay();
+
+  /// These need log_mutex_.
+  int roll_locked();
+  int append_locked(uint32_t type, uint64_t seq, uint64_t id,
+                    uint64_t offset, const char *data, uint32_t length,
+                    Location *at);
+
+  /// Appends a record with a new sequence number.
+  int append(uint32_t type, uint64_t id, uint64_t offset, const char *data,
+             uint32_t length, Location *at);
+
+  /// These need the file's mutex and mutex_.
+  void map_locked(File *file, uint64_t offset, const Extent &extent);
+  void cut_locked(File *file, uint64_t offset, uint64_t end);
+  void truncate_locked(File *file, uint64_t length);
+
+  /// Returns the file 'id', or NULL.
+  FilePtr find(uint64_t id);
+  void cleaner_loop();
+
+  std::string dir_;
+  std::mutex log_mutex_;
+  uint64_t next_seq_;  ///< Under log_mutex_.
+  std::mutex mutex_;
+  std::map<uint64_t, SegmentPtr> segments_;
+  SegmentPtr head_;    ///< Changed under both mutexes.
+  std::map<uint64_t, FilePtr> files_;
+  std::map<uint64_t, std::vector<Tombstone>> tombstones_;  ///< By segment.
+
+  std::thread cleaner_;
+  std::mutex cleaner_mutex_;
+  std::condition_variable cleaner_cond_;
+  bool cleaner_stop_;
+};
+
+#endif  // LOGSTORE_H_
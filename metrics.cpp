@@ -0,0 +1,320 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./metrics.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "./layers.h"
+#include "./stats.h"
+#include "./timing.h"
+
+using std::string;
+
+namespace {
+
+/// Connections served at once; further ones wait in the backlog.
+const size_t kMaxClients = 16;
+
+/// Requests larger than this are answered without reading them further.
+const size_t kMaxRequest = 8192;
+
+/// Connections idle for this long are closed.
+const uint64_t kIdleTimeoutNs = 5000000000ULL;
+
+struct Client {
+  int fd;
+  string request;
+  string response;
+  size_t sent;
+  uint64_t deadline;
+};
+
+/// Maps a counter name such as "op.read.calls" to a metric name.
+string metric_name(const char *name) {
+  string out = "wrapperfs_";
+  for (const char *p = name; *p; p++) {
+    out.push_back(isalnum(static_cast<unsigned char>(*p)) ? *p : '_');
+  }
+  return out;
+}
+
+bool request_complete(const string &request) {
+  return request.size() >= kMaxRequest ||
+      request.find("\r\n\r\n") != string::npos ||
+      request.find("\n\n") != string::npos;
+}
+
+string http_response(const string &body) {
+  char header[160];
+  snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: %zu\r\n\r\n", body.size());
+  return header + body;
+}
+
+void render_latency(string *out) {
+  out->append("# TYPE wrapperfs_op_latency_seconds histogram\n");
+  char line[512];
+  for (int op = 0; op < OP_COUNT; op++) {
+    const OpStats &stats = op_stats[op];
+    // Calls and buckets are bumped separately, so the buckets, read
+    // once, give +Inf and _count; the cumulative counts never exceed them.
+    uint64_t buckets[OpStats::kLatencyBuckets];
+    uint64_t calls = 0;
+    for (int b = 0; b < OpStats::kLatencyBuckets; b++) {
+      buckets[b] = stats.latency[b].load(std::memory_order_relaxed);
+      calls += buckets[b];
+    }
+    if (!calls) {
+      continue;
+    }
+    uint64_t cumulative = 0;
+    for (int b = 0; b < OpStats::kLatencyBuckets - 1; b++) {
+      cumulative += buckets[b];
+      snprintf(line, sizeof(line),
+               "wrapperfs_op_latency_seconds_bucket{op=\"%s\",le=\"%.9g\"} "
+               "%llu\n", op_names[op], (1ULL << b) / 1e6,
+               static_cast<unsigned long long>(cumulative));  // NOLINT
+      out->append(line);
+    }
+    snprintf(line, sizeof(line),
+             "wrapperfs_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} "
+             "%llu\n"
+             "wrapperfs_op_latency_seconds_sum{op=\"%s\"} %.9f\n"
+             "wrapperfs_op_latency_seconds_count{op=\"%s\"} %llu\n",
+             op_names[op], static_cast<unsigned long long>(calls),  // NOLINT
+             op_names[op], stats.ns.value() / 1e9, op_names[op],
+             static_cast<unsigned long long>(calls));  // NOLINT
+    out->append(line);
+  }
+}
+
+}  // namespace
+
+MetricsServer metrics;
+
+MetricsServer::MetricsServer() : listen_fd_(-1) {
+  wakeup_[0] = wakeup_[1] = -1;
+}
+
+MetricsServer::~MetricsServer() {
+  stop();
+  if (listen_fd_ != -1) {
+    close(listen_fd_);
+    if (!unix_path_.empty()) {
+      unlink(unix_path_.c_str());
+    }
+  }
+}
+
+int MetricsServer::listen(const string &address) {
+  int fd;
+  if (!address.empty() && address[0] == '/') {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (address.size() >= sizeof(addr.sun_path)) {
+      return -ENAMETOOLONG;
+    }
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+    // A socket left behind by an earlier mount would fail bind().
+    struct stat stbuf;
+    if (lstat(address.c_str(), &stbuf) == 0 && S_ISSOCK(stbuf.st_mode)) {
+      unlink(address.c_str());
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      return -errno;
+    }
+    // Stats reveal what the mount is used for, so only the owner may ask.
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) == -1 || chmod(address.c_str(), 0600) == -1) {
+      int err = -errno;
+      close(fd);
+      return err;
+    }
+    unix_path_ = address;
+  } else {
+    // Only loopback: the endpoint has no authentication.
+    string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != string::npos) {
+      string host = address.substr(0, colon);
+      if (host != "127.0.0.1" && host != "localhost") {
+        return -EINVAL;
+      }
+      port = address.substr(colon + 1);
+    }
+    char *end;
+    long number = strtol(port.c_str(), &end, 10);  // NOLINT
+    if (port.empty() || *end || number <= 0 || number > 65535) {
+      return -EINVAL;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(number);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      return -errno;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) == -1) {
+      int err = -errno;
+      close(fd);
+      return err;
+    }
+  }
+  if (::listen(fd, 16) == -1 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  listen_fd_ = fd;
+  return 0;
+}
+
+void MetricsServer::adopt(int fd, const string &address) {
+  listen_fd_ = fd;
+  if (!address.empty() && address[0] == '/') {
+    unix_path_ = address;
+  }
+}
+
+void MetricsServer::add_collector(const Collector &collector) {
+  collectors_.push_back(collector);
+}
+
+void MetricsServer::start() {
+  if (listen_fd_ == -1 || pipe2(wakeup_, O_CLOEXEC) == -1) {
+    return;
+  }
+  server_ = std::thread(&MetricsServer::serve, this);
+}
+
+void MetricsServer::stop() {
+  if (!server_.joinable()) {
+    return;
+  }
+  char byte = 0;
+  while (write(wakeup_[1], &byte, 1) == -1 && errno == EINTR) {
+  }
+  server_.join();
+  close(wakeup_[0]);
+  close(wakeup_[1]);
+  wakeup_[0] = wakeup_[1] = -1;
+}
+
+void MetricsServer::render(string *out) const {
+  stats_for_each([out](const Counter &counter) {
+    string name = metric_name(counter.name()) + "_total";
+    char value[32];
+    snprintf(value, sizeof(value), " %llu\n",
+             static_cast<unsigned long long>(counter.value()));  // NOLINT
+    out->append("# TYPE " + name + " counter\n" + name + value);
+  });
+  render_latency(out);
+  for (const auto &collector : collectors_) {
+    collector(out);
+  }
+}
+
+void MetricsServer::serve() {
+  std::vector<Client> clients;
+  while (true) {
+    std::vector<struct pollfd> fds;
+    fds.push_back({ wakeup_[0], POLLIN, 0 });
+    fds.push_back({ listen_fd_,
+                    static_cast<short>(clients.size() < kMaxClients ?  // NOLINT
+                                       POLLIN : 0), 0 });
+    for (const auto &client : clients) {
+      fds.push_back({ client.fd, static_cast<short>(  // NOLINT
+          client.response.empty() ? POLLIN : POLLOUT), 0 });
+    }
+    if (poll(&fds[0], fds.size(), 1000) == -1 && errno != EINTR) {
+      break;
+    }
+    if (fds[0].revents) {
+      break;
+    }
+    uint64_t now = now_ns();
+    std::vector<Client> open;
+    for (size_t i = 0; i < clients.size(); i++) {
+      Client &client = clients[i];
+      short revents = fds[i + 2].revents;  // NOLINT
+      bool done = now > client.deadline || (revents & (POLLERR | POLLNVAL));
+      if (!done && (revents & (POLLIN | POLLHUP)) &&
+          client.response.empty()) {
+        char buf[1024];
+        ssize_t n = recv(client.fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+          client.request.append(buf, n);
+        }
+        if (n == 0 || request_complete(client.request)) {
+          string body;
+          render(&body);
+          client.response = http_response(body);
+        } else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+          done = true;
+        }
+      }
+      if (!done && !client.response.empty() &&
+          (revents & POLLOUT || client.sent == 0)) {
+        ssize_t n = send(client.fd, client.response.data() + client.sent,
+                         client.response.size() - client.sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+          client.sent += n;
+        }
+        done = client.sent == client.response.size() ||
+            (n == -1 && errno != EAGAIN && errno != EINTR);
+      }
+      if (done) {
+        close(client.fd);
+      } else {
+        open.push_back(client);
+      }
+    }
+    clients.swap(open);
+    if (fds[1].revents & POLLIN) {
+      int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd != -1) {
+        clients.push_back({ fd, string(), string(), 0,
+                            now + kIdleTimeoutNs });
+      }
+    }
+  }
+  for (const auto &client : clients) {
+    close(client.fd);
+  }
+}
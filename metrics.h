@@ -0,0 +1,77 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Metrics endpoint in the Prometheus text exposition format.
+ *
+ * A single thread serves every connection to a Unix domain socket or a
+ * loopback TCP port: it reads a request up to its blank line (or EOF),
+ * answers with an HTTP/1.0 response holding the metrics and closes the
+ * connection, so both "curl --unix-socket" and a scraper work. Metrics
+ * are rendered from the counter registry, which is read without locking
+ * the threads updating it, and from collectors added by other modules.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+class MetricsServer {
+ public:
+  /// Appends samples, with their "# TYPE" lines, to 'out'.
+  typedef std::function<void(std::string *out)> Collector;
+
+  MetricsServer();
+  ~MetricsServer();
+
+  /// Binds to 'address': an absolute path for a Unix domain socket, or
+  /// "PORT" or "127.0.0.1:PORT" for loopback TCP. Returns 0 or -errno.
+  int listen(const std::string &address);
+
+  /// Serves on 'fd', a socket bound to 'address' by another process.
+  void adopt(int fd, const std::string &address);
+
+  /// The listening socket, or -1.
+  int fd() const {
+    return listen_fd_;
+  }
+
+  void add_collector(const Collector &collector);
+
+  /// Starts and stops the serving thread.
+  void start();
+  void stop();
+
+  /// Renders every metric.
+  void render(std::string *out) const;
+
+ private:
+  void serve();
+
+  int listen_fd_;
+  int wakeup_[2];  ///< Pipe that interrupts serve() on stop().
+  std::string unix_path_;
+  std::vector<Collector> collectors_;
+  std::thread server_;
+};
+
+extern MetricsServer metrics;
+
+#endif  // METRICS_H_
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./nullfs.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace {
+
+bool is_root(const char *path) {
+  return strcmp(path, "/") == 0;
+}
+
+}  // namespace
+
+NullFs::NullFs(uint64_t file_size)
+    : file_size_(file_size), uid_(getuid()), gid_(getgid()) {
+  clock_gettime(CLOCK_REALTIME, &mount_time_);
+}
+
+int NullFs::getattr(const char *path, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(*stbuf));
+  if (is_root(path)) {
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+  } else {
+    stbuf->st_mode = S_IFREG | 0666;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = file_size_;
+  }
+  stbuf->st_uid = uid_;
+  stbuf->st_gid = gid_;
+  stbuf->st_blksize = 4096;
+  stbuf->st_atim = stbuf->st_mtim = stbuf->st_ctim = mount_time_;
+  return 0;
+}
+
+int NullFs::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                    off_t offset) {
+  (void) offset;
+  if (!is_root(path)) {
+    return -ENOTDIR;
+  }
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  return 0;
+}
+
+int NullFs::access(const char *path, int mask) {
+  (void) path;
+  (void) mask;
+  return 0;
+}
+
+int NullFs::readlink(const char *path, char *buf, size_t size) {
+  (void) path;
+  (void) buf;
+  (void) size;
+  return -EINVAL;
+}
+
+int NullFs::mkdir(const char *path, mode_t mode) {
+  (void) path;
+  (void) mode;
+  return -EPERM;
+}
+
+int NullFs::rmdir(const char *path) {
+  return is_root(path) ? -EBUSY : -ENOTDIR;
+}
+
+int NullFs::unlink(const char *path) {
+  return is_root(path) ? -EISDIR : 0;
+}
+
+int NullFs::rename(const char *oldpath, const char *newpath) {
+  return is_root(oldpath) || is_root(newpath) ? -EBUSY : 0;
+}
+
+int NullFs::link(const char *oldpath, const char *newpath) {
+  (void) oldpath;
+  (void) newpath;
+  return -EPERM;
+}
+
+int NullFs::symlink(const char *target, const char *path) {
+  (void) target;
+  (void) path;
+  return -EPERM;
+}
+
+int NullFs::chmod(const char *path, mode_t mode) {
+  (void) path;
+  (void) mode;
+  return 0;
+}
+
+int NullFs::chown(const char *path, uid_t owner, gid_t group) {
+  (void) path;
+  (void) owner;
+  (void) group;
+  return 0;
+}
+
+int NullFs::utimens(const char *path, const struct timespec tv[2]) {
+  (void) path;
+  (void) tv;
+  return 0;
+}
+
+int NullFs::truncate(const char *path, off_t length) {
+  (void) length;
+  return is_root(path) ? -EISDIR : 0;
+}
+
+int NullFs::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  (void) mode;
+  return open(path, fi);
+}
+
+int NullFs::open(const char *path, struct fuse_file_info *fi) {
+  fi->fh = 0;
+  return is_root(path) ? -EISDIR : 0;
+}
+
+int NullFs::release(struct fuse_file_info *fi) {
+  (void) fi;
+  return 0;
+}
+
+int NullFs::read(char *buf, size_t size, off_t offset,
+                 struct fuse_file_info *fi) {
+  (void) fi;
+  if (static_cast<uint64_t>(offset) >= file_size_) {
+    return 0;
+  }
+  size = std::min<uint64_t>(size, file_size_ - offset);
+  memset(buf, 0, size);
+  return size;
+}
+
+int NullFs::write(const char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+  (void) buf;
+  (void) offset;
+  (void) fi;
+  return size;
+}
+
+int NullFs::fsync(int datasync, struct fuse_file_info *fi) {
+  (void) datasync;
+  (void) fi;
+  return 0;
+}
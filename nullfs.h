@@ -0,0 +1,71 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Backend that stores nothing.
+ *
+ * The root directory is empty, yet every other path names a regular file
+ * of 'file_size' bytes. Writes and namespace changes are accepted and
+ * discarded, and reads return zeros. Benchmarks against it measure the
+ * cost of FUSE itself, the floor under every other backend.
+ */
+
+#ifndef NULLFS_H_
+#define NULLFS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "./backend.h"
+
+class NullFs : public Backend {
+ public:
+  explicit NullFs(uint64_t file_size);
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  uint64_t file_size_;
+  uid_t uid_;
+  gid_t gid_;
+  struct timespec mount_time_;
+};
+
+#endif  // NULLFS_H_
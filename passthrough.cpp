@@ -0,0 +1,576 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./passthrough.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include "./probes.h"
+#include "./tunables.h"
+
+using std::string;
+
+#define CALL_RETURN(x) return (x) == -1 ? -errno : 0;
+
+// Makes the backing syscall 'call' on a path between the syscall probes.
+#define PROBED(name, call) probed(name, -1, [&] { return call; })
+
+namespace {
+
+/// Runs 'call', a syscall returning -1 and setting errno on failure,
+/// between the syscall_entry and syscall_return probes (see probes.h).
+template <typename Call>
+auto probed(const char *name, int fd, Call call) -> decltype(call()) {
+  WRAPPERFS_PROBE4(syscall_entry, name, fd, 0, 0);
+  auto ret = call();
+  WRAPPERFS_PROBE2(syscall_return, name,
+                   ret == -1 ? -errno : static_cast<int64_t>(ret));
+  return ret;
+}
+
+}  // namespace
+
+// Copies a file shared with snapshots before it is changed.
+#define PRESERVE(abs) \
+  if (snapshots_) { \
+    int err = snapshots_->preserve(abs); \
+    if (err) return err; \
+  }
+
+// Lets a snapshot being taken copy the parents of an entry first.
+#define PRESERVE_NAME(abs) \
+  if (snapshots_) snapshots_->preserve_name(abs);
+
+// Snapshots are read-only.
+#define REJECT_SNAPSHOT(path) \
+  if (snapshots_ && Snapshots::owns(path)) return -EROFS;
+
+PassthroughFs::PassthroughFs(const string &basedir, int fanout_levels)
+    : basedir_(basedir), fanout_(fanout_levels), logstore_(NULL),
+      lazy_times_(NULL), lazy_interval_ms_(0), snapshots_(NULL) {
+}
+
+PassthroughFs::~PassthroughFs() {
+  delete snapshots_;
+  delete lazy_times_;
+  delete logstore_;
+}
+
+int PassthroughFs::enable_logdata() {
+  string private_dir = basedir_ + "/.wrapperfs";
+  if (::mkdir(private_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  logstore_ = new LogStore;
+  return logstore_->init(private_dir + "/log");
+}
+
+void PassthroughFs::enable_lazy_times(unsigned interval_ms) {
+  lazy_times_ = new LazyTimes;
+  lazy_interval_ms_ = interval_ms;
+}
+
+int PassthroughFs::enable_snapshots() {
+  string private_dir = basedir_ + "/.wrapperfs";
+  if (::mkdir(private_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  snapshots_ = new Snapshots(basedir_, fanout_);
+  snapshots_->flush = [this] {
+    return lazy_times_ ? lazy_times_->flush_all() : 0;
+  };
+  return snapshots_->init();
+}
+
+void PassthroughFs::start() {
+  if (logstore_) {
+    logstore_->start_cleaner();
+  }
+  if (lazy_times_) {
+    lazy_times_->start(lazy_interval_ms_);
+  }
+}
+
+void PassthroughFs::stop() {
+  if (lazy_times_) {
+    lazy_times_->stop();
+  }
+  if (logstore_) {
+    logstore_->stop_cleaner();
+    logstore_->sync();
+  }
+}
+
+int PassthroughFs::sync() {
+  int ret = lazy_times_ ? lazy_times_->flush_all() : 0;
+  if (logstore_) {
+    int err = logstore_->sync();
+    ret = ret ? ret : err;
+  }
+  return ret;
+}
+
+int PassthroughFs::compact() {
+  if (logstore_) {
+    while (logstore_->clean_one(tunables().clean_live_ratio)) {
+    }
+  }
+  return 0;
+}
+
+string PassthroughFs::abspath(const string &path) const {
+  if (snapshots_ && Snapshots::owns(path.c_str())) {
+    return snapshots_->abspath(path);
+  }
+  return fanout_.map(basedir_, path);
+}
+
+int PassthroughFs::backing_fd(const struct fuse_file_info *fi) const {
+  if (logstore_) {
+    return reinterpret_cast<LogHandle*>(fi->fh)->fd;
+  }
+  return fi->fh;
+}
+
+void PassthroughFs::flush_parent(const string &abspath) {
+  if (lazy_times_) {
+    lazy_times_->flush(abspath.substr(0, abspath.rfind('/')));
+  }
+}
+
+template <typename Op>
+int PassthroughFs::make(const string &abspath, Op op) {
+  int ret = op();
+  if (ret == -1 && errno == ENOENT && fanout_.enabled() &&
+      fanout_.make_shards(abspath) == 0) {
+    ret = op();
+  }
+  return ret;
+}
+
+int PassthroughFs::set_fh(int fd, struct fuse_file_info *fi) {
+  if (!logstore_) {
+    fi->fh = fd;
+    return 0;
+  }
+  struct stat stbuf;
+  int ret = probed("fstat", fd, [&] {
+    return fstat(fd, &stbuf);
+  }) == -1 ? -errno : 0;
+  if (!ret) {
+    ret = logstore_->open(stbuf.st_ino, stbuf.st_size);
+  }
+  if (ret) {
+    probed("close", fd, [&] { return close(fd); });
+    return ret;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(new LogHandle{fd, stbuf.st_ino});
+  return 0;
+}
+
+uint64_t PassthroughFs::last_link(const string &abspath) const {
+  struct stat stbuf;
+  if (!logstore_ || PROBED("lstat", lstat(abspath.c_str(), &stbuf)) == -1 ||
+      !S_ISREG(stbuf.st_mode) || stbuf.st_nlink != 1) {
+    return 0;
+  }
+  return stbuf.st_ino;
+}
+
+int PassthroughFs::getattr(const char *path, struct stat *stbuf) {
+  string abs = abspath(path);
+  if (PROBED("stat", ::stat(abs.c_str(), stbuf)) == -1) {
+    return -errno;
+  }
+  if (lazy_times_) {
+    lazy_times_->get(abs, stbuf);
+  }
+  if (fanout_.enabled() && S_ISDIR(stbuf->st_mode)) {
+    // The backing link count reflects shards, not subdirectories; 1 tells
+    // tools such as find(1) not to rely on it.
+    stbuf->st_nlink = 1;
+  }
+  if (snapshots_ && S_ISREG(stbuf->st_mode) && stbuf->st_nlink > 1 &&
+      !Snapshots::owns(path)) {
+    // Not the links that snapshots hold until the file changes.
+    nlink_t links = snapshots_->links(stbuf->st_ino);
+    stbuf->st_nlink = links < stbuf->st_nlink ? stbuf->st_nlink - links : 1;
+  }
+  return 0;
+}
+
+int PassthroughFs::readdir(const char *path, void *buf,
+                           fuse_fill_dir_t filler, off_t offset) {
+  string abs = abspath(path);
+  bool listing_snapshots = snapshots_ && strcmp(path, Snapshots::kDir) == 0;
+  if (fanout_.enabled() && !listing_snapshots) {
+    return fanout_.readdir(abs, buf, filler, offset);
+  }
+
+  WRAPPERFS_PROBE4(syscall_entry, "opendir", -1, 0, 0);
+  DIR *dirp = opendir(abs.c_str());
+  WRAPPERFS_PROBE2(syscall_return, "opendir", dirp == NULL ? -errno : 0);
+  if (dirp == NULL) {
+    return -errno;
+  }
+
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+
+  // BASEDIR/.wrapperfs holds private state and is shadowed by ctlfs.
+  bool is_root = strcmp(path, "/") == 0;
+  struct dirent *dp;
+  while ((dp = ::readdir(dirp)) != NULL) {
+    if (is_root && strcmp(dp->d_name, ".wrapperfs") == 0) {
+      continue;
+    } else if (listing_snapshots && dp->d_name[0] == '.') {
+      continue;  // ".", ".." and snapshots being taken or removed
+    }
+    filler(buf, dp->d_name, NULL, 0);
+  }
+  closedir(dirp);
+  return 0;
+}
+
+int PassthroughFs::access(const char *path, int mask) {
+  if (mask & W_OK) {
+    REJECT_SNAPSHOT(path);
+  }
+  string abs = abspath(path);
+  CALL_RETURN(PROBED("access", ::access(abs.c_str(), mask)));
+}
+
+int PassthroughFs::readlink(const char *path, char *buf, size_t size) {
+  if (size == 0) {
+    return -EINVAL;  // No room even for the terminating NUL.
+  }
+  string abs = abspath(path);
+  ssize_t len = PROBED("readlink", ::readlink(abs.c_str(), buf, size - 1));
+  if (len == -1) {
+    return -errno;
+  }
+  buf[len] = '\0';
+  return 0;
+}
+
+int PassthroughFs::mkdir(const char *path, mode_t mode) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE_NAME(abs);
+  flush_parent(abs);
+  CALL_RETURN(make(abs, [&] {
+    return PROBED("mkdir", ::mkdir(abs.c_str(), mode));
+  }));
+}
+
+int PassthroughFs::rmdir(const char *path) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE_NAME(abs);
+  flush_parent(abs);
+  int ret;
+  if (fanout_.enabled()) {
+    ret = fanout_.rmdir(abs);
+  } else {
+    ret = PROBED("rmdir", ::rmdir(abs.c_str())) == -1 ? -errno : 0;
+  }
+  if (!ret && lazy_times_) {
+    lazy_times_->forget(abs, true);
+  }
+  return ret;
+}
+
+int PassthroughFs::unlink(const char *path) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE_NAME(abs);
+  flush_parent(abs);
+  if (lazy_times_) {
+    // For the other links of the file, if any.
+    lazy_times_->flush(abs);
+  }
+  uint64_t dropped = last_link(abs);
+  if (PROBED("unlink", ::unlink(abs.c_str())) == -1) {
+    return -errno;
+  }
+  if (lazy_times_) {
+    lazy_times_->forget(abs);
+  }
+  return dropped ? logstore_->drop(dropped) : 0;
+}
+
+int PassthroughFs::rename(const char *oldpath, const char *newpath) {
+  REJECT_SNAPSHOT(oldpath);
+  REJECT_SNAPSHOT(newpath);
+  Snapshots::Writer writer(snapshots_);
+  string abs_oldpath = abspath(oldpath);
+  string abs_newpath = abspath(newpath);
+  uint64_t dropped = last_link(abs_newpath);
+  if (dropped && dropped == last_link(abs_oldpath)) {
+    dropped = 0;  // rename() onto itself
+  }
+  if (lazy_times_) {
+    // Written out under the names they were set on: a replaced 'newpath'
+    // may have other links.
+    lazy_times_->flush(abs_oldpath, true);
+    lazy_times_->flush(abs_newpath, true);
+    flush_parent(abs_oldpath);
+    flush_parent(abs_newpath);
+  }
+  auto op = [&] {
+    return make(abs_newpath, [&] {
+      return PROBED("rename",
+                    ::rename(abs_oldpath.c_str(), abs_newpath.c_str()));
+    });
+  };
+  int ret = snapshots_ ? snapshots_->rename(abs_oldpath, abs_newpath, op) :
+      op();
+  if (ret == -1) {
+    return -errno;
+  }
+  if (lazy_times_) {
+    lazy_times_->renamed(abs_oldpath, abs_newpath);
+  }
+  return dropped ? logstore_->drop(dropped) : 0;
+}
+
+int PassthroughFs::link(const char *oldpath, const char *newpath) {
+  REJECT_SNAPSHOT(oldpath);
+  REJECT_SNAPSHOT(newpath);
+  Snapshots::Writer writer(snapshots_);
+  string abs_oldpath = abspath(oldpath);
+  string abs_newpath = abspath(newpath);
+  PRESERVE_NAME(abs_newpath);
+  flush_parent(abs_newpath);
+  CALL_RETURN(make(abs_newpath, [&] {
+    return PROBED("link",
+                  ::link(abs_oldpath.c_str(), abs_newpath.c_str()));
+  }));
+}
+
+int PassthroughFs::symlink(const char *target, const char *path) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs_target;
+  /*
+   * FUSE pass out-of-partition source directory path as absolute path,
+   * and pass in-partition source directory as related path
+   */
+  if (target[0] == '/') {
+    abs_target = target;
+  } else {
+    abs_target = abspath(target);
+  }
+  string abs = abspath(path);
+  PRESERVE_NAME(abs);
+  flush_parent(abs);
+  CALL_RETURN(make(abs, [&] {
+    return PROBED("symlink", ::symlink(abs_target.c_str(), abs.c_str()));
+  }));
+}
+
+int PassthroughFs::chmod(const char *path, mode_t mode) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE(abs);
+  CALL_RETURN(PROBED("chmod", ::chmod(abs.c_str(), mode)));
+}
+
+int PassthroughFs::chown(const char *path, uid_t owner, gid_t group) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE(abs);
+  CALL_RETURN(PROBED("chown", ::chown(abs.c_str(), owner, group)));
+}
+
+int PassthroughFs::utimens(const char *path, const struct timespec tv[2]) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE(abs);
+  if (lazy_times_) {
+    lazy_times_->set(abs, tv);
+    return 0;
+  }
+  CALL_RETURN(PROBED("utimensat", utimensat(AT_FDCWD, abs.c_str(), tv, 0)));
+}
+
+int PassthroughFs::truncate(const char *path, off_t length) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE(abs);
+  if (lazy_times_) {
+    lazy_times_->flush(abs);
+  }
+  if (logstore_) {
+    struct stat stbuf;
+    if (PROBED("stat", ::stat(abs.c_str(), &stbuf)) == -1) {
+      return -errno;
+    }
+    int ret = logstore_->truncate(stbuf.st_ino, length);
+    if (ret) {
+      return ret;
+    }
+  }
+  CALL_RETURN(PROBED("truncate", ::truncate(abs.c_str(), length)));
+}
+
+int PassthroughFs::create(const char *path, mode_t mode,
+                          struct fuse_file_info *fi) {
+  REJECT_SNAPSHOT(path);
+  Snapshots::Writer writer(snapshots_);
+  string abs = abspath(path);
+  PRESERVE_NAME(abs);
+  flush_parent(abs);
+  int fd = make(abs, [&] {
+    return PROBED("creat", creat(abs.c_str(), mode));
+  });
+  if (fd == -1) {
+    return -errno;
+  }
+  if (snapshots_) {
+    snapshots_->created(fd);
+  }
+  int ret = set_fh(fd, fi);
+  if (!ret && lazy_times_) {
+    lazy_times_->opened(fd, abs);
+  }
+  return ret;
+}
+
+int PassthroughFs::open(const char *path, struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+    REJECT_SNAPSHOT(path);
+  }
+  Snapshots::Writer writer(fi->flags & O_TRUNC ? snapshots_ : NULL);
+  string abs = abspath(path);
+  if (fi->flags & O_TRUNC) {
+    PRESERVE(abs);
+  }
+  if (lazy_times_ && (fi->flags & O_TRUNC)) {
+    lazy_times_->flush(abs);
+  }
+  int fd = PROBED("open", ::open(abs.c_str(), fi->flags));
+  if (fd == -1) {
+    return -errno;
+  }
+  int ret = set_fh(fd, fi);
+  if (!ret && lazy_times_) {
+    lazy_times_->opened(fd, abs);
+  }
+  return ret;
+}
+
+int PassthroughFs::open_backing(const char *path, int flags) {
+  if (logstore_) {
+    return -ENOTSUP;
+  }
+  // Never a symlink: a client could plant one under a name it asked for.
+  string abs = abspath(path);
+  int fd = PROBED("open", ::open(abs.c_str(),
+                                 flags | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY));
+  return fd == -1 ? -errno : fd;
+}
+
+int PassthroughFs::release(struct fuse_file_info *fi) {
+  if (lazy_times_) {
+    lazy_times_->closed(backing_fd(fi));
+  }
+  if (logstore_) {
+    LogHandle *handle = reinterpret_cast<LogHandle*>(fi->fh);
+    logstore_->release(handle->id);
+    int fd = handle->fd;
+    delete handle;
+    CALL_RETURN(probed("close", fd, [&] { return close(fd); }));
+  }
+  CALL_RETURN(probed("close", fi->fh, [&] { return close(fi->fh); }));
+}
+
+int PassthroughFs::read(char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi) {
+  if (logstore_) {
+    LogHandle *handle = reinterpret_cast<LogHandle*>(fi->fh);
+    return logstore_->read(handle->id, handle->fd, buf, size, offset);
+  }
+  WRAPPERFS_PROBE4(syscall_entry, "pread", fi->fh, size, offset);
+  ssize_t nread = pread(fi->fh, buf, size, offset);
+  WRAPPERFS_PROBE2(syscall_return, "pread", nread == -1 ? -errno : nread);
+  if (nread == -1) {
+    return -errno;
+  }
+  return nread;
+}
+
+int PassthroughFs::write(const char *buf, size_t size, off_t offset,
+                         struct fuse_file_info *fi) {
+  Snapshots::Writer writer(snapshots_);
+  if (snapshots_) {
+    int ret = snapshots_->preserve_fd(backing_fd(fi));
+    if (ret) {
+      return ret;
+    }
+  }
+  if (lazy_times_) {
+    // The write sets mtime; times set before it must not override that.
+    lazy_times_->flush_fd(backing_fd(fi));
+  }
+  if (logstore_) {
+    LogHandle *handle = reinterpret_cast<LogHandle*>(fi->fh);
+    return logstore_->write(handle->id, handle->fd, buf, size, offset);
+  }
+  WRAPPERFS_PROBE4(syscall_entry, "pwrite", fi->fh, size, offset);
+  ssize_t nwrite = pwrite(fi->fh, buf, size, offset);
+  WRAPPERFS_PROBE2(syscall_return, "pwrite",
+                   nwrite == -1 ? -errno : nwrite);
+  if (nwrite == -1) {
+    return -errno;
+  }
+  return nwrite;
+}
+
+int PassthroughFs::fsync(int datasync, struct fuse_file_info *fi) {
+  if (lazy_times_) {
+    lazy_times_->flush_fd(backing_fd(fi));
+  }
+  if (logstore_) {
+    // File data lives in the log; the placeholder only carries metadata.
+    LogHandle *handle = reinterpret_cast<LogHandle*>(fi->fh);
+    int ret = logstore_->sync();
+    if (ret) {
+      return ret;
+    }
+    CALL_RETURN(datasync ? 0 : probed("fsync", handle->fd, [&] {
+      return ::fsync(handle->fd);
+    }));
+  }
+  WRAPPERFS_PROBE4(syscall_entry, datasync ? "fdatasync" : "fsync",
+                   fi->fh, 0, 0);
+  int ret = datasync ? fdatasync(fi->fh) : ::fsync(fi->fh);
+  ret = ret == -1 ? -errno : 0;
+  WRAPPERFS_PROBE2(syscall_return, datasync ? "fdatasync" : "fsync", ret);
+  return ret;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Backend that mirrors a directory of the host file system.
+ *
+ * Every operation is forwarded to the same path under 'basedir', optionally
+ * through a hash-sharded FanoutLayout. With a LogStore attached, file data
+ * is appended to the log and the backing files only carry the namespace,
+ * attributes and size.
+ */
+
+#ifndef PASSTHROUGH_H_
+#define PASSTHROUGH_H_
+
+#include <stdint.h>
+#include <string>
+#include "./backend.h"
+#include "./fanout.h"
+#include "./lazytimes.h"
+#include "./logstore.h"
+#include "./snapshot.h"
+
+class PassthroughFs : public Backend {
+ public:
+  PassthroughFs(const std::string &basedir, int fanout_levels);
+  ~PassthroughFs();
+
+  /// Sends file data through a log under BASEDIR/.wrapperfs/log.
+  int enable_logdata();
+
+  /// Returns the data log, or NULL without enable_logdata().
+  LogStore *logstore() const { return logstore_; }
+
+  /// Defers utimens, writing the times out every 'interval_ms' or before
+  /// they could be overwritten (see lazytimes.h).
+  void enable_lazy_times(unsigned interval_ms);
+
+  /// Serves read-only snapshots of the tree under /.snapshots, kept in
+  /// BASEDIR/.wrapperfs/snapshots (see snapshot.h).
+  int enable_snapshots();
+
+  /// Returns the snapshots, or NULL without enable_snapshots().
+  Snapshots *snapshots() const { return snapshots_; }
+
+  void start() override;
+  void stop() override;
+
+  /// Syncs the data log, if any, and writes out deferred times.
+  int sync() override;
+
+  /// Cleans every log segment below the clean_live_ratio tunable.
+  int compact() override;
+
+  /// Not with a data log, whose backing files only hold the namespace.
+  int open_backing(const char *path, int flags) override;
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  /// File handle in logdata mode.
+  struct LogHandle {
+    int fd;
+    uint64_t id;  ///< backing inode number
+  };
+
+  std::string abspath(const std::string &path) const;
+
+  /// The backing descriptor behind 'fi'.
+  int backing_fd(const struct fuse_file_info *fi) const;
+
+  /// Writes out the deferred times of the directory holding 'abspath',
+  /// before an entry in it is added or removed.
+  void flush_parent(const std::string &abspath);
+
+  /// Runs 'op', which creates 'abspath' and returns -1 on failure. In
+  /// fanout mode the shard directories are only created on ENOENT.
+  template <typename Op>
+  int make(const std::string &abspath, Op op);
+
+  /// Stores the backing 'fd' in 'fi', wrapped in a LogHandle if needed.
+  int set_fh(int fd, struct fuse_file_info *fi);
+
+  /// Returns the inode number of the regular file at 'abspath' if removing
+  /// that name drops its last link, so that its logged data can be dropped.
+  uint64_t last_link(const std::string &abspath) const;
+
+  std::string basedir_;
+  FanoutLayout fanout_;
+  LogStore *logstore_;
+  LazyTimes *lazy_times_;  ///< NULL unless enable_lazy_times()
+  unsigned lazy_interval_ms_;
+  Snapshots *snapshots_;  ///< NULL unless enable_snapshots()
+};
+
+#endif  // PASSTHROUGH_H_
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief USDT probes for tracing with bpftrace, perf or SystemTap.
+ *
+ * When built with <sys/sdt.h> the probes below are compiled in as a single
+ * nop each, plus an ELF note that tracers use to find the probe sites and
+ * their arguments; without it they compile to nothing. Their provider is
+ * "wrapperfs" and their argument layouts are stable:
+ *
+ *   op_entry(const char *op, const char *path, uint64_t size,
+ *            int64_t offset)
+ *   op_return(const char *op, const char *path, int result)
+ *     Around every wrapperfs_* handler. 'op' is the handler name without
+ *     prefix; 'size' and 'offset' are 0 where the operation has none.
+ *   syscall_entry(const char *name, int fd, uint64_t size, int64_t offset)
+ *   syscall_return(const char *name, int64_t result)
+ *     Around every syscall the passthrough backend makes on its own,
+ *     named after it ("pread", "stat", "rename", ...). 'fd' is -1 for
+ *     calls by path; 'size' and 'offset' are 0 except for "pread" and
+ *     "pwrite". 'result' is -errno on failure.
+ *   device_wait(uint64_t type, uint64_t addr, uint64_t size, uint64_t ns)
+ *     An emulated device (--device) delays an I/O by 'ns'; 'type' is a
+ *     DeviceModel::IoType.
+ *   qos_throttle(uint64_t tenant, uint64_t bytes, uint64_t ns)
+ *     A tenant (--qos) waits 'ns' for its token buckets.
+ *
+ * Ready-made bpftrace scripts are in bpftrace/.
+ */
+
+#ifndef PROBES_H_
+#define PROBES_H_
+
+#include "./config.h"
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define WRAPPERFS_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2(wrapperfs, name, a1, a2)
+#define WRAPPERFS_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(wrapperfs, name, a1, a2, a3)
+#define WRAPPERFS_PROBE4(name, a1, a2, a3, a4) \
+  DTRACE_PROBE4(wrapperfs, name, a1, a2, a3, a4)
+#else
+#define WRAPPERFS_PROBE2(name, a1, a2)
+#define WRAPPERFS_PROBE3(name, a1, a2, a3)
+#define WRAPPERFS_PROBE4(name, a1, a2, a3, a4)
+#endif
+
+#endif  // PROBES_H_
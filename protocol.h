@@ -0,0 +1,169 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief The parts of the FUSE kernel protocol (linux/fuse.h) that the
+ * request loop looks into.
+ *
+ * libfuse parses requests itself; these are only for code that classifies
+ * or rewrites them on the way. The layouts are those of protocol 7.12 and
+ * later, and are the same on every platform FUSE runs on.
+ */
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum FuseOpcode {
+  kFuseLookup = 1,
+  kFuseForget = 2,
+  kFuseGetattr = 3,
+  kFuseSetattr = 4,
+  kFuseSymlink = 6,
+  kFuseMknod = 8,
+  kFuseMkdir = 9,
+  kFuseUnlink = 10,
+  kFuseRmdir = 11,
+  kFuseRename = 12,
+  kFuseLink = 13,
+  kFuseOpen = 14,
+  kFuseRead = 15,
+  kFuseWrite = 16,
+  kFuseRelease = 18,
+  kFuseFsync = 20,
+  kFuseFlush = 25,
+  kFuseInit = 26,
+  kFuseOpendir = 27,
+  kFuseReaddir = 28,
+  kFuseReleasedir = 29,
+  kFuseFsyncdir = 30,
+  kFuseGetlk = 31,
+  kFuseSetlk = 32,
+  kFuseSetlkw = 33,
+  kFuseCreate = 35,
+  kFuseIoctl = 39,
+  kFusePoll = 40,
+  kFuseBatchForget = 42,
+  kFuseFallocate = 43,
+  kFuseReaddirplus = 44,
+  kFuseLseek = 46,
+};
+
+/// Node id of the root directory.
+const uint64_t kFuseRootId = 1;
+
+/// fuse_getattr_in.getattr_flags: fh is valid.
+const uint32_t kFuseGetattrFh = 1;
+
+/// fuse_setattr_in.valid: fh is valid.
+const uint32_t kFuseFattrFh = 1 << 3;
+
+/// Header of every request (struct fuse_in_header).
+struct FuseInHeader {
+  uint32_t len;
+  uint32_t opcode;
+  uint64_t unique;
+  uint64_t nodeid;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t pid;
+  uint32_t padding;
+};
+
+/// Header of every reply (struct fuse_out_header).
+struct FuseOutHeader {
+  uint32_t len;
+  int32_t error;
+  uint64_t unique;
+};
+
+struct FuseInitIn {
+  uint32_t major;
+  uint32_t minor;
+  uint32_t max_readahead;
+  uint32_t flags;
+};
+
+struct FuseForgetIn {
+  uint64_t nlookup;
+};
+
+struct FuseForgetOne {
+  uint64_t nodeid;
+  uint64_t nlookup;
+};
+
+struct FuseBatchForgetIn {
+  uint32_t count;
+  uint32_t dummy;
+};
+
+/// Body of OPEN and OPENDIR.
+struct FuseOpenIn {
+  uint32_t flags;
+  uint32_t unused;
+};
+
+struct FuseCreateIn {
+  uint32_t flags;
+  uint32_t mode;
+  uint32_t umask;
+  uint32_t padding;
+};
+
+struct FuseMknodIn {
+  uint32_t mode;
+  uint32_t rdev;
+  uint32_t umask;
+  uint32_t padding;
+};
+
+struct FuseMkdirIn {
+  uint32_t mode;
+  uint32_t umask;
+};
+
+struct FuseRenameIn {
+  uint64_t newdir;
+};
+
+struct FuseLinkIn {
+  uint64_t oldnodeid;
+};
+
+/// Leading fields of fuse_getattr_in and fuse_setattr_in.
+struct FuseAttrIn {
+  uint32_t flags;
+  uint32_t padding;
+  uint64_t fh;
+};
+
+/// Leading fields of fuse_entry_out; the whole struct is kFuseEntryOutSize.
+struct FuseEntryOut {
+  uint64_t nodeid;
+  uint64_t generation;
+};
+
+const size_t kFuseEntryOutSize = 128;
+
+/// Leading field of fuse_open_out.
+struct FuseOpenOut {
+  uint64_t fh;
+};
+
+#endif  // PROTOCOL_H_
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./qos.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include <string>
+#include "./probes.h"
+#include "./timing.h"
+
+using std::string;
+
+QosScheduler qos;
+
+namespace {
+
+/// Idle tenants without explicit limits are forgotten beyond this many.
+const size_t kMaxTenants = 1024;
+
+/// Fair-queuing cost of an operation, in 4KiB units.
+double cost(uint64_t bytes) {
+  return 1.0 + bytes / 4096.0;
+}
+
+void append_limits(string *out, double iops, double mbps, double weight) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), " iops=%g mbps=%g weight=%g\n", iops, mbps,
+           weight);
+  out->append(buf);
+}
+
+}  // namespace
+
+QosScheduler::QosScheduler()
+    : key_(BY_UID), depth_(0), arrivals_(0), virtual_time_(0),
+      running_(0) {
+  default_limits_ = Limits{0, 0, 1};
+}
+
+void QosScheduler::init(Key key, int depth) {
+  key_ = key;
+  depth_ = depth;
+}
+
+int QosScheduler::configure(const string &text) {
+  Limits default_limits = {0, 0, 1};
+  std::map<uint64_t, Limits> limits;
+  std::istringstream lines(text);
+  string line;
+  while (std::getline(lines, line)) {
+    std::istringstream words(line);
+    string tenant;
+    if (!(words >> tenant) || tenant[0] == '#') {
+      continue;
+    }
+    Limits entry = {0, 0, 1};
+    string word;
+    while (words >> word) {
+      size_t eq = word.find('=');
+      char *end;
+      double value = eq == string::npos ? -1 :
+          strtod(word.c_str() + eq + 1, &end);
+      if (value < 0 || *end) {
+        return -EINVAL;
+      }
+      string name = word.substr(0, eq);
+      if (name == "iops") {
+        entry.iops = value;
+      } else if (name == "mbps") {
+        entry.mbps = value;
+      } else if (name == "weight" && value > 0) {
+        entry.weight = value;
+      } else {
+        return -EINVAL;
+      }
+    }
+    if (tenant == "default") {
+      default_limits = entry;
+    } else {
+      char *end;
+      uint64_t id = strtoull(tenant.c_str(), &end, 10);
+      if (*end) {
+        return -EINVAL;
+      }
+      limits[id] = entry;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  default_limits_ = default_limits;
+  limits_.swap(limits);
+  for (auto &it : tenants_) {
+    apply(it.second.get(), limits_for(it.first));
+  }
+  return 0;
+}
+
+const QosScheduler::Limits &QosScheduler::limits_for(uint64_t id) const {
+  auto it = limits_.find(id);
+  return it == limits_.end() ? default_limits_ : it->second;
+}
+
+void QosScheduler::apply(Tenant *tenant, const Limits &limits) {
+  // One second worth of tokens may be spent at once.
+  tenant->limits = limits;
+  tenant->iops.set_rate(limits.iops, limits.iops);
+  tenant->bytes_per_sec.set_rate(limits.mbps * 1e6, limits.mbps * 1e6);
+}
+
+std::shared_ptr<QosScheduler::Tenant> QosScheduler::tenant(uint64_t id,
+                                                           uint64_t now) {
+  auto it = tenants_.find(id);
+  if (it != tenants_.end()) {
+    it->second->last_used = now;
+    return it->second;
+  }
+  if (tenants_.size() >= kMaxTenants) {
+    // Typically short-lived pids: drop the least recently used one.
+    auto victim = tenants_.end();
+    for (auto t = tenants_.begin(); t != tenants_.end(); ++t) {
+      if (!limits_.count(t->first) && (victim == tenants_.end() ||
+          t->second->last_used < victim->second->last_used)) {
+        victim = t;
+      }
+    }
+    if (victim != tenants_.end()) {
+      tenants_.erase(victim);
+    }
+  }
+  std::shared_ptr<Tenant> tenant = std::make_shared<Tenant>();
+  apply(tenant.get(), limits_for(id));
+  tenant->last_used = now;
+  tenants_[id] = tenant;
+  return tenant;
+}
+
+void QosScheduler::begin(uint64_t bytes) {
+  struct fuse_context *ctx = fuse_get_context();
+  uint64_t id = key_ == BY_UID ? ctx->uid : ctx->pid;
+  uint64_t now = now_ns();
+  std::unique_lock<std::mutex> lock(mutex_);
+  std::shared_ptr<Tenant> t = tenant(id, now);
+  t->ops++;
+  t->bytes += bytes;
+  lock.unlock();
+
+  uint64_t ready = std::max(t->iops.reserve(1, now),
+                            t->bytes_per_sec.reserve(bytes, now));
+  if (ready > now) {
+    WRAPPERFS_PROBE3(qos_throttle, id, bytes, ready - now);
+    sleep_until_ns(ready);
+  }
+
+  lock.lock();
+  t->throttled_ns += ready - now;
+  if (depth_ <= 0) {
+    return;
+  }
+  double start = std::max(virtual_time_, t->finish_tag);
+  t->finish_tag = start + cost(bytes) / t->limits.weight;
+  if (running_ >= depth_ || !queue_.empty()) {
+    uint64_t queued = now_ns();
+    auto entry = queue_.insert(std::make_pair(
+        std::make_pair(t->finish_tag, arrivals_++), start)).first;
+    dispatched_.wait(lock, [&] {
+      return running_ < depth_ && queue_.begin() == entry;
+    });
+    queue_.erase(entry);
+    t->queued_ns += now_ns() - queued;
+    // Let the next one in line check whether a slot is still free.
+    dispatched_.notify_all();
+  }
+  virtual_time_ = start;
+  running_++;
+}
+
+void QosScheduler::end() {
+  if (depth_ <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(mutex_);
+  running_--;
+  dispatched_.notify_all();
+}
+
+void QosScheduler::report(string *out) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  char buf[160];
+  snprintf(buf, sizeof(buf), "# key %s depth %d running %d queued %zu\n",
+           key_ == BY_UID ? "uid" : "pid", depth_, running_, queue_.size());
+  out->append(buf);
+  out->append("default");
+  append_limits(out, default_limits_.iops, default_limits_.mbps,
+                default_limits_.weight);
+  for (const auto &it : limits_) {
+    out->append(std::to_string(it.first));
+    append_limits(out, it.second.iops, it.second.mbps, it.second.weight);
+  }
+  out->append("# tenant ops bytes throttled_ms queued_ms\n");
+  for (const auto &it : tenants_) {
+    const Tenant &t = *it.second;
+    snprintf(buf, sizeof(buf), "# %llu %llu %llu %.3f %.3f\n",
+             static_cast<unsigned long long>(it.first),  // NOLINT
+             static_cast<unsigned long long>(t.ops),  // NOLINT
+             static_cast<unsigned long long>(t.bytes),  // NOLINT
+             t.throttled_ns / 1e6, t.queued_ns / 1e6);
+    out->append(buf);
+  }
+}
+
+void QosScheduler::metrics(string *out) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  char buf[200];
+  snprintf(buf, sizeof(buf),
+           "# TYPE wrapperfs_qos_running gauge\n"
+           "wrapperfs_qos_running %d\n"
+           "# TYPE wrapperfs_qos_queued gauge\n"
+           "wrapperfs_qos_queued %zu\n"
+           "# TYPE wrapperfs_qos_tenants gauge\n"
+           "wrapperfs_qos_tenants %zu\n", running_, queue_.size(),
+           tenants_.size());
+  out->append(buf);
+}
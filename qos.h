@@ -0,0 +1,151 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Per-tenant I/O quality of service.
+ *
+ * Tenants are the uid or pid of the calling process (fuse_get_context()).
+ * Every read, write and fsync of a tenant first passes its token buckets,
+ * which cap its IOPS and bandwidth, and then a start-time fair queue that
+ * lets at most 'depth' operations reach the backend at once and shares
+ * them between tenants in proportion to their weights.
+ *
+ * Limits are set at runtime by writing lines of
+ *   TENANT [iops=N] [mbps=N] [weight=N]
+ * to /.wrapperfs/qos, where TENANT is a number or "default"; a write
+ * replaces the whole configuration and omitted limits are unlimited.
+ * Reading the file returns the configuration in the same form, followed by
+ * per-tenant counters as "#" comment lines, so it can be edited in place.
+ */
+
+#ifndef QOS_H_
+#define QOS_H_
+
+#include <fuse.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "./tokenbucket.h"
+
+class QosScheduler {
+ public:
+  enum Key { BY_UID, BY_PID };
+
+  QosScheduler();
+
+  /// Sets the tenant key and the number of operations allowed to run at
+  /// once (0 disables fair queuing).
+  ///
+  /// begin() blocks the calling thread, so it must run on a loop that
+  /// starts more threads when all are busy (fuse_loop_mt()), not on the
+  /// bounded pools of --split_queues.
+  void init(Key key, int depth);
+
+  /// Replaces the configuration with the parsed 'text'. Returns 0 or
+  /// -EINVAL, leaving the configuration unchanged.
+  int configure(const std::string &text);
+
+  /// Renders the configuration and per-tenant counters.
+  void report(std::string *out) const;
+
+  /// Renders the admitted and queued operations as Prometheus gauges.
+  void metrics(std::string *out) const;
+
+  /// Admits an operation of 'bytes' for the calling tenant, blocking while
+  /// it is throttled or queued; end() must follow once it is done.
+  void begin(uint64_t bytes);
+  void end();
+
+ private:
+  struct Limits {
+    double iops;
+    double mbps;
+    double weight;
+  };
+
+  struct Tenant {
+    Tenant() : finish_tag(0), ops(0), bytes(0), throttled_ns(0),
+               queued_ns(0), last_used(0) {}
+
+    Limits limits;
+    TokenBucket iops;
+    TokenBucket bytes_per_sec;
+    double finish_tag;  ///< Virtual finish time of its last operation.
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t throttled_ns;
+    uint64_t queued_ns;
+    uint64_t last_used;
+  };
+
+  /// Returns the tenant 'id', creating it if needed; caller holds mutex_.
+  std::shared_ptr<Tenant> tenant(uint64_t id, uint64_t now);
+  void apply(Tenant *tenant, const Limits &limits);
+  const Limits &limits_for(uint64_t id) const;
+
+  Key key_;
+  int depth_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable dispatched_;
+  Limits default_limits_;
+  std::map<uint64_t, Limits> limits_;
+  std::map<uint64_t, std::shared_ptr<Tenant>> tenants_;
+
+  /// Queued operations by (finish tag, arrival), mapped to start tags.
+  std::map<std::pair<double, uint64_t>, double> queue_;
+  uint64_t arrivals_;
+  double virtual_time_;
+  int running_;
+};
+
+extern QosScheduler qos;
+
+/**
+ * \brief Handler layer that sends data operations through 'qos'.
+ */
+template <class Next>
+struct QosLayer : Next {
+  class Admission {
+   public:
+    explicit Admission(uint64_t bytes) { qos.begin(bytes); }
+    ~Admission() { qos.end(); }
+  };
+
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    Admission admission(size);
+    return Next::read(path, buf, size, offset, fi);
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    Admission admission(size);
+    return Next::write(path, buf, size, offset, fi);
+  }
+
+  static int fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    Admission admission(0);
+    return Next::fsync(path, datasync, fi);
+  }
+};
+
+#endif  // QOS_H_
@@ -0,0 +1,517 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./ramfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+
+using std::string;
+
+namespace {
+
+struct timespec now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts;
+}
+
+/// Resizes 'data' to 'size' bytes; returns 0, -EFBIG past what it can
+/// hold, or -ENOSPC when out of memory.
+int resize(string *data, uint64_t size) {
+  if (size > data->max_size()) {
+    return -EFBIG;
+  }
+  try {
+    data->resize(size);
+  } catch (const std::bad_alloc &) {
+    return -ENOSPC;
+  }
+  return 0;
+}
+
+/// Holds lock_ for reading or writing for the current scope.
+class ScopedLock {
+ public:
+  ScopedLock(pthread_rwlock_t *lock, bool write) : lock_(lock) {
+    if (write) {
+      pthread_rwlock_wrlock(lock_);
+    } else {
+      pthread_rwlock_rdlock(lock_);
+    }
+  }
+  ~ScopedLock() { pthread_rwlock_unlock(lock_); }
+
+ private:
+  pthread_rwlock_t *lock_;
+};
+
+}  // namespace
+
+RamFs::RamFs() : root_(std::make_shared<Node>()), next_ino_(1) {
+  pthread_rwlock_init(&lock_, NULL);
+  // fuse_get_context() is not valid before the mount, so new_node() can
+  // not be used here.
+  root_->ino = next_ino_++;
+  root_->mode = S_IFDIR | 0755;
+  root_->uid = getuid();
+  root_->gid = getgid();
+  root_->nlink = 2;
+  root_->atime = root_->mtime = root_->ctime = now();
+}
+
+RamFs::~RamFs() {
+  pthread_rwlock_destroy(&lock_);
+}
+
+RamFs::NodePtr RamFs::new_node(mode_t mode) {
+  NodePtr node = std::make_shared<Node>();
+  node->ino = next_ino_++;
+  node->mode = mode;
+  struct fuse_context *ctx = fuse_get_context();
+  node->uid = ctx->uid;
+  node->gid = ctx->gid;
+  node->nlink = S_ISDIR(mode) ? 2 : 1;
+  node->atime = node->mtime = node->ctime = now();
+  return node;
+}
+
+RamFs::NodePtr RamFs::lookup(const string &path) const {
+  NodePtr node = root_;
+  size_t pos = 0;
+  while (node && pos < path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos) {
+      next = path.size();
+    }
+    if (next > pos) {
+      if (!S_ISDIR(node->mode)) {
+        return NodePtr();
+      }
+      auto it = node->children.find(path.substr(pos, next - pos));
+      node = it == node->children.end() ? NodePtr() : it->second;
+    }
+    pos = next + 1;
+  }
+  return node;
+}
+
+int RamFs::lookup_parent(const string &path, NodePtr *parent,
+                         string *name) const {
+  size_t end = path.find_last_not_of('/');
+  if (end == string::npos) {
+    return -EBUSY;  // the root itself
+  }
+  size_t slash = path.rfind('/', end);
+  *name = path.substr(slash + 1, end - slash);
+  *parent = lookup(path.substr(0, slash + 1));
+  if (!*parent) {
+    return -ENOENT;
+  }
+  return S_ISDIR((*parent)->mode) ? 0 : -ENOTDIR;
+}
+
+int RamFs::add_node(const string &path, const NodePtr &node) {
+  ScopedLock lock(&lock_, true);
+  NodePtr parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  if (parent->children.count(name)) {
+    return -EEXIST;
+  }
+  parent->children[name] = node;
+  if (S_ISDIR(node->mode)) {
+    parent->nlink++;
+  }
+  std::lock_guard<std::mutex> guard(parent->mutex);
+  parent->mtime = parent->ctime = node->ctime;
+  return 0;
+}
+
+void RamFs::fill_stat(Node *node, struct stat *stbuf) const {
+  memset(stbuf, 0, sizeof(*stbuf));
+  std::lock_guard<std::mutex> guard(node->mutex);
+  stbuf->st_ino = node->ino;
+  stbuf->st_mode = node->mode;
+  stbuf->st_nlink = node->nlink;
+  stbuf->st_uid = node->uid;
+  stbuf->st_gid = node->gid;
+  stbuf->st_size = node->data.size();
+  stbuf->st_blksize = 4096;
+  stbuf->st_blocks = (node->data.size() + 511) / 512;
+  stbuf->st_atim = node->atime;
+  stbuf->st_mtim = node->mtime;
+  stbuf->st_ctim = node->ctime;
+}
+
+int RamFs::getattr(const char *path, struct stat *stbuf) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  fill_stat(node.get(), stbuf);
+  return 0;
+}
+
+int RamFs::readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                   off_t offset) {
+  (void) offset;
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  if (!S_ISDIR(node->mode)) {
+    return -ENOTDIR;
+  }
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (const auto &child : node->children) {
+    struct stat stbuf;
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.st_ino = child.second->ino;
+    stbuf.st_mode = child.second->mode;
+    if (filler(buf, child.first.c_str(), &stbuf, 0)) {
+      break;
+    }
+  }
+  return 0;
+}
+
+int RamFs::access(const char *path, int mask) {
+  // Permissions are checked by the kernel (-odefault_permissions).
+  (void) mask;
+  ScopedLock lock(&lock_, false);
+  return lookup(path) ? 0 : -ENOENT;
+}
+
+int RamFs::readlink(const char *path, char *buf, size_t size) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  if (!S_ISLNK(node->mode)) {
+    return -EINVAL;
+  }
+  if (size == 0) {
+    return 0;
+  }
+  size_t len = std::min(node->data.size(), size - 1);
+  memcpy(buf, node->data.data(), len);
+  buf[len] = '\0';
+  return 0;
+}
+
+int RamFs::mkdir(const char *path, mode_t mode) {
+  return add_node(path, new_node(S_IFDIR | (mode & 07777)));
+}
+
+int RamFs::symlink(const char *target, const char *path) {
+  NodePtr node = new_node(S_IFLNK | 0777);
+  node->data = target;
+  return add_node(path, node);
+}
+
+int RamFs::rmdir(const char *path) {
+  ScopedLock lock(&lock_, true);
+  NodePtr parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  auto it = parent->children.find(name);
+  if (it == parent->children.end()) {
+    return -ENOENT;
+  }
+  NodePtr node = it->second;
+  if (!S_ISDIR(node->mode)) {
+    return -ENOTDIR;
+  }
+  if (!node->children.empty()) {
+    return -ENOTEMPTY;
+  }
+  parent->children.erase(it);
+  parent->nlink--;
+  node->nlink = 0;
+  std::lock_guard<std::mutex> guard(parent->mutex);
+  parent->mtime = parent->ctime = now();
+  return 0;
+}
+
+int RamFs::unlink(const char *path) {
+  ScopedLock lock(&lock_, true);
+  NodePtr parent;
+  string name;
+  int ret = lookup_parent(path, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  auto it = parent->children.find(name);
+  if (it == parent->children.end()) {
+    return -ENOENT;
+  }
+  NodePtr node = it->second;
+  if (S_ISDIR(node->mode)) {
+    return -EISDIR;
+  }
+  // Open handles keep their own reference to the node.
+  parent->children.erase(it);
+  node->nlink--;
+  struct timespec ts = now();
+  {
+    std::lock_guard<std::mutex> guard(node->mutex);
+    node->ctime = ts;
+  }
+  std::lock_guard<std::mutex> guard(parent->mutex);
+  parent->mtime = parent->ctime = ts;
+  return 0;
+}
+
+int RamFs::rename(const char *oldpath, const char *newpath) {
+  string oldstr(oldpath);
+  string newstr(newpath);
+  if (newstr.compare(0, oldstr.size(), oldstr) == 0 &&
+      newstr.size() > oldstr.size() && newstr[oldstr.size()] == '/') {
+    return -EINVAL;  // moving a directory below itself
+  }
+  ScopedLock lock(&lock_, true);
+  NodePtr old_parent;
+  NodePtr new_parent;
+  string old_name;
+  string new_name;
+  int ret = lookup_parent(oldstr, &old_parent, &old_name);
+  if (!ret) {
+    ret = lookup_parent(newstr, &new_parent, &new_name);
+  }
+  if (ret) {
+    return ret;
+  }
+  auto src = old_parent->children.find(old_name);
+  if (src == old_parent->children.end()) {
+    return -ENOENT;
+  }
+  NodePtr node = src->second;
+  bool is_dir = S_ISDIR(node->mode);
+  auto dst = new_parent->children.find(new_name);
+  if (dst != new_parent->children.end()) {
+    NodePtr victim = dst->second;
+    if (victim == node) {
+      return 0;
+    }
+    if (is_dir && !S_ISDIR(victim->mode)) {
+      return -ENOTDIR;
+    }
+    if (!is_dir && S_ISDIR(victim->mode)) {
+      return -EISDIR;
+    }
+    if (is_dir && !victim->children.empty()) {
+      return -ENOTEMPTY;
+    }
+    if (is_dir) {
+      new_parent->nlink--;
+      victim->nlink = 0;
+    } else {
+      victim->nlink--;
+    }
+    new_parent->children.erase(dst);
+  }
+  old_parent->children.erase(src);
+  new_parent->children[new_name] = node;
+  if (is_dir) {
+    old_parent->nlink--;
+    new_parent->nlink++;
+  }
+  struct timespec ts = now();
+  for (Node *n : { node.get(), old_parent.get(), new_parent.get() }) {
+    std::lock_guard<std::mutex> guard(n->mutex);
+    n->ctime = ts;
+    if (n != node.get()) {
+      n->mtime = ts;
+    }
+  }
+  return 0;
+}
+
+int RamFs::link(const char *oldpath, const char *newpath) {
+  ScopedLock lock(&lock_, true);
+  NodePtr node = lookup(oldpath);
+  if (!node) {
+    return -ENOENT;
+  }
+  if (S_ISDIR(node->mode)) {
+    return -EPERM;
+  }
+  NodePtr parent;
+  string name;
+  int ret = lookup_parent(newpath, &parent, &name);
+  if (ret) {
+    return ret;
+  }
+  if (parent->children.count(name)) {
+    return -EEXIST;
+  }
+  parent->children[name] = node;
+  node->nlink++;
+  struct timespec ts = now();
+  {
+    std::lock_guard<std::mutex> guard(node->mutex);
+    node->ctime = ts;
+  }
+  std::lock_guard<std::mutex> guard(parent->mutex);
+  parent->mtime = parent->ctime = ts;
+  return 0;
+}
+
+int RamFs::chmod(const char *path, mode_t mode) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  std::lock_guard<std::mutex> guard(node->mutex);
+  node->mode = (node->mode & S_IFMT) | (mode & 07777);
+  node->ctime = now();
+  return 0;
+}
+
+int RamFs::chown(const char *path, uid_t owner, gid_t group) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  std::lock_guard<std::mutex> guard(node->mutex);
+  if (owner != static_cast<uid_t>(-1)) {
+    node->uid = owner;
+  }
+  if (group != static_cast<gid_t>(-1)) {
+    node->gid = group;
+  }
+  node->ctime = now();
+  return 0;
+}
+
+int RamFs::utimens(const char *path, const struct timespec tv[2]) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  struct timespec ts = now();
+  std::lock_guard<std::mutex> guard(node->mutex);
+  if (tv[0].tv_nsec != UTIME_OMIT) {
+    node->atime = tv[0].tv_nsec == UTIME_NOW ? ts : tv[0];
+  }
+  if (tv[1].tv_nsec != UTIME_OMIT) {
+    node->mtime = tv[1].tv_nsec == UTIME_NOW ? ts : tv[1];
+  }
+  node->ctime = ts;
+  return 0;
+}
+
+int RamFs::truncate(const char *path, off_t length) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  if (S_ISDIR(node->mode)) {
+    return -EISDIR;
+  }
+  if (!S_ISREG(node->mode) || length < 0) {
+    return -EINVAL;
+  }
+  std::lock_guard<std::mutex> guard(node->mutex);
+  int ret = resize(&node->data, length);
+  if (ret) {
+    return ret;
+  }
+  node->mtime = node->ctime = now();
+  return 0;
+}
+
+int RamFs::create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+  NodePtr node = new_node(S_IFREG | (mode & 07777));
+  int ret = add_node(path, node);
+  if (ret) {
+    return ret;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(new NodePtr(node));
+  return 0;
+}
+
+int RamFs::open(const char *path, struct fuse_file_info *fi) {
+  ScopedLock lock(&lock_, false);
+  NodePtr node = lookup(path);
+  if (!node) {
+    return -ENOENT;
+  }
+  if (S_ISDIR(node->mode)) {
+    return -EISDIR;
+  }
+  fi->fh = reinterpret_cast<uint64_t>(new NodePtr(node));
+  return 0;
+}
+
+int RamFs::release(struct fuse_file_info *fi) {
+  delete reinterpret_cast<NodePtr*>(fi->fh);
+  return 0;
+}
+
+int RamFs::read(char *buf, size_t size, off_t offset,
+                struct fuse_file_info *fi) {
+  Node *node = reinterpret_cast<NodePtr*>(fi->fh)->get();
+  std::lock_guard<std::mutex> guard(node->mutex);
+  if (static_cast<uint64_t>(offset) >= node->data.size()) {
+    return 0;
+  }
+  size_t len = std::min(size, node->data.size() - offset);
+  memcpy(buf, node->data.data() + offset, len);
+  return len;
+}
+
+int RamFs::write(const char *buf, size_t size, off_t offset,
+                 struct fuse_file_info *fi) {
+  Node *node = reinterpret_cast<NodePtr*>(fi->fh)->get();
+  std::lock_guard<std::mutex> guard(node->mutex);
+  if (offset + size > node->data.size()) {
+    int ret = resize(&node->data, offset + size);
+    if (ret) {
+      return ret;
+    }
+  }
+  memcpy(&node->data[offset], buf, size);
+  node->mtime = node->ctime = now();
+  return size;
+}
+
+int RamFs::fsync(int datasync, struct fuse_file_info *fi) {
+  (void) datasync;
+  (void) fi;
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Backend that keeps the whole file system in memory.
+ *
+ * Nothing is persisted; the contents are lost on unmount. Since no storage
+ * is involved, benchmarks against it give an upper bound for what any
+ * backend can reach through FUSE.
+ */
+
+#ifndef RAMFS_H_
+#define RAMFS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "./backend.h"
+
+class RamFs : public Backend {
+ public:
+  RamFs();
+  ~RamFs();
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  struct Node;
+  typedef std::shared_ptr<Node> NodePtr;
+
+  struct Node {
+    uint64_t ino;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    nlink_t nlink;  ///< Guarded by lock_.
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+    std::string data;  ///< File contents or symlink target.
+    std::map<std::string, NodePtr> children;  ///< Guarded by lock_.
+    std::mutex mutex;  ///< Guards everything else.
+  };
+
+  /// The caller holds lock_.
+  NodePtr lookup(const std::string &path) const;
+  int lookup_parent(const std::string &path, NodePtr *parent,
+                    std::string *name) const;
+
+  NodePtr new_node(mode_t mode);
+
+  /// Adds a new node named 'path'; takes lock_.
+  int add_node(const std::string &path, const NodePtr &node);
+
+  void fill_stat(Node *node, struct stat *stbuf) const;
+
+  NodePtr root_;
+  std::atomic<uint64_t> next_ino_;
+
+  /// Guards the shape of the tree. Taken before any Node::mutex.
+  mutable pthread_rwlock_t lock_;
+};
+
+#endif  // RAMFS_H_
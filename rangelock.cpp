@@ -0,0 +1,288 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./rangelock.h"
+#include <stdint.h>
+#include <algorithm>
+#include "./stats.h"
+#include "./timing.h"
+
+namespace {
+
+Counter range_lock_waits("rangelock.waits");
+Counter range_lock_wait_ns("rangelock.wait_ns");
+
+}  // namespace
+
+RangeLock::RangeLock() : longest_(0), next_ticket_(0) {
+}
+
+bool RangeLock::blocked(Iterator it) const {
+  uint64_t start = it->first;
+  const Range &range = it->second;
+  // Ranges starting further back end before 'start'.
+  auto other = ranges_.lower_bound(start > longest_ ? start - longest_ : 0);
+  auto last = ranges_.lower_bound(range.end);
+  for (; other != last; ++other) {
+    if (other->second.ticket < range.ticket && other->second.end > start &&
+        (other->second.exclusive || range.exclusive)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+RangeLock::Iterator RangeLock::lock(uint64_t start, uint64_t end,
+                                    bool exclusive) {
+  std::unique_lock<std::mutex> guard(mutex_);
+  Range range = { end, exclusive, next_ticket_++ };
+  Iterator it = ranges_.insert(std::make_pair(start, range));
+  longest_ = std::max(longest_, end - start);
+  if (blocked(it)) {
+    uint64_t begin = now_ns();
+    range_lock_waits.add();
+    do {
+      released_.wait(guard);
+    } while (blocked(it));
+    range_lock_wait_ns.add(now_ns() - begin);
+  }
+  return it;
+}
+
+void RangeLock::unlock(Iterator it) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    uint64_t length = it->second.end - it->first;
+    ranges_.erase(it);
+    if (length == longest_) {
+      // A truncate holds up to UINT64_MAX; once it is gone, lookups must
+      // not keep scanning from offset 0.
+      longest_ = 0;
+      for (const auto &range : ranges_) {
+        longest_ = std::max(longest_, range.second.end - range.first);
+      }
+    }
+  }
+  released_.notify_all();
+}
+
+uint64_t RangeLock::longest() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return longest_;
+}
+
+RangeLock::Guard::Guard(RangeLock *lock, uint64_t start, uint64_t end,
+                        bool exclusive)
+    : lock_(lock) {
+  if (lock_) {
+    it_ = lock_->lock(start, end, exclusive);
+  }
+}
+
+RangeLock::Guard::~Guard() {
+  if (lock_) {
+    lock_->unlock(it_);
+  }
+}
+
+RangeLockFs::RangeLockFs(Backend *inner) : inner_(inner) {
+}
+
+RangeLockFs::~RangeLockFs() {
+  for (const auto &entry : files_) {
+    delete entry.second;
+  }
+}
+
+RangeLockFs::File *RangeLockFs::get_file(const char *path) {
+  struct stat stbuf;
+  if (inner_->getattr(path, &stbuf)) {
+    return NULL;
+  }
+  std::lock_guard<std::mutex> guard(files_mutex_);
+  File *&file = files_[stbuf.st_ino];
+  if (file == NULL) {
+    file = new File;
+    file->ino = stbuf.st_ino;
+    file->refs = 0;
+  }
+  file->refs++;
+  return file;
+}
+
+void RangeLockFs::put_file(File *file) {
+  if (file == NULL) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(files_mutex_);
+  if (--file->refs == 0) {
+    files_.erase(file->ino);
+    delete file;
+  }
+}
+
+void RangeLockFs::wrap(const char *path, struct fuse_file_info *fi) {
+  Handle *handle = new Handle;
+  handle->fh = fi->fh;
+  // Without a file the handle goes unlocked rather than failing the open.
+  handle->file = get_file(path);
+  fi->fh = reinterpret_cast<uint64_t>(handle);
+#if defined(FUSE_VERSION) && FUSE_VERSION >= 315
+  // Writes to one file are ordered here, so the kernel need not hold the
+  // inode lock while sending direct writes (libfuse 3.15).
+  fi->parallel_direct_writes = 1;
+#endif
+}
+
+struct fuse_file_info RangeLockFs::unwrap(const struct fuse_file_info *fi) {
+  struct fuse_file_info inner = *fi;
+  inner.fh = reinterpret_cast<Handle*>(fi->fh)->fh;
+  return inner;
+}
+
+void RangeLockFs::start() {
+  inner_->start();
+}
+
+void RangeLockFs::stop() {
+  inner_->stop();
+}
+
+int RangeLockFs::sync() {
+  return inner_->sync();
+}
+
+int RangeLockFs::compact() {
+  return inner_->compact();
+}
+
+int RangeLockFs::open_backing(const char *path, int flags) {
+  return inner_->open_backing(path, flags);
+}
+
+int RangeLockFs::getattr(const char *path, struct stat *stbuf) {
+  return inner_->getattr(path, stbuf);
+}
+
+int RangeLockFs::readdir(const char *path, void *buf,
+                         fuse_fill_dir_t filler, off_t offset) {
+  return inner_->readdir(path, buf, filler, offset);
+}
+
+int RangeLockFs::access(const char *path, int mask) {
+  return inner_->access(path, mask);
+}
+
+int RangeLockFs::readlink(const char *path, char *buf, size_t size) {
+  return inner_->readlink(path, buf, size);
+}
+
+int RangeLockFs::mkdir(const char *path, mode_t mode) {
+  return inner_->mkdir(path, mode);
+}
+
+int RangeLockFs::rmdir(const char *path) {
+  return inner_->rmdir(path);
+}
+
+int RangeLockFs::unlink(const char *path) {
+  return inner_->unlink(path);
+}
+
+int RangeLockFs::rename(const char *oldpath, const char *newpath) {
+  return inner_->rename(oldpath, newpath);
+}
+
+int RangeLockFs::link(const char *oldpath, const char *newpath) {
+  return inner_->link(oldpath, newpath);
+}
+
+int RangeLockFs::symlink(const char *target, const char *path) {
+  return inner_->symlink(target, path);
+}
+
+int RangeLockFs::chmod(const char *path, mode_t mode) {
+  return inner_->chmod(path, mode);
+}
+
+int RangeLockFs::chown(const char *path, uid_t owner, gid_t group) {
+  return inner_->chown(path, owner, group);
+}
+
+int RangeLockFs::utimens(const char *path, const struct timespec tv[2]) {
+  return inner_->utimens(path, tv);
+}
+
+int RangeLockFs::truncate(const char *path, off_t length) {
+  File *file = get_file(path);
+  int ret;
+  {
+    // Everything from the new end on changes, whether it grows or shrinks.
+    RangeLock::Guard guard(file ? &file->lock : NULL, length, UINT64_MAX,
+                           true);
+    ret = inner_->truncate(path, length);
+  }
+  put_file(file);
+  return ret;
+}
+
+int RangeLockFs::create(const char *path, mode_t mode,
+                        struct fuse_file_info *fi) {
+  int ret = inner_->create(path, mode, fi);
+  if (ret == 0) {
+    wrap(path, fi);
+  }
+  return ret;
+}
+
+int RangeLockFs::open(const char *path, struct fuse_file_info *fi) {
+  int ret = inner_->open(path, fi);
+  if (ret == 0) {
+    wrap(path, fi);
+  }
+  return ret;
+}
+
+int RangeLockFs::release(struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  Handle *handle = reinterpret_cast<Handle*>(fi->fh);
+  put_file(handle->file);
+  delete handle;
+  return inner_->release(&inner);
+}
+
+int RangeLockFs::read(char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+  File *file = reinterpret_cast<Handle*>(fi->fh)->file;
+  RangeLock::Guard guard(file ? &file->lock : NULL, offset, offset + size,
+                         false);
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->read(buf, size, offset, &inner);
+}
+
+int RangeLockFs::write(const char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+  File *file = reinterpret_cast<Handle*>(fi->fh)->file;
+  RangeLock::Guard guard(file ? &file->lock : NULL, offset, offset + size,
+                         true);
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->write(buf, size, offset, &inner);
+}
+
+int RangeLockFs::fsync(int datasync, struct fuse_file_info *fi) {
+  struct fuse_file_info inner = unwrap(fi);
+  return inner_->fsync(datasync, &inner);
+}
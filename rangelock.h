@@ -0,0 +1,163 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Byte-range locks on open files.
+ *
+ * Workers serve requests on the same file concurrently and nothing below
+ * the handlers orders them, so overlapping writes may interleave and a
+ * read may see half of a write. RangeLockFs sits between the handlers and
+ * another backend, and each read, write and truncate first locks the bytes
+ * it touches in the file's RangeLock. Reads share their ranges, while
+ * writes and truncates own theirs. Calls on disjoint ranges of one file
+ * still run in parallel, so writers sharing a file (MPI-IO style) scale
+ * with the number of workers.
+ *
+ * A RangeLock keeps every range held or waited for in a map ordered by
+ * start offset. A range is granted once no earlier range it conflicts
+ * with is left, i.e. in arrival order, so a stream of readers cannot
+ * starve a writer.
+ *
+ * Files are told apart by the inode number the inner backend reports when
+ * they are opened, so all handles on a file share its locks. Built against
+ * FUSE 3.15 or later, the handles also allow parallel direct writes, which
+ * the kernel otherwise sends to a file one at a time.
+ */
+
+#ifndef RANGELOCK_H_
+#define RANGELOCK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "./backend.h"
+
+class RangeLock {
+ public:
+  RangeLock();
+
+  class Guard;
+
+  /// No range held or waited for is longer.
+  uint64_t longest();
+
+ private:
+  struct Range {
+    uint64_t end;
+    bool exclusive;
+    uint64_t ticket;  ///< Arrival order.
+  };
+  typedef std::multimap<uint64_t, Range>::iterator Iterator;
+
+  Iterator lock(uint64_t start, uint64_t end, bool exclusive);
+  void unlock(Iterator it);
+
+  /// Whether an earlier range conflicting with 'it' is in the map.
+  bool blocked(Iterator it) const;
+
+  std::mutex mutex_;
+  std::condition_variable released_;
+  std::multimap<uint64_t, Range> ranges_;  ///< By start offset.
+  uint64_t longest_;  ///< No range in the map is longer.
+  uint64_t next_ticket_;
+};
+
+/// Holds [start, end) of a RangeLock while in scope; a NULL lock holds
+/// nothing.
+class RangeLock::Guard {
+ public:
+  Guard(RangeLock *lock, uint64_t start, uint64_t end, bool exclusive);
+  ~Guard();
+
+ private:
+  Guard(const Guard&) = delete;
+  Guard &operator=(const Guard&) = delete;
+
+  RangeLock *lock_;
+  Iterator it_;
+};
+
+class RangeLockFs : public Backend {
+ public:
+  /// Takes ownership of 'inner'.
+  explicit RangeLockFs(Backend *inner);
+  ~RangeLockFs();
+
+  void start() override;
+  void stop() override;
+  int sync() override;
+  int compact() override;
+  int open_backing(const char *path, int flags) override;
+
+  int getattr(const char *path, struct stat *stbuf) override;
+  int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset) override;
+  int access(const char *path, int mask) override;
+  int readlink(const char *path, char *buf, size_t size) override;
+
+  int mkdir(const char *path, mode_t mode) override;
+  int rmdir(const char *path) override;
+  int unlink(const char *path) override;
+  int rename(const char *oldpath, const char *newpath) override;
+  int link(const char *oldpath, const char *newpath) override;
+  int symlink(const char *target, const char *path) override;
+  int chmod(const char *path, mode_t mode) override;
+  int chown(const char *path, uid_t owner, gid_t group) override;
+  int utimens(const char *path, const struct timespec tv[2]) override;
+  int truncate(const char *path, off_t length) override;
+
+  int create(const char *path, mode_t mode,
+             struct fuse_file_info *fi) override;
+  int open(const char *path, struct fuse_file_info *fi) override;
+  int release(struct fuse_file_info *fi) override;
+  int read(char *buf, size_t size, off_t offset,
+           struct fuse_file_info *fi) override;
+  int write(const char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi) override;
+  int fsync(int datasync, struct fuse_file_info *fi) override;
+
+ private:
+  /// The locks of a file, shared by the handles open on it.
+  struct File {
+    ino_t ino;
+    int refs;
+    RangeLock lock;
+  };
+
+  /// Wraps the inner backend's handle with the file's locks.
+  struct Handle {
+    uint64_t fh;
+    File *file;
+  };
+
+  /// Returns the File of 'path' with a reference taken, or NULL if the
+  /// inner backend cannot stat it.
+  File *get_file(const char *path);
+  void put_file(File *file);
+
+  /// Replaces the inner handle in 'fi' with a Handle for 'path'.
+  void wrap(const char *path, struct fuse_file_info *fi);
+  static struct fuse_file_info unwrap(const struct fuse_file_info *fi);
+
+  std::unique_ptr<Backend> inner_;
+  std::mutex files_mutex_;
+  std::map<ino_t, File*> files_;  ///< Files with open handles.
+};
+
+#endif  // RANGELOCK_H_
@@ -0,0 +1,274 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./roaring.h"
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Cookies of the portable format, with and without run containers.
+const uint32_t kSerialCookie = 12347;
+const uint32_t kSerialCookieNoRuns = 12346;
+
+/// Containers from which the format with runs has offsets.
+const size_t kNoOffsetThreshold = 4;
+
+void append_u16(string *out, uint16_t v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void append_u32(string *out, uint32_t v) {
+  out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void put_u32(string *out, size_t pos, uint32_t v) {
+  memcpy(&(*out)[pos], &v, sizeof(v));
+}
+
+/// Sets bits [start, end) of 'bits'; returns how many were clear.
+uint32_t set_bits(vector<uint64_t> *bits, uint32_t start, uint32_t end) {
+  uint32_t added = 0;
+  while (start < end) {
+    uint32_t word = start / 64;
+    uint32_t last = std::min(end, (word + 1) * 64);
+    uint64_t mask = ~0ULL << (start % 64);
+    if (last % 64) {
+      mask &= ~(~0ULL << (last % 64));
+    }
+    uint64_t &w = (*bits)[word];
+    added += __builtin_popcountll(mask & ~w);
+    w |= mask;
+    start = last;
+  }
+  return added;
+}
+
+}  // namespace
+
+void RoaringBitmap::Container::to_bitmap() {
+  bits.assign(kBitmapWords, 0);
+  for (uint16_t v : array) {
+    bits[v / 64] |= 1ULL << (v % 64);
+  }
+  vector<uint16_t>().swap(array);
+}
+
+void RoaringBitmap::Container::add_range(uint32_t start, uint32_t end) {
+  if (bits.empty() && array.size() + (end - start) > kMaxArray) {
+    to_bitmap();
+  }
+  if (!bits.empty()) {
+    cardinality += set_bits(&bits, start, end);
+    return;
+  }
+  auto lo = std::lower_bound(array.begin(), array.end(), start);
+  auto hi = std::lower_bound(lo, array.end(), end);
+  size_t before = lo - array.begin();
+  size_t after = array.end() - hi;
+  vector<uint16_t> merged;
+  merged.reserve(before + (end - start) + after);
+  merged.insert(merged.end(), array.begin(), lo);
+  for (uint32_t v = start; v < end; v++) {
+    merged.push_back(v);
+  }
+  merged.insert(merged.end(), hi, array.end());
+  array.swap(merged);
+  cardinality = array.size();
+}
+
+void RoaringBitmap::Container::remove_from(uint32_t start) {
+  if (bits.empty()) {
+    array.erase(std::lower_bound(array.begin(), array.end(), start),
+                array.end());
+    cardinality = array.size();
+    return;
+  }
+  uint32_t word = start / 64;
+  if (start % 64) {
+    bits[word] &= ~(~0ULL << (start % 64));
+    word++;
+  }
+  std::fill(bits.begin() + word, bits.end(), 0);
+  cardinality = 0;
+  for (uint64_t w : bits) {
+    cardinality += __builtin_popcountll(w);
+  }
+}
+
+void RoaringBitmap::Container::runs(
+    vector<std::pair<uint32_t, uint32_t>> *out) const {
+  out->clear();
+  if (bits.empty()) {
+    for (uint16_t v : array) {
+      if (!out->empty() && out->back().first + out->back().second == v) {
+        out->back().second++;
+      } else {
+        out->push_back(std::make_pair(v, 1));
+      }
+    }
+    return;
+  }
+  uint32_t v = 0;
+  while (v < 65536) {
+    uint64_t w = bits[v / 64] >> (v % 64);
+    if (w == 0) {
+      v = (v / 64 + 1) * 64;
+      continue;
+    }
+    v += __builtin_ctzll(w);
+    uint32_t start = v;
+    while (v < 65536) {
+      w = ~bits[v / 64] >> (v % 64);
+      if (w) {
+        v += __builtin_ctzll(w);
+        break;
+      }
+      v = (v / 64 + 1) * 64;
+    }
+    out->push_back(std::make_pair(start, v - start));
+  }
+}
+
+RoaringBitmap::RoaringBitmap() {
+}
+
+RoaringBitmap::Container *RoaringBitmap::get(uint16_t key) {
+  auto it = std::lower_bound(
+      containers_.begin(), containers_.end(), key,
+      [](const Container &c, uint16_t k) { return c.key < k; });
+  if (it == containers_.end() || it->key != key) {
+    Container c;
+    c.key = key;
+    c.cardinality = 0;
+    it = containers_.insert(it, c);
+  }
+  return &*it;
+}
+
+void RoaringBitmap::add_range(uint64_t start, uint64_t end) {
+  end = std::min<uint64_t>(end, 1ULL << 32);
+  while (start < end) {
+    uint64_t last = std::min(end, ((start >> 16) + 1) << 16);
+    get(start >> 16)->add_range(start & 0xffff, last - (start & ~0xffffULL));
+    start = last;
+  }
+}
+
+void RoaringBitmap::remove_from(uint64_t start) {
+  auto it = std::lower_bound(
+      containers_.begin(), containers_.end(), start >> 16,
+      [](const Container &c, uint64_t k) { return c.key < k; });
+  if (it != containers_.end() && it->key == start >> 16) {
+    it->remove_from(start & 0xffff);
+    if (it->cardinality) {
+      ++it;
+    }
+  }
+  containers_.erase(it, containers_.end());
+}
+
+void RoaringBitmap::clear() {
+  containers_.clear();
+}
+
+void RoaringBitmap::swap(RoaringBitmap *other) {
+  containers_.swap(other->containers_);
+}
+
+uint64_t RoaringBitmap::cardinality() const {
+  uint64_t n = 0;
+  for (const auto &c : containers_) {
+    n += c.cardinality;
+  }
+  return n;
+}
+
+void RoaringBitmap::serialize(string *out, uint64_t start,
+                              uint64_t end) const {
+  auto by_key = [](const Container &c, uint64_t k) { return c.key < k; };
+  auto first = std::lower_bound(containers_.begin(), containers_.end(),
+                                start >> 16, by_key);
+  auto last = std::lower_bound(first, containers_.end(), end >> 16, by_key);
+  size_t n = last - first;
+  // Pick the smallest encoding of each container.
+  vector<vector<std::pair<uint32_t, uint32_t>>> runs(n);
+  vector<bool> is_run(n);
+  bool any_run = false;
+  for (size_t i = 0; i < n; i++) {
+    const Container &c = first[i];
+    c.runs(&runs[i]);
+    size_t plain = c.cardinality <= kMaxArray ? 2 * c.cardinality :
+        8 * kBitmapWords;
+    is_run[i] = 2 + 4 * runs[i].size() < plain;
+    any_run = any_run || is_run[i];
+  }
+
+  size_t base = out->size();
+  bool offsets = !any_run || n >= kNoOffsetThreshold;
+  if (any_run) {
+    append_u32(out, kSerialCookie | ((n - 1) << 16));
+    string flags((n + 7) / 8, '\0');
+    for (size_t i = 0; i < n; i++) {
+      if (is_run[i]) {
+        flags[i / 8] |= 1 << (i % 8);
+      }
+    }
+    out->append(flags);
+  } else {
+    append_u32(out, kSerialCookieNoRuns);
+    append_u32(out, n);
+  }
+  for (auto c = first; c != last; ++c) {
+    append_u16(out, c->key);
+    append_u16(out, c->cardinality - 1);
+  }
+  size_t offset_pos = out->size();
+  if (offsets) {
+    out->append(4 * n, '\0');
+  }
+  for (size_t i = 0; i < n; i++) {
+    const Container &c = first[i];
+    if (offsets) {
+      put_u32(out, offset_pos + 4 * i, out->size() - base);
+    }
+    if (is_run[i]) {
+      append_u16(out, runs[i].size());
+      for (const auto &run : runs[i]) {
+        append_u16(out, run.first);
+        append_u16(out, run.second - 1);
+      }
+    } else if (c.cardinality > kMaxArray) {
+      vector<uint64_t> bits(kBitmapWords, 0);
+      for (const auto &run : runs[i]) {
+        set_bits(&bits, run.first, run.first + run.second);
+      }
+      out->append(reinterpret_cast<const char*>(bits.data()),
+                  8 * kBitmapWords);
+    } else {
+      for (const auto &run : runs[i]) {
+        for (uint32_t v = run.first; v < run.first + run.second; v++) {
+          append_u16(out, v);
+        }
+      }
+    }
+  }
+}
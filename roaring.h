@@ -0,0 +1,91 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Compressed bitmap of 32-bit integers.
+ *
+ * RoaringBitmap splits values by their high 16 bits into containers. A
+ * container keeps its low 16 bits as a sorted array while it holds up to
+ * 4096 of them, and as a 65536-bit bitmap beyond. Sparse sets stay small
+ * and dense ones cost at most 8 KiB per 65536 values.
+ *
+ * serialize() writes the portable Roaring format (as read by CRoaring,
+ * pyroaring, RoaringBitmap for Java or roaring-rs). Runs of consecutive
+ * values are written as run containers where that is smaller, so a
+ * range of any length takes a few bytes.
+ */
+
+#ifndef ROARING_H_
+#define ROARING_H_
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+class RoaringBitmap {
+ public:
+  RoaringBitmap();
+
+  /// Adds the values in [start, end), with end up to 2^32.
+  void add_range(uint64_t start, uint64_t end);
+
+  /// Removes every value from 'start' on.
+  void remove_from(uint64_t start);
+
+  void clear();
+  void swap(RoaringBitmap *other);
+
+  bool empty() const {
+    return containers_.empty();
+  }
+
+  uint64_t cardinality() const;
+
+  /// Appends the portable serialization of the bitmap to 'out'.
+  void serialize(std::string *out) const {
+    serialize(out, 0, 1ULL << 32);
+  }
+
+  /// Same, for the values in [start, end) only; both are multiples of
+  /// 65536.
+  void serialize(std::string *out, uint64_t start, uint64_t end) const;
+
+ private:
+  static const uint32_t kMaxArray = 4096;
+  static const uint32_t kBitmapWords = 1024;
+
+  struct Container {
+    uint16_t key;
+    uint32_t cardinality;
+    std::vector<uint16_t> array;  ///< Sorted values while small.
+    std::vector<uint64_t> bits;   ///< Bitmap once it holds more.
+
+    void add_range(uint32_t start, uint32_t end);
+    void remove_from(uint32_t start);
+    void to_bitmap();
+
+    /// Consecutive values as (first value, count).
+    void runs(std::vector<std::pair<uint32_t, uint32_t>> *out) const;
+  };
+
+  /// Returns the container for 'key', adding an empty one if needed.
+  Container *get(uint16_t key);
+
+  std::vector<Container> containers_;  ///< By key.
+};
+
+#endif  // ROARING_H_
@@ -0,0 +1,798 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./session.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include "./protocol.h"
+#include "./timing.h"
+#include "./upgrade.h"
+
+namespace {
+
+/// Interval between two pool size decisions.
+const uint64_t kControlInterval = 250000000;
+
+/// Ticks a pool keeps its size after growth stopped paying off.
+const int kPlateauHold = 20;
+
+/// Growth must raise throughput by this factor to be kept.
+const double kMinGain = 1.05;
+
+/// Queue waits below this are not worth a thread.
+const uint64_t kMinWaitNs = 100000;
+
+/// Request buffers every session keeps, whatever its demand.
+const int kMinShare = 2;
+
+/// Weight of the previous intervals in a session's demand.
+const double kDemandDecay = 0.75;
+
+Counter inline_requests("session.inline_requests");
+
+/// Queue wait of the request the calling worker is processing.
+__thread uint64_t queue_wait_ns;
+
+/// Interrupts the receiving thread's read of /dev/fuse for pause().
+void interrupt_receive(int signum) {
+  (void) signum;
+}
+
+void catch_interrupt() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = interrupt_receive;  // No SA_RESTART.
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, NULL);
+}
+
+/// Appends 'value' as a Prometheus label value.
+void append_label(const std::string &value, std::string *out) {
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+    }
+    out->push_back(c);
+  }
+}
+
+bool is_data(const struct fuse_buf &buf) {
+  if (buf.size < sizeof(FuseInHeader)) {
+    return false;
+  }
+  FuseInHeader in;
+  memcpy(&in, buf.mem, sizeof(in));
+  return in.opcode == kFuseRead || in.opcode == kFuseWrite ||
+      in.opcode == kFuseFsync;
+}
+
+}  // namespace
+
+/// A FUSE session served by a SessionLoop.
+struct ServedSession {
+  ServedSession(struct fuse *fuse, const std::string &label)
+      : se(fuse_get_session(fuse)), ch(fuse_session_next_chan(se, NULL)),
+        name(label), receiving(false), in_flight(0), limit(0), received(0),
+        stalls(0), demand(0), requests(0), data_requests(0), bytes(0),
+        queue_ns(0), service_ns(0), stall_ns(0) {}
+
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  std::string name;
+  std::function<void()> on_exit;
+  std::thread receiver;  ///< Of added sessions.
+  pthread_t receiver_id;
+
+  // Guarded by SessionLoop::free_mutex_.
+  bool receiving;     ///< Whether an added session's receiver still runs.
+  int in_flight;      ///< Buffers held by its requests.
+  int limit;          ///< Its share of the budget.
+  uint64_t received;  ///< Requests received in the current interval.
+  uint64_t stalls;    ///< Waits for a buffer in the current interval.
+  double demand;
+
+  std::atomic<uint64_t> requests;
+  std::atomic<uint64_t> data_requests;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> queue_ns;
+  std::atomic<uint64_t> service_ns;
+  std::atomic<uint64_t> stall_ns;
+};
+
+/// Counters of one pool, as "session.<pool>.<name>".
+struct PoolCounters {
+  PoolCounters(const char *requests_name, const char *queue_name,
+               const char *service_name, const char *grows_name,
+               const char *shrinks_name)
+      : requests(requests_name), queue_ns(queue_name),
+        service_ns(service_name), grows(grows_name),
+        shrinks(shrinks_name) {}
+
+  Counter requests;
+  Counter queue_ns;
+  Counter service_ns;
+  Counter grows;
+  Counter shrinks;
+};
+
+namespace {
+
+#define POOL_COUNTERS(pool) \
+  "session." pool ".requests", "session." pool ".queue_ns", \
+  "session." pool ".service_ns", "session." pool ".grows", \
+  "session." pool ".shrinks"
+
+PoolCounters meta_counters(POOL_COUNTERS("meta"));
+PoolCounters data_counters(POOL_COUNTERS("data"));
+
+}  // namespace
+
+uint64_t current_queue_ns() {
+  return queue_wait_ns;
+}
+
+WorkerPool::WorkerPool(const char *name, int min_threads, int max_threads,
+                       PoolCounters *counters)
+    : name_(name), min_threads_(min_threads),
+      max_threads_(std::max(min_threads, max_threads)), counters_(counters),
+      busy_(0), stopping_(false), window_(), threads_(0), retire_(0),
+      next_id_(0), grow_baseline_(0), last_step_(0), hold_(0),
+      decision_("start") {
+}
+
+WorkerPool::~WorkerPool() {
+  stop();
+}
+
+void WorkerPool::start() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  spawn(min_threads_);
+}
+
+void WorkerPool::spawn(int count) {
+  // Signals must reach the receiving thread, which fuse_session_exit()
+  // interrupts; workers inherit a mask blocking all of them.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (int i = 0; i < count; i++) {
+    int id = next_id_++;
+    workers_[id] = std::thread(&WorkerPool::run, this, id);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  threads_ += count;
+}
+
+void WorkerPool::reap() {
+  std::vector<int> finished;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    finished.swap(finished_);
+  }
+  for (int id : finished) {
+    std::thread worker;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      worker.swap(workers_[id]);
+      workers_.erase(id);
+    }
+    worker.join();
+  }
+}
+
+void WorkerPool::stop() {
+  std::map<int, std::thread> workers;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+    workers.swap(workers_);
+    finished_.clear();
+  }
+  ready_.notify_all();
+  for (auto &worker : workers) {
+    worker.second.join();
+  }
+}
+
+void WorkerPool::submit(SessionRequest *req) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    queue_.push_back(req);
+  }
+  ready_.notify_one();
+}
+
+void WorkerPool::run(int id) {
+  while (true) {
+    SessionRequest *req;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_.wait(lock, [this] {
+        return stopping_ || retire_ > 0 || !queue_.empty();
+      });
+      if (retire_ > 0 && !stopping_) {
+        retire_--;
+        finished_.push_back(id);
+        return;
+      }
+      if (queue_.empty()) {
+        return;
+      }
+      req = queue_.front();
+      queue_.pop_front();
+      busy_++;
+    }
+    uint64_t start = now_ns();
+    uint64_t cpu_start = thread_cpu_ns();
+    uint64_t queue_ns = start - req->received_ns;
+    queue_wait_ns = queue_ns;
+    process(req);
+    queue_wait_ns = 0;
+    uint64_t service_ns = now_ns() - start;
+    uint64_t cpu_ns = thread_cpu_ns() - cpu_start;
+    done(req);
+
+    counters_->requests.add();
+    counters_->queue_ns.add(queue_ns);
+    counters_->service_ns.add(service_ns);
+    std::lock_guard<std::mutex> guard(mutex_);
+    window_.requests++;
+    window_.queue_ns += queue_ns;
+    window_.service_ns += service_ns;
+    window_.cpu_ns += cpu_ns;
+    if (--busy_ == 0 && queue_.empty()) {
+      idle_.notify_all();
+    }
+  }
+}
+
+void WorkerPool::wait_idle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return queue_.empty() && busy_ == 0; });
+}
+
+void WorkerPool::adjust(uint64_t interval) {
+  reap();
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (min_threads_ == max_threads_ || stopping_) {
+    return;
+  }
+  Window w = window_;
+  window_ = Window();
+  double throughput = w.requests * 1e9 / interval;
+  uint64_t wait = w.requests ? w.queue_ns / w.requests : 0;
+  uint64_t service = w.requests ? w.service_ns / w.requests : 0;
+  double busy = static_cast<double>(w.service_ns) / (threads_ * interval);
+  // Threads blocked in syscalls leave the CPU to others; CPU-bound ones do
+  // not get faster beyond one per core.
+  double blocked = w.service_ns ?
+      1.0 - static_cast<double>(w.cpu_ns) / w.service_ns : 0;
+  static const int cores = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+  if (grow_baseline_ > 0) {
+    bool paid_off = throughput >= grow_baseline_ * kMinGain;
+    grow_baseline_ = 0;
+    if (!paid_off) {
+      int step = std::min(last_step_, threads_ - min_threads_);
+      retire_ += step;
+      threads_ -= step;
+      counters_->shrinks.add();
+      hold_ = kPlateauHold;
+      decision_ = "plateau";
+      ready_.notify_all();
+      return;
+    }
+  }
+  if (hold_ > 0) {
+    hold_--;
+  }
+  if (hold_ == 0 && threads_ < max_threads_ && wait > kMinWaitNs &&
+      wait > service / 2 && (blocked > 0.5 || threads_ < cores)) {
+    int step = std::min(std::max(1, threads_ / 4), max_threads_ - threads_);
+    spawn(step);
+    counters_->grows.add();
+    grow_baseline_ = throughput;
+    last_step_ = step;
+    decision_ = "grow";
+  } else if (busy < 0.3 && threads_ > min_threads_ && queue_.empty()) {
+    retire_++;
+    threads_--;
+    counters_->shrinks.add();
+    decision_ = "shrink";
+    ready_.notify_one();
+  } else {
+    decision_ = hold_ > 0 ? "hold" : "keep";
+  }
+  char buf[200];
+  snprintf(buf, sizeof(buf), " (wait_us %.1f service_us %.1f blocked %.2f "
+           "busy %.2f ops/s %.0f)", wait / 1e3, service / 1e3, blocked, busy,
+           throughput);
+  decision_ += buf;
+}
+
+void WorkerPool::report(std::string *out) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  char buf[300];
+  snprintf(buf, sizeof(buf), "%s threads %d min %d max %d queued %zu "
+           "last %s\n", name_, threads_, min_threads_, max_threads_,
+           queue_.size(), decision_.c_str());
+  out->append(buf);
+}
+
+void WorkerPool::metrics(std::string *out) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  char buf[200];
+  snprintf(buf, sizeof(buf),
+           "wrapperfs_session_queued{pool=\"%s\"} %zu\n"
+           "wrapperfs_session_threads{pool=\"%s\"} %d\n",
+           name_, queue_.size(), name_, threads_);
+  out->append(buf);
+}
+
+SessionLoop::SessionLoop(struct fuse *fuse, const std::string &name,
+                         int meta_threads, int data_threads, int max_threads,
+                         LiveUpgrade *upgrade)
+    : main_(new ServedSession(fuse, name)), se_(main_->se), ch_(main_->ch),
+      bufsize_(fuse_chan_bufsize(ch_)), budget_(0), in_flight_(0),
+      closing_(false),
+      meta_("meta", meta_threads, max_threads, &meta_counters),
+      data_("data", data_threads, max_threads, &data_counters),
+      upgrade_(upgrade), pausing_(false), parked_(false), receiving_(false),
+      stopping_(false) {
+  sessions_.push_back(main_);
+  meta_.process = data_.process = [this](SessionRequest *req) {
+    process(req);
+  };
+  meta_.done = data_.done = [this](SessionRequest *req) {
+    put_request(req);
+  };
+}
+
+SessionLoop::~SessionLoop() {
+  for (auto *req : free_) {
+    free(req->mem);
+    delete req;
+  }
+  delete main_;
+}
+
+void SessionLoop::set_budget(size_t bytes) {
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  budget_ = bytes ? std::max<size_t>(1, bytes / bufsize_) : 0;
+  share();
+}
+
+SessionRequest *SessionLoop::get_request(ServedSession *session) {
+  SessionRequest *req = NULL;
+  {
+    std::unique_lock<std::mutex> lock(free_mutex_);
+    if (budget_ && session->in_flight >= session->limit) {
+      session->stalls++;
+      uint64_t start = now_ns();
+      buffer_wakeup_.wait(lock, [session] {
+        return session->in_flight < session->limit ||
+            fuse_session_exited(session->se);
+      });
+      session->stall_ns += now_ns() - start;
+      if (session->in_flight >= session->limit) {
+        return NULL;
+      }
+    }
+    session->in_flight++;
+    session->received++;
+    in_flight_++;
+    if (!free_.empty()) {
+      req = free_.back();
+      free_.pop_back();
+    }
+  }
+  if (!req) {
+    req = new SessionRequest;
+    req->mem = malloc(bufsize_);
+    req->session = session;
+    if (!req->mem) {
+      put_request(req);
+      return NULL;
+    }
+  }
+  // A spliced request replaces the whole fuse_buf.
+  req->buf.mem = req->mem;
+  req->buf.size = bufsize_;
+  req->buf.flags = static_cast<enum fuse_buf_flags>(0);
+  req->ch = session->ch;
+  req->session = session;
+  return req;
+}
+
+void SessionLoop::put_request(SessionRequest *req) {
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  ServedSession *session = req->session;
+  session->in_flight--;
+  in_flight_--;
+  if (!req->mem ||
+      (budget_ && static_cast<int>(free_.size()) + in_flight_ >= budget_)) {
+    free(req->mem);
+    delete req;
+  } else {
+    free_.push_back(req);
+  }
+  if (budget_ || session->in_flight == 0) {
+    buffer_wakeup_.notify_all();
+  }
+}
+
+void SessionLoop::process(SessionRequest *req) {
+  ServedSession *session = req->session;
+  uint64_t start = now_ns();
+  session->queue_ns += start - req->received_ns;
+  if (upgrade_) {
+    upgrade_->process(&req->buf);
+  } else {
+    fuse_session_process_buf(session->se, &req->buf, req->ch);
+  }
+  session->service_ns += now_ns() - start;
+}
+
+void SessionLoop::pause() {
+  std::unique_lock<std::mutex> lock(pause_mutex_);
+  pausing_ = true;
+  // The receiver is most likely blocked reading /dev/fuse. The signal
+  // interrupts the read; it is repeated in case it lands just before.
+  while (!parked_ && receiving_) {
+    pthread_kill(receiver_, SIGUSR1);
+    pause_wakeup_.wait_for(lock, std::chrono::milliseconds(1));
+  }
+  lock.unlock();
+  meta_.wait_idle();
+  data_.wait_idle();
+}
+
+void SessionLoop::resume() {
+  {
+    std::lock_guard<std::mutex> guard(pause_mutex_);
+    pausing_ = false;
+  }
+  pause_wakeup_.notify_all();
+}
+
+void SessionLoop::park() {
+  std::unique_lock<std::mutex> lock(pause_mutex_);
+  parked_ = true;
+  pause_wakeup_.notify_all();
+  while (pausing_ && !fuse_session_exited(se_)) {
+    pause_wakeup_.wait_for(lock, std::chrono::milliseconds(100));
+  }
+  parked_ = false;
+}
+
+void SessionLoop::control() {
+  std::unique_lock<std::mutex> lock(control_mutex_);
+  while (!control_wakeup_.wait_for(lock,
+                                   std::chrono::nanoseconds(kControlInterval),
+                                   [this] { return stopping_; })) {
+    meta_.adjust(kControlInterval);
+    data_.adjust(kControlInterval);
+    rebalance();
+    reap();
+  }
+}
+
+void SessionLoop::rebalance() {
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  for (auto *session : sessions_) {
+    session->demand = session->demand * kDemandDecay +
+        (session->received + session->stalls) * (1 - kDemandDecay);
+    session->received = 0;
+    session->stalls = 0;
+  }
+  share();
+}
+
+void SessionLoop::share() {
+  if (!budget_) {
+    return;
+  }
+  int n = sessions_.size();
+  int floor = std::max(1, std::min(kMinShare, budget_ / n));
+  int spare = std::max(0, budget_ - floor * n);
+  double total = 0;
+  for (const auto *session : sessions_) {
+    total += session->demand;
+  }
+  for (auto *session : sessions_) {
+    session->limit = floor + static_cast<int>(
+        total > 0 ? spare * session->demand / total : spare / n);
+  }
+  buffer_wakeup_.notify_all();
+}
+
+ServedSession *SessionLoop::find(struct fuse *fuse) const {
+  struct fuse_session *se = fuse_get_session(fuse);
+  for (auto *session : sessions_) {
+    if (session->se == se) {
+      return session;
+    }
+  }
+  return NULL;
+}
+
+int SessionLoop::add_session(struct fuse *fuse, const std::string &name,
+                             const std::function<void()> &on_exit) {
+  if (upgrade_) {
+    // The upgrade tracker follows a single session.
+    return -EINVAL;
+  }
+  ServedSession *session = new ServedSession(fuse, name);
+  if (fuse_chan_bufsize(session->ch) > bufsize_) {
+    delete session;
+    return -EINVAL;
+  }
+  session->on_exit = on_exit;
+  catch_interrupt();
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  if (closing_) {
+    delete session;
+    return -ESHUTDOWN;
+  }
+  sessions_.push_back(session);
+  session->receiving = true;
+  // SIGUSR1 interrupts its receiver on removal; other signals are left to
+  // the thread running run().
+  sigset_t mask, old;
+  sigfillset(&mask);
+  sigdelset(&mask, SIGUSR1);
+  pthread_sigmask(SIG_SETMASK, &mask, &old);
+  session->receiver = std::thread(&SessionLoop::serve, this, session);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  session->receiver_id = session->receiver.native_handle();
+  share();
+  return 0;
+}
+
+int SessionLoop::remove_session(struct fuse *fuse) {
+  std::unique_lock<std::mutex> lock(free_mutex_);
+  ServedSession *session = find(fuse);
+  if (session == NULL || session == main_) {
+    return -ENOENT;
+  }
+  stop_receiving(session, &lock);
+  return 0;
+}
+
+void SessionLoop::stop_receiving(ServedSession *session,
+                                 std::unique_lock<std::mutex> *lock) {
+  if (!session->receiving) {
+    return;
+  }
+  fuse_session_exit(session->se);
+  buffer_wakeup_.notify_all();
+  // As in pause(), the signal interrupts a read of /dev/fuse.
+  while (session->receiving) {
+    pthread_kill(session->receiver_id, SIGUSR1);
+    buffer_wakeup_.wait_for(*lock, std::chrono::milliseconds(1));
+  }
+}
+
+void SessionLoop::serve(ServedSession *session) {
+  receive(session);
+  std::unique_lock<std::mutex> lock(free_mutex_);
+  session->receiving = false;
+  buffer_wakeup_.notify_all();
+  buffer_wakeup_.wait(lock, [session] { return session->in_flight == 0; });
+  lock.unlock();
+  session->on_exit();
+  lock.lock();
+  sessions_.erase(std::find(sessions_.begin(), sessions_.end(), session));
+  finished_.push_back(session);
+  share();
+  buffer_wakeup_.notify_all();
+}
+
+void SessionLoop::reap() {
+  std::vector<ServedSession*> finished;
+  {
+    std::lock_guard<std::mutex> guard(free_mutex_);
+    finished.swap(finished_);
+  }
+  for (auto *session : finished) {
+    session->receiver.join();
+    delete session;
+  }
+}
+
+void SessionLoop::session_stats(struct fuse *fuse, std::string *out) const {
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  const ServedSession *session = find(fuse);
+  if (session == NULL) {
+    return;
+  }
+  char buf[400];
+  snprintf(buf, sizeof(buf),
+           "mount.buffers %d\n"
+           "mount.bytes %" PRIu64 "\n"
+           "mount.data_requests %" PRIu64 "\n"
+           "mount.queue_ns %" PRIu64 "\n"
+           "mount.requests %" PRIu64 "\n"
+           "mount.service_ns %" PRIu64 "\n"
+           "mount.stall_ns %" PRIu64 "\n",
+           session->in_flight, session->bytes.load(),
+           session->data_requests.load(), session->queue_ns.load(),
+           session->requests.load(), session->service_ns.load(),
+           session->stall_ns.load());
+  out->append(buf);
+}
+
+void SessionLoop::report(std::string *out) const {
+  meta_.report(out);
+  data_.report(out);
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  for (const auto *session : sessions_) {
+    char buf[200];
+    snprintf(buf, sizeof(buf), " requests %" PRIu64 " buffers %d",
+             session->requests.load(), session->in_flight);
+    out->append("mount " + session->name + buf);
+    if (budget_) {
+      snprintf(buf, sizeof(buf), " share %d demand %.1f", session->limit,
+               session->demand);
+      out->append(buf);
+    }
+    out->append("\n");
+  }
+}
+
+void SessionLoop::metrics(std::string *out) const {
+  out->append("# TYPE wrapperfs_session_queued gauge\n"
+              "# TYPE wrapperfs_session_threads gauge\n");
+  meta_.metrics(out);
+  data_.metrics(out);
+
+  // Samples are grouped by metric, one per session.
+  std::string requests = "# TYPE wrapperfs_mount_requests_total counter\n";
+  std::string bytes = "# TYPE wrapperfs_mount_bytes_total counter\n";
+  std::string stalls =
+      "# TYPE wrapperfs_mount_stall_seconds_total counter\n";
+  std::string buffers = "# TYPE wrapperfs_mount_buffers gauge\n";
+  std::lock_guard<std::mutex> guard(free_mutex_);
+  for (const auto *session : sessions_) {
+    std::string label = "{mount=\"";
+    append_label(session->name, &label);
+    label += "\"} ";
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.9f\n", session->stall_ns / 1e9);
+    requests += "wrapperfs_mount_requests_total" + label +
+        std::to_string(session->requests.load()) + "\n";
+    bytes += "wrapperfs_mount_bytes_total" + label +
+        std::to_string(session->bytes.load()) + "\n";
+    stalls += "wrapperfs_mount_stall_seconds_total" + label + buf;
+    buffers += "wrapperfs_mount_buffers" + label +
+        std::to_string(session->in_flight) + "\n";
+  }
+  out->append(requests + bytes + stalls + buffers);
+}
+
+int SessionLoop::receive(ServedSession *session) {
+  int ret = 0;
+  while (!fuse_session_exited(session->se)) {
+    if (session == main_ && pausing_) {
+      park();
+      continue;
+    }
+    SessionRequest *req = get_request(session);
+    if (req == NULL) {
+      if (!fuse_session_exited(session->se)) {
+        ret = -1;
+      }
+      break;
+    }
+    int res = fuse_session_receive_buf(session->se, &req->buf, &req->ch);
+    if (res == -EINTR || res == -EAGAIN) {
+      put_request(req);
+      continue;
+    }
+    if (res <= 0) {
+      // 0 means the file system was unmounted.
+      put_request(req);
+      if (res < 0) {
+        ret = -1;
+      }
+      break;
+    }
+    req->received_ns = now_ns();
+    session->requests++;
+    session->bytes += res;
+    if (req->buf.flags & FUSE_BUF_IS_FD) {
+      // The data still sits in this thread's splice pipe.
+      inline_requests.add();
+      process(req);
+      put_request(req);
+      continue;
+    }
+    req->buf.size = res;
+    if (is_data(req->buf)) {
+      session->data_requests++;
+      data_.submit(req);
+    } else {
+      meta_.submit(req);
+    }
+  }
+  fuse_session_exit(session->se);
+  return ret;
+}
+
+int SessionLoop::run() {
+  {
+    std::lock_guard<std::mutex> guard(pause_mutex_);
+    receiver_ = pthread_self();
+    receiving_ = true;
+  }
+  if (upgrade_) {
+    catch_interrupt();
+    if (upgrade_->attach(se_, ch_)) {
+      std::lock_guard<std::mutex> guard(pause_mutex_);
+      receiving_ = false;
+      return -1;
+    }
+  }
+  meta_.start();
+  data_.start();
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  controller_ = std::thread(&SessionLoop::control, this);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  int ret = receive(main_);
+  {
+    std::lock_guard<std::mutex> guard(pause_mutex_);
+    receiving_ = false;
+  }
+  pause_wakeup_.notify_all();
+  {
+    // The added sessions finish while the pools still serve them.
+    std::unique_lock<std::mutex> lock(free_mutex_);
+    closing_ = true;
+    while (true) {
+      auto it = std::find_if(sessions_.begin(), sessions_.end(),
+                             [](const ServedSession *session) {
+                               return session->receiving;
+                             });
+      if (it == sessions_.end()) {
+        break;
+      }
+      stop_receiving(*it, &lock);
+    }
+    buffer_wakeup_.wait(lock, [this] { return sessions_.size() == 1; });
+  }
+  {
+    std::lock_guard<std::mutex> guard(control_mutex_);
+    stopping_ = true;
+  }
+  control_wakeup_.notify_all();
+  controller_.join();
+  reap();
+  // Let the queued requests drain before the session goes away.
+  meta_.stop();
+  data_.stop();
+  return ret;
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Request loop with separate worker pools for metadata and data.
+ *
+ * fuse_loop_mt() lets any worker pick up any request, so a burst of slow
+ * reads can occupy every thread while a getattr waits behind them. This
+ * loop receives requests on the calling thread, classifies them by opcode
+ * and hands them to one of two bounded pools: bulk data operations (read,
+ * write, fsync) go to the data pool, everything else to the metadata pool.
+ *
+ * Each pool runs between a minimum and a maximum number of threads. Every
+ * tick, a controller looks at the requests of the last interval: their
+ * queue wait, their service time and how much of it was spent blocked
+ * rather than on the CPU (in backing syscalls). A pool grows while
+ * requests queue for longer than they take to serve and adding threads
+ * still raises throughput. It gives back the last step once throughput
+ * plateaus, and shrinks while its workers are mostly idle.
+ *
+ * Requests received through splice (-osplice_read) are tied to the
+ * receiving thread and are processed inline.
+ *
+ * One loop can serve several mounts: every added session gets a receiving
+ * thread of its own, and all of them feed the same two pools. Request
+ * buffers may be bounded by a memory budget, which the controller splits
+ * between the sessions by how many requests each received lately and how
+ * often it had to wait for a buffer. A session always keeps a couple of
+ * buffers, so an idle mount is never starved by a busy one.
+ */
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./stats.h"
+
+struct ServedSession;
+
+/// A received request waiting for a worker.
+struct SessionRequest {
+  void *mem;  ///< Receive buffer owned by the request.
+  struct fuse_buf buf;
+  struct fuse_chan *ch;
+  ServedSession *session;  ///< Session the request was received from.
+  uint64_t received_ns;
+};
+
+struct PoolCounters;
+class LiveUpgrade;
+
+/**
+ * \brief Pool of threads processing SessionRequests in order.
+ */
+class WorkerPool {
+ public:
+  WorkerPool(const char *name, int min_threads, int max_threads,
+             PoolCounters *counters);
+  ~WorkerPool();
+
+  void start();
+  void stop();
+
+  /// Queues 'req'; done() is called with it once processed.
+  void submit(SessionRequest *req);
+
+  /// Called by workers to process each request, and once it is done.
+  std::function<void(SessionRequest *req)> process;
+  std::function<void(SessionRequest *req)> done;
+
+  /// Waits until no request is queued or being processed.
+  void wait_idle();
+
+  /// Resizes the pool from what happened during the last 'interval' ns.
+  void adjust(uint64_t interval);
+
+  /// Appends the pool size and the last decision.
+  void report(std::string *out) const;
+
+  /// Appends the queue length and pool size as Prometheus samples.
+  void metrics(std::string *out) const;
+
+ private:
+  /// Totals over the requests finished in the current interval.
+  struct Window {
+    uint64_t requests;
+    uint64_t queue_ns;
+    uint64_t service_ns;
+    uint64_t cpu_ns;
+  };
+
+  void run(int id);
+  void spawn(int count);
+  void reap();
+
+  const char *name_;
+  int min_threads_;
+  int max_threads_;
+  PoolCounters *counters_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable ready_;
+  std::condition_variable idle_;
+  std::deque<SessionRequest*> queue_;
+  int busy_;  ///< Requests being processed.
+  bool stopping_;
+  Window window_;
+
+  int threads_;  ///< Live workers, not counting those asked to retire.
+  int retire_;   ///< Workers asked to exit.
+  int next_id_;
+  std::map<int, std::thread> workers_;
+  std::vector<int> finished_;  ///< Retired workers waiting to be joined.
+
+  // Controller state, only touched by adjust() and report().
+  double grow_baseline_;  ///< Throughput before the last growth, or 0.
+  int last_step_;
+  int hold_;              ///< Ticks left without growing.
+  std::string decision_;
+};
+
+/// Time the request being processed by the calling thread spent queued
+/// for a worker; 0 outside the worker pools.
+uint64_t current_queue_ns();
+
+class SessionLoop {
+ public:
+  /// Pools run between their min and max number of threads; equal bounds
+  /// give fixed pools. With 'upgrade', requests go through its tracker.
+  /// 'name' labels the statistics of the session of 'fuse'.
+  SessionLoop(struct fuse *fuse, const std::string &name, int meta_threads,
+              int data_threads, int max_threads, LiveUpgrade *upgrade = NULL);
+  ~SessionLoop();
+
+  /// Keeps the request buffers of all sessions under 'bytes' (0: no
+  /// bound). Must be called before run().
+  void set_budget(size_t bytes);
+
+  /// Runs until the session exits; returns 0 or -1 on error. Added
+  /// sessions are stopped before it returns.
+  int run();
+
+  /**
+   * \brief Serves 'fuse' from the same pools while run() runs. Its
+   * requests are received on a thread of its own until it is unmounted or
+   * removed; 'on_exit' then runs on that thread once they are all done.
+   * Returns 0 or -errno.
+   */
+  int add_session(struct fuse *fuse, const std::string &name,
+                  const std::function<void()> &on_exit);
+
+  /// Stops receiving requests for 'fuse', which must have been added.
+  /// Returns 0 or -ENOENT.
+  int remove_session(struct fuse *fuse);
+
+  /// Appends the counters of the session of 'fuse' as "mount.*" lines.
+  void session_stats(struct fuse *fuse, std::string *out) const;
+
+  /// Stops receiving requests and waits for those in flight; resume()
+  /// receives again.
+  void pause();
+  void resume();
+
+  /// Renders the state of both pools.
+  void report(std::string *out) const;
+
+  /// Renders the pool gauges in the Prometheus text format.
+  void metrics(std::string *out) const;
+
+ private:
+  int receive(ServedSession *session);
+  void serve(ServedSession *session);
+  void stop_receiving(ServedSession *session,
+                      std::unique_lock<std::mutex> *lock);
+  void reap();
+  void rebalance();
+  void share();
+  ServedSession *find(struct fuse *fuse) const;
+  SessionRequest *get_request(ServedSession *session);
+  void put_request(SessionRequest *req);
+  void process(SessionRequest *req);
+  void park();
+  void control();
+
+  ServedSession *main_;  ///< The session of the constructor, served by run().
+  struct fuse_session *se_;
+  struct fuse_chan *ch_;
+  size_t bufsize_;
+
+  // The buffers, the budget and the sessions are guarded by free_mutex_.
+  mutable std::mutex free_mutex_;
+  std::condition_variable buffer_wakeup_;
+  std::vector<SessionRequest*> free_;  ///< Requests with buffers to reuse.
+  int budget_;     ///< Buffers allowed, or 0.
+  int in_flight_;  ///< Buffers held by received requests.
+  std::vector<ServedSession*> sessions_;   ///< Including main_.
+  std::vector<ServedSession*> finished_;   ///< Added ones done serving.
+  bool closing_;  ///< run() is stopping the added sessions.
+
+  WorkerPool meta_;
+  WorkerPool data_;
+  LiveUpgrade *upgrade_;
+
+  pthread_t receiver_;
+  std::atomic<bool> pausing_;
+  std::mutex pause_mutex_;
+  std::condition_variable pause_wakeup_;
+  bool parked_;
+  bool receiving_;  ///< Whether run() still receives requests.
+
+  std::mutex control_mutex_;
+  std::condition_variable control_wakeup_;
+  bool stopping_;
+  std::thread controller_;
+};
+
+#endif  // SESSION_H_
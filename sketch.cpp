@@ -0,0 +1,127 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./sketch.h"
+#include <algorithm>
+#include <string>
+
+using std::string;
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth)
+    : width_(width), depth_(depth), cells_(width * depth) {
+}
+
+size_t CountMinSketch::cell(uint64_t hash, size_t row) const {
+  // Rows index with h1 + row * h2 (Kirsch and Mitzenmacher); mixing the
+  // high bits makes h2 independent enough of h1.
+  uint64_t h2 = (hash >> 32 | hash << 32) * 0x9e3779b97f4a7c15ULL;
+  return row * width_ + (hash + row * (h2 | 1)) % width_;
+}
+
+void CountMinSketch::add(uint64_t hash, uint64_t n) {
+  for (size_t row = 0; row < depth_; row++) {
+    cells_[cell(hash, row)] += n;
+  }
+}
+
+uint64_t CountMinSketch::estimate(uint64_t hash) const {
+  uint64_t min = UINT64_MAX;
+  for (size_t row = 0; row < depth_; row++) {
+    min = std::min(min, cells_[cell(hash, row)]);
+  }
+  return min;
+}
+
+void CountMinSketch::merge(const CountMinSketch &other) {
+  for (size_t i = 0; i < cells_.size(); i++) {
+    cells_[i] += other.cells_[i];
+  }
+}
+
+void CountMinSketch::clear() {
+  std::fill(cells_.begin(), cells_.end(), 0);
+}
+
+TopK::TopK(size_t k) : k_(k) {
+}
+
+void TopK::swap_nodes(size_t a, size_t b) {
+  std::swap(heap_[a], heap_[b]);
+  index_[heap_[a].first] = a;
+  index_[heap_[b].first] = b;
+}
+
+void TopK::sift_down(size_t i) {
+  while (true) {
+    size_t min = i;
+    size_t left = 2 * i + 1;
+    size_t right = left + 1;
+    if (left < heap_.size() && heap_[left].second < heap_[min].second) {
+      min = left;
+    }
+    if (right < heap_.size() && heap_[right].second < heap_[min].second) {
+      min = right;
+    }
+    if (min == i) {
+      return;
+    }
+    swap_nodes(i, min);
+    i = min;
+  }
+}
+
+void TopK::offer(const string &key, uint64_t count) {
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    size_t i = it->second;
+    if (count > heap_[i].second) {
+      heap_[i].second = count;
+      sift_down(i);
+    }
+    return;
+  }
+  if (heap_.size() < k_) {
+    heap_.push_back(Entry(key, count));
+    size_t i = heap_.size() - 1;
+    index_[key] = i;
+    while (i > 0 && heap_[(i - 1) / 2].second > heap_[i].second) {
+      swap_nodes(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+    return;
+  }
+  if (k_ == 0 || count <= heap_[0].second) {
+    return;
+  }
+  index_.erase(heap_[0].first);
+  heap_[0] = Entry(key, count);
+  index_[key] = 0;
+  sift_down(0);
+}
+
+std::vector<TopK::Entry> TopK::sorted() const {
+  std::vector<Entry> entries(heap_);
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  return entries;
+}
+
+void TopK::clear() {
+  heap_.clear();
+  index_.clear();
+}
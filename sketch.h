@@ -0,0 +1,82 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Streaming summaries for heavy hitters.
+ *
+ * CountMinSketch estimates per-key totals of a stream in fixed memory: a
+ * key's estimate never undercounts and exceeds its true total by at most
+ * e/width of the stream total with probability 1 - exp(-depth). TopK keeps
+ * the keys with the largest estimates seen so far.
+ */
+
+#ifndef SKETCH_H_
+#define SKETCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class CountMinSketch {
+ public:
+  CountMinSketch(size_t width, size_t depth);
+
+  /// Adds 'n' to the key hashed to 'hash'.
+  void add(uint64_t hash, uint64_t n);
+
+  uint64_t estimate(uint64_t hash) const;
+
+  /// Adds the counts of 'other', which must have the same dimensions.
+  void merge(const CountMinSketch &other);
+
+  void clear();
+
+ private:
+  size_t cell(uint64_t hash, size_t row) const;
+
+  size_t width_;
+  size_t depth_;
+  std::vector<uint64_t> cells_;
+};
+
+class TopK {
+ public:
+  typedef std::pair<std::string, uint64_t> Entry;
+
+  explicit TopK(size_t k);
+
+  /// Records 'count' as the current estimate of 'key'. Estimates only
+  /// grow, so a key keeps its place until a larger one pushes it out.
+  void offer(const std::string &key, uint64_t count);
+
+  /// Returns the entries by decreasing count.
+  std::vector<Entry> sorted() const;
+
+  void clear();
+
+ private:
+  void swap_nodes(size_t a, size_t b);
+  void sift_down(size_t i);
+
+  size_t k_;
+  std::vector<Entry> heap_;  ///< Min-heap on count.
+  std::unordered_map<std::string, size_t> index_;  ///< Key to heap slot.
+};
+
+#endif  // SKETCH_H_
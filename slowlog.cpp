@@ -0,0 +1,101 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./slowlog.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sstream>
+#include <string>
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+Counter slow_ops("slowlog.ops");
+
+}  // namespace
+
+SlowLog slowlog;
+
+SlowLog::SlowLog() : next_(0) {
+}
+
+void SlowLog::record(const Entry &entry) {
+  slow_ops.add();
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (entries_.size() < kCapacity) {
+    entries_.push_back(entry);
+    return;
+  }
+  entries_[next_] = entry;
+  next_ = (next_ + 1) % kCapacity;
+}
+
+int SlowLog::configure(const string &text) {
+  bool clear = false;
+  string settings;
+  std::istringstream words(text);
+  string word;
+  while (words >> word) {
+    if (word == "clear") {
+      clear = true;
+      continue;
+    }
+    const char kPrefix[] = "threshold_ms=";
+    if (word.compare(0, sizeof(kPrefix) - 1, kPrefix) != 0) {
+      return -EINVAL;
+    }
+    settings += "slow_ms=" + word.substr(sizeof(kPrefix) - 1) + " ";
+  }
+  if (!settings.empty()) {
+    int ret = tunables_update(settings);
+    if (ret) {
+      return ret;
+    }
+  }
+  if (clear) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    entries_.clear();
+    next_ = 0;
+  }
+  return 0;
+}
+
+void SlowLog::report(string *out) const {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "# threshold_ms=%g\n", threshold() / 1e6);
+  out->append(buf);
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (size_t i = 0; i < entries_.size(); i++) {
+    const Entry &e = entries_[(next_ + i) % entries_.size()];
+    struct tm tm;
+    localtime_r(&e.when.tv_sec, &tm);
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(buf + n, sizeof(buf) - n, ".%06ld %s total_us=%.1f "
+             "queue_us=%.1f cpu_us=%.1f blocked_us=%.1f uid=%u pid=%d "
+             "size=%llu offset=%lld ret=%d ", e.when.tv_nsec / 1000, e.op,
+             e.total_ns / 1e3, e.queue_ns / 1e3, e.cpu_ns / 1e3,
+             e.blocked_ns / 1e3, e.uid, e.pid,
+             static_cast<unsigned long long>(e.size),  // NOLINT
+             static_cast<long long>(e.offset), e.result);  // NOLINT
+    out->append(buf);
+    out->append(e.path);
+    out->push_back('\n');
+  }
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Log of slow operations.
+ *
+ * Every operation taking longer than a threshold, counted from when it was
+ * queued, is kept in a bounded ring buffer with its arguments, caller and
+ * a breakdown of where the time went: waiting in a worker pool queue
+ * (with --split_queues), on the CPU
+ * in the handler, and blocked, which is mostly time spent in backing file
+ * system syscalls. The log is read from /.wrapperfs/slowops; writing
+ * "threshold_ms=N" to that file changes the slow_ms tunable (0 turns the
+ * log off) and "clear" empties it.
+ *
+ * While the log is off an operation costs one load of the tunables. While
+ * it is on, fast operations read the clocks once at start and once at the
+ * end; only slow ones take the lock and copy their path.
+ */
+
+#ifndef SLOWLOG_H_
+#define SLOWLOG_H_
+
+#include <fuse.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "./session.h"
+#include "./timing.h"
+#include "./tunables.h"
+
+class SlowLog {
+ public:
+  /// Operations kept before the oldest is overwritten.
+  static const size_t kCapacity = 256;
+
+  /// One slow operation.
+  struct Entry {
+    struct timespec when;  ///< Wall clock time at completion.
+    const char *op;
+    std::string path;
+    uid_t uid;
+    pid_t pid;
+    uint64_t size;
+    int64_t offset;
+    int result;
+    uint64_t total_ns;
+    uint64_t queue_ns;
+    uint64_t cpu_ns;
+    uint64_t blocked_ns;
+  };
+
+  SlowLog();
+
+  /// Operations taking at least this many ns are logged; 0 if none.
+  uint64_t threshold() const {
+    return tunables().slow_ns;
+  }
+
+  void record(const Entry &entry);
+
+  /// Applies "threshold_ms=N" and "clear" lines; returns 0 or -EINVAL.
+  int configure(const std::string &text);
+
+  /// Renders the threshold and the logged operations, oldest first.
+  void report(std::string *out) const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<Entry> entries_;
+  size_t next_;  ///< Slot of the next entry once entries_ is full.
+};
+
+extern SlowLog slowlog;
+
+/**
+ * \brief Handler layer that feeds 'slowlog'.
+ */
+template <class Next>
+struct SlowLogLayer : Next {
+  /// Times the operation in its scope; done() hands over the result.
+  class Probe {
+   public:
+    Probe(const char *op, const char *path, const char *path2 = NULL,
+          uint64_t size = 0, int64_t offset = 0)
+        : threshold_(slowlog.threshold()), op_(op), path_(path),
+          path2_(path2), size_(size), offset_(offset), start_(0),
+          cpu_start_(0) {
+      if (threshold_) {
+        start_ = now_ns();
+        cpu_start_ = thread_cpu_ns();
+      }
+    }
+
+    int done(int result) {
+      if (threshold_) {
+        uint64_t handler = now_ns() - start_;
+        uint64_t queue = current_queue_ns();
+        if (queue + handler >= threshold_) {
+          log(result, handler, queue);
+        }
+      }
+      return result;
+    }
+
+   private:
+    void log(int result, uint64_t handler, uint64_t queue);
+
+    uint64_t threshold_;
+    const char *op_;
+    const char *path_;
+    const char *path2_;
+    uint64_t size_;
+    int64_t offset_;
+    uint64_t start_;
+    uint64_t cpu_start_;
+  };
+
+  static int access(const char *path, int mask) {
+    Probe probe("access", path);
+    return probe.done(Next::access(path, mask));
+  }
+
+  static int chmod(const char *path, mode_t mode) {
+    Probe probe("chmod", path);
+    return probe.done(Next::chmod(path, mode));
+  }
+
+  static int chown(const char *path, uid_t owner, gid_t group) {
+    Probe probe("chown", path);
+    return probe.done(Next::chown(path, owner, group));
+  }
+
+  static int create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    Probe probe("create", path);
+    return probe.done(Next::create(path, mode, fi));
+  }
+
+  static int flush(const char *path, struct fuse_file_info *fi) {
+    Probe probe("flush", path);
+    return probe.done(Next::flush(path, fi));
+  }
+
+  static int fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    Probe probe("fsync", path);
+    return probe.done(Next::fsync(path, datasync, fi));
+  }
+
+  static int getattr(const char *path, struct stat *stbuf) {
+    Probe probe("getattr", path);
+    return probe.done(Next::getattr(path, stbuf));
+  }
+
+  static int link(const char *oldpath, const char *newpath) {
+    Probe probe("link", oldpath, newpath);
+    return probe.done(Next::link(oldpath, newpath));
+  }
+
+  static int mkdir(const char *path, mode_t mode) {
+    Probe probe("mkdir", path);
+    return probe.done(Next::mkdir(path, mode));
+  }
+
+  static int open(const char *path, struct fuse_file_info *fi) {
+    Probe probe("open", path);
+    return probe.done(Next::open(path, fi));
+  }
+
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    Probe probe("read", path, NULL, size, offset);
+    return probe.done(Next::read(path, buf, size, offset, fi));
+  }
+
+  static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi) {
+    Probe probe("readdir", path, NULL, 0, offset);
+    return probe.done(Next::readdir(path, buf, filler, offset, fi));
+  }
+
+  static int readlink(const char *path, char *buf, size_t size) {
+    Probe probe("readlink", path);
+    return probe.done(Next::readlink(path, buf, size));
+  }
+
+  static int release(const char *path, struct fuse_file_info *fi) {
+    Probe probe("release", path);
+    return probe.done(Next::release(path, fi));
+  }
+
+  static int rename(const char *oldpath, const char *newpath) {
+    Probe probe("rename", oldpath, newpath);
+    return probe.done(Next::rename(oldpath, newpath));
+  }
+
+  static int rmdir(const char *path) {
+    Probe probe("rmdir", path);
+    return probe.done(Next::rmdir(path));
+  }
+
+  static int symlink(const char *target, const char *path) {
+    Probe probe("symlink", path);
+    return probe.done(Next::symlink(target, path));
+  }
+
+  static int truncate(const char *path, off_t length) {
+    Probe probe("truncate", path, NULL, 0, length);
+    return probe.done(Next::truncate(path, length));
+  }
+
+  static int unlink(const char *path) {
+    Probe probe("unlink", path);
+    return probe.done(Next::unlink(path));
+  }
+
+  static int utimens(const char *path, const struct timespec tv[2]) {
+    Probe probe("utimens", path);
+    return probe.done(Next::utimens(path, tv));
+  }
+
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    Probe probe("write", path, NULL, size, offset);
+    return probe.done(Next::write(path, buf, size, offset, fi));
+  }
+};
+
+template <class Next>
+void SlowLogLayer<Next>::Probe::log(int result, uint64_t handler,
+                                    uint64_t queue) {
+  SlowLog::Entry entry;
+  clock_gettime(CLOCK_REALTIME, &entry.when);
+  entry.op = op_;
+  entry.path = path_ ? path_ : "";
+  if (path2_) {
+    entry.path += " -> ";
+    entry.path += path2_;
+  }
+  struct fuse_context *ctx = fuse_get_context();
+  entry.uid = ctx ? ctx->uid : 0;
+  entry.pid = ctx ? ctx->pid : 0;
+  entry.size = size_;
+  entry.offset = offset_;
+  entry.result = result;
+  entry.total_ns = queue + handler;
+  entry.queue_ns = queue;
+  entry.cpu_ns = std::min(thread_cpu_ns() - cpu_start_, handler);
+  entry.blocked_ns = handler - entry.cpu_ns;
+  slowlog.record(entry);
+}
+
+#endif  // SLOWLOG_H_
@@ -0,0 +1,948 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./snapshot.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "./stats.h"
+#include "./timing.h"
+
+using std::string;
+using std::vector;
+
+const char Snapshots::kDir[] = "/.snapshots";
+
+namespace {
+
+/// Bytes copied at a time when preserving a file.
+const size_t kCopyBuffer = 1 << 20;
+
+Counter snapshot_created("snapshot.created");
+Counter snapshot_create_ns("snapshot.create_ns");
+Counter snapshot_pause_ns("snapshot.pause_ns");
+Counter snapshot_cloned("snapshot.cloned");
+Counter snapshot_linked("snapshot.linked");
+Counter snapshot_preserved("snapshot.preserved");
+Counter snapshot_preserved_bytes("snapshot.preserved_bytes");
+Counter snapshot_set_aside("snapshot.set_aside");
+
+bool valid_name(const string &name) {
+  return !name.empty() && name[0] != '.' &&
+      name.find('/') == string::npos;
+}
+
+int remove_entry(const char *path, const struct stat *, int type,
+                 struct FTW *) {
+  return type == FTW_DP ? ::rmdir(path) : ::unlink(path);
+}
+
+/// Removes 'path' and everything below it.
+int remove_tree(const string &path) {
+  return nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) == -1 ?
+      -errno : 0;
+}
+
+/// Gives 'fd' the owner, mode and times of 'stbuf', as far as allowed.
+void copy_attributes(int fd, const struct stat &stbuf) {
+  if (fchown(fd, stbuf.st_uid, stbuf.st_gid) == -1) {
+    // Only root may give files away; the mode still applies.
+  }
+  fchmod(fd, stbuf.st_mode & 07777);
+  struct timespec times[2] = { stbuf.st_atim, stbuf.st_mtim };
+  futimens(fd, times);
+}
+
+/// Same, for the entry 'path', which is not followed if a symlink.
+void copy_attributes(const string &path, const struct stat &stbuf) {
+  if (lchown(path.c_str(), stbuf.st_uid, stbuf.st_gid) == -1) {
+    // As above.
+  }
+  if (!S_ISLNK(stbuf.st_mode)) {
+    ::chmod(path.c_str(), stbuf.st_mode & 07777);
+  }
+  struct timespec times[2] = { stbuf.st_atim, stbuf.st_mtim };
+  utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+}
+
+/// Copies the data of 'in' to 'out'; returns the bytes copied or -errno.
+int64_t copy_data(int in, int out) {
+  vector<char> buf(kCopyBuffer);
+  int64_t done = 0;
+  for (;;) {
+    ssize_t n = pread(in, buf.data(), buf.size(), done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    } else if (n == -1) {
+      return -errno;
+    } else if (n == 0) {
+      return done;
+    }
+    for (ssize_t written = 0; written < n; ) {
+      ssize_t m = pwrite(out, buf.data() + written, n - written,
+                         done + written);
+      if (m == -1 && errno != EINTR) {
+        return -errno;
+      }
+      written += m == -1 ? 0 : m;
+    }
+    done += n;
+  }
+}
+
+/// Copies the file open as 'in' to 'to', which is created if need be,
+/// cloning it if 'clone'. Returns the bytes copied or -errno.
+int64_t copy_contents(int in, const string &to, bool clone) {
+  struct stat stbuf;
+  if (fstat(in, &stbuf) == -1) {
+    return -errno;
+  }
+  int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0600);
+  if (out == -1) {
+    return -errno;
+  }
+  int64_t bytes = clone && ioctl(out, FICLONE, in) == 0 ?
+      0 : copy_data(in, out);
+  if (bytes >= 0) {
+    copy_attributes(out, stbuf);
+  }
+  close(out);
+  return bytes;
+}
+
+/// Creates a unique temporary name in the directory of 'path'.
+string temp_name(const string &path) {
+  string name = path.substr(0, path.rfind('/')) + "/.wrapperfs-cow.XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd == -1) {
+    return string();
+  }
+  close(fd);
+  return name;
+}
+
+}  // namespace
+
+/// State of the snapshot being taken.
+struct Snapshots::Walk {
+  /// A directory of the tree that the snapshot has yet to list.
+  struct Pending {
+    string to;          ///< Its copy in the snapshot.
+    struct stat stbuf;  ///< Its attributes when the snapshot started.
+    bool listing;
+  };
+
+  /// What the snapshot has of a file.
+  struct Inode {
+    enum State { kCopying, kCopied } state;
+    /// The copy, or a name of it in the snapshot; empty if the file had
+    /// a single link.
+    string path;
+    bool shared;  ///< Whether 'path' is a link to the live file.
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  /// Directories not listed yet, by their path relative to basedir_, ""
+  /// for the root.
+  std::map<string, Pending> pending;
+  std::unordered_map<ino_t, Inode> inodes;
+  /// Files created since the snapshot started.
+  std::unordered_set<ino_t> fresh;
+  /// Where files changed before the snapshot listed them are copied.
+  string aside;
+  int busy = 0;   ///< Listings and copies made without 'mutex'.
+  int error = 0;  ///< The first failure.
+};
+
+Snapshots::Snapshots(const string &basedir, const FanoutLayout &fanout)
+    : basedir_(basedir), root_(basedir + "/.wrapperfs/snapshots"),
+      fanout_(fanout), reflink_(true), count_(0), active_(false),
+      walk_(new Walk), walking_(false), shared_count_(0), copying_(0) {
+  for (auto &slot : bare_) {
+    slot.writers = 0;
+  }
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  // A snapshot must not wait for a stream of writes to pause.
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(&tree_lock_, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+Snapshots::~Snapshots() {
+  pthread_rwlock_destroy(&tree_lock_);
+  delete walk_;
+}
+
+int Snapshots::init() {
+  if (::mkdir(root_.c_str(), 0700) == -1 && errno != EEXIST) {
+    return -errno;
+  }
+  DIR *dirp = opendir(root_.c_str());
+  if (dirp == NULL) {
+    return -errno;
+  }
+  struct dirent *dp;
+  vector<string> leftovers;
+  std::unordered_map<ino_t, nlink_t> links;
+  while ((dp = ::readdir(dirp)) != NULL) {
+    string name = dp->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    } else if (name[0] == '.') {
+      leftovers.push_back(root_ + "/" + name);
+    } else {
+      scan(root_ + "/" + name, name, &links);
+      count_++;
+    }
+  }
+  closedir(dirp);
+  // Files all of whose links are in snapshots were copied out already.
+  for (auto it = shared_.begin(); it != shared_.end(); ) {
+    if (it->second.paths.size() >= links[it->first]) {
+      it = shared_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  // Snapshots that were being taken when the daemon stopped.
+  for (const auto &path : leftovers) {
+    remove_tree(path);
+  }
+  shared_count_ = shared_.size();
+  active_ = count_ > 0;
+  return 0;
+}
+
+void Snapshots::scan(const string &dir, const string &rel,
+                     std::unordered_map<ino_t, nlink_t> *links) {
+  DIR *dirp = opendir(dir.c_str());
+  if (dirp == NULL) {
+    return;
+  }
+  struct dirent *dp;
+  while ((dp = ::readdir(dirp)) != NULL) {
+    if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+      continue;
+    }
+    string path = dir + "/" + dp->d_name;
+    struct stat stbuf;
+    if (lstat(path.c_str(), &stbuf) == -1) {
+      continue;
+    }
+    if (S_ISDIR(stbuf.st_mode)) {
+      scan(path, rel + "/" + dp->d_name, links);
+    } else if (S_ISREG(stbuf.st_mode) && stbuf.st_nlink > 1) {
+      shared_[stbuf.st_ino].paths.push_back(rel + "/" + dp->d_name);
+      (*links)[stbuf.st_ino] = stbuf.st_nlink;
+    }
+  }
+  closedir(dirp);
+}
+
+bool Snapshots::owns(const char *path) {
+  size_t len = sizeof(kDir) - 1;
+  return strncmp(path, kDir, len) == 0 &&
+      (path[len] == '\0' || path[len] == '/');
+}
+
+string Snapshots::abspath(const string &path) const {
+  size_t start = sizeof(kDir) - 1;
+  if (path.size() <= start + 1) {
+    return root_;
+  }
+  size_t end = path.find('/', start + 1);
+  if (end == string::npos) {
+    return root_ + path.substr(start);
+  }
+  // A snapshot has the layout of the base directory.
+  return fanout_.map(root_ + path.substr(start, end - start),
+                     path.substr(end));
+}
+
+Snapshots::Writer::Writer(Snapshots *snapshots)
+    : snapshots_(snapshots), locked_(false) {
+  if (!snapshots_) {
+    return;
+  }
+  // Counted before active_ is read, so that create() either waits for
+  // this operation or makes it take the lock.
+  std::atomic<int> &writers = snapshots_->bare_[Counter::stripe()].writers;
+  writers.fetch_add(1);
+  if (snapshots_->active_.load()) {
+    writers.fetch_sub(1);
+    pthread_rwlock_rdlock(&snapshots_->tree_lock_);
+    locked_ = true;
+  }
+}
+
+Snapshots::Writer::~Writer() {
+  if (locked_) {
+    pthread_rwlock_unlock(&snapshots_->tree_lock_);
+  } else if (snapshots_) {
+    snapshots_->bare_[Counter::stripe()].writers.fetch_sub(1);
+  }
+}
+
+string Snapshots::key_of(const string &abspath) const {
+  if (abspath.size() <= basedir_.size() + 1) {
+    return string();
+  }
+  return abspath.substr(basedir_.size() + 1);
+}
+
+void Snapshots::preserve_name(const string &abspath) {
+  if (!walking_.load()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(walk_->mutex);
+  reach_locked(&lock, abspath);
+}
+
+int Snapshots::preserve(const string &abspath) {
+  preserve_name(abspath);
+  bool walking = walking_.load();
+  if (!walking && shared_count_.load(std::memory_order_relaxed) == 0) {
+    return 0;
+  }
+  struct stat stbuf;
+  if (lstat(abspath.c_str(), &stbuf) == -1 || !S_ISREG(stbuf.st_mode)) {
+    return 0;
+  }
+  if (walking) {
+    preserve_walk(abspath, stbuf.st_ino);
+  }
+  return preserve(stbuf.st_ino);
+}
+
+int Snapshots::preserve_fd(int fd) {
+  bool walking = walking_.load();
+  if (!walking && shared_count_.load(std::memory_order_relaxed) == 0) {
+    return 0;
+  }
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    return -errno;
+  }
+  if (walking) {
+    // Opened anew, as 'fd' may be write-only.
+    preserve_walk("/proc/self/fd/" + std::to_string(fd), stbuf.st_ino);
+  }
+  return preserve(stbuf.st_ino);
+}
+
+int Snapshots::preserve(ino_t ino) {
+  if (shared_count_.load(std::memory_order_relaxed) == 0) {
+    return 0;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = shared_.find(ino);
+  while (it != shared_.end() && it->second.copying) {
+    copied_.wait(lock);
+    it = shared_.find(ino);
+  }
+  if (it == shared_.end()) {
+    return 0;
+  }
+  it->second.copying = true;
+  copying_++;
+  vector<string> paths = it->second.paths;
+  lock.unlock();
+
+  int ret = copy_out(paths);
+
+  lock.lock();
+  copying_--;
+  it = shared_.find(ino);
+  if (ret) {
+    it->second.copying = false;
+  } else {
+    shared_.erase(it);
+    shared_count_ = shared_.size();
+  }
+  copied_.notify_all();
+  return ret;
+}
+
+int Snapshots::copy_out(const vector<string> &paths) {
+  // Names removed with their snapshot meanwhile are skipped.
+  string copy;
+  for (const auto &rel : paths) {
+    string path = root_ + "/" + rel;
+    // The directory keeps the times it had in the snapshot.
+    string dir = path.substr(0, path.rfind('/'));
+    struct stat dir_stat;
+    if (lstat(dir.c_str(), &dir_stat) == -1) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      return -errno;
+    }
+    string tmp = temp_name(path);
+    if (tmp.empty()) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      return -errno;
+    }
+    // Linked to the first copy, unless that went with its snapshot.
+    int ret = -ENOENT;
+    if (!copy.empty() && ::unlink(tmp.c_str()) == 0) {
+      ret = ::link(copy.c_str(), tmp.c_str()) == -1 ? -errno : 0;
+    }
+    if (ret == -ENOENT) {
+      int in = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+      int64_t bytes = in == -1 ? -errno : copy_contents(in, tmp, false);
+      ret = bytes < 0 ? bytes : 0;
+      if (in != -1) {
+        close(in);
+      }
+      if (!ret) {
+        snapshot_preserved_bytes.add(bytes);
+      }
+    }
+    if (!ret && ::rename(tmp.c_str(), path.c_str()) == -1) {
+      ret = -errno;
+    }
+    if (ret) {
+      ::unlink(tmp.c_str());
+      if (ret == -ENOENT) {
+        continue;
+      }
+      return ret;
+    }
+    struct timespec times[2] = { dir_stat.st_atim, dir_stat.st_mtim };
+    utimensat(AT_FDCWD, dir.c_str(), times, AT_SYMLINK_NOFOLLOW);
+    copy = path;
+  }
+  snapshot_preserved.add();
+  return 0;
+}
+
+int Snapshots::rename(const string &from, const string &to,
+                      const std::function<int()> &op) {
+  if (!walking_.load()) {
+    return op();
+  }
+  std::unique_lock<std::mutex> lock(walk_->mutex);
+  reach_locked(&lock, from);
+  reach_locked(&lock, to);
+  // Directories below 'from' are listed by name, so none may be while
+  // it moves, and those pending are renamed along.
+  std::map<string, Walk::Pending> &pending = walk_->pending;
+  string prefix = key_of(from) + "/";
+  auto below = [&](std::map<string, Walk::Pending>::iterator it) {
+    return it != pending.end() &&
+        it->first.compare(0, prefix.size(), prefix) == 0;
+  };
+  for (;;) {
+    auto it = pending.lower_bound(prefix);
+    while (below(it) && !it->second.listing) {
+      ++it;
+    }
+    if (!walking_ || !below(it)) {
+      break;
+    }
+    walk_->changed.wait(lock);
+  }
+  int ret = op();
+  if (ret == 0 && walking_) {
+    string to_prefix = key_of(to) + "/";
+    vector<std::pair<string, Walk::Pending>> moved;
+    auto first = pending.lower_bound(prefix);
+    auto last = first;
+    for (; below(last); ++last) {
+      moved.push_back(std::make_pair(
+          to_prefix + last->first.substr(prefix.size()), last->second));
+    }
+    pending.erase(first, last);
+    pending.insert(moved.begin(), moved.end());
+  }
+  return ret;
+}
+
+void Snapshots::created(int fd) {
+  if (!walking_.load()) {
+    return;
+  }
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(walk_->mutex);
+  if (walking_) {
+    walk_->fresh.insert(stbuf.st_ino);
+  }
+}
+
+nlink_t Snapshots::links(ino_t ino) {
+  if (shared_count_.load(std::memory_order_relaxed) == 0) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = shared_.find(ino);
+  return it == shared_.end() ? 0 : it->second.paths.size();
+}
+
+void Snapshots::reach_locked(std::unique_lock<std::mutex> *lock,
+                             const string &abspath) {
+  string rel = key_of(abspath);
+  for (size_t end = 0; walking_ && !walk_->pending.empty(); end++) {
+    if (end == 0 || end == rel.size() || rel[end] == '/') {
+      string key = rel.substr(0, end);
+      auto it = walk_->pending.find(key);
+      while (it != walk_->pending.end() && it->second.listing) {
+        walk_->changed.wait(*lock);
+        it = walk_->pending.find(key);
+      }
+      if (it != walk_->pending.end()) {
+        list_locked(lock, key);
+      }
+    }
+    if (end >= rel.size()) {
+      break;
+    }
+  }
+}
+
+int Snapshots::list_locked(std::unique_lock<std::mutex> *lock,
+                           const string &key) {
+  Walk::Pending &entry = walk_->pending[key];
+  entry.listing = true;
+  string to = entry.to;
+  struct stat dir_stat = entry.stbuf;
+  walk_->busy++;
+  lock->unlock();
+
+  string from = key.empty() ? basedir_ : basedir_ + "/" + key;
+  int ret = 0;
+  DIR *dirp = opendir(from.c_str());
+  if (dirp == NULL) {
+    ret = -errno;
+  }
+  struct dirent *dp;
+  while (!ret && (dp = ::readdir(dirp)) != NULL) {
+    if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0 ||
+        (key.empty() && strcmp(dp->d_name, ".wrapperfs") == 0)) {
+      continue;
+    }
+    string child_from = from + "/" + dp->d_name;
+    string child_to = to + "/" + dp->d_name;
+    struct stat stbuf;
+    if (lstat(child_from.c_str(), &stbuf) == -1) {
+      // Only changes made directly under DIR get here.
+      ret = errno == ENOENT ? 0 : -errno;
+    } else if (S_ISDIR(stbuf.st_mode)) {
+      if (::mkdir(child_to.c_str(), 0700) == -1) {
+        ret = -errno;
+      } else {
+        lock->lock();
+        string child_key = key.empty() ? dp->d_name : key + "/" + dp->d_name;
+        walk_->pending[child_key] = Walk::Pending{child_to, stbuf, false};
+        lock->unlock();
+      }
+    } else if (S_ISREG(stbuf.st_mode)) {
+      ret = capture(child_from, child_to, stbuf);
+    } else if (S_ISLNK(stbuf.st_mode)) {
+      vector<char> target(stbuf.st_size + 1);
+      ssize_t len = ::readlink(child_from.c_str(), target.data(),
+                               target.size());
+      if (len == -1 ||
+          ::symlink(string(target.data(), len).c_str(),
+                    child_to.c_str()) == -1) {
+        ret = -errno;
+      } else {
+        copy_attributes(child_to, stbuf);
+      }
+    } else if (mknod(child_to.c_str(), stbuf.st_mode, stbuf.st_rdev) == 0) {
+      copy_attributes(child_to, stbuf);
+    }
+  }
+  if (dirp) {
+    closedir(dirp);
+  }
+  if (!ret) {
+    copy_attributes(to, dir_stat);
+  }
+
+  lock->lock();
+  walk_->pending.erase(key);
+  walk_->busy--;
+  if (ret && !walk_->error) {
+    walk_->error = ret;
+  }
+  walk_->changed.notify_all();
+  return ret;
+}
+
+int Snapshots::capture(const string &from, const string &to,
+                       const struct stat &stbuf) {
+  std::unique_lock<std::mutex> lock(walk_->mutex);
+  auto it = walk_->inodes.find(stbuf.st_ino);
+  while (it != walk_->inodes.end() &&
+         it->second.state == Walk::Inode::kCopying) {
+    walk_->changed.wait(lock);
+    it = walk_->inodes.find(stbuf.st_ino);
+  }
+  bool first = it == walk_->inodes.end();
+  Walk::Inode copy;
+  if (first) {
+    walk_->inodes[stbuf.st_ino] = Walk::Inode{Walk::Inode::kCopying,
+                                              string(), false};
+  } else {
+    copy = it->second;
+  }
+  lock.unlock();
+
+  if (!copy.path.empty() && !copy.shared) {
+    return ::link(copy.path.c_str(), to.c_str()) == -1 ? -errno : 0;
+  } else if (!copy.path.empty()) {
+    // Still the live file, unless it was copied out meanwhile.
+    std::unique_lock<std::mutex> shared_lock(mutex_);
+    auto entry = shared_.find(stbuf.st_ino);
+    while (entry != shared_.end() && entry->second.copying) {
+      copied_.wait(shared_lock);
+      entry = shared_.find(stbuf.st_ino);
+    }
+    if (::link(copy.path.c_str(), to.c_str()) == -1) {
+      return -errno;
+    }
+    string rel = copy.path.substr(root_.size() + 1);
+    if (entry != shared_.end() &&
+        std::find(entry->second.paths.begin(), entry->second.paths.end(),
+                  rel) != entry->second.paths.end()) {
+      entry->second.paths.push_back(to.substr(root_.size() + 1));
+    }
+    return 0;
+  }
+
+  bool shared = false;
+  int ret = copy_file(from, to, stbuf, &shared);
+  if (first) {
+    lock.lock();
+    if (ret) {
+      walk_->inodes.erase(stbuf.st_ino);
+    } else {
+      Walk::Inode &inode = walk_->inodes[stbuf.st_ino];
+      inode.state = Walk::Inode::kCopied;
+      if (stbuf.st_nlink > 1) {
+        inode.path = to;
+        inode.shared = shared;
+      }
+    }
+    walk_->changed.notify_all();
+  }
+  return ret;
+}
+
+int Snapshots::copy_file(const string &from, const string &to,
+                         const struct stat &stbuf, bool *shared) {
+  if (reflink_) {
+    int in = ::open(from.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1) {
+      return -errno;
+    }
+    int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                     0600);
+    int err = out == -1 || ioctl(out, FICLONE, in) == -1 ? errno : 0;
+    if (!err) {
+      copy_attributes(out, stbuf);
+    }
+    close(in);
+    if (out != -1) {
+      close(out);
+    }
+    if (!err) {
+      snapshot_cloned.add();
+      return 0;
+    }
+    if (out != -1) {
+      ::unlink(to.c_str());
+    }
+    if (err != EOPNOTSUPP && err != ENOTTY && err != EXDEV &&
+        err != EINVAL && err != ENOSYS) {
+      return -err;
+    }
+    // The backing file system cannot share extents.
+    reflink_ = false;
+  }
+  // Known to shared_ before any change can reach the file.
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (::link(from.c_str(), to.c_str()) == -1) {
+    return -errno;
+  }
+  shared_[stbuf.st_ino].paths.push_back(to.substr(root_.size() + 1));
+  shared_count_ = shared_.size();
+  *shared = true;
+  snapshot_linked.add();
+  return 0;
+}
+
+void Snapshots::preserve_walk(const string &from, ino_t ino) {
+  std::unique_lock<std::mutex> lock(walk_->mutex);
+  auto it = walk_->inodes.find(ino);
+  while (walking_ && it != walk_->inodes.end() &&
+         it->second.state == Walk::Inode::kCopying) {
+    walk_->changed.wait(lock);
+    it = walk_->inodes.find(ino);
+  }
+  if (!walking_ || it != walk_->inodes.end() || walk_->fresh.count(ino)) {
+    return;
+  }
+  // Not listed yet: the snapshot will link to this copy instead.
+  string aside = walk_->aside + "/" + std::to_string(ino);
+  walk_->inodes[ino] = Walk::Inode{Walk::Inode::kCopying, aside, false};
+  walk_->busy++;
+  lock.unlock();
+
+  int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  int64_t bytes = in == -1 ? -errno : copy_contents(in, aside, reflink_);
+  if (in != -1) {
+    close(in);
+  }
+
+  lock.lock();
+  walk_->busy--;
+  if (bytes < 0) {
+    walk_->inodes.erase(ino);
+    if (!walk_->error) {
+      walk_->error = bytes;
+    }
+  } else {
+    walk_->inodes[ino].state = Walk::Inode::kCopied;
+    snapshot_set_aside.add();
+  }
+  walk_->changed.notify_all();
+}
+
+int Snapshots::walk() {
+  std::unique_lock<std::mutex> lock(walk_->mutex);
+  while (!walk_->error) {
+    auto it = walk_->pending.begin();
+    while (it != walk_->pending.end() && it->second.listing) {
+      ++it;
+    }
+    if (it != walk_->pending.end()) {
+      string key = it->first;
+      list_locked(&lock, key);
+    } else if (walk_->pending.empty() && walk_->busy == 0) {
+      break;
+    } else {
+      walk_->changed.wait(lock);
+    }
+  }
+  int ret = walk_->error;
+  walking_ = false;
+  while (walk_->busy) {
+    walk_->changed.wait(lock);
+  }
+  walk_->pending.clear();
+  walk_->inodes.clear();
+  walk_->fresh.clear();
+  walk_->error = 0;
+  walk_->changed.notify_all();
+  return ret;
+}
+
+void Snapshots::forget_locked(const string &prefix) {
+  for (auto it = shared_.begin(); it != shared_.end(); ) {
+    vector<string> &paths = it->second.paths;
+    if (!it->second.copying) {
+      for (size_t i = 0; i < paths.size(); ) {
+        if (paths[i].compare(0, prefix.size(), prefix) == 0) {
+          paths[i] = paths.back();
+          paths.pop_back();
+        } else {
+          i++;
+        }
+      }
+    }
+    if (paths.empty()) {
+      it = shared_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  shared_count_ = shared_.size();
+}
+
+int Snapshots::create(const string &name) {
+  if (!valid_name(name)) {
+    return -EINVAL;
+  }
+  std::lock_guard<std::mutex> guard(create_mutex_);
+  string path = root_ + "/" + name;
+  if (access(path.c_str(), F_OK) == 0) {
+    return -EEXIST;
+  }
+  string tmp = root_ + "/." + name + ".tmp";
+  string aside = root_ + "/." + name + ".aside";
+  remove_tree(tmp);
+  remove_tree(aside);
+
+  uint64_t start = now_ns();
+  if (!active_) {
+    // Writers that found no snapshots are waited for; later ones lock.
+    active_ = true;
+    for (const auto &slot : bare_) {
+      while (slot.writers.load() != 0) {
+        usleep(100);
+      }
+    }
+  }
+  // Writers only pause while the snapshot starts.
+  struct stat stbuf;
+  pthread_rwlock_wrlock(&tree_lock_);
+  int ret = flush ? flush() : 0;
+  if (!ret && (lstat(basedir_.c_str(), &stbuf) == -1 ||
+               ::mkdir(tmp.c_str(), 0700) == -1 ||
+               ::mkdir(aside.c_str(), 0700) == -1)) {
+    ret = -errno;
+  }
+  if (!ret) {
+    std::lock_guard<std::mutex> lock(walk_->mutex);
+    walk_->pending[""] = Walk::Pending{tmp, stbuf, false};
+    walk_->aside = aside;
+    walking_ = true;
+  }
+  pthread_rwlock_unlock(&tree_lock_);
+  snapshot_pause_ns.add(now_ns() - start);
+
+  if (!ret) {
+    ret = walk();
+  }
+  remove_tree(aside);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    string prefix = "." + name + ".tmp/";
+    if (!ret) {
+      // Copies out in progress may still name files under 'tmp'.
+      while (copying_) {
+        copied_.wait(lock);
+      }
+      if (::rename(tmp.c_str(), path.c_str()) == -1) {
+        ret = -errno;
+      }
+    }
+    if (ret) {
+      forget_locked(prefix);
+    } else {
+      for (auto &entry : shared_) {
+        for (auto &rel : entry.second.paths) {
+          if (rel.compare(0, prefix.size(), prefix) == 0) {
+            rel = name + rel.substr(prefix.size() - 1);
+          }
+        }
+      }
+    }
+  }
+
+  if (ret) {
+    remove_tree(tmp);
+    active_ = count_ > 0;
+    return ret;
+  }
+  count_++;
+  snapshot_created.add();
+  snapshot_create_ns.add(now_ns() - start);
+  return 0;
+}
+
+int Snapshots::remove(const string &name) {
+  if (!valid_name(name)) {
+    return -EINVAL;
+  }
+  std::lock_guard<std::mutex> guard(create_mutex_);
+  string path = root_ + "/" + name;
+  if (access(path.c_str(), F_OK) == -1) {
+    return -errno;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    forget_locked(name + "/");
+  }
+  // Renamed first, so that it disappears at once and a crash while
+  // removing it leaves a leftover for init() to clean up.
+  string tmp = root_ + "/." + name + ".del";
+  if (::rename(path.c_str(), tmp.c_str()) == -1) {
+    return -errno;
+  }
+  count_--;
+  active_ = count_ > 0;
+  return remove_tree(tmp);
+}
+
+int Snapshots::configure(const string &text) {
+  std::istringstream in(text);
+  string command, name;
+  if (!(in >> command >> name)) {
+    return -EINVAL;
+  }
+  if (command == "create") {
+    return create(name);
+  } else if (command == "delete") {
+    return remove(name);
+  }
+  return -EINVAL;
+}
+
+void Snapshots::report(string *out) {
+  std::map<string, time_t> snapshots;
+  DIR *dirp = opendir(root_.c_str());
+  if (dirp) {
+    struct dirent *dp;
+    while ((dp = ::readdir(dirp)) != NULL) {
+      struct stat stbuf;
+      if (dp->d_name[0] != '.' &&
+          lstat((root_ + "/" + dp->d_name).c_str(), &stbuf) == 0) {
+        snapshots[dp->d_name] = stbuf.st_ctime;
+      }
+    }
+    closedir(dirp);
+  }
+  char buf[256];
+  snprintf(buf, sizeof(buf), "# files_to_copy=%zu reflink=%d\n",
+           shared_count_.load(), reflink_.load() ? 1 : 0);
+  out->append(buf);
+  for (const auto &entry : snapshots) {
+    struct tm tm;
+    localtime_r(&entry.second, &tm);
+    strftime(buf, sizeof(buf), " %Y-%m-%dT%H:%M:%S\n", &tm);
+    out->append(entry.first);
+    out->append(buf);
+  }
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Point-in-time snapshots of a passthrough base directory.
+ *
+ * A snapshot copies the backing tree into BASEDIR/.wrapperfs/snapshots/
+ * NAME, with the same (possibly sharded) layout. Operations that modify
+ * the tree only wait while the snapshot starts; the tree is then copied
+ * one directory at a time while they go on, and an operation first copies
+ * the directories on its way that the snapshot has not reached yet, or the
+ * file it writes to through a descriptor.
+ *
+ * Regular files are cloned with FICLONE where the backing file system
+ * shares extents (XFS, Btrfs), which copies no data. Elsewhere, they are
+ * hard-linked into the snapshot and copied lazily: the first write,
+ * truncate or attribute change through wrapperfs to such a file copies
+ * its data and attributes into the snapshot before it goes ahead. Files
+ * the snapshots link to are found again after a restart by their link
+ * counts, and getattr() leaves those links out.
+ *
+ * Snapshots are mounted read-only at /.snapshots/NAME, which directory
+ * listings of the root do not show.
+ *
+ * Lazy snapshots only hold while the base directory is changed through
+ * wrapperfs; a file written to directly changes in its snapshots too.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "./fanout.h"
+#include "./stats.h"
+
+class Snapshots {
+ public:
+  /// Where snapshots show up in the mounted namespace.
+  static const char kDir[];
+
+  Snapshots(const std::string &basedir, const FanoutLayout &fanout);
+  ~Snapshots();
+
+  /// Creates the snapshot directory and finds the files that snapshots
+  /// share with the tree. Returns 0 or -errno.
+  int init();
+
+  /// Called before taking a snapshot, e.g. to write deferred times out.
+  std::function<int()> flush;
+
+  /// Returns true if 'path' is kDir or below it.
+  static bool owns(const char *path);
+
+  /// Maps 'path' below kDir to its backing path.
+  std::string abspath(const std::string &path) const;
+
+  /**
+   * \brief Held by every operation that modifies the tree, so that a
+   * snapshot sees all of an operation or none of it.
+   *
+   * Costs an uncontended counter while there are no snapshots.
+   */
+  class Writer {
+   public:
+    /// Does nothing if 'snapshots' is NULL.
+    explicit Writer(Snapshots *snapshots);
+    ~Writer();
+
+   private:
+    Writer(const Writer&) = delete;
+    Writer &operator=(const Writer&) = delete;
+
+    Snapshots *snapshots_;
+    bool locked_;  ///< Whether tree_lock_ is held.
+  };
+
+  /// Copies what a snapshot being taken still needs before the entry
+  /// 'abspath' is created or removed. Failures fail the snapshot, not
+  /// the operation.
+  void preserve_name(const std::string &abspath);
+
+  /// Same, and copies the file 'abspath' or open as 'fd' into the
+  /// snapshots that share it, before it is changed. Returns 0 or -errno.
+  int preserve(const std::string &abspath);
+  int preserve_fd(int fd);
+
+  /// Renames 'from' to 'to' with 'op', which returns 0 or -1 like
+  /// rename(2).
+  int rename(const std::string &from, const std::string &to,
+             const std::function<int()> &op);
+
+  /// Tells that the file open as 'fd' was just created, so that a
+  /// snapshot being taken does not copy it before it is written to.
+  void created(int fd);
+
+  /// Returns how many links to the live file 'ino' are in snapshots.
+  nlink_t links(ino_t ino);
+
+  /// Accepts "create NAME" and "delete NAME"; returns 0 or -errno.
+  int configure(const std::string &text);
+
+  /// Lists the snapshots and the files waiting to be copied.
+  void report(std::string *out);
+
+ private:
+  /// The names of a shared file in the snapshots, relative to root_.
+  struct Shared {
+    std::vector<std::string> paths;
+    bool copying;
+  };
+
+  /// State of the snapshot being taken.
+  struct Walk;
+
+  int create(const std::string &name);
+  int remove(const std::string &name);
+
+  /// Copies the directories not listed yet, along with those that
+  /// operations list meanwhile. Returns 0 or the first -errno.
+  int walk();
+
+  /// Returns 'abspath' relative to basedir_, as pending directories are
+  /// named.
+  std::string key_of(const std::string &abspath) const;
+
+  /// Lists each directory from the root down to 'abspath' that is yet to
+  /// be, waiting for those being listed. Called with walk_->mutex held.
+  void reach_locked(std::unique_lock<std::mutex> *lock,
+                    const std::string &abspath);
+
+  /// Copies the entries of the pending directory 'key', which is relative
+  /// to basedir_, into the snapshot. Called with walk_->mutex held, which
+  /// it drops meanwhile.
+  int list_locked(std::unique_lock<std::mutex> *lock, const std::string &key);
+
+  /// Copies the regular file 'from' to 'to' unless another link to it
+  /// was, in which case 'to' links to that copy.
+  int capture(const std::string &from, const std::string &to,
+              const struct stat &stbuf);
+  /// Clones or links 'from' to the new file 'to'; sets 'shared' if 'to'
+  /// is a link to the live file.
+  int copy_file(const std::string &from, const std::string &to,
+                const struct stat &stbuf, bool *shared);
+
+  /// Copies the file 'ino', open as 'from', aside before it is changed,
+  /// unless the snapshot being taken has it already.
+  void preserve_walk(const std::string &from, ino_t ino);
+
+  /// Adds the files of 'dir' with more than one link to shared_, and
+  /// their link counts to 'links'.
+  void scan(const std::string &dir, const std::string &rel,
+            std::unordered_map<ino_t, nlink_t> *links);
+
+  int preserve(ino_t ino);
+
+  /// Copies the shared file named by 'paths' over each of them.
+  int copy_out(const std::vector<std::string> &paths);
+
+  /// Forgets the names in shared_ that start with 'prefix'. Called with
+  /// mutex_ held.
+  void forget_locked(const std::string &prefix);
+
+  std::string basedir_;
+  std::string root_;  ///< BASEDIR/.wrapperfs/snapshots
+  const FanoutLayout &fanout_;
+  std::atomic<bool> reflink_;  ///< Whether FICLONE may work.
+
+  pthread_rwlock_t tree_lock_;  ///< Shared by writers, taken by create().
+  std::mutex create_mutex_;
+  size_t count_;                ///< Snapshots, under create_mutex_.
+
+  /// Whether writers take tree_lock_: there are snapshots or one is
+  /// being created. Writers that found it clear count themselves here.
+  std::atomic<bool> active_;
+  struct Slot {
+    std::atomic<int> writers;
+    char pad[64 - sizeof(std::atomic<int>)];  ///< One per cache line
+  };
+  Slot bare_[Counter::kStripes];
+
+  Walk *walk_;
+  std::atomic<bool> walking_;  ///< Whether a snapshot is being copied.
+
+  std::mutex mutex_;
+  std::condition_variable copied_;
+  std::unordered_map<ino_t, Shared> shared_;
+  std::atomic<size_t> shared_count_;  ///< shared_.size(), read unlocked
+  size_t copying_;  ///< Entries of shared_ being copied out.
+};
+
+#endif  // SNAPSHOT_H_
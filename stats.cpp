@@ -0,0 +1,79 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./stats.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::mutex &registry_mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+/// Function-local so that counters defined in other translation units can
+/// register during static initialization.
+std::vector<const Counter*> &registry() {
+  static std::vector<const Counter*> counters;
+  return counters;
+}
+
+}  // namespace
+
+__thread unsigned Counter::stripe_;
+
+Counter::Counter(const char *name) : name_(name) {
+  for (auto &cell : cells_) {
+    cell.value = 0;
+  }
+  std::lock_guard<std::mutex> guard(registry_mutex());
+  registry().push_back(this);
+}
+
+unsigned Counter::next_stripe() {
+  static std::atomic<unsigned> next(0);
+  return next++ % kStripes + 1;
+}
+
+void stats_for_each(const std::function<void(const Counter &)> &func) {
+  std::vector<const Counter*> counters;
+  {
+    std::lock_guard<std::mutex> guard(registry_mutex());
+    counters = registry();
+  }
+  std::sort(counters.begin(), counters.end(),
+            [](const Counter *a, const Counter *b) {
+              return strcmp(a->name(), b->name()) < 0;
+            });
+  for (const auto *counter : counters) {
+    func(*counter);
+  }
+}
+
+void stats_dump(std::string *out) {
+  stats_for_each([out](const Counter &counter) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s %" PRIu64 "\n", counter.name(),
+             counter.value());
+    out->append(line);
+  });
+}
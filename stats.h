@@ -0,0 +1,85 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Named event counters.
+ *
+ * Counters are meant to be defined at namespace scope next to the code that
+ * bumps them; each registers itself on construction so that dump() can list
+ * every counter without a central table. Each counter is striped over
+ * cache lines that threads update separately, and summed when read.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <string>
+
+class Counter {
+ public:
+  explicit Counter(const char *name);
+
+  /// Adds to the calling thread's stripe, so that threads bumping the
+  /// same counter do not contend for its cache line.
+  void add(uint64_t n = 1) {
+    cells_[stripe()].value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /// Sums the stripes without stopping writers.
+  uint64_t value() const {
+    uint64_t sum = 0;
+    for (const auto &cell : cells_) {
+      sum += cell.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  const char *name() const { return name_; }
+
+  static const unsigned kStripes = 16;
+
+  /// The calling thread's stripe, in [0, kStripes).
+  static unsigned stripe() {
+    if (!stripe_) {
+      stripe_ = next_stripe();
+    }
+    return stripe_ - 1;
+  }
+
+ private:
+  struct alignas(64) Cell {
+    std::atomic<uint64_t> value;
+  };
+
+  /// Assigns stripes to threads round-robin; returns the stripe plus one.
+  static unsigned next_stripe();
+
+  static __thread unsigned stripe_;  ///< Stripe of this thread plus one.
+
+  const char *name_;
+  Cell cells_[kStripes];
+};
+
+/// Calls 'func' for every registered counter, sorted by name.
+void stats_for_each(const std::function<void(const Counter &)> &func);
+
+/// Appends "name value\n" for every registered counter, sorted by name.
+void stats_dump(std::string *out);
+
+#endif  // STATS_H_
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks which descriptors a --bypass client may trade for the
+ * backing file, and that the backing file must match the client's.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include "./bypass.h"
+#include "./test.h"
+
+namespace {
+
+std::string dir;
+
+std::string create(const char *name) {
+  std::string path = dir + "/" + name;
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  CHECK(fd != -1);
+  CHECK(close(fd) == 0);
+  return path;
+}
+
+int check(int fd, std::string *path) {
+  struct stat stbuf;
+  int ret = bypass_check_client(fd, &stbuf, path);
+  CHECK(close(fd) == 0);
+  return ret;
+}
+
+void test_client() {
+  std::string a = create("a");
+  std::string path;
+  CHECK(check(open(a.c_str(), O_RDONLY), &path) == 0);
+  CHECK(path == a);
+
+  // Only reads bypass the mount.
+  CHECK(check(open(a.c_str(), O_RDWR), &path) == -EINVAL);
+  CHECK(check(open(a.c_str(), O_WRONLY), &path) == -EINVAL);
+  CHECK(check(open(dir.c_str(), O_RDONLY | O_DIRECTORY), &path) == -EXDEV);
+
+  // A rename is followed.
+  int fd = open(a.c_str(), O_RDONLY);
+  std::string c = dir + "/c";
+  CHECK(rename(a.c_str(), c.c_str()) == 0);
+  CHECK(check(fd, &path) == 0);
+  CHECK(path == c);
+
+  // Unlinked: no name to open.
+  fd = open(c.c_str(), O_RDONLY);
+  CHECK(unlink(c.c_str()) == 0);
+  CHECK(check(fd, &path) == -ESTALE);
+
+  // Still linked elsewhere, but the name the kernel reports is gone.
+  std::string b = create("b");
+  std::string d = dir + "/d";
+  CHECK(link(b.c_str(), d.c_str()) == 0);
+  fd = open(b.c_str(), O_RDONLY);
+  CHECK(unlink(b.c_str()) == 0);
+  CHECK(check(fd, &path) == -ESTALE);
+  CHECK(unlink(d.c_str()) == 0);
+}
+
+void test_backing() {
+  std::string e = create("e");
+  std::string f = create("f");
+  struct stat client, backing, other;
+  CHECK(stat(e.c_str(), &client) == 0);
+  CHECK(stat(e.c_str(), &backing) == 0);
+  CHECK(stat(f.c_str(), &other) == 0);
+  CHECK(bypass_check_backing(backing, backing, client) == 0);
+
+  // The backend serves another file under the name by now.
+  CHECK(bypass_check_backing(backing, other, client) == -ESTALE);
+
+  // The client's descriptor does not show the backing file's owner or
+  // mode.
+  CHECK(chmod(e.c_str(), 0600) == 0);
+  CHECK(stat(e.c_str(), &backing) == 0);
+  CHECK(bypass_check_backing(backing, backing, client) == -ESTALE);
+  CHECK(stat(e.c_str(), &client) == 0);
+  CHECK(bypass_check_backing(backing, backing, client) == 0);
+  client.st_uid++;
+  CHECK(bypass_check_backing(backing, backing, client) == -ESTALE);
+  client.st_uid--;
+  client.st_gid++;
+  CHECK(bypass_check_backing(backing, backing, client) == -ESTALE);
+}
+
+}  // namespace
+
+int main() {
+  std::string tmp = test_dir("bypass_test");
+  char real[PATH_MAX];
+  CHECK(realpath(tmp.c_str(), real) != NULL);
+  dir = real;
+  test_client();
+  test_backing();
+  remove_dir(dir);
+  return 0;
+}
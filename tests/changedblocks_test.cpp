@@ -0,0 +1,156 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks the blocks ChangedBlocksFs records for writes, truncates
+ * and O_TRUNC opens, and how its attributes end epochs and page bitmaps.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include "./changedblocks.h"
+#include "./passthrough.h"
+#include "./roaring.h"
+#include "./test.h"
+
+using std::string;
+
+namespace {
+
+const uint64_t kBlock = 1 << ChangedBlocksFs::kBlockShift;
+const uint64_t kPage = ChangedBlocksFs::kPageBlocks;
+const char *kEpoch = "user.wrapperfs.cbt.epoch";
+const char *kChanged = "user.wrapperfs.cbt.changed";
+const char *kFrozen = "user.wrapperfs.cbt.frozen";
+
+typedef std::initializer_list<std::pair<uint64_t, uint64_t>> Ranges;
+
+/// The attribute value listing the blocks in 'ranges' from 'start' on.
+string bitmap(Ranges ranges, uint64_t start = 0,
+              uint64_t end = 1ULL << 32) {
+  RoaringBitmap blocks;
+  for (const auto &range : ranges) {
+    blocks.add_range(range.first, range.second);
+  }
+  string out;
+  blocks.serialize(&out, start, end);
+  return out;
+}
+
+string xattr(ChangedBlocksFs *fs, const char *name) {
+  int size = fs->getxattr("/f", name, NULL, 0);
+  if (size < 0) {
+    return "error " + std::to_string(size);
+  }
+  string value(size, '\0');
+  CHECK(fs->getxattr("/f", name, &value[0], size) == size);
+  return value;
+}
+
+void write_at(ChangedBlocksFs *fs, struct fuse_file_info *fi,
+              uint64_t offset, size_t size) {
+  string data(size, 'x');
+  CHECK(fs->write(data.data(), size, offset, fi) ==
+        static_cast<int>(size));
+}
+
+void test_epochs(ChangedBlocksFs *fs, struct fuse_file_info *fi) {
+  write_at(fs, fi, 0, kBlock + 1);
+  write_at(fs, fi, 10 * kBlock + 5, 10);
+  CHECK(xattr(fs, kChanged) == bitmap({ {0, 2}, {10, 11} }));
+  CHECK(xattr(fs, kFrozen) == bitmap({}));
+
+  string epoch = xattr(fs, kEpoch);
+  CHECK(epoch.size() > 2 && epoch.substr(epoch.size() - 2) == ".0");
+  CHECK(fs->setxattr("/f", kEpoch, "x.0", 3) == -ESTALE);
+  CHECK(fs->setxattr("/f", kEpoch, epoch.data(), epoch.size()) == 0);
+  CHECK(xattr(fs, kChanged) == bitmap({}));
+  CHECK(xattr(fs, kFrozen) == bitmap({ {0, 2}, {10, 11} }));
+  CHECK(xattr(fs, kEpoch) == epoch.substr(0, epoch.size() - 1) + "1");
+  // Only the current epoch can be ended.
+  CHECK(fs->setxattr("/f", kEpoch, epoch.data(), epoch.size()) == -ESTALE);
+}
+
+void test_truncate(ChangedBlocksFs *fs, struct fuse_file_info *fi) {
+  string epoch = xattr(fs, kEpoch);
+  CHECK(fs->setxattr("/f", kEpoch, epoch.data(), epoch.size()) == 0);
+  // Growing from 10 blocks and 15 bytes zeroes the rest of block 10.
+  CHECK(fs->truncate("/f", 20 * kBlock + 5) == 0);
+  CHECK(xattr(fs, kChanged) == bitmap({ {10, 21} }));
+  // Shrinking drops every block past the new end.
+  CHECK(fs->truncate("/f", 5 * kBlock) == 0);
+  CHECK(xattr(fs, kChanged) == bitmap({ {5, 21} }));
+  // So does cutting the file to nothing on open.
+  write_at(fs, fi, 7 * kBlock, 1);
+  struct fuse_file_info trunc = {};
+  trunc.flags = O_WRONLY | O_TRUNC;
+  CHECK(fs->open("/f", &trunc) == 0);
+  CHECK(fs->release(&trunc) == 0);
+  CHECK(xattr(fs, kChanged) == bitmap({ {0, 21} }));
+  // Cutting an empty file changes nothing.
+  epoch = xattr(fs, kEpoch);
+  CHECK(fs->setxattr("/f", kEpoch, epoch.data(), epoch.size()) == 0);
+  CHECK(fs->open("/f", &trunc) == 0);
+  CHECK(fs->release(&trunc) == 0);
+  CHECK(xattr(fs, kChanged) == bitmap({}));
+}
+
+void test_pages(ChangedBlocksFs *fs, struct fuse_file_info *fi) {
+  // One block in the first page and one in the second.
+  write_at(fs, fi, 3 * kBlock, 1);
+  write_at(fs, fi, (kPage + 7) * kBlock, 1);
+  Ranges blocks = { {3, 4}, {kPage + 7, kPage + 8} };
+  CHECK(xattr(fs, kChanged) == bitmap(blocks));
+  string page0 = string(kChanged) + ".0";
+  string page1 = string(kChanged) + ".1";
+  string page2 = string(kChanged) + ".2";
+  CHECK(xattr(fs, page0.c_str()) == bitmap(blocks, 0, kPage));
+  CHECK(xattr(fs, page1.c_str()) == bitmap(blocks, kPage, 2 * kPage));
+  CHECK(xattr(fs, page2.c_str()) == bitmap({}, 2 * kPage, 3 * kPage));
+  CHECK(xattr(fs, page0.c_str()) != xattr(fs, page1.c_str()));
+
+  string frozen = string(kFrozen) + ".1";
+  CHECK(xattr(fs, frozen.c_str()) == bitmap({}, kPage, 2 * kPage));
+  // Malformed and out of range page numbers.
+  string malformed[] = {
+    string(kChanged) + ".", string(kChanged) + ".-1",
+    string(kChanged) + ".1x", string(kEpoch) + ".0",
+    string(kChanged) + "." + std::to_string((1ULL << 32) / kPage),
+  };
+  for (const string &name : malformed) {
+    CHECK(fs->getxattr("/f", name.c_str(), NULL, 0) == -ENODATA);
+  }
+}
+
+}  // namespace
+
+int main() {
+  string dir = test_dir("changedblocks_test");
+  ChangedBlocksFs fs(new PassthroughFs(dir, 0));
+  struct fuse_file_info fi = {};
+  fi.flags = O_RDWR | O_CREAT;
+  CHECK(fs.create("/f", 0644, &fi) == 0);
+  test_epochs(&fs, &fi);
+  test_truncate(&fs, &fi);
+  test_pages(&fs, &fi);
+  CHECK(fs.release(&fi) == 0);
+  remove_dir(dir);
+  return 0;
+}
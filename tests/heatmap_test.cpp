@@ -0,0 +1,129 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks the heatmap offset buckets, the sampling rate and that a
+ * full ring drops samples instead of overwriting them.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include "./heatmap.h"
+#include "./stats.h"
+#include "./tunables.h"
+#include "./test.h"
+
+namespace {
+
+uint64_t counter(const char *name) {
+  uint64_t value = 0;
+  stats_for_each([&](const Counter &c) {
+    if (strcmp(c.name(), name) == 0) {
+      value = c.value();
+    }
+  });
+  return value;
+}
+
+std::string report() {
+  std::string out;
+  heatmap.report(&out);
+  return out;
+}
+
+void test_buckets() {
+  CHECK(heatmap.configure("rate=1") == 0);
+  CHECK(tunables().heatmap_rate == 1);
+  heatmap.count(Heatmap::READ, "/a", 0, 10);
+  heatmap.count(Heatmap::READ, "/a", 1, 10);
+  heatmap.count(Heatmap::READ, "/a", 3, 10);
+  // [4K, 8K) is one bucket.
+  heatmap.count(Heatmap::READ, "/a", 4096, 10);
+  heatmap.count(Heatmap::READ, "/a", 8191, 20);
+  heatmap.count(Heatmap::WRITE, "/a", 1ULL << 30, 4096);
+  heatmap.count(Heatmap::WRITE, "/a", UINT64_MAX, 1);
+  for (int i = 0; i < 10; i++) {
+    heatmap.count(Heatmap::WRITE, "/b", 8192, 1);
+  }
+  std::string out = report();
+  // Busiest file first.
+  CHECK(out.find("file /b\n  write 8K:10/10\n") != std::string::npos);
+  CHECK(out.find("file /a\n  read 0:1/10 1:1/10 2:1/10 4K:2/30\n"
+                 "  write 1G:1/4096 8E:1/1\n") != std::string::npos);
+  CHECK(out.find("file /b") < out.find("file /a"));
+
+  CHECK(heatmap.configure("clear") == 0);
+  CHECK(report().find("file ") == std::string::npos);
+}
+
+void test_rate() {
+  CHECK(heatmap.configure("rate=4") == 0);
+  // A thread samples its first operation, then one in every four.
+  std::thread thread([] {
+    for (int i = 0; i < 9; i++) {
+      heatmap.count(Heatmap::READ, "/c", 0, 1);
+    }
+  });
+  thread.join();
+  CHECK(report().find("file /c\n  read 0:3/3\n") != std::string::npos);
+
+  CHECK(heatmap.configure("rate=0 clear") == 0);
+  heatmap.count(Heatmap::READ, "/c", 0, 1);
+  CHECK(report().find("file ") == std::string::npos);
+
+  // Bad requests change nothing.
+  CHECK(heatmap.configure("rate=2 speed=1") == -EINVAL);
+  CHECK(heatmap.configure("rate=-1") == -EINVAL);
+  CHECK(tunables().heatmap_rate == 0);
+}
+
+void test_full_ring() {
+  CHECK(heatmap.configure("rate=1") == 0);
+  uint64_t dropped = counter("heatmap.dropped");
+  // Rings hold 512 samples between two drains.
+  for (int i = 0; i < 600; i++) {
+    heatmap.count(Heatmap::WRITE, "/d", 0, 1);
+  }
+  CHECK(counter("heatmap.dropped") == dropped + 88);
+  CHECK(report().find("file /d\n  write 0:512/512\n") != std::string::npos);
+
+  // Drained, the ring takes samples again.
+  heatmap.count(Heatmap::WRITE, "/d", 0, 1);
+  CHECK(report().find("write 0:513/513\n") != std::string::npos);
+}
+
+void test_drainer() {
+  CHECK(heatmap.configure("clear") == 0);
+  heatmap.start();
+  heatmap.count(Heatmap::READ, "/e", 0, 1);
+  heatmap.stop();
+  CHECK(report().find("file /e\n  read 0:1/1\n") != std::string::npos);
+}
+
+}  // namespace
+
+int main() {
+  tunables_init(Tunables());
+  heatmap.init();
+  test_buckets();
+  test_rate();
+  test_full_ring();
+  test_drainer();
+  return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks the change journal ring: records read back in order across
+ * its wrap, readers that fell behind are told so, and a reader racing with
+ * the writer never returns a torn record.
+ */
+
+#include <errno.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "./journal.h"
+#include "./test.h"
+
+/// Stands in for libfuse's: every change is made by the same caller.
+struct fuse_context *fuse_get_context(void) {
+  static struct fuse_context context;
+  context.uid = 42;
+  context.pid = 7;
+  return &context;
+}
+
+namespace {
+
+const uint64_t kCapacity = 1 << 20;
+
+std::string dir;
+
+/// The path written for record 'seq', long enough to wrap often.
+std::string path_for(uint64_t seq) {
+  return "/" + std::string(1000 + seq % 2000, 'a' + seq % 26) +
+      std::to_string(seq);
+}
+
+void test_records() {
+  std::string file = dir + "/records";
+  CHECK(journal.open(file, kCapacity) == 0);
+  journal.append(JOURNAL_CREATE, "/a", NULL, 0644);
+  journal.append(JOURNAL_WRITE, "/a", NULL, 4096, 100);
+  journal.append(JOURNAL_RENAME, "/a", "/b");
+  // Not part of the tree.
+  journal.append(JOURNAL_CREATE, "/.wrapperfs/config", NULL, 0644);
+
+  JournalReader reader;
+  CHECK(reader.open(file) == 0);
+  JournalReader::Cursor cursor = reader.oldest();
+  CHECK(cursor.seq == 1);
+  JournalChange change;
+  CHECK(reader.next(&cursor, &change) == 1);
+  CHECK(change.seq == 1);
+  CHECK(change.op == JOURNAL_CREATE);
+  CHECK(change.path == "/a");
+  CHECK(change.arg[0] == 0644);
+  CHECK(change.uid == 42);
+  CHECK(change.pid == 7);
+  CHECK(reader.next(&cursor, &change) == 1);
+  CHECK(change.op == JOURNAL_WRITE);
+  CHECK(change.arg[0] == 4096);
+  CHECK(change.arg[1] == 100);
+  CHECK(reader.next(&cursor, &change) == 1);
+  CHECK(change.op == JOURNAL_RENAME);
+  CHECK(change.path2 == "/b");
+  CHECK(reader.next(&cursor, &change) == 0);
+
+  // Sequence numbers carry on across mounts, even of a resized journal.
+  journal.close();
+  CHECK(journal.open(file, kCapacity) == 0);
+  journal.append(JOURNAL_UNLINK, "/b");
+  CHECK(reader.next(&cursor, &change) == 1);
+  CHECK(change.seq == 4);
+  journal.close();
+  CHECK(journal.open(file, 2 * kCapacity) == 0);
+  journal.append(JOURNAL_UNLINK, "/c");
+  journal.close();
+  CHECK(reader.open(file) == 0);
+  cursor = reader.oldest();
+  CHECK(reader.next(&cursor, &change) == 1);
+  CHECK(change.seq == 5);
+  CHECK(change.path == "/c");
+}
+
+void test_wrap() {
+  std::string file = dir + "/wrap";
+  CHECK(journal.open(file, kCapacity) == 0);
+  JournalReader reader;
+  CHECK(reader.open(file) == 0);
+  JournalReader::Cursor behind = reader.oldest();
+  for (uint64_t seq = 1; seq <= 5000; seq++) {
+    journal.append(JOURNAL_UNLINK, path_for(seq).c_str());
+  }
+
+  // Only the latest records are kept, all of them in order.
+  JournalReader::Cursor cursor = reader.oldest();
+  JournalReader::Cursor end = reader.end();
+  CHECK(end.seq == 5001);
+  CHECK(cursor.seq > 1);
+  CHECK(end.pos - cursor.pos <= kCapacity);
+  JournalChange change;
+  uint64_t seq = cursor.seq;
+  while (reader.next(&cursor, &change) == 1) {
+    CHECK(change.seq == seq);
+    CHECK(change.path == path_for(seq));
+    seq++;
+  }
+  CHECK(seq == end.seq);
+
+  // A reader left at the start has fallen behind.
+  JournalReader::Cursor oldest = reader.oldest();
+  CHECK(reader.next(&behind, &change) == -ESTALE);
+  CHECK(behind.seq == oldest.seq);
+  CHECK(behind.pos == oldest.pos);
+  CHECK(reader.seek(1, &cursor) == -ESTALE);
+  CHECK(cursor.seq == oldest.seq);
+  CHECK(reader.seek(4990, &cursor) == 0);
+  CHECK(reader.next(&cursor, &change) == 1);
+  CHECK(change.path == path_for(4990));
+  journal.close();
+}
+
+void test_racing_reader() {
+  std::string file = dir + "/race";
+  CHECK(journal.open(file, kCapacity) == 0);
+  std::atomic<bool> done(false);
+  std::atomic<uint64_t> read(0);
+  std::atomic<uint64_t> stale(0);
+  std::thread reader_thread([&] {
+    JournalReader reader;
+    CHECK(reader.open(file) == 0);
+    JournalChange change;
+    // The oldest record is the next one the writer overwrites.
+    while (!done) {
+      JournalReader::Cursor cursor = reader.oldest();
+      int ret = reader.next(&cursor, &change);
+      if (ret == -ESTALE) {
+        stale++;
+        continue;
+      }
+      // Never a half-overwritten record.
+      CHECK(ret >= 0);
+      if (ret == 1) {
+        CHECK(change.path == path_for(change.seq));
+        read++;
+      }
+    }
+  });
+  for (uint64_t seq = 1; seq <= 100000; seq++) {
+    journal.append(JOURNAL_UNLINK, path_for(seq).c_str());
+  }
+  done = true;
+  reader_thread.join();
+  CHECK(read > 0);
+  journal.close();
+}
+
+}  // namespace
+
+int main() {
+  dir = test_dir("journal_test");
+  test_records();
+  test_wrap();
+  test_racing_reader();
+  remove_dir(dir);
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Replays the kv store after reopening, after a torn write and
+ * after compaction, including compaction racing writers.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "./kvstore.h"
+#include "./test.h"
+
+using std::string;
+
+namespace {
+
+string value_of(const KvStore &store, const string &key) {
+  string value;
+  return store.get(key, &value) ? value : "<none>";
+}
+
+/// What every test below expects to find.
+void check_contents(const KvStore &store) {
+  CHECK(store.size() == 3);
+  CHECK(value_of(store, "a") == "<none>");
+  CHECK(value_of(store, "b") == "2");
+  CHECK(value_of(store, "c") == "33");
+  CHECK(value_of(store, "d") == "4");
+}
+
+void test_reopen(const string &dir) {
+  KvStore store;
+  CHECK(store.open(dir) == 0);
+  CHECK(store.put("a", "1") == 0);
+  CHECK(store.put("b", "2") == 0);
+  CHECK(store.put("c", "3") == 0);
+  CHECK(store.del("a") == 0);
+  KvBatch batch;
+  batch.put("c", "33");
+  batch.put("d", "4");
+  CHECK(store.write(batch) == 0);
+  check_contents(store);
+  store.close();
+
+  KvStore reopened;
+  CHECK(reopened.open(dir) == 0);
+  check_contents(reopened);
+}
+
+/// A record cut short by a crash is dropped, and cut off so that later
+/// records are not appended behind it.
+void test_torn_tail(const string &dir) {
+  string log = dir + "/kv.log";
+  off_t size = file_size(log);
+  CHECK(size > 0);
+  int fd = open(log.c_str(), O_WRONLY | O_APPEND);
+  CHECK(fd != -1);
+  // A header promising 100 bytes, followed by only 10.
+  char torn[18] = { 100 };
+  CHECK(write(fd, torn, sizeof(torn)) == sizeof(torn));
+  close(fd);
+
+  {
+    KvStore store;
+    CHECK(store.open(dir) == 0);
+    check_contents(store);
+    CHECK(file_size(log) == size);
+    CHECK(store.put("e", "5") == 0);
+  }
+  KvStore store;
+  CHECK(store.open(dir) == 0);
+  CHECK(value_of(store, "e") == "5");
+  CHECK(store.del("e") == 0);
+}
+
+void test_compact(const string &dir) {
+  {
+    KvStore store;
+    CHECK(store.open(dir) == 0);
+    CHECK(store.compact() == 0);
+    CHECK(file_size(dir + "/kv.log") == 0);
+    CHECK(file_size(dir + "/kv.snap") > 0);
+    check_contents(store);
+    CHECK(store.put("b", "22") == 0);
+  }
+  KvStore store;
+  CHECK(store.open(dir) == 0);
+  CHECK(store.size() == 3);
+  CHECK(value_of(store, "b") == "22");
+  CHECK(value_of(store, "c") == "33");
+}
+
+/// Writes made while the snapshot is written stay in the log.
+void test_compact_while_writing(const string &dir) {
+  const int kKeys = 5000;
+  {
+    KvStore store;
+    CHECK(store.open(dir) == 0);
+    std::atomic<bool> done(false);
+    std::thread writer([&store, &done] {
+      for (int i = 0; i < kKeys; i++) {
+        CHECK(store.put("k" + std::to_string(i), std::to_string(i)) == 0);
+        if (i % 2) {
+          CHECK(store.del("k" + std::to_string(i - 1)) == 0);
+        }
+      }
+      done = true;
+    });
+    while (!done) {
+      CHECK(store.compact() == 0);
+    }
+    writer.join();
+    CHECK(store.put("last", "1") == 0);
+  }
+  KvStore store;
+  CHECK(store.open(dir) == 0);
+  CHECK(store.size() == 3 + kKeys / 2 + 1);
+  for (int i = 0; i < kKeys; i++) {
+    string key = "k" + std::to_string(i);
+    CHECK(value_of(store, key) == (i % 2 ? std::to_string(i) : "<none>"));
+  }
+  CHECK(value_of(store, "last") == "1");
+}
+
+}  // namespace
+
+int main() {
+  string dir = test_dir("kvstore_test");
+  test_reopen(dir);
+  test_torn_tail(dir);
+  test_compact(dir);
+  test_compact_while_writing(dir);
+  remove_dir(dir);
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks that LazyTimes serves and writes out deferred times, moves
+ * them along with renames and forgets those of removed files.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include "./lazytimes.h"
+#include "./test.h"
+
+namespace {
+
+std::string dir;
+
+std::string create(const std::string &name) {
+  std::string path = dir + "/" + name;
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  CHECK(fd != -1);
+  CHECK(close(fd) == 0);
+  return path;
+}
+
+/// Sets the mtime of 'path' to 'sec', leaving its atime alone.
+void set_mtime(LazyTimes *times, const std::string &path, time_t sec) {
+  struct timespec tv[2];
+  tv[0].tv_sec = 0;
+  tv[0].tv_nsec = UTIME_OMIT;
+  tv[1].tv_sec = sec;
+  tv[1].tv_nsec = 123;
+  times->set(path, tv);
+}
+
+/// The mtime on disk.
+time_t disk_mtime(const std::string &path) {
+  struct stat stbuf;
+  CHECK(stat(path.c_str(), &stbuf) == 0);
+  return stbuf.st_mtim.tv_sec;
+}
+
+/// The mtime getattr would report.
+time_t served_mtime(LazyTimes *times, const std::string &path) {
+  struct stat stbuf;
+  CHECK(stat(path.c_str(), &stbuf) == 0);
+  times->get(path, &stbuf);
+  return stbuf.st_mtim.tv_sec;
+}
+
+void test_deferred() {
+  LazyTimes times;
+  std::string a = create("a");
+  time_t now = disk_mtime(a);
+  set_mtime(&times, a, 1000);
+  CHECK(served_mtime(&times, a) == 1000);
+  CHECK(disk_mtime(a) == now);
+
+  times.flush(a);
+  CHECK(disk_mtime(a) == 1000);
+  struct stat stbuf;
+  CHECK(stat(a.c_str(), &stbuf) == 0);
+  CHECK(stbuf.st_mtim.tv_nsec == 123);
+  CHECK(unlink(a.c_str()) == 0);
+}
+
+void test_renamed() {
+  LazyTimes times;
+  std::string a = create("a");
+  std::string b = create("b");
+  set_mtime(&times, a, 1000);
+  set_mtime(&times, b, 2000);
+  // 'a' replaces 'b': b's pending times go with it.
+  CHECK(rename(a.c_str(), b.c_str()) == 0);
+  times.renamed(a, b);
+  CHECK(served_mtime(&times, b) == 1000);
+  CHECK(times.flush_all() == 0);
+  CHECK(disk_mtime(b) == 1000);
+
+  // Whole directories move, and neighbours sharing the prefix stay.
+  CHECK(mkdir((dir + "/d").c_str(), 0755) == 0);
+  std::string x = create("d/x");
+  std::string d2 = create("d2");
+  set_mtime(&times, x, 3000);
+  set_mtime(&times, d2, 4000);
+  CHECK(rename((dir + "/d").c_str(), (dir + "/e").c_str()) == 0);
+  times.renamed(dir + "/d", dir + "/e");
+  std::string y = dir + "/e/x";
+  CHECK(served_mtime(&times, y) == 3000);
+  CHECK(served_mtime(&times, d2) == 4000);
+
+  // A descriptor open under the old name flushes the new one on close.
+  int fd = open(y.c_str(), O_RDONLY);
+  CHECK(fd != -1);
+  times.opened(fd, y);
+  CHECK(rename(y.c_str(), b.c_str()) == 0);
+  times.renamed(y, b);
+  times.closed(fd);
+  CHECK(close(fd) == 0);
+  CHECK(disk_mtime(b) == 3000);
+  CHECK(disk_mtime(d2) != 4000);
+}
+
+void test_forget() {
+  LazyTimes times;
+  std::string f = create("f");
+  set_mtime(&times, f, 1000);
+  CHECK(unlink(f.c_str()) == 0);
+  times.forget(f);
+  // A new file by that name must not get them.
+  f = create("f");
+  CHECK(served_mtime(&times, f) != 1000);
+  CHECK(times.flush_all() == 0);
+  CHECK(disk_mtime(f) != 1000);
+
+  CHECK(mkdir((dir + "/g").c_str(), 0755) == 0);
+  std::string z = create("g/z");
+  std::string g2 = create("g2");
+  set_mtime(&times, z, 2000);
+  set_mtime(&times, g2, 2000);
+  times.forget(dir + "/g", true);
+  CHECK(served_mtime(&times, z) != 2000);
+  CHECK(served_mtime(&times, g2) == 2000);
+}
+
+}  // namespace
+
+int main() {
+  dir = test_dir("lazytimes_test");
+  test_deferred();
+  test_renamed();
+  test_forget();
+  remove_dir(dir);
+  return 0;
+}
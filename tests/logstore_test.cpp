@@ -0,0 +1,119 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Reads back writes to the log store, replays its segments after a
+ * restart and cleans them.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include "./logstore.h"
+#include "./test.h"
+
+using std::string;
+
+namespace {
+
+const uint64_t kFile = 7;
+
+/// 500 bytes of 'a', 50 of 'b': what kFile holds once written.
+void check_file(LogStore *store, int fd) {
+  char buf[1000];
+  CHECK(store->read(kFile, fd, buf, sizeof(buf), 0) == 550);
+  CHECK(string(buf, 500) == string(500, 'a'));
+  CHECK(string(buf + 500, 50) == string(50, 'b'));
+  CHECK(store->read(kFile, fd, buf, sizeof(buf), 540) == 10);
+  CHECK(buf[0] == 'b');
+}
+
+void test_write(const string &dir, int fd) {
+  LogStore store;
+  CHECK(store.init(dir) == 0);
+  CHECK(store.open(kFile, 0) == 0);
+  string a(10000, 'a');
+  CHECK(store.write(kFile, fd, a.data(), a.size(), 0) == 10000);
+  // Overwritten over and over, leaving mostly dead records behind.
+  string b(100, 'b');
+  for (int i = 0; i < 1000; i++) {
+    CHECK(store.write(kFile, fd, b.data(), b.size(), 500) == 100);
+  }
+  char buf[700];
+  CHECK(store.read(kFile, fd, buf, sizeof(buf), 0) == 700);
+  CHECK(buf[499] == 'a' && buf[500] == 'b' && buf[599] == 'b' &&
+        buf[600] == 'a');
+  // The caller truncates the backing file after the store.
+  CHECK(store.truncate(kFile, 550) == 0);
+  CHECK(ftruncate(fd, 550) == 0);
+  check_file(&store, fd);
+  store.release(kFile);
+  CHECK(store.sync() == 0);
+}
+
+void test_replay(const string &dir, int fd) {
+  LogStore store;
+  CHECK(store.init(dir) == 0);
+  CHECK(store.open(kFile, 550) == 0);
+  check_file(&store, fd);
+  store.release(kFile);
+}
+
+void test_clean(const string &dir, int fd) {
+  {
+    LogStore store;
+    CHECK(store.init(dir) == 0);
+    CHECK(store.open(kFile, 550) == 0);
+    CHECK(store.clean_one(0.5));
+    check_file(&store, fd);
+    store.release(kFile);
+    CHECK(store.sync() == 0);
+  }
+  // The live extents and the truncate record were carried over.
+  test_replay(dir, fd);
+}
+
+void test_drop(const string &dir, int fd) {
+  {
+    LogStore store;
+    CHECK(store.init(dir) == 0);
+    CHECK(store.drop(kFile) == 0);
+    CHECK(store.sync() == 0);
+  }
+  LogStore store;
+  CHECK(store.init(dir) == 0);
+  CHECK(store.open(kFile, 550) == 0);
+  // Only the sparse backing file is left.
+  char buf[1000];
+  CHECK(store.read(kFile, fd, buf, sizeof(buf), 0) == 550);
+  CHECK(string(buf, 550) == string(550, '\0'));
+  store.release(kFile);
+}
+
+}  // namespace
+
+int main() {
+  string dir = test_dir("logstore_test");
+  int fd = open((dir + "/file").c_str(), O_RDWR | O_CREAT, 0600);
+  CHECK(fd != -1);
+  test_write(dir + "/log", fd);
+  test_replay(dir + "/log", fd);
+  test_clean(dir + "/log", fd);
+  test_drop(dir + "/log", fd);
+  close(fd);
+  remove_dir(dir);
+  return 0;
+}
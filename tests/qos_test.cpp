@@ -0,0 +1,167 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks the token buckets and the QoS scheduler: throttling,
+ * configuration parsing and weighted fair queuing between tenants.
+ */
+
+#include <errno.h>
+#include <fuse.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./qos.h"
+#include "./timing.h"
+#include "./tokenbucket.h"
+#include "./test.h"
+
+/// Stands in for libfuse's: each thread is a caller of its own.
+struct fuse_context *fuse_get_context(void) {
+  static thread_local struct fuse_context context;
+  return &context;
+}
+
+namespace {
+
+const uint64_t kSecond = 1000000000;
+
+/// Number of operations waiting in the fair queue.
+size_t queued() {
+  std::string out;
+  qos.metrics(&out);
+  unsigned long count = 0;  // NOLINT
+  size_t at = out.find("\nwrapperfs_qos_queued ");
+  CHECK(at != std::string::npos);
+  CHECK(sscanf(&out[at], "\nwrapperfs_qos_queued %lu", &count) == 1);
+  return count;
+}
+
+void test_bucket() {
+  TokenBucket unlimited;
+  CHECK(unlimited.reserve(1e9, kSecond) == kSecond);
+
+  TokenBucket bucket(10, 10);
+  CHECK(bucket.reserve(10, kSecond) == kSecond);
+  // Empty: one more token takes a tenth of a second to accrue.
+  CHECK(bucket.reserve(1, kSecond) == kSecond + kSecond / 10);
+  // The debt is repaid first, then the bucket refills up to its burst.
+  CHECK(bucket.reserve(10, 3 * kSecond) == 3 * kSecond);
+  CHECK(bucket.reserve(1, 3 * kSecond) > 3 * kSecond);
+
+  // A bucket that was unlimited starts out full.
+  unlimited.set_rate(5, 5);
+  CHECK(unlimited.reserve(5, kSecond) == kSecond);
+  CHECK(unlimited.reserve(5, kSecond) == 2 * kSecond);
+}
+
+void test_configure() {
+  CHECK(qos.configure("default iops=100\n7 mbps=2 weight=3\n") == 0);
+  const char *bad[] = {
+    "7 iops\n", "7 iops=-1\n", "7 weight=0\n", "7 speed=1\n",
+    "x7 iops=1\n", "7 iops=1x\n",
+  };
+  for (const char *text : bad) {
+    CHECK(qos.configure(text) == -EINVAL);
+  }
+  std::string out;
+  qos.report(&out);
+  CHECK(out.find("default iops=100 mbps=0 weight=1\n") != std::string::npos);
+  CHECK(out.find("7 iops=0 mbps=2 weight=3\n") != std::string::npos);
+
+  CHECK(qos.configure("# nothing\n\n") == 0);
+  out.clear();
+  qos.report(&out);
+  CHECK(out.find("default iops=0 mbps=0 weight=1\n") != std::string::npos);
+  CHECK(out.find("\n7 ") == std::string::npos);
+}
+
+void test_throttle() {
+  qos.init(QosScheduler::BY_UID, 0);
+  CHECK(qos.configure("1 iops=10\n") == 0);
+  fuse_get_context()->uid = 1;
+  uint64_t start = now_ns();
+  // The first second's worth passes at once, the next op waits for a token.
+  for (int i = 0; i < 10; i++) {
+    qos.begin(0);
+    qos.end();
+  }
+  CHECK(now_ns() - start < kSecond / 20);
+  qos.begin(0);
+  qos.end();
+  CHECK(now_ns() - start >= kSecond / 20);
+
+  // Other tenants are not held back.
+  fuse_get_context()->uid = 2;
+  start = now_ns();
+  for (int i = 0; i < 20; i++) {
+    qos.begin(0);
+    qos.end();
+  }
+  CHECK(now_ns() - start < kSecond / 20);
+}
+
+void test_fair_queue() {
+  qos.init(QosScheduler::BY_UID, 1);
+  CHECK(qos.configure("1 weight=1\n2 weight=4\n") == 0);
+  std::mutex mutex;
+  std::vector<int> order;
+  auto run = [&](int uid) {
+    fuse_get_context()->uid = uid;
+    qos.begin(0);
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      order.push_back(uid);
+    }
+    qos.end();
+  };
+
+  // Hold the only slot, then queue tenant 1 ahead of tenant 2.
+  fuse_get_context()->uid = 3;
+  qos.begin(0);
+  std::thread first(run, 1);
+  while (queued() < 1) {
+    usleep(1000);
+  }
+  std::thread second(run, 2);
+  while (queued() < 2) {
+    usleep(1000);
+  }
+  CHECK(order.empty());
+  qos.end();
+  first.join();
+  second.join();
+
+  // The heavier tenant finishes its share first and so goes first.
+  CHECK(order.size() == 2);
+  CHECK(order[0] == 2);
+  CHECK(order[1] == 1);
+  CHECK(queued() == 0);
+}
+
+}  // namespace
+
+int main() {
+  test_bucket();
+  test_configure();
+  test_throttle();
+  test_fair_queue();
+  return 0;
+}
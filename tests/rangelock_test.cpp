@@ -0,0 +1,174 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks which ranges of a RangeLock wait for which, and that the
+ * longest range shrinks back as ranges are released.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "./rangelock.h"
+#include "./stats.h"
+#include "./test.h"
+
+namespace {
+
+uint64_t waits() {
+  uint64_t value = 0;
+  stats_for_each([&value](const Counter &counter) {
+    if (strcmp(counter.name(), "rangelock.waits") == 0) {
+      value = counter.value();
+    }
+  });
+  return value;
+}
+
+/// Locks [start, end) in a thread of its own until released.
+class Locker {
+ public:
+  Locker(RangeLock *lock, uint64_t start, uint64_t end, bool exclusive)
+      : held_(false), release_(false) {
+    thread_ = std::thread([=] {
+      RangeLock::Guard guard(lock, start, end, exclusive);
+      held_ = true;
+      while (!release_) {
+        usleep(1000);
+      }
+    });
+  }
+  ~Locker() {
+    release();
+  }
+
+  bool held() const { return held_; }
+
+  /// Waits until the range is granted.
+  void wait_held() const {
+    while (!held_) {
+      usleep(1000);
+    }
+  }
+
+  void release() {
+    release_ = true;
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+ private:
+  std::atomic<bool> held_;
+  std::atomic<bool> release_;
+  std::thread thread_;
+};
+
+/// Starts a Locker and returns once it holds its range or waits for it.
+std::unique_ptr<Locker> start(RangeLock *lock, uint64_t start, uint64_t end,
+                              bool exclusive) {
+  uint64_t before = waits();
+  std::unique_ptr<Locker> locker(new Locker(lock, start, end, exclusive));
+  while (!locker->held() && waits() == before) {
+    usleep(1000);
+  }
+  return locker;
+}
+
+void test_disjoint() {
+  RangeLock lock;
+  // Ranges are half open, so adjacent writes do not conflict.
+  RangeLock::Guard first(&lock, 0, 100, true);
+  RangeLock::Guard second(&lock, 100, 200, true);
+  RangeLock::Guard far(&lock, 1 << 20, (1 << 20) + 1, true);
+  RangeLock::Guard shared(&lock, 300, 400, false);
+  RangeLock::Guard sharing(&lock, 350, 450, false);
+  auto locker = start(&lock, 200, 300, true);
+  CHECK(locker->held());
+}
+
+void test_overlap() {
+  RangeLock lock;
+  std::unique_ptr<Locker> reader, writer, apart;
+  {
+    RangeLock::Guard write(&lock, 100, 200, true);
+    reader = start(&lock, 150, 160, false);
+    writer = start(&lock, 0, 101, true);
+    apart = start(&lock, 200, 300, true);
+    CHECK(!reader->held());
+    CHECK(!writer->held());
+    CHECK(apart->held());
+  }
+  reader->wait_held();
+  writer->wait_held();
+}
+
+void test_arrival_order() {
+  RangeLock lock;
+  auto reader = start(&lock, 0, 10, false);
+  CHECK(reader->held());
+  auto writer = start(&lock, 5, 6, true);
+  CHECK(!writer->held());
+  // Shares with the first reader, but came after the writer.
+  auto late = start(&lock, 0, 10, false);
+  CHECK(!late->held());
+
+  reader->release();
+  writer->wait_held();
+  usleep(10000);
+  CHECK(!late->held());
+  writer->release();
+  late->wait_held();
+}
+
+void test_longest() {
+  RangeLock lock;
+  CHECK(lock.longest() == 0);
+  std::unique_ptr<Locker> reader;
+  {
+    RangeLock::Guard small(&lock, 0, 1000, true);
+    {
+      RangeLock::Guard truncate(&lock, 5000, UINT64_MAX, true);
+      CHECK(lock.longest() == UINT64_MAX - 5000);
+    }
+    CHECK(lock.longest() == 1000);
+    // Still found when looking back from its own start.
+    reader = start(&lock, 900, 950, false);
+    CHECK(!reader->held());
+    {
+      RangeLock::Guard shorter(&lock, 2000, 2010, true);
+      CHECK(lock.longest() == 1000);
+    }
+    CHECK(lock.longest() == 1000);
+  }
+  reader->wait_held();
+  CHECK(lock.longest() == 50);
+  reader->release();
+  CHECK(lock.longest() == 0);
+}
+
+}  // namespace
+
+int main() {
+  test_disjoint();
+  test_overlap();
+  test_arrival_order();
+  test_longest();
+  return 0;
+}
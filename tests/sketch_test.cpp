@@ -0,0 +1,131 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks the count-min sketch error bounds and that TopK keeps the
+ * heaviest keys of a skewed stream, in order.
+ */
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "./sketch.h"
+#include "./test.h"
+
+namespace {
+
+uint64_t hash(const std::string &key) {
+  return std::hash<std::string>()(key);
+}
+
+void test_sketch() {
+  CountMinSketch sketch(1024, 4);
+  std::map<std::string, uint64_t> truth;
+  uint64_t total = 0;
+  uint32_t seed = 1;
+  for (int i = 0; i < 100000; i++) {
+    seed = seed * 1103515245 + 12345;
+    std::string key = "key" + std::to_string(seed % 5000);
+    sketch.add(hash(key), 1);
+    truth[key]++;
+    total++;
+  }
+  // Never under, and over by e/width of the total with high probability.
+  size_t over = 0;
+  for (const auto &it : truth) {
+    uint64_t estimate = sketch.estimate(hash(it.first));
+    CHECK(estimate >= it.second);
+    if (estimate > it.second + total * 2.72 / 1024) {
+      over++;
+    }
+  }
+  CHECK(over < truth.size() / 50);
+
+  CountMinSketch other(1024, 4);
+  other.add(hash("key1"), 1000);
+  uint64_t before = sketch.estimate(hash("key1"));
+  sketch.merge(other);
+  CHECK(sketch.estimate(hash("key1")) >= before + 1000);
+
+  sketch.clear();
+  CHECK(sketch.estimate(hash("key1")) == 0);
+}
+
+void test_top_k() {
+  TopK top(3);
+  top.offer("a", 5);
+  top.offer("b", 1);
+  top.offer("c", 3);
+  std::vector<TopK::Entry> entries = top.sorted();
+  CHECK(entries.size() == 3);
+  CHECK(entries[0] == TopK::Entry("a", 5));
+  CHECK(entries[1] == TopK::Entry("c", 3));
+  CHECK(entries[2] == TopK::Entry("b", 1));
+
+  // Not larger than the smallest: ignored.
+  top.offer("d", 1);
+  // Pushes out the smallest.
+  top.offer("e", 4);
+  // A known key moves up without taking a second slot.
+  top.offer("c", 9);
+  // Estimates only grow.
+  top.offer("a", 2);
+  entries = top.sorted();
+  CHECK(entries.size() == 3);
+  CHECK(entries[0] == TopK::Entry("c", 9));
+  CHECK(entries[1] == TopK::Entry("a", 5));
+  CHECK(entries[2] == TopK::Entry("e", 4));
+
+  top.clear();
+  CHECK(top.sorted().empty());
+  top.offer("b", 1);
+  CHECK(top.sorted().size() == 1);
+}
+
+void test_heavy_hitters() {
+  // A few hot keys in a stream of many cold ones, as in hotpaths.
+  CountMinSketch sketch(2048, 4);
+  TopK top(10);
+  uint32_t seed = 7;
+  for (int i = 0; i < 200000; i++) {
+    seed = seed * 1103515245 + 12345;
+    std::string key;
+    if (seed % 4 == 0) {
+      key = "hot" + std::to_string(seed / 4 % 10);
+    } else {
+      key = "cold" + std::to_string(seed % 20000);
+    }
+    sketch.add(hash(key), 1);
+    top.offer(key, sketch.estimate(hash(key)));
+  }
+  std::vector<TopK::Entry> entries = top.sorted();
+  CHECK(entries.size() == 10);
+  for (size_t i = 0; i < entries.size(); i++) {
+    CHECK(entries[i].first.compare(0, 3, "hot") == 0);
+    CHECK(i == 0 || entries[i - 1].second >= entries[i].second);
+  }
+}
+
+}  // namespace
+
+int main() {
+  test_sketch();
+  test_top_k();
+  test_heavy_hitters();
+  return 0;
+}
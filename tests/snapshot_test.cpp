@@ -0,0 +1,261 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks that a snapshot taken while the tree changes holds the
+ * tree as it was when the snapshot started, that live files do not show
+ * the links snapshots keep to them, and that removing snapshots does not
+ * fail writes to the files they share.
+ */
+
+#include <fcntl.h>
+#include <fuse.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./passthrough.h"
+#include "./snapshot.h"
+#include "./test.h"
+
+using std::string;
+
+namespace {
+
+const int kDirs = 40;
+const int kFiles = 8;
+
+int add_name(void *buf, const char *name, const struct stat*, off_t) {
+  if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+    static_cast<std::vector<string>*>(buf)->push_back(name);
+  }
+  return 0;
+}
+
+string read_file(PassthroughFs *fs, const string &path) {
+  struct fuse_file_info fi = {};
+  fi.flags = O_RDONLY;
+  CHECK(fs->open(path.c_str(), &fi) == 0);
+  char buf[256];
+  int size = fs->read(buf, sizeof(buf), 0, &fi);
+  CHECK(size >= 0);
+  CHECK(fs->release(&fi) == 0);
+  return string(buf, size);
+}
+
+void write_file(PassthroughFs *fs, const string &path, const string &data,
+                struct fuse_file_info *keep = NULL) {
+  struct fuse_file_info fi = {};
+  fi.flags = O_RDWR;
+  CHECK(fs->create(path.c_str(), 0644, &fi) == 0);
+  CHECK(fs->write(data.data(), data.size(), 0, &fi) ==
+        static_cast<int>(data.size()));
+  if (keep) {
+    *keep = fi;
+  } else {
+    CHECK(fs->release(&fi) == 0);
+  }
+}
+
+/// Describes every entry below 'dir' (relative to it): its type, mode,
+/// times and contents.
+void describe(PassthroughFs *fs, const string &dir, const string &rel,
+              std::map<string, string> *out) {
+  std::vector<string> names;
+  string listed = dir.empty() && rel.empty() ? "/" : dir + rel;
+  CHECK(fs->readdir(listed.c_str(), &names, add_name, 0) == 0);
+  for (const string &name : names) {
+    string path = rel + "/" + name;
+    struct stat stbuf;
+    CHECK(fs->getattr((dir + path).c_str(), &stbuf) == 0);
+    string &entry = (*out)[path];
+    entry = std::to_string(stbuf.st_mode) + " " +
+        std::to_string(stbuf.st_size);
+    if (S_ISDIR(stbuf.st_mode)) {
+      describe(fs, dir, path, out);
+    } else {
+      entry += " " + std::to_string(stbuf.st_mtim.tv_sec) + "." +
+          std::to_string(stbuf.st_mtim.tv_nsec) + " " +
+          read_file(fs, dir + path);
+    }
+  }
+}
+
+void populate(PassthroughFs *fs, std::vector<struct fuse_file_info> *open) {
+  for (int d = 0; d < kDirs; d++) {
+    string dir = "/d" + std::to_string(d);
+    CHECK(fs->mkdir(dir.c_str(), 0755) == 0);
+    CHECK(fs->mkdir((dir + "/sub").c_str(), 0755) == 0);
+    for (int f = 0; f < kFiles; f++) {
+      string path = dir + (f % 2 ? "/sub/f" : "/f") + std::to_string(f);
+      write_file(fs, path, "old " + path, f == 0 ? &(*open)[d] : NULL);
+    }
+  }
+}
+
+/// Changes directory 'd' in one of several ways.
+void change(PassthroughFs *fs, int d, struct fuse_file_info *fi) {
+  string dir = "/d" + std::to_string(d);
+  CHECK(fs->write("new", 3, 0, fi) == 3);
+  CHECK(fs->release(fi) == 0);
+  switch (d % 5) {
+  case 0: {
+    string moved = "/m" + std::to_string(d);
+    CHECK(fs->rename(dir.c_str(), moved.c_str()) == 0);
+    CHECK(fs->truncate((moved + "/sub/f1").c_str(), 1) == 0);
+    break;
+  }
+  case 1:
+    CHECK(fs->unlink((dir + "/f2").c_str()) == 0);
+    write_file(fs, dir + "/f2", "new");
+    break;
+  case 2:
+    CHECK(fs->mkdir((dir + "/sub/new").c_str(), 0755) == 0);
+    CHECK(fs->rename((dir + "/sub/f3").c_str(),
+                     ("/x" + std::to_string(d)).c_str()) == 0);
+    break;
+  case 3: {
+    CHECK(fs->chmod((dir + "/f4").c_str(), 0600) == 0);
+    struct timespec times[2] = { { 5, 0 }, { 6, 0 } };
+    CHECK(fs->utimens((dir + "/sub/f5").c_str(), times) == 0);
+    break;
+  }
+  default: {
+    struct fuse_file_info trunc = {};
+    trunc.flags = O_WRONLY | O_TRUNC;
+    CHECK(fs->open((dir + "/f6").c_str(), &trunc) == 0);
+    CHECK(fs->release(&trunc) == 0);
+    CHECK(fs->link((dir + "/f4").c_str(), (dir + "/l4").c_str()) == 0);
+  }
+  }
+}
+
+/// Changes the tree from several threads while the snapshot is taken.
+void test_point_in_time(const string &base, int fanout_levels) {
+  PassthroughFs fs(base, fanout_levels);
+  CHECK(fs.enable_snapshots() == 0);
+  std::vector<struct fuse_file_info> open(kDirs);
+  populate(&fs, &open);
+  std::map<string, string> before;
+  describe(&fs, "", "", &before);
+
+  std::atomic<bool> created(false);
+  std::thread creator([&] {
+    CHECK(fs.snapshots()->configure("create s") == 0);
+    created = true;
+  });
+  // Start once the tree is being copied, or at worst once it was.
+  string copying = base + "/.wrapperfs/snapshots/.s.tmp";
+  while (!created && access(copying.c_str(), F_OK) != 0) {
+    usleep(10);
+  }
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 4; t++) {
+    writers.emplace_back([&, t] {
+      for (int d = kDirs - 1 - t; d >= 0; d -= 4) {
+        change(&fs, d, &open[d]);
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  creator.join();
+
+  std::map<string, string> snapshot;
+  describe(&fs, string(Snapshots::kDir) + "/s", "", &snapshot);
+  CHECK(snapshot == before);
+  std::map<string, string> after;
+  describe(&fs, "", "", &after);
+  CHECK(after != before);
+  CHECK(read_file(&fs, "/d9/f0") == "new /d9/f0");
+  CHECK(read_file(&fs, string(Snapshots::kDir) + "/s/d9/f0") ==
+        "old /d9/f0");
+}
+
+/// Live files do not count the links snapshots keep to them, even after
+/// a restart.
+void test_links(const string &base) {
+  for (int restart = 0; restart < 2; restart++) {
+    PassthroughFs fs(base, 0);
+    CHECK(fs.enable_snapshots() == 0);
+    if (!restart) {
+      write_file(&fs, "/one", "1");
+      write_file(&fs, "/two", "2");
+      CHECK(fs.link("/two", "/two.link") == 0);
+      CHECK(fs.snapshots()->configure("create a") == 0);
+      CHECK(fs.snapshots()->configure("create b") == 0);
+    }
+    struct stat stbuf;
+    CHECK(fs.getattr("/one", &stbuf) == 0);
+    CHECK(stbuf.st_nlink == 1);
+    CHECK(fs.getattr("/two", &stbuf) == 0);
+    CHECK(stbuf.st_nlink == 2);
+    string snapshot = string(Snapshots::kDir) + "/a";
+    CHECK(fs.getattr((snapshot + "/one").c_str(), &stbuf) == 0);
+    CHECK(fs.unlink((snapshot + "/one").c_str()) == -EROFS);
+  }
+}
+
+/// Writes to files while the snapshots sharing them are removed.
+void test_remove(const string &base) {
+  PassthroughFs fs(base, 0);
+  CHECK(fs.enable_snapshots() == 0);
+  const int kCount = 10;
+  string data(1 << 20, 'x');
+  for (int i = 0; i < kCount; i++) {
+    write_file(&fs, "/f" + std::to_string(i), data);
+  }
+  for (int round = 0; round < 3; round++) {
+    for (int s = 0; s < 3; s++) {
+      CHECK(fs.snapshots()->configure("create s" + std::to_string(s)) == 0);
+    }
+    std::thread writer([&] {
+      for (int i = 0; i < kCount; i++) {
+        struct fuse_file_info fi = {};
+        fi.flags = O_WRONLY;
+        CHECK(fs.open(("/f" + std::to_string(i)).c_str(), &fi) == 0);
+        CHECK(fs.write("y", 1, round, &fi) == 1);
+        CHECK(fs.release(&fi) == 0);
+      }
+    });
+    for (int s = 0; s < 3; s++) {
+      CHECK(fs.snapshots()->configure("delete s" + std::to_string(s)) == 0);
+    }
+    writer.join();
+  }
+  CHECK(read_file(&fs, "/f0").substr(0, 4) == "yyyx");
+}
+
+}  // namespace
+
+int main() {
+  string dir = test_dir("snapshot_test");
+  CHECK(mkdir((dir + "/flat").c_str(), 0755) == 0);
+  CHECK(mkdir((dir + "/sharded").c_str(), 0755) == 0);
+  CHECK(mkdir((dir + "/links").c_str(), 0755) == 0);
+  CHECK(mkdir((dir + "/remove").c_str(), 0755) == 0);
+  test_point_in_time(dir + "/flat", 0);
+  test_point_in_time(dir + "/sharded", 2);
+  test_links(dir + "/links");
+  test_remove(dir + "/remove");
+  remove_dir(dir);
+  return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Helpers shared by the test programs run by 'make check'.
+ *
+ * Each test is a plain program that exits with a nonzero status on the
+ * first failed CHECK(), after printing where it failed.
+ */
+
+#ifndef TESTS_TEST_H_
+#define TESTS_TEST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <string>
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+              #cond); \
+      exit(1); \
+    } \
+  } while (0)
+
+/// Creates an empty directory for the test, under $TMPDIR or /tmp.
+inline std::string test_dir(const char *name) {
+  const char *tmp = getenv("TMPDIR");
+  std::string dir = std::string(tmp ? tmp : "/tmp") + "/" + name + ".XXXXXX";
+  CHECK(mkdtemp(&dir[0]) != NULL);
+  return dir;
+}
+
+/// Removes 'dir' and everything below it.
+inline void remove_dir(const std::string &dir) {
+  std::string cmd = "rm -rf '" + dir + "'";
+  CHECK(system(cmd.c_str()) == 0);
+}
+
+/// Size of 'path', or -1 if it does not exist.
+inline off_t file_size(const std::string &path) {
+  struct stat stbuf;
+  return stat(path.c_str(), &stbuf) == 0 ? stbuf.st_size : -1;
+}
+
+#endif  // TESTS_TEST_H_
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Checks that tunables_update() applies a request whole or not at
+ * all, and that readers racing with updates always see one snapshot.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "./stats.h"
+#include "./tunables.h"
+#include "./test.h"
+
+namespace {
+
+uint64_t swaps() {
+  uint64_t value = 0;
+  stats_for_each([&value](const Counter &counter) {
+    if (strcmp(counter.name(), "tunables.swaps") == 0) {
+      value = counter.value();
+    }
+  });
+  return value;
+}
+
+void test_update() {
+  Tunables initial;
+  initial.slow_ns = 5000000;
+  tunables_init(initial);
+  CHECK(tunables().slow_ns == 5000000);
+
+  CHECK(tunables_update("slow_ms=2.5\nheatmap_rate=100 inline_size=4096")
+        == 0);
+  CHECK(tunables().slow_ns == 2500000);
+  CHECK(tunables().heatmap_rate == 100);
+  CHECK(tunables().inline_size == 4096);
+  CHECK(tunables().clean_live_ratio == 0.5);
+
+  std::string out;
+  tunables_report(&out);
+  CHECK(out == "slow_ms 2.5\nheatmap_rate 100\ninline_size 4096\n"
+               "clean_live_ratio 0.5\n");
+}
+
+void test_validation() {
+  const Tunables *before = &tunables();
+  uint64_t swapped = swaps();
+  const char *bad[] = {
+    "slow_ms",                  // No value.
+    "slow_ms=",
+    "slow_ms=1ms",
+    "speed=1",                  // Unknown.
+    "slow_ms=-1",               // Out of range.
+    "clean_live_ratio=1.5",
+    "inline_size=65537",
+    "heatmap_rate=1.5",         // Not an integer.
+    "slow_ms=nan",
+    "slow_ms=1 heatmap_rate=7 inline_size=-1",  // One bad of three.
+  };
+  for (const char *text : bad) {
+    CHECK(tunables_update(text) == -EINVAL);
+  }
+  CHECK(&tunables() == before);
+  CHECK(swaps() == swapped);
+  CHECK(tunables().slow_ns == 2500000);
+  CHECK(tunables().heatmap_rate == 100);
+
+  CHECK(tunables_update("inline_size=65536 clean_live_ratio=1") == 0);
+  CHECK(swaps() == swapped + 1);
+  // The old snapshot is still readable by whoever loaded it.
+  CHECK(before->inline_size == 4096);
+  CHECK(tunables().inline_size == 65536);
+}
+
+void test_atomic_swap() {
+  // Each update keeps slow_ms and heatmap_rate equal; a reader seeing
+  // them differ would have seen half of an update.
+  CHECK(tunables_update("slow_ms=0 heatmap_rate=0") == 0);
+  std::atomic<bool> done(false);
+  std::atomic<int> torn(0);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.push_back(std::thread([&] {
+      while (!done) {
+        const Tunables &t = tunables();
+        if (t.slow_ns != t.heatmap_rate * 1000000ULL) {
+          torn++;
+        }
+      }
+    }));
+  }
+  for (int i = 1; i <= 2000; i++) {
+    std::string n = std::to_string(i);
+    CHECK(tunables_update("slow_ms=" + n + " heatmap_rate=" + n) == 0);
+  }
+  done = true;
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  CHECK(torn == 0);
+  CHECK(tunables().heatmap_rate == 2000);
+}
+
+}  // namespace
+
+int main() {
+  test_update();
+  test_validation();
+  test_atomic_swap();
+  return 0;
+}
@@ -0,0 +1,348 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Hands a session over between two processes and checks that the
+ * new one translates the node ids and file handles the kernel knows.
+ *
+ * There is no kernel: requests are fed to LiveUpgrade::process() and the
+ * replies are caught by the channel the session reads from. Each process
+ * serves a lowlevel file system of a few names in the root, with its own
+ * inode numbers and file handles.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include "./protocol.h"
+#include "./test.h"
+#include "./upgrade.h"
+
+using std::string;
+
+namespace {
+
+/// Body of READ (struct fuse_read_in).
+struct ReadIn {
+  uint64_t fh;
+  uint64_t offset;
+  uint32_t size;
+  uint32_t read_flags;
+  uint64_t lock_owner;
+  uint32_t flags;
+  uint32_t padding;
+};
+
+/// What a process serves, and what its handlers were last asked for.
+struct Tree {
+  std::map<string, fuse_ino_t> names;
+  uint64_t fh_base;
+  fuse_ino_t last_ino;
+  uint64_t last_fh;
+  std::map<fuse_ino_t, unsigned long> forgotten;
+};
+
+Tree *tree_of(fuse_req_t req) {
+  return static_cast<Tree*>(fuse_req_userdata(req));
+}
+
+void do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  Tree *tree = tree_of(req);
+  auto it = tree->names.find(name);
+  if (parent != kFuseRootId || it == tree->names.end()) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  struct fuse_entry_param entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.ino = it->second;
+  entry.generation = 1;
+  entry.attr.st_ino = it->second;
+  entry.attr.st_mode = S_IFREG | 0644;
+  fuse_reply_entry(req, &entry);
+}
+
+void do_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  tree_of(req)->forgotten[ino] += nlookup;
+  fuse_reply_none(req);
+}
+
+void do_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*) {
+  tree_of(req)->last_ino = ino;
+  struct stat stbuf;
+  memset(&stbuf, 0, sizeof(stbuf));
+  stbuf.st_ino = ino;
+  stbuf.st_mode = S_IFREG | 0644;
+  fuse_reply_attr(req, &stbuf, 1.0);
+}
+
+void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  fi->fh = tree_of(req)->fh_base + ino;
+  fuse_reply_open(req, fi);
+}
+
+void do_read(fuse_req_t req, fuse_ino_t ino, size_t, off_t,
+             struct fuse_file_info *fi) {
+  tree_of(req)->last_ino = ino;
+  tree_of(req)->last_fh = fi->fh;
+  fuse_reply_buf(req, "data", 4);
+}
+
+void do_unlink(fuse_req_t req, fuse_ino_t, const char *name) {
+  fuse_reply_err(req, tree_of(req)->names.erase(name) ? 0 : ENOENT);
+}
+
+void do_rename(fuse_req_t req, fuse_ino_t, const char *name, fuse_ino_t,
+               const char *newname) {
+  Tree *tree = tree_of(req);
+  auto it = tree->names.find(name);
+  if (it == tree->names.end()) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  tree->names[newname] = it->second;
+  tree->names.erase(it);
+  fuse_reply_err(req, 0);
+}
+
+/// Keeps what the session sends to the kernel.
+int catch_reply(struct fuse_chan *ch, const struct iovec iov[],
+                size_t count) {
+  string *replies = static_cast<string*>(fuse_chan_data(ch));
+  for (size_t i = 0; i < count; i++) {
+    replies->append(static_cast<const char*>(iov[i].iov_base),
+                    iov[i].iov_len);
+  }
+  return 0;
+}
+
+/// A lowlevel session serving 'tree', and the channel it reads from.
+struct Session {
+  Session(Tree *tree, int fd) {
+    struct fuse_lowlevel_ops ops;
+    memset(&ops, 0, sizeof(ops));
+    ops.lookup = do_lookup;
+    ops.forget = do_forget;
+    ops.getattr = do_getattr;
+    ops.open = do_open;
+    ops.read = do_read;
+    ops.unlink = do_unlink;
+    ops.rename = do_rename;
+    static char name[] = "upgrade_test";
+    static char *argv[] = { name, NULL };
+    struct fuse_args args = FUSE_ARGS_INIT(1, argv);
+    se = fuse_lowlevel_new(&args, &ops, sizeof(ops), tree);
+    static struct fuse_chan_ops ch_ops = { NULL, catch_reply, NULL };
+    ch = fuse_chan_new(&ch_ops, fd, 128 << 10, &replies);
+    CHECK(se != NULL && ch != NULL);
+  }
+
+  ~Session() {
+    fuse_session_destroy(se);
+    fuse_chan_destroy(ch);
+  }
+
+  struct fuse_session *se;
+  struct fuse_chan *ch;
+  string replies;
+};
+
+struct Reply {
+  int error;
+  string body;
+};
+
+/// Sends a request through 'upgrade' as the kernel would.
+Reply send(LiveUpgrade *upgrade, Session *session, uint32_t opcode,
+           uint64_t nodeid, const void *arg, size_t arg_size,
+           const char *name = NULL, const char *newname = NULL) {
+  static uint64_t unique = 1;
+  FuseInHeader in;
+  memset(&in, 0, sizeof(in));
+  in.opcode = opcode;
+  in.unique = unique++;
+  in.nodeid = nodeid;
+  string request(reinterpret_cast<const char*>(&in), sizeof(in));
+  request.append(static_cast<const char*>(arg), arg_size);
+  if (name) {
+    request.append(name, strlen(name) + 1);
+  }
+  if (newname) {
+    request.append(newname, strlen(newname) + 1);
+  }
+  reinterpret_cast<FuseInHeader*>(&request[0])->len = request.size();
+  struct fuse_buf buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.size = request.size();
+  buf.mem = &request[0];
+  session->replies.clear();
+  upgrade->process(&buf);
+
+  Reply reply = { 0, string() };
+  FuseOutHeader out;
+  if (session->replies.size() >= sizeof(out)) {
+    memcpy(&out, session->replies.data(), sizeof(out));
+    CHECK(out.unique == in.unique && out.len == session->replies.size());
+    reply.error = out.error;
+    reply.body = session->replies.substr(sizeof(out));
+  }
+  return reply;
+}
+
+uint64_t lookup(LiveUpgrade *upgrade, Session *session, const char *name) {
+  Reply reply = send(upgrade, session, kFuseLookup, kFuseRootId, NULL, 0,
+                     name);
+  if (reply.error) {
+    return 0;
+  }
+  CHECK(reply.body.size() == kFuseEntryOutSize);
+  FuseEntryOut entry;
+  memcpy(&entry, reply.body.data(), sizeof(entry));
+  return entry.nodeid;
+}
+
+uint64_t open_file(LiveUpgrade *upgrade, Session *session, uint64_t node,
+                   uint32_t flags) {
+  FuseOpenIn open_in = { flags, 0 };
+  Reply reply = send(upgrade, session, kFuseOpen, node, &open_in,
+                     sizeof(open_in));
+  CHECK(reply.error == 0 && reply.body.size() >= sizeof(FuseOpenOut));
+  FuseOpenOut open_out;
+  memcpy(&open_out, reply.body.data(), sizeof(open_out));
+  return open_out.fh;
+}
+
+int getattr(LiveUpgrade *upgrade, Session *session, uint64_t node) {
+  FuseAttrIn attr_in = { 0, 0, 0 };
+  return send(upgrade, session, kFuseGetattr, node, &attr_in,
+              sizeof(attr_in)).error;
+}
+
+int read_file(LiveUpgrade *upgrade, Session *session, uint64_t node,
+              uint64_t fh) {
+  ReadIn read_in = { fh, 0, 4096, 0, 0, 0, 0 };
+  Reply reply = send(upgrade, session, kFuseRead, node, &read_in,
+                     sizeof(read_in));
+  CHECK(reply.error || reply.body == "data");
+  return reply.error;
+}
+
+/// The old process: serves a few requests, then waits to be replaced.
+/// Its ids are those of its tree: a is 101, x 102 and b 103, and the
+/// handle of inode N is 1000 + N.
+void serve_old(const string &path, int ready) {
+  Tree tree = { { { "a", 101 }, { "x", 102 }, { "b", 103 } }, 1000, 0, 0,
+                {} };
+  int fds[2];
+  CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  Session session(&tree, fds[0]);
+  LiveUpgrade upgrade;
+  CHECK(upgrade.listen(path) == 0);
+  CHECK(upgrade.attach(session.se, session.ch) == 0);
+  upgrade.pause = [] { return 0; };
+
+  FuseInitIn init_in = { 7, 19, 0, 0 };
+  CHECK(send(&upgrade, &session, kFuseInit, 0, &init_in,
+             sizeof(init_in)).error == 0);
+  CHECK(lookup(&upgrade, &session, "a") == 101);
+  CHECK(lookup(&upgrade, &session, "x") == 102);
+  CHECK(lookup(&upgrade, &session, "b") == 103);
+  CHECK(lookup(&upgrade, &session, "none") == 0);
+  CHECK(open_file(&upgrade, &session, 101, O_RDWR) == 1101);
+  CHECK(open_file(&upgrade, &session, 102, O_RDONLY) == 1102);
+  FuseRenameIn rename_in = { kFuseRootId };
+  CHECK(send(&upgrade, &session, kFuseRename, kFuseRootId, &rename_in,
+             sizeof(rename_in), "a", "c").error == 0);
+  // Still referred to by the kernel, but gone for the next process.
+  CHECK(send(&upgrade, &session, kFuseUnlink, kFuseRootId, NULL, 0,
+             "x").error == 0);
+
+  upgrade.start();
+  CHECK(write(ready, "r", 1) == 1);
+  // Exits once the session is handed over.
+  while (true) {
+    pause();
+  }
+}
+
+}  // namespace
+
+int main() {
+  string dir = test_dir("upgrade_test");
+  string path = dir + "/upgrade";
+  int ready[2];
+  CHECK(pipe(ready) == 0);
+  pid_t old = fork();
+  CHECK(old != -1);
+  if (old == 0) {
+    close(ready[0]);
+    serve_old(path, ready[1]);
+  }
+  close(ready[1]);
+  char byte;
+  CHECK(read(ready[0], &byte, 1) == 1);
+  close(ready[0]);
+
+  // The same names, with other ids: c (renamed from a) is 501, b 502 and
+  // d, created meanwhile, 503. Handles are 5000 + the inode.
+  Tree tree = { { { "c", 501 }, { "b", 502 }, { "d", 503 } }, 5000, 0, 0,
+                {} };
+  LiveUpgrade upgrade;
+  CHECK(upgrade.take_over(path) == 0);
+  CHECK(upgrade.shared_fd("fuse") != -1);
+  Session session(&tree, upgrade.shared_fd("fuse"));
+  CHECK(upgrade.attach(session.se, session.ch) == 0);
+  CHECK(upgrade.took_over());
+  int status;
+  CHECK(waitpid(old, &status, 0) == old);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // Node ids and handles the kernel got from the old process.
+  CHECK(getattr(&upgrade, &session, 101) == 0 && tree.last_ino == 501);
+  CHECK(getattr(&upgrade, &session, 103) == 0 && tree.last_ino == 502);
+  CHECK(read_file(&upgrade, &session, 101, 1101) == 0);
+  CHECK(tree.last_ino == 501 && tree.last_fh == 5501);
+  // The unlinked file and its handle could not be carried over.
+  CHECK(getattr(&upgrade, &session, 102) == -ESTALE);
+  CHECK(read_file(&upgrade, &session, 102, 1102) == -ESTALE);
+  CHECK(getattr(&upgrade, &session, 999) == -ESTALE);
+
+  // Looking a known node up again returns the id the kernel knows.
+  CHECK(lookup(&upgrade, &session, "c") == 101);
+  uint64_t d = lookup(&upgrade, &session, "d");
+  CHECK(d != 0 && getattr(&upgrade, &session, d) == 0);
+  CHECK(tree.last_ino == 503);
+  uint64_t fh = open_file(&upgrade, &session, d, O_RDONLY);
+  CHECK(read_file(&upgrade, &session, d, fh) == 0 && tree.last_fh == 5503);
+
+  // libfuse forgets b once the kernel does.
+  FuseForgetIn forget_in = { 1 };
+  send(&upgrade, &session, kFuseForget, 103, &forget_in, sizeof(forget_in));
+  CHECK(tree.forgotten[502] == 1);
+  CHECK(getattr(&upgrade, &session, 103) == -ESTALE);
+
+  string report;
+  upgrade.report(&report);
+  CHECK(report.find("taken_over yes") != string::npos);
+  remove_dir(dir);
+  return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./timing.h"
+#include <errno.h>
+
+namespace {
+
+/// Waits shorter than this are spun rather than slept.
+const uint64_t kSpinNs = 50000;
+
+}  // namespace
+
+void sleep_until_ns(uint64_t deadline) {
+  if (deadline > kSpinNs && now_ns() < deadline - kSpinNs) {
+    struct timespec ts;
+    ts.tv_sec = (deadline - kSpinNs) / 1000000000ULL;
+    ts.tv_nsec = (deadline - kSpinNs) % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+  }
+  while (now_ns() < deadline) {
+  }
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./tokenbucket.h"
+#include <algorithm>
+
+TokenBucket::TokenBucket(double rate, double burst)
+    : rate_(rate), burst_(burst), tokens_(burst), last_(0) {
+}
+
+void TokenBucket::refill(uint64_t now) {
+  if (last_ && now > last_) {
+    tokens_ = std::min(burst_, tokens_ + rate_ * (now - last_) / 1e9);
+  }
+  last_ = std::max(last_, now);
+}
+
+uint64_t TokenBucket::reserve(double n, uint64_t now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (rate_ <= 0) {
+    return now;
+  }
+  refill(now);
+  tokens_ -= n;
+  if (tokens_ >= 0) {
+    return now;
+  }
+  return now + static_cast<uint64_t>(-tokens_ / rate_ * 1e9);
+}
+
+void TokenBucket::set_rate(double rate, double burst) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  // A bucket that was unlimited starts out full.
+  tokens_ = rate_ <= 0 ? burst : std::min(tokens_, burst);
+  rate_ = rate;
+  burst_ = burst;
+}
+
+double TokenBucket::rate() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return rate_;
+}
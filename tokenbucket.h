@@ -0,0 +1,54 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Token bucket rate limiter.
+ *
+ * Tokens accrue at 'rate' per second up to 'burst'. reserve() never fails:
+ * a caller may overdraw the bucket and is told when the debt is repaid,
+ * so that callers are served in arrival order and can wait precisely.
+ */
+
+#ifndef TOKENBUCKET_H_
+#define TOKENBUCKET_H_
+
+#include <stdint.h>
+#include <mutex>
+
+class TokenBucket {
+ public:
+  /// A 'rate' of 0 means unlimited.
+  TokenBucket(double rate = 0, double burst = 0);
+
+  /// Takes 'n' tokens at time 'now' (ns) and returns the time at which
+  /// the caller may proceed; 'now' itself if tokens were available.
+  uint64_t reserve(double n, uint64_t now);
+
+  void set_rate(double rate, double burst);
+
+  double rate() const;
+
+ private:
+  void refill(uint64_t now);
+
+  mutable std::mutex mutex_;
+  double rate_;
+  double burst_;
+  double tokens_;
+  uint64_t last_;
+};
+
+#endif  // TOKENBUCKET_H_
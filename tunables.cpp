@@ -0,0 +1,128 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./tunables.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "./stats.h"
+
+using std::string;
+
+namespace {
+
+/// One setting, exposed in its own unit.
+struct Setting {
+  const char *name;
+  bool integer;
+  double min;
+  double max;
+  double (*get)(const Tunables &t);
+  void (*set)(Tunables *t, double value);
+};
+
+const Setting kSettings[] = {
+  { "slow_ms", false, 0, 3600e3,
+    [](const Tunables &t) { return t.slow_ns / 1e6; },
+    [](Tunables *t, double v) { t->slow_ns = v * 1e6; } },
+  { "heatmap_rate", true, 0, 1e9,
+    [](const Tunables &t) { return static_cast<double>(t.heatmap_rate); },
+    [](Tunables *t, double v) { t->heatmap_rate = v; } },
+  { "inline_size", true, 0, kMaxInlineSize,
+    [](const Tunables &t) { return static_cast<double>(t.inline_size); },
+    [](Tunables *t, double v) { t->inline_size = v; } },
+  { "clean_live_ratio", false, 0, 1,
+    [](const Tunables &t) { return t.clean_live_ratio; },
+    [](Tunables *t, double v) { t->clean_live_ratio = v; } },
+};
+
+Counter tunables_swaps("tunables.swaps");
+
+std::mutex update_mutex;
+
+/// Every snapshot ever installed, including the current one.
+std::vector<std::unique_ptr<const Tunables>> &snapshots() {
+  static std::vector<std::unique_ptr<const Tunables>> all;
+  return all;
+}
+
+/// Installs 't'; caller holds update_mutex.
+void install(Tunables *t) {
+  snapshots().push_back(std::unique_ptr<const Tunables>(t));
+  current_tunables.store(t, std::memory_order_release);
+}
+
+const Tunables kDefaults;
+
+}  // namespace
+
+std::atomic<const Tunables*> current_tunables(&kDefaults);
+
+Tunables::Tunables()
+    : slow_ns(0), heatmap_rate(0), inline_size(0), clean_live_ratio(0.5) {
+}
+
+void tunables_init(const Tunables &initial) {
+  std::lock_guard<std::mutex> guard(update_mutex);
+  install(new Tunables(initial));
+}
+
+int tunables_update(const string &text) {
+  std::lock_guard<std::mutex> guard(update_mutex);
+  std::unique_ptr<Tunables> next(new Tunables(tunables()));
+  std::istringstream words(text);
+  string word;
+  while (words >> word) {
+    size_t eq = word.find('=');
+    if (eq == string::npos) {
+      return -EINVAL;
+    }
+    string name = word.substr(0, eq);
+    char *end;
+    double value = strtod(word.c_str() + eq + 1, &end);
+    if (*end || eq + 1 == word.size()) {
+      return -EINVAL;
+    }
+    const Setting *setting = NULL;
+    for (const auto &s : kSettings) {
+      if (name == s.name) {
+        setting = &s;
+      }
+    }
+    if (!setting || !(value >= setting->min && value <= setting->max) ||
+        (setting->integer && value != static_cast<uint64_t>(value))) {
+      return -EINVAL;
+    }
+    setting->set(next.get(), value);
+  }
+  install(next.release());
+  tunables_swaps.add();
+  return 0;
+}
+
+void tunables_report(string *out) {
+  const Tunables &t = tunables();
+  for (const auto &setting : kSettings) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s %.9g\n", setting.name, setting.get(t));
+    out->append(buf);
+  }
+}
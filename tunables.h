@@ -0,0 +1,70 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Settings that can be changed without remounting.
+ *
+ * The settings form an immutable Tunables snapshot reached through an
+ * atomic pointer, read-copy-update style: a handler loads the pointer once
+ * (no lock, no shared write) and uses that snapshot for the operation,
+ * while a writer copies the current snapshot, applies and validates every
+ * change of a request, and swaps the copy in as a whole. Replaced
+ * snapshots are kept until exit, as a handler may still be reading one;
+ * each is a few dozen bytes and changes are made by hand.
+ *
+ * /.wrapperfs/config lists the settings as "name value" lines. Writing
+ * "name=value" lines (or words) to it changes them; a request with an
+ * unknown name or an out-of-range value changes nothing.
+ */
+
+#ifndef TUNABLES_H_
+#define TUNABLES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct Tunables {
+  Tunables();
+
+  uint64_t slow_ns;         ///< Slow operation threshold (0: off).
+  unsigned heatmap_rate;    ///< Heatmap sampling rate (0: off).
+  size_t inline_size;       ///< Largest inline file with --metastore.
+  double clean_live_ratio;  ///< Log segments below it are cleaned.
+};
+
+/// Upper bound of inline_size: inline data is rewritten with the inode
+/// record on every flush and replayed from the metadata log.
+const size_t kMaxInlineSize = 64 << 10;
+
+extern std::atomic<const Tunables*> current_tunables;
+
+/// The snapshot in effect.
+inline const Tunables &tunables() {
+  return *current_tunables.load(std::memory_order_acquire);
+}
+
+/// Installs the settings from the command line; called before the mount.
+void tunables_init(const Tunables &initial);
+
+/// Applies "name=value" settings; returns 0 or -EINVAL.
+int tunables_update(const std::string &text);
+
+/// Renders the current settings as "name value" lines.
+void tunables_report(std::string *out);
+
+#endif  // TUNABLES_H_
@@ -0,0 +1,1051 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "./upgrade.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "./stats.h"
+#include "./timing.h"
+
+using std::string;
+
+namespace {
+
+/// First bytes sent by a process taking over.
+const char kHello[4] = { 'W', 'F', 'U', '1' };
+
+/// Sent by the new process once it serves the session.
+const char kAck = 'k';
+
+/// Descriptors passed on a handoff, at most.
+const size_t kMaxFds = 8;
+
+/// Ids handed to the kernel when libfuse's own are taken.
+const uint64_t kFirstSpareId = 1ULL << 32;
+const uint64_t kFirstSpareFh = 1ULL << 62;
+
+/// Precedes the state sent to the new process.
+struct HandoffHeader {
+  int32_t error;
+  uint32_t fds;
+  uint64_t size;
+};
+
+/// The request a worker is processing, while its reply may change the
+/// tables. Names point into the request buffer.
+struct Pending {
+  uint64_t unique;  ///< 0 if the request is not tracked.
+  uint32_t opcode;
+  uint64_t parent;
+  uint64_t newdir;
+  uint32_t flags;
+  const char *name;
+  const char *newname;
+};
+
+__thread Pending pending;
+
+Counter takeover_ns("upgrade.takeover_ns");
+Counter stale_requests("upgrade.stale_requests");
+
+void append_u32(string *buf, uint32_t v) {
+  buf->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void append_u64(string *buf, uint64_t v) {
+  buf->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void append_str(string *buf, const string &s) {
+  append_u32(buf, s.size());
+  buf->append(s);
+}
+
+/// Reads the fields appended above; fails once past the end.
+class Reader {
+ public:
+  explicit Reader(const string &buf) : buf_(buf), pos_(0), ok_(true) {}
+
+  uint32_t u32() {
+    uint32_t v = 0;
+    read(&v, sizeof(v));
+    return v;
+  }
+
+  uint64_t u64() {
+    uint64_t v = 0;
+    read(&v, sizeof(v));
+    return v;
+  }
+
+  string str() {
+    uint32_t len = u32();
+    if (!ok_ || len > buf_.size() - pos_) {
+      ok_ = false;
+      return string();
+    }
+    pos_ += len;
+    return buf_.substr(pos_ - len, len);
+  }
+
+  void read(void *out, size_t size) {
+    if (!ok_ || size > buf_.size() - pos_) {
+      ok_ = false;
+      return;
+    }
+    memcpy(out, buf_.data() + pos_, size);
+    pos_ += size;
+  }
+
+  bool ok() const {
+    return ok_;
+  }
+
+  size_t pos() const {
+    return pos_;
+  }
+
+ private:
+  const string &buf_;
+  size_t pos_;
+  bool ok_;
+};
+
+int write_all(int fd, const char *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = write(fd, buf + done, size - done);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+int read_all(int fd, char *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = read(fd, buf + done, size - done);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n == 0 ? -EPIPE : -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/// Whether the process at the other end of 'conn' runs as our user.
+bool same_user(int conn) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+    return false;
+  }
+  return cred.uid == geteuid() || cred.uid == 0;
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(conn, &uid, &gid) == -1) {
+    return false;
+  }
+  return uid == geteuid() || uid == 0;
+#endif
+}
+
+bool is_release(uint32_t opcode) {
+  return opcode == kFuseRelease || opcode == kFuseReleasedir;
+}
+
+}  // namespace
+
+LiveUpgrade::LiveUpgrade()
+    : se_(NULL), ch_(NULL), wrapped_(NULL), capture_(NULL), listen_fd_(-1),
+      conn_(-1), paused_ns_(0), translating_(false), init_(),
+      next_unique_(1ULL << 63), next_id_(kFirstSpareId),
+      next_fh_(kFirstSpareFh) {
+  wakeup_[0] = wakeup_[1] = -1;
+  pthread_rwlock_init(&lock_, NULL);
+  Node root = { kFuseRootId, 0, string(), 1, 1, 0 };
+  nodes_[kFuseRootId] = root;
+  node_ids_[kFuseRootId] = kFuseRootId;
+}
+
+LiveUpgrade::~LiveUpgrade() {
+  stop();
+  if (wrapped_) {
+    fuse_chan_destroy(wrapped_);
+  }
+  if (capture_) {
+    fuse_chan_destroy(capture_);
+  }
+  pthread_rwlock_destroy(&lock_);
+}
+
+int LiveUpgrade::listen(const string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  struct stat stbuf;
+  if (lstat(path.c_str(), &stbuf) == 0 && S_ISSOCK(stbuf.st_mode)) {
+    unlink(path.c_str());
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -errno;
+  }
+  // Whoever connects gets the mount, so only the owner may.
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+           sizeof(addr)) == -1 || chmod(path.c_str(), 0600) == -1 ||
+      ::listen(fd, 1) == -1) {
+    int err = -errno;
+    close(fd);
+    return err;
+  }
+  listen_fd_ = fd;
+  fds_["upgrade"] = fd;
+  return 0;
+}
+
+int LiveUpgrade::take_over(const string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return -ENAMETOOLONG;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -errno;
+  }
+  HandoffHeader header;
+  struct iovec iov = { &header, sizeof(header) };
+  char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  int err = 0;
+  if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) == -1) {
+    err = -errno;
+  } else {
+    err = write_all(fd, kHello, sizeof(kHello));
+  }
+  ssize_t received = -1;
+  while (!err && (received = recvmsg(fd, &msg, MSG_WAITALL)) == -1) {
+    if (errno != EINTR) {
+      err = -errno;
+    }
+  }
+  if (!err && received != sizeof(header)) {
+    err = -EPROTO;
+  }
+  std::vector<int> fds;
+  for (struct cmsghdr *cmsg = err ? NULL : CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int *data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      fds.insert(fds.end(), data, data + count);
+    }
+  }
+  if (!err && header.error) {
+    err = header.error;
+  }
+  if (!err && (header.fds != fds.size() || header.size > (1ULL << 32))) {
+    err = -EPROTO;
+  }
+  string state;
+  if (!err) {
+    state.resize(header.size);
+    err = read_all(fd, &state[0], state.size());
+  }
+  Reader reader(state);
+  for (size_t i = 0; !err && i < fds.size(); i++) {
+    fds_[reader.str()] = fds[i];
+  }
+  if (!err && (!reader.ok() || !fds_.count("fuse"))) {
+    err = -EPROTO;
+  }
+  if (err) {
+    for (int received : fds) {
+      close(received);
+    }
+    fds_.clear();
+    close(fd);
+    return err;
+  }
+  state_ = state.substr(reader.pos());
+  conn_ = fd;
+  listen_fd_ = shared_fd("upgrade");
+  return 0;
+}
+
+int LiveUpgrade::shared_fd(const string &name) const {
+  auto it = fds_.find(name);
+  return it == fds_.end() ? -1 : it->second;
+}
+
+void LiveUpgrade::share_fd(const string &name, int fd) {
+  fds_[name] = fd;
+}
+
+int LiveUpgrade::attach(struct fuse_session *se, struct fuse_chan *ch) {
+  static struct fuse_chan_ops wrapped_ops = { NULL, &send_reply, NULL };
+  static struct fuse_chan_ops capture_ops = { NULL, &capture_reply, NULL };
+  se_ = se;
+  ch_ = ch;
+  fds_["fuse"] = fuse_chan_fd(ch);
+  wrapped_ = fuse_chan_new(&wrapped_ops, fuse_chan_fd(ch),
+                           fuse_chan_bufsize(ch), this);
+  capture_ = fuse_chan_new(&capture_ops, -1, fuse_chan_bufsize(ch), this);
+  if (!wrapped_ || !capture_) {
+    return -ENOMEM;
+  }
+  if (conn_ == -1) {
+    return 0;
+  }
+  int err = replay();
+  if (!err) {
+    err = write_all(conn_, &kAck, 1);
+  }
+  close(conn_);
+  conn_ = -1;
+  return err;
+}
+
+void LiveUpgrade::start() {
+  if (listen_fd_ == -1 || pipe2(wakeup_, O_CLOEXEC) == -1) {
+    return;
+  }
+  server_ = std::thread(&LiveUpgrade::serve, this);
+}
+
+void LiveUpgrade::stop() {
+  if (!server_.joinable()) {
+    return;
+  }
+  char byte = 0;
+  while (write(wakeup_[1], &byte, 1) == -1 && errno == EINTR) {
+  }
+  server_.join();
+  close(wakeup_[0]);
+  close(wakeup_[1]);
+  wakeup_[0] = wakeup_[1] = -1;
+}
+
+void LiveUpgrade::process(struct fuse_buf *buf) {
+  if (filter(buf)) {
+    fuse_session_process_buf(se_, buf, wrapped_);
+  }
+  pending.unique = 0;
+}
+
+bool LiveUpgrade::filter(struct fuse_buf *buf) {
+  if ((buf->flags & FUSE_BUF_IS_FD) || buf->size < sizeof(FuseInHeader)) {
+    return true;
+  }
+  char *mem = static_cast<char*>(buf->mem);
+  FuseInHeader *in = reinterpret_cast<FuseInHeader*>(mem);
+  char *arg = mem + sizeof(*in);
+  size_t arg_size = buf->size - sizeof(*in);
+  Pending p = { in->unique, in->opcode, in->nodeid, 0, 0, NULL, NULL };
+  bool tracked = false;
+  uint64_t *fh = NULL;
+
+  switch (in->opcode) {
+  case kFuseInit:
+    if (arg_size >= sizeof(init_)) {
+      memcpy(&init_, arg, sizeof(init_));
+    }
+    return true;
+  case kFuseForget:
+    if (arg_size < sizeof(FuseForgetIn)) {
+      return true;
+    }
+    return forget(&in->nodeid,
+                  &reinterpret_cast<FuseForgetIn*>(arg)->nlookup);
+  case kFuseBatchForget: {
+    if (arg_size < sizeof(FuseBatchForgetIn)) {
+      return true;
+    }
+    FuseBatchForgetIn *batch = reinterpret_cast<FuseBatchForgetIn*>(arg);
+    FuseForgetOne *one = reinterpret_cast<FuseForgetOne*>(batch + 1);
+    uint32_t count = std::min<size_t>(
+        batch->count, (arg_size - sizeof(*batch)) / sizeof(*one));
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      FuseForgetOne item = one[i];
+      if (forget(&item.nodeid, &item.nlookup)) {
+        one[kept++] = item;
+      }
+    }
+    if (kept == 0) {
+      return false;
+    }
+    batch->count = kept;
+    in->len = sizeof(*in) + sizeof(*batch) + kept * sizeof(*one);
+    buf->size = in->len;
+    return true;
+  }
+  case kFuseLookup:
+  case kFuseSymlink:
+  case kFuseUnlink:
+  case kFuseRmdir:
+    p.name = arg;
+    tracked = true;
+    break;
+  case kFuseMknod:
+    p.name = arg + sizeof(FuseMknodIn);
+    tracked = arg_size > sizeof(FuseMknodIn);
+    break;
+  case kFuseMkdir:
+    p.name = arg + sizeof(FuseMkdirIn);
+    tracked = arg_size > sizeof(FuseMkdirIn);
+    break;
+  case kFuseCreate:
+    p.name = arg + sizeof(FuseCreateIn);
+    tracked = arg_size > sizeof(FuseCreateIn);
+    if (tracked) {
+      p.flags = reinterpret_cast<FuseCreateIn*>(arg)->flags;
+    }
+    break;
+  case kFuseOpen:
+  case kFuseOpendir:
+    tracked = arg_size >= sizeof(FuseOpenIn);
+    if (tracked) {
+      p.flags = reinterpret_cast<FuseOpenIn*>(arg)->flags;
+    }
+    break;
+  case kFuseLink:
+  case kFuseRename: {
+    // Both start with the other node id: the link target or the new
+    // parent directory.
+    if (arg_size <= sizeof(uint64_t)) {
+      break;
+    }
+    uint64_t *other = reinterpret_cast<uint64_t*>(arg);
+    p.name = arg + sizeof(uint64_t);
+    if (in->opcode == kFuseRename) {
+      p.newdir = *other;
+      p.newname = p.name + strnlen(p.name, arg_size - sizeof(uint64_t)) + 1;
+    }
+    tracked = true;
+    if (translating_) {
+      pthread_rwlock_rdlock(&lock_);
+      auto it = nodes_.find(*other);
+      *other = it == nodes_.end() ? 0 : it->second.lib;
+      pthread_rwlock_unlock(&lock_);
+      if (*other == 0) {
+        answer(in->unique, -ESTALE);
+        return false;
+      }
+    }
+    break;
+  }
+  case kFuseGetattr:
+  case kFuseSetattr:
+    if (arg_size >= sizeof(FuseAttrIn)) {
+      FuseAttrIn *attr = reinterpret_cast<FuseAttrIn*>(arg);
+      uint32_t has_fh = in->opcode == kFuseGetattr ? kFuseGetattrFh :
+          kFuseFattrFh;
+      if (attr->flags & has_fh) {
+        fh = &attr->fh;
+      }
+    }
+    break;
+  case kFuseRead:
+  case kFuseWrite:
+  case kFuseRelease:
+  case kFuseFsync:
+  case kFuseFlush:
+  case kFuseReaddir:
+  case kFuseReleasedir:
+  case kFuseFsyncdir:
+  case kFuseGetlk:
+  case kFuseSetlk:
+  case kFuseSetlkw:
+  case kFuseIoctl:
+  case kFusePoll:
+  case kFuseFallocate:
+  case kFuseReaddirplus:
+  case kFuseLseek:
+    // Their arguments all start with the file handle.
+    if (arg_size >= sizeof(uint64_t)) {
+      fh = reinterpret_cast<uint64_t*>(arg);
+    }
+    break;
+  }
+
+  if (translating_ && in->nodeid) {
+    pthread_rwlock_rdlock(&lock_);
+    auto it = nodes_.find(in->nodeid);
+    uint64_t lib = it == nodes_.end() ? 0 : it->second.lib;
+    pthread_rwlock_unlock(&lock_);
+    if (lib == 0) {
+      if (fh && is_release(in->opcode)) {
+        translate_fh(in->opcode, fh);  // Drops the handle.
+      }
+      answer(in->unique, is_release(in->opcode) ? 0 : -ESTALE);
+      return false;
+    }
+    in->nodeid = lib;
+  }
+  if (fh && !translate_fh(in->opcode, fh)) {
+    answer(in->unique, is_release(in->opcode) ? 0 : -ESTALE);
+    return false;
+  }
+  if (tracked) {
+    pending = p;
+  }
+  return true;
+}
+
+bool LiveUpgrade::translate_fh(uint32_t opcode, uint64_t *fh) {
+  bool release = is_release(opcode);
+  if (!translating_ && !release) {
+    return true;
+  }
+  if (release) {
+    pthread_rwlock_wrlock(&lock_);
+  } else {
+    pthread_rwlock_rdlock(&lock_);
+  }
+  auto it = handles_.find(*fh);
+  bool valid = it != handles_.end() && it->second.valid;
+  if (valid && translating_) {
+    *fh = it->second.lib;
+  }
+  if (release && it != handles_.end()) {
+    handles_.erase(it);
+  }
+  pthread_rwlock_unlock(&lock_);
+  return valid || !translating_;
+}
+
+bool LiveUpgrade::forget(uint64_t *id, uint64_t *nlookup) {
+  pthread_rwlock_wrlock(&lock_);
+  auto it = nodes_.find(*id);
+  if (it == nodes_.end() || *id == kFuseRootId) {
+    pthread_rwlock_unlock(&lock_);
+    return !translating_;
+  }
+  Node &node = it->second;
+  node.nlookup -= std::min(node.nlookup, *nlookup);
+  bool forward = true;
+  if (translating_) {
+    // libfuse learnt of the node through fewer lookups than the kernel;
+    // it forgets it all at once, when the kernel is done with it.
+    forward = node.nlookup == 0 && node.lib != 0;
+    *id = node.lib;
+    *nlookup = node.lib_nlookup;
+  } else {
+    node.lib_nlookup = node.nlookup;
+  }
+  if (node.nlookup == 0) {
+    auto name = names_.find(Name(node.parent, node.name));
+    if (name != names_.end() && name->second == it->first) {
+      names_.erase(name);
+    }
+    if (node.lib) {
+      node_ids_.erase(node.lib);
+    }
+    nodes_.erase(it);
+  }
+  pthread_rwlock_unlock(&lock_);
+  return forward;
+}
+
+int LiveUpgrade::send_reply(struct fuse_chan *ch, const struct iovec iov[],
+                            size_t count) {
+  LiveUpgrade *self = static_cast<LiveUpgrade*>(fuse_chan_data(ch));
+  if (pending.unique == 0) {
+    return fuse_chan_send(self->ch_, iov, count);
+  }
+  return self->on_reply(iov, count);
+}
+
+int LiveUpgrade::capture_reply(struct fuse_chan *ch, const struct iovec iov[],
+                               size_t count) {
+  LiveUpgrade *self = static_cast<LiveUpgrade*>(fuse_chan_data(ch));
+  for (size_t i = 0; i < count; i++) {
+    self->captured_.append(static_cast<const char*>(iov[i].iov_base),
+                           iov[i].iov_len);
+  }
+  return 0;
+}
+
+int LiveUpgrade::on_reply(const struct iovec iov[], size_t count) {
+  Pending p = pending;
+  pending.unique = 0;
+  string reply;
+  for (size_t i = 0; i < count; i++) {
+    reply.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+  }
+  FuseOutHeader out;
+  if (reply.size() < sizeof(out)) {
+    return fuse_chan_send(ch_, iov, count);
+  }
+  memcpy(&out, reply.data(), sizeof(out));
+  if (out.unique != p.unique || out.error != 0) {
+    return fuse_chan_send(ch_, iov, count);
+  }
+  char *body = &reply[sizeof(out)];
+  size_t body_size = reply.size() - sizeof(out);
+  uint64_t node = 0;
+  uint64_t fh = 0;
+  bool has_fh = false;
+
+  pthread_rwlock_wrlock(&lock_);
+  switch (p.opcode) {
+  case kFuseLookup:
+  case kFuseMknod:
+  case kFuseMkdir:
+  case kFuseSymlink:
+  case kFuseLink:
+  case kFuseCreate: {
+    if (body_size < kFuseEntryOutSize) {
+      break;
+    }
+    FuseEntryOut *entry = reinterpret_cast<FuseEntryOut*>(body);
+    if (entry->nodeid == 0) {
+      break;  // A negative entry.
+    }
+    node = add_entry(p.parent, p.name, entry);
+    if (p.opcode == kFuseCreate &&
+        body_size >= kFuseEntryOutSize + sizeof(FuseOpenOut)) {
+      FuseOpenOut *open_out =
+          reinterpret_cast<FuseOpenOut*>(body + kFuseEntryOutSize);
+      fh = open_out->fh = add_handle(node, p.flags, false, open_out->fh);
+      has_fh = true;
+    }
+    break;
+  }
+  case kFuseOpen:
+  case kFuseOpendir:
+    if (body_size >= sizeof(FuseOpenOut)) {
+      FuseOpenOut *open_out = reinterpret_cast<FuseOpenOut*>(body);
+      fh = open_out->fh = add_handle(p.parent, p.flags,
+                                     p.opcode == kFuseOpendir, open_out->fh);
+      has_fh = true;
+    }
+    break;
+  case kFuseUnlink:
+  case kFuseRmdir:
+    unlink_name(Name(p.parent, p.name));
+    break;
+  case kFuseRename: {
+    auto it = names_.find(Name(p.parent, p.name));
+    if (it != names_.end()) {
+      uint64_t moved = it->second;
+      names_.erase(it);
+      unlink_name(Name(p.newdir, p.newname));
+      names_[Name(p.newdir, p.newname)] = moved;
+      nodes_[moved].parent = p.newdir;
+      nodes_[moved].name = p.newname;
+    }
+    break;
+  }
+  }
+  pthread_rwlock_unlock(&lock_);
+
+  struct iovec one = { &reply[0], reply.size() };
+  int res = fuse_chan_send(ch_, &one, 1);
+  if (res != 0 && (node || has_fh)) {
+    // The kernel never saw the reply; libfuse undoes its side itself.
+    pthread_rwlock_wrlock(&lock_);
+    if (node) {
+      drop_entry(node);
+    }
+    if (has_fh) {
+      handles_.erase(fh);
+    }
+    pthread_rwlock_unlock(&lock_);
+  }
+  return res;
+}
+
+uint64_t LiveUpgrade::add_entry(uint64_t parent, const string &name,
+                                FuseEntryOut *entry) {
+  auto known = node_ids_.find(entry->nodeid);
+  if (known != node_ids_.end()) {
+    Node &node = nodes_[known->second];
+    node.nlookup++;
+    node.lib_nlookup++;
+    entry->nodeid = known->second;
+    entry->generation = node.generation;
+    return known->second;
+  }
+  uint64_t id = entry->nodeid;
+  if (translating_) {
+    while (nodes_.count(id)) {
+      id = next_id_++;
+    }
+  }
+  Node node = { entry->nodeid, parent, name, 1, 1, entry->generation };
+  nodes_[id] = node;
+  node_ids_[entry->nodeid] = id;
+  unlink_name(Name(parent, name));
+  names_[Name(parent, name)] = id;
+  entry->nodeid = id;
+  return id;
+}
+
+void LiveUpgrade::drop_entry(uint64_t id) {
+  auto it = nodes_.find(id);
+  if (it == nodes_.end() || id == kFuseRootId) {
+    return;
+  }
+  Node &node = it->second;
+  node.lib_nlookup--;
+  if (--node.nlookup > 0) {
+    return;
+  }
+  auto name = names_.find(Name(node.parent, node.name));
+  if (name != names_.end() && name->second == id) {
+    names_.erase(name);
+  }
+  node_ids_.erase(node.lib);
+  nodes_.erase(it);
+}
+
+uint64_t LiveUpgrade::add_handle(uint64_t node, uint32_t flags, bool dir,
+                                 uint64_t lib_fh) {
+  uint64_t fh = lib_fh;
+  if (translating_) {
+    while (handles_.count(fh)) {
+      fh = next_fh_++;
+    }
+  }
+  Handle handle = { lib_fh, node, flags, dir, true };
+  handles_[fh] = handle;
+  return fh;
+}
+
+void LiveUpgrade::unlink_name(const Name &name) {
+  auto it = names_.find(name);
+  if (it == names_.end()) {
+    return;
+  }
+  Node &node = nodes_[it->second];
+  node.parent = 0;
+  node.name.clear();
+  names_.erase(it);
+}
+
+void LiveUpgrade::answer(uint64_t unique, int error) {
+  if (error) {
+    stale_requests.add();
+  }
+  FuseOutHeader out = { sizeof(out), error, unique };
+  struct iovec iov = { &out, sizeof(out) };
+  fuse_chan_send(ch_, &iov, 1);
+}
+
+void LiveUpgrade::serve() {
+  while (true) {
+    struct pollfd fds[2] = {
+      { wakeup_[0], POLLIN, 0 },
+      { listen_fd_, POLLIN, 0 },
+    };
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    if (fds[0].revents) {
+      return;
+    }
+    int conn = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+      continue;
+    }
+    char hello[sizeof(kHello)];
+    struct pollfd wait = { conn, POLLIN, 0 };
+    if (same_user(conn) && poll(&wait, 1, 1000) == 1 &&
+        read_all(conn, hello, sizeof(hello)) == 0 &&
+        memcmp(hello, kHello, sizeof(hello)) == 0) {
+      hand_off(conn);
+    }
+    close(conn);
+  }
+}
+
+void LiveUpgrade::hand_off(int conn) {
+  paused_ns_ = now_ns();
+  // Entry replies are parsed with the 7.12 layouts.
+  int err = init_.minor >= 12 && se_ ? 0 : -ENOTSUP;
+  if (!err) {
+    err = pause ? pause() : -ENOTSUP;
+  }
+  HandoffHeader header = { err, 0, 0 };
+  string state;
+  std::vector<int> fds;
+  if (!err) {
+    for (const auto &it : fds_) {
+      if (it.second != -1 && fds.size() < kMaxFds) {
+        append_str(&state, it.first);
+        fds.push_back(it.second);
+      }
+    }
+    serialize(&state);
+    header.fds = fds.size();
+    header.size = state.size();
+  }
+
+  struct iovec iov = { &header, sizeof(header) };
+  char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+  int sent = 0;
+  while ((sent = sendmsg(conn, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+  }
+  if (err) {
+    return;
+  }
+  char ack = 0;
+  if (sent == sizeof(header) &&
+      write_all(conn, state.data(), state.size()) == 0 &&
+      read_all(conn, &ack, 1) == 0 && ack == kAck) {
+    // The new process serves the session; leave without unmounting or
+    // touching the backend again.
+    fprintf(stderr, "Handed the session over.\n");
+    fflush(NULL);
+    _exit(0);
+  }
+  if (resume) {
+    resume();
+  }
+}
+
+void LiveUpgrade::serialize(string *out) {
+  pthread_rwlock_rdlock(&lock_);
+  append_u64(out, paused_ns_);
+  out->append(reinterpret_cast<const char*>(&init_), sizeof(init_));
+  append_u64(out, nodes_.size() - 1);
+  for (const auto &it : nodes_) {
+    if (it.first == kFuseRootId) {
+      continue;
+    }
+    const Node &node = it.second;
+    append_u64(out, it.first);
+    append_u64(out, node.lib ? node.parent : 0);
+    append_u64(out, node.nlookup);
+    append_u64(out, node.generation);
+    append_str(out, node.name);
+  }
+  append_u64(out, handles_.size());
+  for (const auto &it : handles_) {
+    const Handle &handle = it.second;
+    append_u64(out, it.first);
+    append_u64(out, handle.node);
+    append_u32(out, handle.flags);
+    append_u32(out, (handle.dir ? 1 : 0) | (handle.valid ? 2 : 0));
+  }
+  pthread_rwlock_unlock(&lock_);
+}
+
+int LiveUpgrade::deserialize(const string &in) {
+  Reader reader(in);
+  paused_ns_ = reader.u64();
+  reader.read(&init_, sizeof(init_));
+  uint64_t count = reader.u64();
+  for (uint64_t i = 0; i < count && reader.ok(); i++) {
+    uint64_t id = reader.u64();
+    Node node = { 0, 0, string(), 0, 0, 0 };
+    node.parent = reader.u64();
+    node.nlookup = reader.u64();
+    node.generation = reader.u64();
+    node.name = reader.str();
+    if (node.parent) {
+      names_[Name(node.parent, node.name)] = id;
+    }
+    nodes_[id] = node;
+  }
+  count = reader.u64();
+  for (uint64_t i = 0; i < count && reader.ok(); i++) {
+    uint64_t fh = reader.u64();
+    Handle handle = { 0, 0, 0, false, false };
+    handle.node = reader.u64();
+    handle.flags = reader.u32();
+    uint32_t bits = reader.u32();
+    handle.dir = bits & 1;
+    handle.valid = bits & 2;
+    handles_[fh] = handle;
+  }
+  return reader.ok() ? 0 : -EPROTO;
+}
+
+int LiveUpgrade::call(uint32_t opcode, uint64_t nodeid, const void *arg,
+                      size_t arg_size, const string &name, string *reply) {
+  FuseInHeader in;
+  memset(&in, 0, sizeof(in));
+  in.opcode = opcode;
+  in.unique = next_unique_++;
+  in.nodeid = nodeid;
+  in.len = sizeof(in) + arg_size + (name.empty() ? 0 : name.size() + 1);
+  std::vector<char> mem(in.len);
+  memcpy(&mem[0], &in, sizeof(in));
+  if (arg_size) {
+    memcpy(&mem[sizeof(in)], arg, arg_size);
+  }
+  if (!name.empty()) {
+    memcpy(&mem[sizeof(in) + arg_size], name.c_str(), name.size() + 1);
+  }
+  struct fuse_buf buf;
+  memset(&buf, 0, sizeof(buf));
+  buf.size = in.len;
+  buf.mem = &mem[0];
+  captured_.clear();
+  fuse_session_process_buf(se_, &buf, capture_);
+  reply->swap(captured_);
+  FuseOutHeader out;
+  if (reply->size() < sizeof(out)) {
+    return -EIO;
+  }
+  memcpy(&out, reply->data(), sizeof(out));
+  reply->erase(0, sizeof(out));
+  return out.error;
+}
+
+int LiveUpgrade::replay() {
+  int err = deserialize(state_);
+  state_.clear();
+  if (err) {
+    return err;
+  }
+  string reply;
+  err = call(kFuseInit, 0, &init_, sizeof(init_), string(), &reply);
+  if (err) {
+    return err;
+  }
+
+  // Look every node up again, parents first. Nodes that are gone, and
+  // those below them, stay in the table without a libfuse id.
+  std::multimap<uint64_t, uint64_t> children;
+  for (const auto &it : nodes_) {
+    if (it.second.parent) {
+      children.insert(std::make_pair(it.second.parent, it.first));
+    }
+  }
+  std::vector<uint64_t> queue(1, kFuseRootId);
+  for (size_t i = 0; i < queue.size(); i++) {
+    uint64_t parent_lib = nodes_[queue[i]].lib;
+    auto range = children.equal_range(queue[i]);
+    for (auto it = range.first; it != range.second; ++it) {
+      Node &node = nodes_[it->second];
+      if (call(kFuseLookup, parent_lib, NULL, 0, node.name, &reply) ||
+          reply.size() < kFuseEntryOutSize) {
+        continue;
+      }
+      FuseEntryOut entry;
+      memcpy(&entry, reply.data(), sizeof(entry));
+      if (entry.nodeid == 0 || node_ids_.count(entry.nodeid)) {
+        continue;
+      }
+      node.lib = entry.nodeid;
+      node.lib_nlookup = 1;
+      node_ids_[entry.nodeid] = it->second;
+      queue.push_back(it->second);
+    }
+  }
+
+  // Reopen the handles. They are new open files on the backing store,
+  // created without O_CREAT, O_EXCL or O_TRUNC.
+  for (auto &it : handles_) {
+    Handle &handle = it.second;
+    auto node = nodes_.find(handle.node);
+    bool valid = handle.valid;
+    handle.valid = false;
+    if (!valid || node == nodes_.end() || node->second.lib == 0) {
+      continue;
+    }
+    FuseOpenIn open_in = { handle.flags & ~(O_CREAT | O_EXCL | O_TRUNC), 0 };
+    if (call(handle.dir ? kFuseOpendir : kFuseOpen, node->second.lib,
+             &open_in, sizeof(open_in), string(), &reply) == 0 &&
+        reply.size() >= sizeof(FuseOpenOut)) {
+      FuseOpenOut open_out;
+      memcpy(&open_out, reply.data(), sizeof(open_out));
+      handle.lib = open_out.fh;
+      handle.valid = true;
+    }
+  }
+
+  translating_ = true;
+  uint64_t downtime = now_ns() - paused_ns_;
+  takeover_ns.add(downtime);
+  fprintf(stderr, "Took over %zu nodes and %zu handles in %.1f ms.\n",
+          nodes_.size() - 1, handles_.size(), downtime / 1e6);
+  return 0;
+}
+
+void LiveUpgrade::report(string *out) {
+  pthread_rwlock_rdlock(&lock_);
+  size_t stale_nodes = 0;
+  for (const auto &it : nodes_) {
+    stale_nodes += it.second.lib == 0;
+  }
+  size_t stale_handles = 0;
+  for (const auto &it : handles_) {
+    stale_handles += !it.second.valid;
+  }
+  char buf[200];
+  snprintf(buf, sizeof(buf), "nodes %zu (stale %zu) handles %zu (stale %zu)"
+           " taken_over %s\n", nodes_.size(), stale_nodes, handles_.size(),
+           stale_handles, translating_ ? "yes" : "no");
+  pthread_rwlock_unlock(&lock_);
+  out->append(buf);
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2010-2013 (c) Lei Xu <eddyxu@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \brief Live upgrade: hands a mounted session over to a new process.
+ *
+ * Upgrading by remounting kills every process with a file open. With
+ * --upgrade=PATH the daemon listens on a Unix socket, and a new binary
+ * started with the same options plus --takeover connects to it. The old
+ * daemon stops reading requests, lets those in flight finish, flushes and
+ * stops its backend, and passes the /dev/fuse descriptor, its listening
+ * sockets and its session state (SCM_RIGHTS). The new process rebuilds
+ * the state and goes on reading the same descriptor, so the mount never
+ * goes away; requests issued meanwhile wait in the kernel.
+ *
+ * The state is what the kernel holds references to: node ids and open
+ * file handles. libfuse 2.x cannot export or import its node table, so a
+ * tracker between the request loop and libfuse mirrors it from the
+ * requests and replies (lookups, forgets, renames, opens and releases).
+ * The new process replays INIT, a LOOKUP for every node and an OPEN for
+ * every handle into its own libfuse, which hands out different ids, and
+ * from then on the tracker translates node ids and handles in every
+ * request and reply.
+ *
+ * Not carried over, and failing with ESTALE afterwards: files that were
+ * unlinked (or renamed over) while the kernel still referred to them, and
+ * their open handles. Handles are reopened by path with their original
+ * flags, so POSIX locks taken through the old ones are lost. The ram
+ * backend keeps its files in memory and cannot be handed over.
+ */
+
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include "./protocol.h"
+
+class LiveUpgrade {
+ public:
+  LiveUpgrade();
+  ~LiveUpgrade();
+
+  /// Listens for a new process on the Unix socket 'path'.
+  int listen(const std::string &path);
+
+  /// Connects to the daemon listening on 'path' and receives its session;
+  /// the daemon stops serving until finish() or until this process exits.
+  int take_over(const std::string &path);
+
+  /// Descriptor passed by the old process under 'name', or -1.
+  int shared_fd(const std::string &name) const;
+
+  /// Passes 'fd' to the next process under 'name'.
+  void share_fd(const std::string &name, int fd);
+
+  /**
+   * Starts tracking the session 'se' reading from 'ch'. After take_over(),
+   * first rebuilds the received state and tells the old process to exit.
+   */
+  int attach(struct fuse_session *se, struct fuse_chan *ch);
+
+  /// Whether the session was taken over from another process.
+  bool took_over() const {
+    return translating_;
+  }
+
+  /// Starts and stops the thread waiting for a new process.
+  void start();
+  void stop();
+
+  /// Processes a request received from the kernel.
+  void process(struct fuse_buf *buf);
+
+  /// Stops serving requests and flushes the backend. Returns 0, or -errno
+  /// with the session still served.
+  std::function<int()> pause;
+
+  /// Serves requests again after a failed handoff.
+  std::function<void()> resume;
+
+  /// Renders the number of tracked nodes and handles.
+  void report(std::string *out);
+
+ private:
+  /// A node id known to the kernel.
+  struct Node {
+    uint64_t lib;          ///< libfuse's id, 0 if it could not be kept.
+    uint64_t parent;       ///< 0 once unlinked.
+    std::string name;
+    uint64_t nlookup;      ///< Lookups the kernel has not forgotten.
+    uint64_t lib_nlookup;  ///< Lookups libfuse has not been told to forget.
+    uint64_t generation;
+  };
+
+  /// A file handle known to the kernel.
+  struct Handle {
+    uint64_t lib;  ///< libfuse's handle, if valid.
+    uint64_t node;
+    uint32_t flags;
+    bool dir;
+    bool valid;    ///< False if it could not be kept.
+  };
+
+  typedef std::pair<uint64_t, std::string> Name;
+
+  static int send_reply(struct fuse_chan *ch, const struct iovec iov[],
+                        size_t count);
+  static int capture_reply(struct fuse_chan *ch, const struct iovec iov[],
+                           size_t count);
+
+  bool filter(struct fuse_buf *buf);
+  bool translate_fh(uint32_t opcode, uint64_t *fh);
+  bool forget(uint64_t *id, uint64_t *nlookup);
+  int on_reply(const struct iovec iov[], size_t count);
+  uint64_t add_entry(uint64_t parent, const std::string &name,
+                     FuseEntryOut *entry);
+  void drop_entry(uint64_t id);
+  uint64_t add_handle(uint64_t node, uint32_t flags, bool dir,
+                      uint64_t lib_fh);
+  void unlink_name(const Name &name);
+  void answer(uint64_t unique, int error);
+
+  void serve();
+  void hand_off(int conn);
+  void serialize(std::string *out);
+  int deserialize(const std::string &in);
+  int call(uint32_t opcode, uint64_t nodeid, const void *arg,
+           size_t arg_size, const std::string &name, std::string *reply);
+  int replay();
+
+  struct fuse_session *se_;
+  struct fuse_chan *ch_;       ///< The /dev/fuse channel.
+  struct fuse_chan *wrapped_;  ///< Passes replies to on_reply().
+  struct fuse_chan *capture_;  ///< Keeps replies to call().
+  std::string captured_;
+
+  int listen_fd_;
+  int wakeup_[2];     ///< Pipe that interrupts serve() on stop().
+  int conn_;          ///< Connection to the old process, during takeover.
+  std::string state_;  ///< Received state, until attach().
+  uint64_t paused_ns_;
+  std::map<std::string, int> fds_;
+  std::thread server_;
+
+  bool translating_;
+  FuseInitIn init_;
+  uint64_t next_unique_;
+
+  mutable pthread_rwlock_t lock_;
+  std::unordered_map<uint64_t, Node> nodes_;
+  std::unordered_map<uint64_t, uint64_t> node_ids_;  ///< libfuse's to ours.
+  std::map<Name, uint64_t> names_;
+  std::unordered_map<uint64_t, Handle> handles_;
+  uint64_t next_id_;
+  uint64_t next_fh_;
+};
+
+#endif  // UPGRADE_H_
@@ -28,173 +28,1109 @@
 #include <fuse_opt.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <utime.h>
 #include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include "./config.h"
+#include "./backend.h"
+#include "./bypass.h"
+#include "./changedblocks.h"
+#include "./ctlfs.h"
+#include "./device.h"
+#include "./dirstats.h"
+#include "./heatmap.h"
+#include "./hotpaths.h"
+#include "./journal.h"
+#include "./kvfs.h"
+#include "./layers.h"
+#include "./metrics.h"
+#include "./nullfs.h"
+#include "./passthrough.h"
+#include "./qos.h"
+#include "./ramfs.h"
+#include "./rangelock.h"
+#include "./session.h"
+#include "./slowlog.h"
+#include "./stats.h"
+#include "./tunables.h"
+#include "./upgrade.h"
 
 using std::string;
 
-#define CALL_RETURN(x) return (x) == -1 ? -errno : 0;
+/** the control directory can not be modified */
+#define REJECT_CONTROL(p) if (mount->ctlfs.owns(p)) return -EPERM;
 
 /** command line options */
 struct options {
   char *basedir;
+  char *backend;
+  int metastore;
+  unsigned inline_size;
+  int fanout;
+  int logdata;
+  unsigned long null_size;  // NOLINT
+  char *stack;
+  char *device;
+  char *qos;
+  int qos_depth;
+  int split_queues;
+  int meta_threads;
+  int data_threads;
+  int max_threads;
+  unsigned slow_ms;
+  unsigned hot;
+  unsigned heatmap;
+  char *metrics;
+  char *upgrade;
+  int takeover;
+  int multi;
+  unsigned mem_budget;
+  char *bypass;
+  int range_locks;
+  unsigned lazy_times;
+  int dirstats;
+  int changed_blocks;
+  char *journal;
+  unsigned journal_mb;
+  int snapshots;
 } options;
 
-string wrapperfs_abspath(const string &path) {
-  return string(options.basedir) + path;
+/** a base directory served on a mount point */
+struct Mount {
+  Mount()
+      : backend(NULL), dirstats(NULL), blocks(NULL), fuse(NULL), dev(0) {}
+
+  string basedir;
+  string mountpoint;
+  Backend *backend;  ///< storage engine (--backend)
+  DirStatsFs *dirstats;  ///< part of 'backend' with --dirstats, or NULL
+  ChangedBlocksFs *blocks;  ///< part of 'backend' with --changed_blocks
+  CtlFs ctlfs;       ///< virtual files under /.wrapperfs
+  struct fuse *fuse;
+  dev_t dev;  ///< device of the mount point once mounted, or 0 (--bypass)
+};
+
+/** the mount given on the command line */
+Mount main_mount;
+
+/** hands the mount over to a new process (--upgrade) */
+LiveUpgrade upgrade;
+
+/** the mount the calling handler serves */
+Mount *current_mount() {
+  return static_cast<Mount*>(fuse_get_context()->private_data);
 }
 
 int wrapperfs_getattr(const char *path, struct stat *stbuf) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(stat(abspath.c_str(), stbuf));
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.getattr(path, stbuf);
+  }
+  return mount->backend->getattr(path, stbuf);
 }
 
 int wrapperfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                off_t offset, struct fuse_file_info *fi) {
-  (void) offset;
   (void) fi;
 
-  int res = 0;
-  string abspath = wrapperfs_abspath(path);
-
-  DIR *dirp = opendir(abspath.c_str());
-  if (dirp == NULL) {
-    return -errno;
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.readdir(path, buf, filler);
   }
-
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
-
-  struct dirent *dp;
-  while ((dp = readdir(dirp)) != NULL) {
-    filler(buf, dp->d_name, NULL, 0);
-  }
-  closedir(dirp);
-  return res;
+  return mount->backend->readdir(path, buf, filler, offset);
 }
 
 int wrapperfs_open(const char *path, struct fuse_file_info *fi) {
-  string abspath = wrapperfs_abspath(path);
-  int fd = open(abspath.c_str(), fi->flags);
-  if (fd == -1) {
-    return -errno;
-  };
-  fi->fh = fd;
-  return 0;
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.open(path, fi);
+  }
+  return mount->backend->open(path, fi);
 }
 
 int wrapperfs_create(const char *path, mode_t mode,
                      struct fuse_file_info *fi) {
-  string abspath = wrapperfs_abspath(path);
-  int fd = creat(abspath.c_str(), mode);
-  if (fd == -1) {
-    return -errno;
-  };
-  fi->fh = fd;
-  return 0;
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->create(path, mode, fi);
 }
 
 int wrapperfs_release(const char *path , struct fuse_file_info *fi) {
-  (void) path;
-  CALL_RETURN(close(fi->fh));
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.release(fi);
+  }
+  return mount->backend->release(fi);
 }
 
 int wrapperfs_read(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi) {
-  (void) path;
-  ssize_t nread = pread(fi->fh, buf, size, offset);
-  if (nread == -1) {
-    return -errno;
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.read(buf, size, offset, fi);
   }
-  return nread;
+  return mount->backend->read(buf, size, offset, fi);
 }
 
 int wrapperfs_write(const char *path, const char *buf, size_t size,
                     off_t offset, struct fuse_file_info *fi) {
-  (void) path;
-  ssize_t nwrite = pwrite(fi->fh, buf, size, offset);
-  if (nwrite == -1) {
-    return -errno;
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.write(buf, size, offset, fi);
+  }
+  return mount->backend->write(buf, size, offset, fi);
+}
+
+int wrapperfs_flush(const char *path, struct fuse_file_info *fi) {
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.flush(fi);
   }
-  return nwrite;
+  return 0;
+}
+
+int wrapperfs_fsync(const char *path, int datasync,
+                    struct fuse_file_info *fi) {
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return 0;
+  }
+  return mount->backend->fsync(datasync, fi);
 }
 
 int wrapperfs_access(const char *path, int flag) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(access(abspath.c_str(), flag));
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.access(path, flag);
+  }
+  return mount->backend->access(path, flag);
 }
 
 int wrapperfs_chmod(const char *path, mode_t mode) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(chmod(abspath.c_str(), mode));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->chmod(path, mode);
 }
 
 int wrapperfs_chown(const char *path, uid_t owner, gid_t group) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(chown(abspath.c_str(), owner, group));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->chown(path, owner, group);
 }
 
 int wrapperfs_utimens(const char *path, const struct timespec tv[2]) {
-  string abspath = wrapperfs_abspath(path);
-  struct timeval times[2];
-  times[0].tv_sec = tv[0].tv_sec;
-  times[0].tv_usec = tv[0].tv_nsec / 1000;
-  times[1].tv_sec = tv[1].tv_sec;
-  times[1].tv_usec = tv[1].tv_nsec / 1000;
-  CALL_RETURN(utimes(abspath.c_str(), times));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->utimens(path, tv);
 }
 
 int wrapperfs_unlink(const char *path) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(unlink(abspath.c_str()));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->unlink(path);
 }
 
 int wrapperfs_rename(const char *oldpath, const char *newpath) {
-  string abs_oldpath = wrapperfs_abspath(oldpath);
-  string abs_newpath = wrapperfs_abspath(newpath);
-  CALL_RETURN(rename(abs_oldpath.c_str(), abs_newpath.c_str()));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(oldpath);
+  REJECT_CONTROL(newpath);
+  return mount->backend->rename(oldpath, newpath);
 }
 
 int wrapperfs_link(const char *path1, const char *path2) {
-  string abs_path1 = wrapperfs_abspath(path1);
-  string abs_path2 = wrapperfs_abspath(path2);
-  CALL_RETURN(link(abs_path1.c_str(), abs_path2.c_str()));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path1);
+  REJECT_CONTROL(path2);
+  return mount->backend->link(path1, path2);
 }
 
 int wrapperfs_symlink(const char *path1, const char *path2) {
-  string abs_path1;
-  /*
-   * FUSE pass out-of-partition source directory path as absolute path,
-   * and pass in-partition source directory as related path
-   */
-  if (path1[0] == '/') {
-    abs_path1 = path1;
-  } else {
-    abs_path1 = wrapperfs_abspath(path1);
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path2);
+  return mount->backend->symlink(path1, path2);
+}
+
+int wrapperfs_readlink(const char *path, char *buf, size_t size) {
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return -EINVAL;
   }
-  string abs_path2 = wrapperfs_abspath(path2);
-  CALL_RETURN(symlink(abs_path1.c_str(), abs_path2.c_str()));
+  return mount->backend->readlink(path, buf, size);
+}
+
+int wrapperfs_getxattr(const char *path, const char *name, char *value,
+                       size_t size) {
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return -ENODATA;
+  }
+  int ret = -ENODATA;
+  if (mount->dirstats) {
+    ret = mount->dirstats->getxattr(path, name, value, size);
+  }
+  if (ret == -ENODATA && mount->blocks) {
+    ret = mount->blocks->getxattr(path, name, value, size);
+  }
+  return ret;
+}
+
+int wrapperfs_setxattr(const char *path, const char *name, const char *value,
+                       size_t size, int flags) {
+  (void) flags;
+  Mount *mount = current_mount();
+  if (mount->blocks == NULL || mount->ctlfs.owns(path)) {
+    return -ENOTSUP;
+  }
+  return mount->blocks->setxattr(path, name, value, size);
 }
 
 int wrapperfs_truncate(const char *path, off_t length) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(truncate(abspath.c_str(), length));
+  Mount *mount = current_mount();
+  if (mount->ctlfs.owns(path)) {
+    return mount->ctlfs.truncate(path, length);
+  }
+  return mount->backend->truncate(path, length);
 }
 
 int wrapperfs_mkdir(const char *path, mode_t mode) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(mkdir(abspath.c_str(), mode));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->mkdir(path, mode);
 }
 
 int wrapperfs_rmdir(const char *path) {
-  string abspath = wrapperfs_abspath(path);
-  CALL_RETURN(rmdir(abspath.c_str()));
+  Mount *mount = current_mount();
+  REJECT_CONTROL(path);
+  return mount->backend->rmdir(path);
+}
+
+void *wrapperfs_init(struct fuse_conn_info *conn) {
+  (void) conn;
+  Mount *mount = current_mount();
+  // Threads must be started after fuse_main() has daemonized.
+  mount->backend->start();
+  if (mount == &main_mount) {
+    heatmap.start();
+    metrics.start();
+    bypass.start();
+    upgrade.start();
+  }
+  // Becomes the private_data of every later request.
+  return mount;
+}
+
+void wrapperfs_destroy(void *private_data) {
+  Mount *mount = static_cast<Mount*>(private_data);
+  if (mount == &main_mount) {
+    upgrade.stop();
+    bypass.stop();
+    metrics.stop();
+    heatmap.stop();
+  }
+  mount->backend->stop();
+}
+
+/**
+ * \brief The wrapperfs_* handlers as a layer (see layers.h).
+ */
+struct WrapperfsHandlers {
+  static int access(const char *path, int mask) {
+    return wrapperfs_access(path, mask);
+  }
+  static int chmod(const char *path, mode_t mode) {
+    return wrapperfs_chmod(path, mode);
+  }
+  static int chown(const char *path, uid_t owner, gid_t group) {
+    return wrapperfs_chown(path, owner, group);
+  }
+  static int create(const char *path, mode_t mode,
+                    struct fuse_file_info *fi) {
+    return wrapperfs_create(path, mode, fi);
+  }
+  static void destroy(void *private_data) {
+    wrapperfs_destroy(private_data);
+  }
+  static int flush(const char *path, struct fuse_file_info *fi) {
+    return wrapperfs_flush(path, fi);
+  }
+  static int fsync(const char *path, int datasync,
+                   struct fuse_file_info *fi) {
+    return wrapperfs_fsync(path, datasync, fi);
+  }
+  static int getattr(const char *path, struct stat *stbuf) {
+    return wrapperfs_getattr(path, stbuf);
+  }
+  static int getxattr(const char *path, const char *name, char *value,
+                      size_t size) {
+    return wrapperfs_getxattr(path, name, value, size);
+  }
+  static void *init(struct fuse_conn_info *conn) {
+    return wrapperfs_init(conn);
+  }
+  static int link(const char *oldpath, const char *newpath) {
+    return wrapperfs_link(oldpath, newpath);
+  }
+  static int mkdir(const char *path, mode_t mode) {
+    return wrapperfs_mkdir(path, mode);
+  }
+  static int open(const char *path, struct fuse_file_info *fi) {
+    return wrapperfs_open(path, fi);
+  }
+  static int read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    return wrapperfs_read(path, buf, size, offset, fi);
+  }
+  static int readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi) {
+    return wrapperfs_readdir(path, buf, filler, offset, fi);
+  }
+  static int readlink(const char *path, char *buf, size_t size) {
+    return wrapperfs_readlink(path, buf, size);
+  }
+  static int release(const char *path, struct fuse_file_info *fi) {
+    return wrapperfs_release(path, fi);
+  }
+  static int rename(const char *oldpath, const char *newpath) {
+    return wrapperfs_rename(oldpath, newpath);
+  }
+  static int rmdir(const char *path) {
+    return wrapperfs_rmdir(path);
+  }
+  static int setxattr(const char *path, const char *name, const char *value,
+                      size_t size, int flags) {
+    return wrapperfs_setxattr(path, name, value, size, flags);
+  }
+  static int symlink(const char *target, const char *path) {
+    return wrapperfs_symlink(target, path);
+  }
+  static int truncate(const char *path, off_t length) {
+    return wrapperfs_truncate(path, length);
+  }
+  static int unlink(const char *path) {
+    return wrapperfs_unlink(path);
+  }
+  static int utimens(const char *path, const struct timespec tv[2]) {
+    return wrapperfs_utimens(path, tv);
+  }
+  static int write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi) {
+    return wrapperfs_write(path, buf, size, offset, fi);
+  }
+};
+
+/** bottom of every handler stack */
+typedef ProbeLayer<WrapperfsHandlers> Handlers;
+typedef QosLayer<Handlers> QosHandlers;
+
+/// Tops 'Stack' with the slow operation log, which is always there since
+/// its threshold can be set at runtime, and hot path tracking if --hot.
+template <class Stack>
+void make_hot_stack(struct fuse_operations *ops) {
+  if (options.hot) {
+    make_operations<SlowLogLayer<HotPathsLayer<Stack>>>(ops);
+  } else {
+    make_operations<SlowLogLayer<Stack>>(ops);
+  }
+}
+
+/// Adds heatmap sampling if --heatmap, then the layers above it.
+template <class Stack>
+void make_heatmap_stack(struct fuse_operations *ops) {
+  if (options.heatmap) {
+    make_hot_stack<HeatmapLayer<Stack>>(ops);
+  } else {
+    make_hot_stack<Stack>(ops);
+  }
+}
+
+/// Tops a preset with the layers of the features enabled when mounting,
+/// starting with the change journal if --journal.
+template <class Stack>
+void make_stack(struct fuse_operations *ops) {
+  if (options.journal) {
+    make_heatmap_stack<JournalLayer<Stack>>(ops);
+  } else {
+    make_heatmap_stack<Stack>(ops);
+  }
+}
+
+/** handler stacks selectable with --stack */
+struct StackPreset {
+  const char *name;
+  void (*make)(struct fuse_operations *ops);
+  void (*make_qos)(struct fuse_operations *ops);  ///< with --qos
+};
+
+const StackPreset wrapperfs_stacks[] = {
+  { "plain", make_stack<Handlers>, make_stack<QosHandlers> },
+  { "stats", make_stack<OpStatsLayer<Handlers>>,
+    make_stack<OpStatsLayer<QosHandlers>> },
+  { "readonly", make_stack<ReadOnlyLayer<Handlers>>,
+    make_stack<ReadOnlyLayer<QosHandlers>> },
+  { "readonly-stats", make_stack<OpStatsLayer<ReadOnlyLayer<Handlers>>>,
+    make_stack<OpStatsLayer<ReadOnlyLayer<QosHandlers>>> },
+};
+
+/**
+ * Checks that 'basedir' is mounted with the on-disk 'layout' it was first
+ * mounted with, recorded in BASEDIR/.wrapperfs/layout. The plain
+ * passthrough layout ("") is not recorded, so that other layouts can only
+ * be set up in a directory holding no files yet. Returns 0 or prints the
+ * reason and returns -errno.
+ */
+int wrapperfs_check_layout(const string &basedir, const string &layout) {
+  string private_dir = basedir + "/.wrapperfs";
+  string path = private_dir + "/layout";
+  string recorded;
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    char buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    recorded.assign(buf, n > 0 ? n : 0);
+    while (!recorded.empty() && recorded.back() == '\n') {
+      recorded.pop_back();
+    }
+  } else if (errno != ENOENT) {
+    int err = errno;
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(err));
+    return -err;
+  } else if (!layout.empty()) {
+    DIR *dirp = opendir(basedir.c_str());
+    if (dirp == NULL) {
+      int err = errno;
+      fprintf(stderr, "%s: %s\n", basedir.c_str(), strerror(err));
+      return -err;
+    }
+    struct dirent *dp;
+    bool has_files = false;
+    while (!has_files && (dp = readdir(dirp)) != NULL) {
+      has_files = strcmp(dp->d_name, ".") != 0 &&
+          strcmp(dp->d_name, "..") != 0 &&
+          strcmp(dp->d_name, ".wrapperfs") != 0;
+    }
+    closedir(dirp);
+    if (has_files) {
+      fprintf(stderr, "%s already holds files; set up '%s' in an empty "
+              "directory, or write it to %s if the files were written "
+              "with these options.\n", basedir.c_str(), layout.c_str(),
+              path.c_str());
+      return -EINVAL;
+    }
+    if (mkdir(private_dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      return -errno;
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    string line = layout + "\n";
+    if (fd == -1 || write(fd, line.data(), line.size()) == -1 ||
+        fsync(fd) == -1) {
+      int err = errno;
+      fprintf(stderr, "%s: %s\n", path.c_str(), strerror(err));
+      if (fd != -1) {
+        close(fd);
+        unlink(path.c_str());
+      }
+      return -err;
+    }
+    close(fd);
+    return 0;
+  }
+  if (recorded != layout) {
+    fprintf(stderr, "%s was set up as '%s', not '%s'; mount it with the "
+            "options it was set up with.\n", basedir.c_str(),
+            recorded.empty() ? "plain passthrough" : recorded.c_str(),
+            layout.empty() ? "plain passthrough" : layout.c_str());
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * Creates the backend selected on the command line for 'mount'. Returns 0
+ * or prints the reason and returns -errno.
+ */
+int wrapperfs_make_backend(Mount *mount, struct fuse_args *args) {
+  string name = options.backend ? options.backend : "passthrough";
+  if (options.metastore) {
+    if (options.backend && name != "kv") {
+      fprintf(stderr, "--metastore conflicts with --backend=%s.\n",
+              name.c_str());
+      return -EINVAL;
+    }
+    name = "kv";
+  }
+  if (options.fanout < 0 || options.fanout > FanoutLayout::kMaxLevels) {
+    fprintf(stderr, "--fanout must be between 0 and %d.\n",
+            FanoutLayout::kMaxLevels);
+    return -EINVAL;
+  }
+  if ((options.fanout || options.logdata) && name != "passthrough") {
+    fprintf(stderr, "--fanout and --logdata only apply to the passthrough "
+            "backend.\n");
+    return -EINVAL;
+  }
+  if (options.inline_size && name != "kv") {
+    fprintf(stderr, "--inline_size only applies to the kv backend.\n");
+    return -EINVAL;
+  }
+  if (options.inline_size > kMaxInlineSize) {
+    fprintf(stderr, "--inline_size cannot exceed %zu.\n", kMaxInlineSize);
+    return -EINVAL;
+  }
+  if (options.lazy_times && name != "passthrough") {
+    fprintf(stderr, "--lazy_times only applies to the passthrough "
+            "backend.\n");
+    return -EINVAL;
+  }
+  if (options.snapshots && (name != "passthrough" || options.logdata)) {
+    fprintf(stderr, "--snapshots only applies to the passthrough backend "
+            "without --logdata.\n");
+    return -EINVAL;
+  }
+
+  if (name == "passthrough" || name == "kv") {
+    // Mounting a base directory in another layout would misread it.
+    char layout[64] = "backend=kv";
+    if (name == "passthrough") {
+      layout[0] = '\0';
+      if (options.fanout || options.logdata) {
+        snprintf(layout, sizeof(layout),
+                 "backend=passthrough fanout=%d logdata=%d", options.fanout,
+                 options.logdata ? 1 : 0);
+      }
+    }
+    int ret = wrapperfs_check_layout(mount->basedir, layout);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  if (name == "passthrough") {
+    PassthroughFs *passthrough = new PassthroughFs(mount->basedir,
+                                                   options.fanout);
+    mount->backend = passthrough;
+    if (options.lazy_times) {
+      passthrough->enable_lazy_times(options.lazy_times);
+    }
+    if (options.logdata) {
+      int ret = passthrough->enable_logdata();
+      if (ret) {
+        fprintf(stderr, "Failed to open data log: %s\n", strerror(-ret));
+        return ret;
+      }
+      LogStore *logstore = passthrough->logstore();
+      mount->ctlfs.add_file("logstore",
+                            [=](string *out) { logstore->report(out); });
+    }
+    if (options.snapshots) {
+      int ret = passthrough->enable_snapshots();
+      if (ret) {
+        fprintf(stderr, "Failed to open snapshots: %s\n", strerror(-ret));
+        return ret;
+      }
+      Snapshots *snapshots = passthrough->snapshots();
+      mount->ctlfs.add_file("snapshots",
+                            [=](string *out) { snapshots->report(out); },
+                            [=](const string &text) {
+                              return snapshots->configure(text);
+                            });
+    }
+  } else if (name == "kv") {
+    KvFs *kvfs = new KvFs;
+    mount->backend = kvfs;
+    int ret = kvfs->init(mount->basedir);
+    if (ret) {
+      fprintf(stderr, "Failed to open metadata store: %s\n", strerror(-ret));
+      return ret;
+    }
+  } else if (name == "ram") {
+    mount->backend = new RamFs;
+  } else if (name == "null") {
+    mount->backend = new NullFs(options.null_size);
+  } else {
+    fprintf(stderr, "Unknown backend: %s\n", name.c_str());
+    return -EINVAL;
+  }
+  if (name == "kv" || name == "ram") {
+    // Permissions are kept by the backend, so let the kernel enforce them.
+    fuse_opt_add_arg(args, "-odefault_permissions");
+  }
+
+  if (options.device) {
+    string error;
+    DeviceModel *model = DeviceModel::create(options.device, &error);
+    if (model == NULL) {
+      fprintf(stderr, "--device: %s\n", error.c_str());
+      return -EINVAL;
+    }
+    DeviceFs *device = new DeviceFs(mount->backend, model);
+    mount->backend = device;
+    mount->ctlfs.add_file("device",
+                          [=](string *out) { device->report(out); });
+  }
+  if (options.dirstats) {
+    mount->dirstats = new DirStatsFs(mount->backend);
+    mount->backend = mount->dirstats;
+  }
+  if (options.changed_blocks) {
+    mount->blocks = new ChangedBlocksFs(mount->backend);
+    mount->backend = mount->blocks;
+  }
+  if (options.range_locks) {
+    // Outermost, so that a write holds its range while the device waits.
+    mount->backend = new RangeLockFs(mount->backend);
+  }
+  return 0;
+}
+
+/** request loop with --split_queues, while it runs */
+SessionLoop *session_loop = NULL;
+
+void wrapperfs_resume() {
+  main_mount.backend->start();
+  heatmap.start();
+  metrics.start();
+  bypass.start();
+  session_loop->resume();
+}
+
+/**
+ * Stops serving and flushes the backend before a handoff. Returns 0, or
+ * -errno after serving again.
+ */
+int wrapperfs_pause() {
+  if (session_loop == NULL) {
+    return -EAGAIN;
+  }
+  session_loop->pause();
+  bypass.stop();
+  metrics.stop();
+  heatmap.stop();
+  int ret = main_mount.backend->sync();
+  main_mount.backend->stop();
+  if (ret) {
+    wrapperfs_resume();
+  }
+  return ret;
+}
+
+/** mounts added through /.wrapperfs/mounts (--multi), by mount point */
+std::mutex mounts_mutex;
+std::map<string, Mount*> mounts;
+
+/** arguments of the added mounts: those of the main one, less its path */
+struct fuse_args mount_args = FUSE_ARGS_INIT(0, NULL);
+struct fuse_operations mount_opers;
+
+int wrapperfs_configure_mounts(const string &in);
+
+/** Adds the files every mount has under /.wrapperfs. */
+void wrapperfs_add_ctl_files(Mount *mount) {
+  CtlFs *ctlfs = &mount->ctlfs;
+  ctlfs->add_file("stats", [mount](string *out) {
+    stats_dump(out);
+    if (session_loop && mount->fuse) {
+      session_loop->session_stats(mount->fuse, out);
+    }
+  });
+  ctlfs->add_file("config", tunables_report,
+                  [](const string &in) { return tunables_update(in); });
+  ctlfs->add_file("control", [](string *out) {
+    out->append("sync\ncompact\n");
+  }, [mount](const string &in) {
+    string command = in.substr(0, in.find_last_not_of(" \n") + 1);
+    if (command == "sync") {
+      int ret = mount->backend->sync();
+      return ret ? ret : journal.sync();
+    } else if (command == "compact") {
+      return mount->backend->compact();
+    }
+    return -EINVAL;
+  });
+  ctlfs->add_file("slowops", [](string *out) { slowlog.report(out); },
+                  [](const string &in) { return slowlog.configure(in); });
+  if (options.hot) {
+    ctlfs->add_file("hot", [](string *out) { hot_paths.report(out); },
+                    [](const string &in) { return hot_paths.configure(in); });
+  }
+  if (options.journal) {
+    ctlfs->add_file("journal", [](string *out) { journal.report(out); });
+  }
+  if (options.heatmap) {
+    ctlfs->add_file("heatmap", [](string *out) { heatmap.report(out); },
+                    [](const string &in) { return heatmap.configure(in); });
+  }
+  if (options.qos) {
+    ctlfs->add_file("qos", [](string *out) { qos.report(out); },
+                    [](const string &in) { return qos.configure(in); });
+  }
+  if (options.split_queues) {
+    ctlfs->add_file("workers", [](string *out) {
+      if (session_loop) {
+        session_loop->report(out);
+      }
+    });
+  }
+  if (options.upgrade) {
+    ctlfs->add_file("upgrade", [](string *out) { upgrade.report(out); });
+  }
+  if (options.multi) {
+    // Mounts are managed from the main mount, which outlives them all.
+    CtlFs::Store store;
+    if (mount == &main_mount) {
+      store = wrapperfs_configure_mounts;
+    }
+    ctlfs->add_file("mounts", [](string *out) {
+      out->append(main_mount.mountpoint + " " + main_mount.basedir + "\n");
+      std::lock_guard<std::mutex> guard(mounts_mutex);
+      for (const auto &entry : mounts) {
+        if (entry.second->fuse) {
+          out->append(entry.first + " " + entry.second->basedir + "\n");
+        }
+      }
+    }, store);
+  }
+}
+
+/** Unmounts an added mount once its session stopped serving. */
+void wrapperfs_drop_mount(Mount *mount) {
+  struct fuse_session *se = fuse_get_session(mount->fuse);
+  fuse_unmount(mount->mountpoint.c_str(), fuse_session_next_chan(se, NULL));
+  fuse_destroy(mount->fuse);
+  {
+    std::lock_guard<std::mutex> guard(mounts_mutex);
+    mounts.erase(mount->mountpoint);
+  }
+  delete mount->backend;
+  delete mount;
+}
+
+/**
+ * Serves 'basedir' on 'mountpoint' too, with the options of the main
+ * mount. Returns 0 or -errno.
+ */
+int wrapperfs_add_mount(const string &basedir, const string &mountpoint) {
+  if (access(basedir.c_str(), F_OK) == -1) {
+    return -errno;
+  }
+  char *real = realpath(mountpoint.c_str(), NULL);
+  if (real == NULL) {
+    return -errno;
+  }
+  std::unique_ptr<Mount> mount(new Mount);
+  mount->basedir = basedir;
+  mount->mountpoint = real;
+  free(real);
+  {
+    std::lock_guard<std::mutex> guard(mounts_mutex);
+    if (mount->mountpoint == main_mount.mountpoint ||
+        mounts.count(mount->mountpoint)) {
+      return -EEXIST;
+    }
+    // Reserved while mounting, listed once mounted.
+    mounts[mount->mountpoint] = mount.get();
+  }
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  for (int i = 0; i < mount_args.argc; i++) {
+    fuse_opt_add_arg(&args, mount_args.argv[i]);
+  }
+  struct fuse_chan *ch = NULL;
+  struct fuse *fuse = NULL;
+  int ret = wrapperfs_make_backend(mount.get(), &args);
+  if (!ret) {
+    ch = fuse_mount(mount->mountpoint.c_str(), &args);
+    if (ch) {
+      fuse = fuse_new(ch, &args, &mount_opers, sizeof(mount_opers),
+                      mount.get());
+    }
+    ret = fuse ? 0 : -EIO;
+  }
+  fuse_opt_free_args(&args);
+  if (!ret) {
+    {
+      std::lock_guard<std::mutex> guard(mounts_mutex);
+      mount->fuse = fuse;
+    }
+    // The control files must be in place before the first request.
+    wrapperfs_add_ctl_files(mount.get());
+    Mount *added = mount.get();
+    ret = session_loop->add_session(fuse, mount->mountpoint, [added] {
+      wrapperfs_drop_mount(added);
+    });
+  }
+  if (ret) {
+    if (ch) {
+      fuse_unmount(mount->mountpoint.c_str(), ch);
+    }
+    if (fuse) {
+      fuse_destroy(fuse);
+    }
+    delete mount->backend;
+    std::lock_guard<std::mutex> guard(mounts_mutex);
+    mounts.erase(mount->mountpoint);
+    return ret;
+  }
+  mount.release();
+  return 0;
+}
+
+/**
+ * Stops serving 'mountpoint', as given to wrapperfs_add_mount(). It is
+ * unmounted once its requests in flight are done.
+ */
+int wrapperfs_remove_mount(const string &mountpoint) {
+  // No realpath(): resolving a path in one of our mounts would need a
+  // worker, while this runs on one.
+  string path = mountpoint;
+  while (path.size() > 1 && path[path.size() - 1] == '/') {
+    path.erase(path.size() - 1);
+  }
+  std::lock_guard<std::mutex> guard(mounts_mutex);
+  auto it = mounts.find(path);
+  if (it == mounts.end() || it->second->fuse == NULL) {
+    return path == main_mount.mountpoint ? -EBUSY : -ENOENT;
+  }
+  return session_loop->remove_session(it->second->fuse);
+}
+
+/** the mount serving 'path'; called with mounts_mutex held */
+Mount *wrapperfs_find_mount(const string &path) {
+  Mount *found = NULL;
+  auto consider = [&](Mount *mount) {
+    const string &prefix = mount->mountpoint;
+    if (!prefix.empty() && path.compare(0, prefix.size(), prefix) == 0 &&
+        (path.size() == prefix.size() || path[prefix.size()] == '/') &&
+        (found == NULL || prefix.size() > found->mountpoint.size())) {
+      found = mount;
+    }
+  };
+  consider(&main_mount);
+  for (const auto &entry : mounts) {
+    if (entry.second->fuse) {
+      consider(entry.second);
+    }
+  }
+  return found;
+}
+
+/**
+ * Opens the backing file of 'path' for a --bypass client, if 'path' is a
+ * file in one of our mounts and 'client' describes it. Returns a
+ * descriptor or -errno.
+ */
+int wrapperfs_open_backing(const string &path, const struct stat &client,
+                           string *name) {
+  string unknown;  // mount point whose device is not known yet
+  {
+    std::lock_guard<std::mutex> guard(mounts_mutex);
+    Mount *mount = wrapperfs_find_mount(path);
+    if (mount == NULL) {
+      return -EXDEV;
+    }
+    if (mount->dev == 0) {
+      unknown = mount->mountpoint;
+    }
+  }
+  if (!unknown.empty()) {
+    // Not under the lock: the mount itself serves this stat().
+    struct stat stbuf;
+    if (stat(unknown.c_str(), &stbuf) == -1) {
+      return -errno;
+    }
+    std::lock_guard<std::mutex> guard(mounts_mutex);
+    Mount *mount = wrapperfs_find_mount(unknown);
+    if (mount && mount->mountpoint == unknown) {
+      mount->dev = stbuf.st_dev;
+    }
+  }
+  std::lock_guard<std::mutex> guard(mounts_mutex);
+  Mount *mount = wrapperfs_find_mount(path);
+  // Anything mounted below a mount point has a device of its own.
+  if (mount == NULL || mount->dev != client.st_dev) {
+    return -EXDEV;
+  }
+  *name = path.substr(mount->mountpoint.size());
+  if (name->empty()) {
+    *name = "/";
+  }
+  if (mount->ctlfs.owns(name->c_str())) {
+    return -EPERM;
+  }
+  // Under the lock, since mounts are dropped from 'mounts' before their
+  // backend is deleted.
+  int fd = mount->backend->open_backing(name->c_str(), O_RDONLY);
+  if (fd < 0) {
+    return fd;
+  }
+  // 'path' was read before the open and may have been renamed over since.
+  struct stat backing, served;
+  int ret = fstat(fd, &backing) == -1 ? -errno :
+      mount->backend->getattr(name->c_str(), &served);
+  if (!ret) {
+    ret = bypass_check_backing(backing, served, client);
+  }
+  if (ret) {
+    close(fd);
+    return ret;
+  }
+  return fd;
+}
+
+/** Applies "add BASEDIR MOUNTPOINT" and "remove MOUNTPOINT" lines. */
+int wrapperfs_configure_mounts(const string &in) {
+  if (session_loop == NULL) {
+    return -EAGAIN;
+  }
+  std::istringstream lines(in);
+  string line;
+  while (std::getline(lines, line)) {
+    std::istringstream words(line);
+    string command, first, second, extra;
+    if (!(words >> command) || command[0] == '#') {
+      continue;
+    }
+    words >> first >> second >> extra;
+    int ret;
+    if (command == "add" && !second.empty() && extra.empty() &&
+        first[0] == '/' && second[0] == '/') {
+      ret = wrapperfs_add_mount(first, second);
+    } else if (command == "remove" && !first.empty() && second.empty() &&
+               first[0] == '/') {
+      ret = wrapperfs_remove_mount(first);
+    } else {
+      ret = -EINVAL;
+    }
+    if (ret) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+/** options that only apply to mounting, dropped with --takeover */
+const struct fuse_opt wrapperfs_mount_opts[] = {
+  FUSE_OPT_KEY("allow_other", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("allow_root", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("nonempty", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("auto_unmount", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("blkdev", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("fsname=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("subtype=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("large_read", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("blksize=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("default_permissions", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("context=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("fscontext=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("defcontext=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("rootcontext=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("user=", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("-r", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("ro", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("rw", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("suid", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("nosuid", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("dev", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("nodev", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("exec", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("noexec", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("async", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("sync", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("dirsync", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("atime", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_KEY("noatime", FUSE_OPT_KEY_DISCARD),
+  FUSE_OPT_END
+};
+
+/**
+ * fuse_setup() for --takeover: serves the /dev/fuse descriptor received
+ * from the old process instead of mounting.
+ */
+struct fuse *wrapperfs_takeover(struct fuse_args *args,
+                                struct fuse_operations *opers,
+                                char **mountpoint, int *multithreaded) {
+  int foreground;
+  if (fuse_parse_cmdline(args, mountpoint, multithreaded,
+                         &foreground) == -1) {
+    return NULL;
+  }
+  if (*mountpoint == NULL) {
+    fprintf(stderr, "Missing mountpoint.\n");
+    return NULL;
+  }
+  struct fuse_chan *ch = NULL;
+  struct fuse *fuse = NULL;
+  if (fuse_opt_parse(args, NULL, wrapperfs_mount_opts, NULL) == 0) {
+    ch = fuse_kern_chan_new(upgrade.shared_fd("fuse"));
+  }
+  if (ch) {
+    fuse = fuse_new(ch, args, opers, sizeof(*opers), &main_mount);
+  }
+  if (fuse == NULL) {
+    if (ch) {
+      fuse_chan_destroy(ch);
+    }
+    free(*mountpoint);
+    return NULL;
+  }
+  if (fuse_daemonize(foreground) == -1 ||
+      fuse_set_signal_handlers(fuse_get_session(fuse)) == -1) {
+    fuse_destroy(fuse);
+    free(*mountpoint);
+    return NULL;
+  }
+  return fuse;
+}
+
+/**
+ * Mounts the file system and serves it until unmounted. Returns the exit
+ * status of the program.
+ */
+int wrapperfs_run(struct fuse_args *args, struct fuse_operations *opers) {
+  if (!options.split_queues) {
+    return fuse_main(args->argc, args->argv, opers, &main_mount);
+  }
+  char *mountpoint;
+  int multithreaded;
+  struct fuse *fuse = options.takeover ?
+      wrapperfs_takeover(args, opers, &mountpoint, &multithreaded) :
+      fuse_setup(args->argc, args->argv, opers, sizeof(*opers), &mountpoint,
+                 &multithreaded, &main_mount);
+  if (fuse == NULL) {
+    return 1;
+  }
+  main_mount.mountpoint = mountpoint;
+  main_mount.fuse = fuse;
+  int ret;
+  if (multithreaded) {
+    SessionLoop loop(fuse, mountpoint, options.meta_threads,
+                     options.data_threads, options.max_threads,
+                     options.upgrade ? &upgrade : NULL);
+    loop.set_budget(static_cast<size_t>(options.mem_budget) << 20);
+    session_loop = &loop;
+    ret = loop.run();
+    session_loop = NULL;
+  } else if (options.upgrade || options.multi) {
+    fprintf(stderr, "--upgrade and --multi need the multithreaded loop.\n");
+    ret = -1;
+  } else {
+    ret = fuse_loop(fuse);
+  }
+  if (options.takeover && !upgrade.took_over()) {
+    // The old process still serves the mount.
+    fuse_remove_signal_handlers(fuse_get_session(fuse));
+    fuse_destroy(fuse);
+    free(mountpoint);
+  } else {
+    fuse_teardown(fuse, mountpoint);
+  }
+  return ret == -1 ? 1 : 0;
 }
 
 #define WRAPPERFS_OPT_KEY(t, p, v) { t, offsetof(struct options, p), v }
@@ -207,6 +1143,38 @@ enum {
 struct fuse_opt wrapperfs_opts[] = {
   WRAPPERFS_OPT_KEY("--basedir %s", basedir, 0),
   WRAPPERFS_OPT_KEY("-b %s", basedir, 0),
+  WRAPPERFS_OPT_KEY("--backend=%s", backend, 0),
+  WRAPPERFS_OPT_KEY("--metastore", metastore, 1),
+  WRAPPERFS_OPT_KEY("--inline_size=%u", inline_size, 0),
+  WRAPPERFS_OPT_KEY("--fanout=%d", fanout, 0),
+  WRAPPERFS_OPT_KEY("--logdata", logdata, 1),
+  WRAPPERFS_OPT_KEY("--null_size=%lu", null_size, 0),
+  WRAPPERFS_OPT_KEY("--stack=%s", stack, 0),
+  WRAPPERFS_OPT_KEY("--device=%s", device, 0),
+  WRAPPERFS_OPT_KEY("--qos=%s", qos, 0),
+  WRAPPERFS_OPT_KEY("--qos_depth=%d", qos_depth, 0),
+  WRAPPERFS_OPT_KEY("--split_queues", split_queues, 1),
+  WRAPPERFS_OPT_KEY("--meta_threads=%d", meta_threads, 0),
+  WRAPPERFS_OPT_KEY("--data_threads=%d", data_threads, 0),
+  WRAPPERFS_OPT_KEY("--max_threads=%d", max_threads, 0),
+  WRAPPERFS_OPT_KEY("--slow_ms=%u", slow_ms, 0),
+  WRAPPERFS_OPT_KEY("--hot=%u", hot, 0),
+  WRAPPERFS_OPT_KEY("--heatmap", heatmap, 64),
+  WRAPPERFS_OPT_KEY("--heatmap=%u", heatmap, 0),
+  WRAPPERFS_OPT_KEY("--metrics=%s", metrics, 0),
+  WRAPPERFS_OPT_KEY("--upgrade=%s", upgrade, 0),
+  WRAPPERFS_OPT_KEY("--takeover", takeover, 1),
+  WRAPPERFS_OPT_KEY("--multi", multi, 1),
+  WRAPPERFS_OPT_KEY("--mem_budget=%u", mem_budget, 0),
+  WRAPPERFS_OPT_KEY("--bypass=%s", bypass, 0),
+  WRAPPERFS_OPT_KEY("--range_locks", range_locks, 1),
+  WRAPPERFS_OPT_KEY("--lazy_times", lazy_times, 1000),
+  WRAPPERFS_OPT_KEY("--dirstats", dirstats, 1),
+  WRAPPERFS_OPT_KEY("--changed_blocks", changed_blocks, 1),
+  WRAPPERFS_OPT_KEY("--lazy_times=%u", lazy_times, 0),
+  WRAPPERFS_OPT_KEY("--journal=%s", journal, 0),
+  WRAPPERFS_OPT_KEY("--journal_mb=%u", journal_mb, 0),
+  WRAPPERFS_OPT_KEY("--snapshots", snapshots, 1),
 
   FUSE_OPT_KEY("--version", KEY_VERSION),
   FUSE_OPT_KEY("-h", KEY_HELP),
@@ -231,6 +1199,72 @@ int wrapperfs_opt_proc(void *data, const char *arg, int key,
         "\n"
         "Mount options:\n"
         "  -b, --basedir DIR\tmount target directory\n"
+        "  --backend=NAME\tstorage engine: passthrough (default), kv,\n"
+        "\t\t\tram or null\n"
+        "  --metastore\t\tsame as --backend=kv: keep the namespace in\n"
+        "\t\t\tan embedded key-value store under DIR/.wrapperfs\n"
+        "  --inline_size=N\tkeep files up to N bytes inline in the\n"
+        "\t\t\tmetadata store (with --metastore)\n"
+        "  --fanout=LEVELS\tstore each directory as LEVELS (1 or 2)\n"
+        "\t\t\tlevels of 256 hash shards\n"
+        "  --logdata\t\tappend file writes to a log under\n"
+        "\t\t\tDIR/.wrapperfs/log\n"
+        "  --null_size=N\t\tsize of every file with --backend=null\n"
+        "\t\t\t(default 1TiB)\n"
+        "  --stack=NAME\t\thandler layers: plain (default), stats,\n"
+        "\t\t\treadonly or readonly-stats\n"
+        "  --device=MODEL\t\temulate a storage device under the backend:\n"
+        "\t\t\tssd, hdd or cloud, with optional parameters\n"
+        "\t\t\tas MODEL:key=value,... (see device.h)\n"
+        "  --qos=uid|pid\t\tper-tenant I/O limits and fair queuing,\n"
+        "\t\t\tset in /.wrapperfs/qos (not with\n"
+        "\t\t\t--split_queues)\n"
+        "  --qos_depth=N\t\toperations let through to the backend at\n"
+        "\t\t\tonce with --qos (default 16)\n"
+        "  --split_queues\t\tserve data (read/write/fsync) and metadata\n"
+        "\t\t\trequests from separate worker pools\n"
+        "  --meta_threads=N\tmetadata workers (default 4)\n"
+        "  --data_threads=N\tdata workers (default 8)\n"
+        "  --max_threads=N\tlet each pool grow up to N workers while\n"
+        "\t\t\tthat helps (implies --split_queues)\n"
+        "  --slow_ms=N\t\tlog operations taking N ms or more to\n"
+        "\t\t\t/.wrapperfs/slowops (default 0: off)\n"
+        "  --hot=K\t\ttrack the K busiest files and directories in\n"
+        "\t\t\t/.wrapperfs/hot (default 0: off)\n"
+        "  --heatmap[=N]\t\tsample 1 in N (default 64) reads and writes\n"
+        "\t\t\tinto per-file offset heatmaps in\n"
+        "\t\t\t/.wrapperfs/heatmap\n"
+        "  --metrics=ADDR\t\tserve Prometheus metrics on a Unix socket\n"
+        "\t\t\t(absolute path) or on 127.0.0.1:PORT\n"
+        "  --upgrade=PATH\tlet a new process take the mount over\n"
+        "\t\t\tthrough the Unix socket PATH (implies\n"
+        "\t\t\t--split_queues)\n"
+        "  --takeover\t\ttake the mount over from the process on\n"
+        "\t\t\t--upgrade=PATH\n"
+        "  --multi\t\tserve more mounts from this process, added\n"
+        "\t\t\tthrough /.wrapperfs/mounts (implies\n"
+        "\t\t\t--split_queues)\n"
+        "  --mem_budget=MB\tkeep the request buffers of all mounts\n"
+        "\t\t\tunder MB MiB, shared by demand\n"
+        "  --bypass=PATH\t\tlet processes preloading\n"
+        "\t\t\tlibwrapperfs_bypass.so read files directly,\n"
+        "\t\t\tthrough the Unix socket PATH\n"
+        "  --range_locks\t\torder overlapping reads and writes to a\n"
+        "\t\t\tfile; disjoint ones still run in parallel\n"
+        "  --lazy_times[=MS]\tdefer utimens to the backing files and\n"
+        "\t\t\twrite them out in batches every MS ms\n"
+        "\t\t\t(default 1000)\n"
+        "  --dirstats\t\tkeep recursive sizes and file counts of\n"
+        "\t\t\tdirectories in user.wrapperfs.* xattrs\n"
+        "  --changed_blocks\ttrack the 64 KiB blocks changed in each\n"
+        "\t\t\tfile, in user.wrapperfs.cbt.* xattrs\n"
+        "  --journal=FILE\t\tappend every change to the tree to the\n"
+        "\t\t\tmemory-mapped ring FILE (see journal.h)\n"
+        "  --journal_mb=MB\tkeep the latest MB MiB of changes\n"
+        "\t\t\t(default 64)\n"
+        "  --snapshots\t\tserve read-only snapshots of the tree under\n"
+        "\t\t\t/.snapshots, taken through\n"
+        "\t\t\t/.wrapperfs/snapshots\n"
         "\n"
         , outargs->argv[0]);
     fuse_opt_add_arg(outargs, "-ho");
@@ -254,27 +1288,15 @@ int wrapperfs_opt_proc(void *data, const char *arg, int key,
 int main(int argc, char *argv[]) {
   int ret = 0;
 
-  fuse_operations opers;
-  opers.access = wrapperfs_access;
-  opers.chmod = wrapperfs_chmod;
-  opers.chown = wrapperfs_chown;
-  opers.create = wrapperfs_create;
-  opers.getattr = wrapperfs_getattr;
-  opers.link = wrapperfs_link;
-  opers.mkdir = wrapperfs_mkdir;
-  opers.open = wrapperfs_open;
-  opers.read = wrapperfs_read;
-  opers.readdir = wrapperfs_readdir;
-  opers.release = wrapperfs_release;
-  opers.rename = wrapperfs_rename;
-  opers.rmdir = wrapperfs_rmdir;
-  opers.symlink = wrapperfs_symlink;
-  opers.truncate = wrapperfs_truncate;
-  opers.unlink = wrapperfs_unlink;
-  opers.utimens = wrapperfs_utimens;
-  opers.write = wrapperfs_write;
+  fuse_operations opers = {};
+  const StackPreset *stack = NULL;
 
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  options.null_size = 1UL << 40;
+  options.qos_depth = 16;
+  options.meta_threads = 4;
+  options.data_threads = 8;
+  options.journal_mb = 64;
   if (fuse_opt_parse(&args, &options, wrapperfs_opts,
                      wrapperfs_opt_proc) == -1) {
     ret = -1;
@@ -293,13 +1315,213 @@ int main(int argc, char *argv[]) {
     goto exit_handler;
   }
 
+  for (const auto &preset : wrapperfs_stacks) {
+    if (strcmp(preset.name, options.stack ? options.stack : "plain") == 0) {
+      stack = &preset;
+    }
+  }
+  if (stack == NULL) {
+    fprintf(stderr, "Unknown handler stack: %s\n", options.stack);
+    ret = 1;
+    goto exit_handler;
+  }
+  if (options.max_threads || options.upgrade || options.multi) {
+    options.split_queues = 1;
+  }
+  if (options.multi && options.upgrade) {
+    fprintf(stderr, "--multi and --upgrade cannot be combined.\n");
+    ret = 1;
+    goto exit_handler;
+  }
+  if (options.multi && options.journal) {
+    fprintf(stderr, "--multi and --journal cannot be combined.\n");
+    ret = 1;
+    goto exit_handler;
+  }
+  if (options.bypass && (options.qos || options.device)) {
+    fprintf(stderr, "--bypass cannot be combined with --qos or --device.\n");
+    ret = 1;
+    goto exit_handler;
+  }
+  if (options.takeover && !options.upgrade) {
+    fprintf(stderr, "--takeover needs --upgrade=PATH.\n");
+    ret = 1;
+    goto exit_handler;
+  }
+  if (options.takeover && options.backend &&
+      strcmp(options.backend, "ram") == 0) {
+    fprintf(stderr, "The ram backend cannot be taken over.\n");
+    ret = 1;
+    goto exit_handler;
+  }
+  if (options.upgrade) {
+    // The tracker needs to read every request's header.
+    fuse_opt_add_arg(&args, "-ono_splice_read");
+  }
+  if (options.split_queues &&
+      (options.meta_threads < 1 || options.data_threads < 1)) {
+    fprintf(stderr, "Each worker pool needs at least one thread.\n");
+    ret = 1;
+    goto exit_handler;
+  }
+
+  if (options.qos) {
+    if (strcmp(options.qos, "uid") && strcmp(options.qos, "pid")) {
+      fprintf(stderr, "--qos must be uid or pid.\n");
+      ret = 1;
+      goto exit_handler;
+    }
+    if (options.qos_depth < 1) {
+      fprintf(stderr, "--qos_depth must be at least 1.\n");
+      ret = 1;
+      goto exit_handler;
+    }
+    if (options.split_queues) {
+      // Throttled and queued operations sleep on the worker that took
+      // them, which would starve a bounded pool.
+      fprintf(stderr, "--qos cannot be combined with --split_queues, "
+              "--max_threads, --upgrade or --multi.\n");
+      ret = 1;
+      goto exit_handler;
+    }
+    qos.init(options.qos[0] == 'u' ? QosScheduler::BY_UID :
+             QosScheduler::BY_PID, options.qos_depth);
+    stack->make_qos(&opers);
+  } else {
+    stack->make(&opers);
+  }
+  if (!options.dirstats && !options.changed_blocks) {
+    // Otherwise the kernel asks for security.capability before every
+    // write, only to be told there is none.
+    opers.getxattr = NULL;
+  }
+  if (!options.changed_blocks) {
+    opers.setxattr = NULL;
+  }
+
+  {
+    Tunables initial;
+    initial.slow_ns = options.slow_ms * 1000000ULL;
+    initial.heatmap_rate = options.heatmap;
+    initial.inline_size = options.inline_size;
+    tunables_init(initial);
+  }
+
+  if (options.upgrade) {
+    // Taking over makes the old process flush and stop its backend, so
+    // this comes before opening ours.
+    int err = options.takeover ? upgrade.take_over(options.upgrade) :
+        upgrade.listen(options.upgrade);
+    if (err) {
+      fprintf(stderr, "--upgrade=%s: %s\n", options.upgrade, strerror(-err));
+      ret = 1;
+      goto exit_handler;
+    }
+    upgrade.pause = wrapperfs_pause;
+    upgrade.resume = wrapperfs_resume;
+  }
+
+  if (options.journal) {
+    // After a takeover, so that the old process no longer appends.
+    int err = journal.open(options.journal,
+                           static_cast<uint64_t>(options.journal_mb) << 20);
+    if (err) {
+      fprintf(stderr, "--journal=%s: %s\n", options.journal, strerror(-err));
+      ret = 1;
+      goto exit_handler;
+    }
+  }
+
+  if (options.multi || options.bypass) {
+    // Added mounts take the same options; parsing drops the mount point,
+    // which --bypass recognizes its files by.
+    for (int i = 0; i < args.argc; i++) {
+      fuse_opt_add_arg(&mount_args, args.argv[i]);
+    }
+    char *mountpoint;
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&mount_args, &mountpoint, &multithreaded,
+                           &foreground) == -1) {
+      ret = 1;
+      goto exit_handler;
+    }
+    if (mountpoint) {
+      main_mount.mountpoint = mountpoint;
+      free(mountpoint);
+    }
+    mount_opers = opers;
+  }
+  main_mount.basedir = options.basedir;
+  if (wrapperfs_make_backend(&main_mount, &args)) {
+    ret = 1;
+    goto exit_handler;
+  }
+
+  if (options.hot) {
+    hot_paths.init(options.hot);
+  }
+  if (options.metrics) {
+    int err = 0;
+    int fd = upgrade.shared_fd("metrics");
+    if (fd != -1) {
+      metrics.adopt(fd, options.metrics);
+    } else {
+      err = metrics.listen(options.metrics);
+    }
+    if (err) {
+      fprintf(stderr, "--metrics=%s: %s\n", options.metrics, strerror(-err));
+      ret = 1;
+      goto exit_handler;
+    }
+    upgrade.share_fd("metrics", metrics.fd());
+    metrics.add_collector([](string *out) {
+      if (session_loop) {
+        session_loop->metrics(out);
+      }
+    });
+    if (options.qos) {
+      metrics.add_collector([](string *out) { qos.metrics(out); });
+    }
+    metrics.add_collector([](string *out) {
+      out->append("# TYPE wrapperfs_backend_info gauge\n"
+                  "wrapperfs_backend_info{backend=\"");
+      out->append(options.backend ? options.backend :
+                  options.metastore ? "kv" : "passthrough");
+      out->append("\",device=\"");
+      out->append(options.device ? options.device : "");
+      out->append("\"} 1\n");
+    });
+  }
+  if (options.bypass) {
+    int err = 0;
+    int fd = upgrade.shared_fd("bypass");
+    if (fd != -1) {
+      bypass.adopt(fd, options.bypass);
+    } else {
+      err = bypass.listen(options.bypass);
+    }
+    if (err) {
+      fprintf(stderr, "--bypass=%s: %s\n", options.bypass, strerror(-err));
+      ret = 1;
+      goto exit_handler;
+    }
+    upgrade.share_fd("bypass", bypass.fd());
+    bypass.open_backing = wrapperfs_open_backing;
+  }
+  if (options.heatmap) {
+    heatmap.init();
+  }
+  wrapperfs_add_ctl_files(&main_mount);
+
   fprintf(stderr, "Mount %s to %s.\n", args.argv[0], options.basedir);
-  ret = fuse_main(args.argc, args.argv, &opers, NULL);
+  ret = wrapperfs_run(&args, &opers);
 
   if (ret)
     fprintf(stderr, "\n");
 
 exit_handler:  // NOLINT
+  delete main_mount.backend;
+  fuse_opt_free_args(&mount_args);
   fuse_opt_free_args(&args);
   return ret;
 }